@@ -72,6 +72,9 @@ int acct_conf_init(void)
 	CHECK_MALLOC( acct_config = malloc(sizeof(struct acct_conf)) );
 	memset(acct_config, 0, sizeof(struct acct_conf) );
 	fd_list_init(&acct_config->avps, NULL);
+	acct_config->writers = ACCT_DEF_WRITERS;
+	acct_config->batch_size = ACCT_DEF_BATCH_SIZE;
+	acct_config->queue_size = ACCT_DEF_QUEUE_SIZE;
 	
 	return 0;
 }
@@ -102,6 +105,13 @@ int acct_conf_check(char * conffile)
 	fd_log_debug("   Table name .... : '%s'", acct_config->tablename ?: "<null>");
 	fd_log_debug("   Timestamp field : '%s'", acct_config->tsfield ?: "<null>");
 	fd_log_debug("   Server name fld : '%s'", acct_config->srvnfield ?: "<null>");
+	fd_log_debug(" Writers:");
+	fd_log_debug("   Threads ....... : %d", acct_config->writers);
+	fd_log_debug("   Batch size .... : %d", acct_config->batch_size);
+	fd_log_debug("   Batch delay ... : %dms", acct_config->batch_delay);
+	fd_log_debug("   Queue size .... : %d", acct_config->queue_size);
+	fd_log_debug("   Early answer .. : %s", acct_config->early_answer ? "yes" : "no");
+	fd_log_debug("   Spool file .... : '%s'", acct_config->spool ?: "<null>");
 	fd_log_debug(" AVPs that will be saved to the database:");
 	for (li = acct_config->avps.next; li != &acct_config->avps; li = li->next) {
 		struct acct_conf_avp * a = (struct acct_conf_avp *)li;
@@ -138,6 +148,7 @@ void acct_conf_free(void)
 	free(acct_config->tablename);
 	free(acct_config->tsfield);
 	free(acct_config->srvnfield);
+	free(acct_config->spool);
 	
 	/* Done */
 	free(acct_config);
@@ -207,6 +218,12 @@ static struct acct_conf_avp avpdata;
 %token 		TABLE
 %token 		TSFIELD
 %token 		SRVNFIELD
+%token 		WRITERS
+%token 		BATCHSIZE
+%token 		BATCHDELAY
+%token 		QUEUESIZE
+%token 		EARLYANSWER
+%token 		SPOOL
 
 /* Tokens and types */
 /* A (de)quoted string (malloc'd in lex parser; it must be freed after use) */
@@ -227,6 +244,12 @@ conffile:		/* empty grammar is OK for the parser (will be validated afterwards)
 			| conffile tableline
 			| conffile tsfieldline
 			| conffile srvnfieldline
+			| conffile writersline
+			| conffile batchsizeline
+			| conffile batchdelayline
+			| conffile queuesizeline
+			| conffile earlyanswerline
+			| conffile spoolline
 			| conffile errors
 			{
 				yyerror(&yylloc, conffile, "An error occurred while parsing the configuration file.");
@@ -334,3 +357,59 @@ srvnfieldline:		SRVNFIELD '=' QSTRING ';'
 				acct_config->srvnfield = $3;
 			}
 			;
+
+writersline:		WRITERS '=' INTEGER ';'
+			{
+				if (($3 < 1) || ($3 > 64)) {
+					yyerror (&yylloc, conffile, "Writer_threads must be between 1 and 64");
+					YYERROR;
+				}
+				acct_config->writers = $3;
+			}
+			;
+
+batchsizeline:		BATCHSIZE '=' INTEGER ';'
+			{
+				if (($3 < 1) || ($3 > 1000)) {
+					yyerror (&yylloc, conffile, "Batch_size must be between 1 and 1000");
+					YYERROR;
+				}
+				acct_config->batch_size = $3;
+			}
+			;
+
+batchdelayline:		BATCHDELAY '=' INTEGER ';'
+			{
+				if (($3 < 0) || ($3 > 10000)) {
+					yyerror (&yylloc, conffile, "Batch_delay must be between 0 and 10000 (ms)");
+					YYERROR;
+				}
+				acct_config->batch_delay = $3;
+			}
+			;
+
+queuesizeline:		QUEUESIZE '=' INTEGER ';'
+			{
+				if ($3 < 1) {
+					yyerror (&yylloc, conffile, "Queue_size must be positive");
+					YYERROR;
+				}
+				acct_config->queue_size = $3;
+			}
+			;
+
+earlyanswerline:	EARLYANSWER ';'
+			{
+				acct_config->early_answer = 1;
+			}
+			;
+
+spoolline:		SPOOL '=' QSTRING ';'
+			{
+				if (acct_config->spool) {
+					yyerror (&yylloc, conffile, "Duplicate entry");
+					YYERROR;
+				}
+				acct_config->spool = $3;
+			}
+			;
@@ -35,12 +35,21 @@
 
 /* Database interface module */
 
-/* There is one connection to the db per thread. 
-The connection is stored in the pthread_key_t variable */
+/* The dispatch threads do not talk to the database. They copy the values of the record in a
+buffer, which is queued. A pool of writer threads, each with its own connection, takes the 
+queued records by batches and saves each batch with a single multi-row INSERT (a prepared 
+statement is created for each number of rows). The dispatch thread waits until its record
+is committed, unless Answer_before_commit is set in the configuration.
+
+When the queue is full or the database cannot be reached, and a spool file is configured,
+the records are appended to this file. The writers insert them in the database later, once
+it is reachable again. */
 
 
 #include "app_acct.h"
 #include <libpq-fe.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 const char * diam2db_types_mapping[AVP_TYPE_MAX + 1] = {
 	"" 		/* AVP_TYPE_GROUPED */,
@@ -53,25 +62,453 @@ const char * diam2db_types_mapping[AVP_TYPE_MAX + 1] = {
 	"double precision" /* AVP_TYPE_FLOAT64 */
 };
 
+/* How long a writer waits before a new attempt when the database cannot be reached, in seconds */
+#define ACCT_RETRY_DELAY	1
+
+/* The number of parameters of a statement is a 16-bit value in the protocol */
+#define ACCT_MAX_PARAMS		65535
+
 static const char * stmt = "acct_db_stmt";
 #ifndef TEST_DEBUG
 static 
 #endif /* TEST_DEBUG */
-pthread_key_t connk;
-static char * sql = NULL;   /* The buffer that will contain the SQL query */
-static int nbrecords = 0;
+pthread_key_t connk;	/* The connection created by acct_db_init, in the thread that called it */
+static char * sql = NULL;   /* The INSERT statement for a single record */
+static char * sql_head = NULL;	/* "INSERT INTO table (fields) VALUES " */
+static char * sql_row = NULL;	/* the values of one row, with "%d" in place of the parameters numbers */
+static int nbparams = 0;	/* The number of parameters of each row */
+static int ts_binary = 0;	/* The timestamp is passed in binary format (the server stores it as an integer) */
+
+/* The origin of the binary timestamps of PostgreSQL (2000-01-01 00:00:00 UTC), as a time_t */
+#define PG_EPOCH	946684800LL
+
+/* A record, as it is queued. The values of the parameters are serialized in data: for each, 
+ an int32_t length (-1 for NULL) and an int32_t binary flag, followed by the value. In the 
+ spool file, each record is written as its size (uint32_t) followed by data. */
+struct acct_db_rec {
+	struct fd_list	chain;		/* link in acct_queue */
+	int		waited;		/* a dispatch thread is waiting for the result, it frees the record */
+	int		done;		/* the record has been processed */
+	int		ret;		/* the result of the processing */
+	uint32_t	size;		/* the size of data */
+	uint8_t		data[];
+};
 
+/* The queue of records */
+static struct fd_list	acct_queue = FD_LIST_INITIALIZER(acct_queue);
+static int		acct_queued = 0;
+static pthread_mutex_t	acct_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	acct_cond_rec = PTHREAD_COND_INITIALIZER;	/* records were queued */
+static pthread_cond_t	acct_cond_room = PTHREAD_COND_INITIALIZER;	/* records were removed from the queue */
+static pthread_cond_t	acct_cond_done = PTHREAD_COND_INITIALIZER;	/* records were processed */
+static int		acct_stop = 0;
+
+/* The writers */
+struct acct_writer {
+	pthread_t	thr;
+	PGconn *	conn;
+	char *		prepared;	/* prepared[n] is set when the statement for n rows is prepared on conn */
+	const char **	val;		/* the parameters of the statement, batch_size * nbparams entries */
+	int *		val_len;
+	int *		val_isbin;
+};
+static struct acct_writer * writers = NULL;
+static int nbwriters = 0;
+
+/* The spool file */
+static int		spool_fd = -1;
+static int		spool_pending = 0;	/* records have been spooled */
+static pthread_mutex_t	spool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Build the INSERT statement for n rows. The string must be freed after use. */
+static char * acct_db_sql(int n)
+{
+	char * buf = NULL;
+	size_t len = 0, offset = 0;
+	int r;
+	
+	CHECK_MALLOC_DO( fd_dump_extend(&buf, &len, &offset, "%s", sql_head), return NULL );
+	for (r = 0; r < n; r++) {
+		char * p;
+		int idx = r * nbparams;
+		
+		CHECK_MALLOC_DO( fd_dump_extend(&buf, &len, &offset, r ? ", (" : "("), goto error );
+		/* Copy the row, replacing each "%d" with the next parameter number */
+		for (p = sql_row; *p; p++) {
+			if ((p[0] == '%') && (p[1] == 'd')) {
+				CHECK_MALLOC_DO( fd_dump_extend(&buf, &len, &offset, "%d", ++idx), goto error );
+				p++;
+			} else {
+				CHECK_MALLOC_DO( fd_dump_extend(&buf, &len, &offset, "%c", *p), goto error );
+			}
+		}
+		CHECK_MALLOC_DO( fd_dump_extend(&buf, &len, &offset, ")"), goto error );
+	}
+	CHECK_MALLOC_DO( fd_dump_extend(&buf, &len, &offset, ";"), goto error );
+	return buf;
+error:
+	free(buf);
+	return NULL;
+}
+
+/* Write all the buffer in the spool file */
+static int acct_spool_write(const void * data, size_t len)
+{
+	while (len) {
+		ssize_t ret = write(spool_fd, data, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		data = (const uint8_t *)data + ret;
+		len -= ret;
+	}
+	return 0;
+}
 
-/* Initialize the database context: connection to the DB, prepared statement to insert new records */
+/* The size of the complete records at the beginning of the spool data. A crash while a record was appended leaves it incomplete at the end. */
+static size_t acct_spool_complete(uint8_t * buf, size_t size)
+{
+	size_t len = 0;
+	
+	while (len + sizeof(uint32_t) <= size) {
+		uint32_t rsize;
+		memcpy(&rsize, buf + len, sizeof(uint32_t));
+		if (len + sizeof(uint32_t) + rsize > size)
+			break;
+		len += sizeof(uint32_t) + rsize;
+	}
+	if (len < size)
+		fd_log_debug("The spool file '%s' is truncated, the last record is lost", acct_config->spool);
+	return len;
+}
+
+/* Append records to the spool file; they are saved on the disk when this function returns */
+static int acct_spool(struct acct_db_rec ** recs, int n)
+{
+	struct stat st;
+	int i, ret = 0;
+	
+	CHECK_POSIX( pthread_mutex_lock(&spool_lock) );
+	if (fstat(spool_fd, &st) < 0)
+		ret = errno;
+	for (i = 0; (i < n) && !ret; i++) {
+		ret = acct_spool_write(&recs[i]->size, sizeof(uint32_t));
+		if (!ret)
+			ret = acct_spool_write(recs[i]->data, recs[i]->size);
+	}
+	if (!ret && (fdatasync(spool_fd) < 0))
+		ret = errno;
+	if (!ret) {
+		spool_pending = 1;
+	} else if (i) {
+		/* Do not leave a partial record, the following ones could not be read back */
+		CHECK_SYS_DO( ftruncate(spool_fd, st.st_size), );
+	}
+	CHECK_POSIX( pthread_mutex_unlock(&spool_lock) );
+	
+	if (ret) {
+		fd_log_debug("Unable to write in the spool file '%s': %s", acct_config->spool, strerror(ret));
+	}
+	return ret;
+}
+
+/* Make sure the writer has a working connection to the database */
+static int acct_db_connect(struct acct_writer * w)
+{
+	if (!w->conn) {
+		w->conn = PQconnectdb(acct_config->conninfo);
+		memset(w->prepared, 0, acct_config->batch_size + 1);
+	}
+	
+	/* Check if the connection with the DB has not staled, and eventually try to fix it */
+	if (PQstatus(w->conn) != CONNECTION_OK) {
+		/* Attempt a reset, the prepared statements are lost */
+		PQreset(w->conn);
+		memset(w->prepared, 0, acct_config->batch_size + 1);
+		if (PQstatus(w->conn) != CONNECTION_OK) {
+			TRACE_DEBUG(INFO, "Lost connection to the database server, and attempt to reestablish it failed");
+			return ENOTCONN;
+		}
+	}
+	return 0;
+}
+
+/* Save n records in the database, in a single statement */
+static int acct_db_exec(struct acct_writer * w, struct acct_db_rec ** recs, int n)
+{
+	char name[32];
+	PGresult * res;
+	int i, j, idx = 0, ret;
+	
+	ret = acct_db_connect(w);
+	if (ret)
+		return ret;
+	
+	snprintf(name, sizeof(name), "%s%d", stmt, n);
+	if (!w->prepared[n]) {
+		/* Create the prepared statement for this number of rows on this connection, it is not shared */
+		char * s;
+		CHECK_MALLOC( s = acct_db_sql(n) );
+		res = PQprepare(w->conn, name, s, n * nbparams, NULL);
+		if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+			TRACE_DEBUG(INFO, "Preparing statement '%s' failed: %s",
+				s, PQerrorMessage(w->conn));
+			PQclear(res);
+			free(s);
+			return (PQstatus(w->conn) != CONNECTION_OK) ? ENOTCONN : EINVAL;
+        	}
+		PQclear(res);
+		free(s);
+		w->prepared[n] = 1;
+	}
+	
+	/* The parameters point inside the queued records */
+	for (i = 0; i < n; i++) {
+		uint8_t * p = recs[i]->data, * end = p + recs[i]->size;
+		for (j = 0; j < nbparams; j++) {
+			int32_t len, isbin;
+			if ((size_t)(end - p) < 2 * sizeof(int32_t))
+				goto invalid;
+			memcpy(&len, p, sizeof(int32_t));
+			memcpy(&isbin, p + sizeof(int32_t), sizeof(int32_t));
+			p += 2 * sizeof(int32_t);
+			if (len > end - p)
+				goto invalid;
+			if (len < 0) {
+				w->val[idx] = NULL;
+				w->val_len[idx] = 0;
+			} else {
+				w->val[idx] = (const char *)p;
+				w->val_len[idx] = len;
+				p += len;
+			}
+			w->val_isbin[idx] = isbin;
+			idx++;
+		}
+	}
+	
+	/* OK, now execute the SQL statement */
+	res = PQexecPrepared(w->conn, name, idx, w->val, w->val_len, w->val_isbin, 1 /* We actually don't care here */);
+	
+	/* Now check the result code */
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		TRACE_DEBUG(INFO, "An error occurred while INSERTing in the database: %s", PQerrorMessage(w->conn));
+		PQclear(res);
+		/* If the connection is fine, it was probably a mistake in configuration file, or an invalid value */
+		return (PQstatus(w->conn) != CONNECTION_OK) ? ENOTCONN : EINVAL;
+        }
+	PQclear(res);
+	
+	/* Ok, we are done */
+	return 0;
+
+invalid:
+	/* It may come from a damaged spool file */
+	TRACE_DEBUG(INFO, "Invalid accounting record of %u bytes, parameter %d", recs[i]->size, j + 1);
+	return EINVAL;
+}
+
+/* Save a batch of records, the result is set in each record. Returns ENOTCONN if the database could not be reached. */
+static int acct_db_save(struct acct_writer * w, struct acct_db_rec ** recs, int n)
+{
+	int i, ret;
+	
+	ret = acct_db_exec(w, recs, n);
+	if ((ret == EINVAL) && (n > 1)) {
+		/* Do not reject all the batch because of one invalid record */
+		for (i = 0; i < n; i++) {
+			if (acct_db_save(w, &recs[i], 1) == ENOTCONN)
+				ret = ENOTCONN;
+		}
+		return ret;
+	}
+	for (i = 0; i < n; i++)
+		recs[i]->ret = ret;
+	if ((ret == ENOTCONN) && (spool_fd >= 0)) {
+		int sret = acct_spool(recs, n);
+		for (i = 0; i < n; i++)
+			recs[i]->ret = sret;
+	}
+	return ret;
+}
+
+/* Insert the records of the spool file in the database, if it can be reached. Returns ENOTCONN if it cannot. */
+static int acct_unspool(struct acct_writer * w, struct acct_db_rec ** recs)
+{
+	struct stat st;
+	uint8_t * buf = NULL;
+	size_t off = 0, done = 0, len = 0;
+	int n = 0, ret = 0;
+	
+	/* Only one writer does this */
+	if (pthread_mutex_trylock(&spool_lock))
+		return 0;
+	if (!spool_pending)
+		goto out;
+	
+	CHECK_SYS_DO( fstat(spool_fd, &st), { ret = errno; goto out; } );
+	CHECK_MALLOC_DO( buf = malloc(st.st_size ?: 1), { ret = ENOMEM; goto out; } );
+	if (pread(spool_fd, buf, st.st_size, 0) != st.st_size) {
+		fd_log_debug("Unable to read the spool file '%s'", acct_config->spool);
+		ret = EIO;
+		goto out;
+	}
+	
+	/* An incomplete record at the end is dropped with the next rewrite of the file */
+	len = acct_spool_complete(buf, st.st_size);
+	
+	/* The records are inserted by batches, they point in the buffer; the spooled records are aligned by copying their header */
+	while (off < len) {
+		uint32_t size;
+		memcpy(&size, buf + off, sizeof(uint32_t));
+		CHECK_MALLOC_DO( recs[n] = malloc(sizeof(struct acct_db_rec) + size), { ret = ENOMEM; break; } );
+		memset(recs[n], 0, sizeof(struct acct_db_rec));
+		recs[n]->size = size;
+		memcpy(recs[n]->data, buf + off + sizeof(uint32_t), size);
+		off += sizeof(uint32_t) + size;
+		n++;
+		
+		if ((n == acct_config->batch_size) || (off == len)) {
+			int i;
+			ret = acct_db_exec(w, recs, n);
+			if ((ret == EINVAL) && (n > 1)) {
+				/* One by one, the records that are not valid are dropped; done follows the committed ones */
+				for (i = 0; i < n; i++) {
+					ret = acct_db_exec(w, &recs[i], 1);
+					if (ret == ENOTCONN)
+						break;
+					if (ret)
+						fd_log_debug("A record from the spool file was not inserted in the database and is lost");
+					done += sizeof(uint32_t) + recs[i]->size;
+				}
+			} else if (ret != ENOTCONN) {
+				if (ret)
+					fd_log_debug("A record from the spool file was not inserted in the database and is lost");
+				done = off;
+			}
+			while (n)
+				free(recs[--n]);
+			if (ret == ENOTCONN) {
+				/* The database is not available, we try again later */
+				break;
+			}
+			ret = 0;
+		}
+	}
+	while (n)
+		free(recs[--n]);
+	
+	/* Remove the records that were saved from the file, and the incomplete one */
+	if (done == len) {
+		CHECK_SYS_DO( ftruncate(spool_fd, 0), );
+		spool_pending = 0;
+	} else if (done || (len < st.st_size)) {
+		CHECK_SYS_DO( ftruncate(spool_fd, 0), );
+		CHECK_FCT_DO( acct_spool_write(buf + done, len - done), );
+		CHECK_SYS_DO( fdatasync(spool_fd), );
+	}
+out:
+	free(buf);
+	CHECK_POSIX_DO( pthread_mutex_unlock(&spool_lock), );
+	return ret;
+}
+
+/* The writer threads */
+static void * acct_db_writer(void * arg)
+{
+	struct acct_writer * w = arg;
+	struct acct_db_rec ** recs;
+	
+	fd_log_threadname ( "app_acct writer" );
+	
+	CHECK_MALLOC_DO( recs = calloc(acct_config->batch_size, sizeof(struct acct_db_rec *)), return NULL );
+	
+	CHECK_POSIX_DO( pthread_mutex_lock(&acct_lock), goto out );
+	while (1) {
+		struct timespec ts;
+		int n = 0, i, failed;
+		
+		/* Wait for records, and meanwhile retry the spooled ones */
+		while (!acct_queued && !acct_stop) {
+			CHECK_SYS_DO( clock_gettime(CLOCK_REALTIME, &ts), goto unlock );
+			ts.tv_sec += ACCT_RETRY_DELAY;
+			(void) pthread_cond_timedwait(&acct_cond_rec, &acct_lock, &ts);
+			if (!acct_queued && spool_pending) {
+				CHECK_POSIX_DO( pthread_mutex_unlock(&acct_lock), goto out );
+				(void) acct_unspool(w, recs);
+				CHECK_POSIX_DO( pthread_mutex_lock(&acct_lock), goto out );
+			}
+		}
+		if (!acct_queued)
+			break; /* stopping */
+		
+		/* Let more records come, for a bigger batch */
+		if (acct_config->batch_delay && (acct_queued < acct_config->batch_size) && !acct_stop) {
+			CHECK_SYS_DO( clock_gettime(CLOCK_REALTIME, &ts), goto unlock );
+			ts.tv_nsec += (acct_config->batch_delay % 1000) * 1000000L;
+			ts.tv_sec += acct_config->batch_delay / 1000 + ts.tv_nsec / 1000000000L;
+			ts.tv_nsec %= 1000000000L;
+			while ((acct_queued < acct_config->batch_size) && !acct_stop) {
+				if (pthread_cond_timedwait(&acct_cond_rec, &acct_lock, &ts) == ETIMEDOUT)
+					break;
+			}
+			if (!acct_queued)
+				continue; /* another writer took them */
+		}
+		
+		/* Take the batch */
+		while ((n < acct_config->batch_size) && !FD_IS_LIST_EMPTY(&acct_queue)) {
+			recs[n] = (struct acct_db_rec *)(acct_queue.next);
+			fd_list_unlink(&recs[n]->chain);
+			n++;
+		}
+		acct_queued -= n;
+		CHECK_POSIX_DO( pthread_cond_broadcast(&acct_cond_room), );
+		CHECK_POSIX_DO( pthread_mutex_unlock(&acct_lock), goto out );
+		
+		failed = (acct_db_save(w, recs, n) == ENOTCONN);
+		
+		/* Report the results */
+		CHECK_POSIX_DO( pthread_mutex_lock(&acct_lock), goto out );
+		for (i = 0; i < n; i++) {
+			if (recs[i]->waited) {
+				recs[i]->done = 1;
+			} else {
+				if (recs[i]->ret) {
+					fd_log_debug("An accounting record could not be saved (%s), it is lost.", strerror(recs[i]->ret));
+				}
+				free(recs[i]);
+			}
+		}
+		CHECK_POSIX_DO( pthread_cond_broadcast(&acct_cond_done), );
+		
+		if (failed && !acct_stop) {
+			/* Give some time to the database to come back */
+			CHECK_SYS_DO( clock_gettime(CLOCK_REALTIME, &ts), goto unlock );
+			ts.tv_sec += ACCT_RETRY_DELAY;
+			while (!acct_stop && (pthread_cond_timedwait(&acct_cond_room, &acct_lock, &ts) != ETIMEDOUT))
+				;
+		}
+	}
+unlock:
+	CHECK_POSIX_DO( pthread_mutex_unlock(&acct_lock), );
+out:
+	free(recs);
+	return NULL;
+}
+
+/* Initialize the database context: connection to the DB, prepared statement to insert new records, writer threads */
 int acct_db_init(void)
 {
 	struct acct_record_list emptyrecords;
-	struct fd_list * li;
 	size_t sql_allocd = 0; /* The malloc'd size of the buffer */
 	size_t sql_offset = 0; /* The actual data already written in this buffer */
-	int idx = 0;
 	PGresult * res;
 	PGconn *conn;
+	int i, idx;
 	#define REALLOC_SIZE	1024	/* We extend the buffer by this amount */
 	
 	TRACE_ENTRY();
@@ -88,17 +525,20 @@ int acct_db_init(void)
 	/* Check to see that the backend connection was successfully made */
 	if (PQstatus(conn) != CONNECTION_OK) {
 		fd_log_debug("Connection to database failed: %s", PQerrorMessage(conn));
-		acct_db_free();
+		PQfinish(conn);
 		return EINVAL;
 	}
 	if (PQprotocolVersion(conn) < 3) {
 		fd_log_debug("Database protocol version is too old, version 3 is required for prepared statements.");
-		acct_db_free();
+		PQfinish(conn);
 		return EINVAL;
 	}
 	
 	TRACE_DEBUG(FULL, "Connection to database successful, server version %d.", PQserverVersion(conn));
 	
+	/* The binary format of the timestamps depends on this compilation option of the server (default since 8.4) */
+	ts_binary = PQparameterStatus(conn, "integer_datetimes") && !strcmp(PQparameterStatus(conn, "integer_datetimes"), "on");
+	
 	/* Now, prepare the request object */
 	
 	/* First, we build the list of AVP we will insert in the database */
@@ -144,7 +584,7 @@ int acct_db_init(void)
 		sql_offset += p;									\
 	}
 	
-	/* INSERT INTO table (tsfield, field1, field2, ...) VALUES (now, $1::bytea, $2::integer, ...) */
+	/* INSERT INTO table (tsfield, field1, field2, ...) VALUES (%d, %d::bytea, %d::integer, ...) */
 	ADD_EXTEND("INSERT INTO %s (", acct_config->tablename);
 	
 	if (acct_config->tsfield) {
@@ -159,23 +599,25 @@ int acct_db_init(void)
 		ADD_EXTEND("\", ");
 	}
 	
-	for (li = emptyrecords.all.next; li != &emptyrecords.all; li = li->next) {
-		struct acct_record_item * i = (struct acct_record_item *)(li->o);
+	for (idx = 0; idx < emptyrecords.nball; idx++) {
+		struct acct_record_item * i = &emptyrecords.items[idx];
 		ADD_EXTEND("\"");
 		ADD_ESCAPE(i->param->field?:i->param->avpname);
 		if (i->index) {
 			ADD_EXTEND("%d", i->index);
 		}
-		if (li->next != &emptyrecords.all) {
+		if (idx + 1 < emptyrecords.nball) {
 			ADD_EXTEND("\", ");
 		}
 	}
 	
-	ADD_EXTEND("\") VALUES (");
+	ADD_EXTEND("\") VALUES ");
+	CHECK_MALLOC( sql_head = strdup(sql) );
+	sql_offset = 0;
 	
 	if (acct_config->tsfield) {
-		++idx;
-		ADD_EXTEND("$%d, ", idx);
+		++nbparams;
+		ADD_EXTEND("$%%d::timestamp with time zone, ");
 	}
 	if (acct_config->srvnfield) {
 		ADD_EXTEND("'");
@@ -183,34 +625,77 @@ int acct_db_init(void)
 		ADD_EXTEND("', ");
 	}
 	
-	for (li = emptyrecords.all.next; li != &emptyrecords.all; li = li->next) {
-		struct acct_record_item * i = (struct acct_record_item *)(li->o);
-		++idx;
-		ADD_EXTEND("$%d::%s", idx, diam2db_types_mapping[i->param->avptype]);
+	for (idx = 0; idx < emptyrecords.nball; idx++) {
+		struct acct_record_item * i = &emptyrecords.items[idx];
+		++nbparams;
+		ADD_EXTEND("$%%d::%s", diam2db_types_mapping[i->param->avptype]);
 		
-		if (li->next != &emptyrecords.all) {
+		if (idx + 1 < emptyrecords.nball) {
 			ADD_EXTEND(", ");
 		}
 	}
 	
-	ADD_EXTEND(");");
+	CHECK_MALLOC( sql_row = strdup(sql) );
+	free(sql);
+	CHECK_MALLOC( sql = acct_db_sql(1) );
+	
+	acct_rec_empty(&emptyrecords);
 	
 	TRACE_DEBUG(FULL, "Preparing the following SQL statement: '%s'", sql);
-	res = PQprepare(conn, stmt, sql, emptyrecords.nball, NULL);
+	res = PQprepare(conn, stmt, sql, nbparams, NULL);
 	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
 		TRACE_DEBUG(INFO, "Preparing statement '%s' failed: %s",
 			sql, PQerrorMessage(conn));
 		PQclear(res);
+		PQfinish(conn);
 		return EINVAL;
         }
 	PQclear(res);
-	nbrecords = emptyrecords.nball;
 	
-	acct_rec_empty(&emptyrecords);
+	/* The multi-row statements must stay within the protocol limit */
+	if (acct_config->batch_size * nbparams > ACCT_MAX_PARAMS) {
+		int max = ACCT_MAX_PARAMS / nbparams;
+		LOG_N("app_acct: batch_size reduced from %d to %d, a statement cannot have more than %d parameters (%d per record)",
+				acct_config->batch_size, max, ACCT_MAX_PARAMS, nbparams);
+		acct_config->batch_size = max;
+	}
 	
 	CHECK_POSIX( pthread_key_create(&connk, (void (*)(void*))PQfinish) );
 	CHECK_POSIX( pthread_setspecific(connk, conn) );
 	
+	/* Open the spool file, it may contain records from a previous run */
+	if (acct_config->spool) {
+		struct stat st;
+		CHECK_SYS_DO( spool_fd = open(acct_config->spool, O_RDWR | O_APPEND | O_CREAT, 0600), 
+			{ fd_log_debug("Unable to open the spool file '%s': %s", acct_config->spool, strerror(errno)); return errno; } );
+		CHECK_SYS( fstat(spool_fd, &st) );
+		if (st.st_size > 0) {
+			/* Do not append the new records after an incomplete one */
+			uint8_t * buf;
+			size_t len;
+			CHECK_MALLOC( buf = malloc(st.st_size) );
+			CHECK_SYS_DO( pread(spool_fd, buf, st.st_size, 0), { free(buf); return errno; } );
+			len = acct_spool_complete(buf, st.st_size);
+			free(buf);
+			if (len < st.st_size) {
+				CHECK_SYS( ftruncate(spool_fd, len) );
+			}
+			spool_pending = (len > 0);
+		}
+	}
+	
+	/* Start the writers, they connect to the database when they first need it */
+	CHECK_MALLOC( writers = calloc(acct_config->writers, sizeof(struct acct_writer)) );
+	for (i = 0; i < acct_config->writers; i++) {
+		struct acct_writer * w = &writers[i];
+		CHECK_MALLOC( w->prepared  = calloc(acct_config->batch_size + 1, sizeof(char)) );
+		CHECK_MALLOC( w->val       = calloc(acct_config->batch_size * nbparams, sizeof(const char *)) );
+		CHECK_MALLOC( w->val_len   = calloc(acct_config->batch_size * nbparams, sizeof(int)) );
+		CHECK_MALLOC( w->val_isbin = calloc(acct_config->batch_size * nbparams, sizeof(int)) );
+		CHECK_POSIX( pthread_create(&w->thr, NULL, acct_db_writer, w) );
+		nbwriters++;
+	}
+	
 	/* Ok, ready */
 	return 0;
 }
@@ -218,124 +703,201 @@ int acct_db_init(void)
 /* Terminate the connection to the DB */
 void acct_db_free(void)
 {	
-	CHECK_POSIX_DO(pthread_key_delete(connk) , );
-	free(sql);
-}
-
-/* When a new message has been received, insert the content of the parsed mapping into the DB (using prepared statement) */
-int acct_db_insert(struct acct_record_list * records)
-{
-	char 	**val;
-	int	 *val_len;
-	int 	 *val_isbin;
-	int	  idx = 0;
-	int	  size = 0;
-	PGresult *res;
-	struct fd_list *li;
-	PGconn *conn;
-	int new = 0;
+	int i;
 	
-	TRACE_ENTRY("%p", records);
-	CHECK_PARAMS( records );
+	/* The writers save the queued records before they terminate */
+	CHECK_POSIX_DO( pthread_mutex_lock(&acct_lock), );
+	acct_stop = 1;
+	CHECK_POSIX_DO( pthread_cond_broadcast(&acct_cond_rec), );
+	CHECK_POSIX_DO( pthread_cond_broadcast(&acct_cond_room), );
+	CHECK_POSIX_DO( pthread_mutex_unlock(&acct_lock), );
 	
-	conn = pthread_getspecific(connk);
-	if (!conn) {
-		conn = PQconnectdb(acct_config->conninfo);
-		CHECK_POSIX( pthread_setspecific(connk, conn) );
-		
-		new = 1;
+	for (i = 0; i < nbwriters; i++) {
+		CHECK_POSIX_DO( pthread_join(writers[i].thr, NULL), );
 	}
-	
-	/* First, check if the connection with the DB has not staled, and eventually try to fix it */
-	if (PQstatus(conn) != CONNECTION_OK) {
-		/* Attempt a reset */
-		PQreset(conn);
-		if (PQstatus(conn) != CONNECTION_OK) {
-			TRACE_DEBUG(INFO, "Lost connection to the database server, and attempt to reestablish it failed");
-			TODO("Terminate the freeDiameter instance completely?");
-			return ENOTCONN;
+	if (writers) {
+		for (i = 0; i < acct_config->writers; i++) {
+			if (writers[i].conn)
+				PQfinish(writers[i].conn);
+			free(writers[i].prepared);
+			free(writers[i].val);
+			free(writers[i].val_len);
+			free(writers[i].val_isbin);
 		}
+		free(writers);
+		writers = NULL;
 	}
+	nbwriters = 0;
 	
-	if (new) {
-		/* Create the prepared statement for this ocnnection, it is not shared */
-		res = PQprepare(conn, stmt, sql, nbrecords, NULL);
-		if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-			TRACE_DEBUG(INFO, "Preparing statement '%s' failed: %s",
-				sql, PQerrorMessage(conn));
-			PQclear(res);
-			return EINVAL;
-        	}
-		PQclear(res);
+	if (spool_fd >= 0) {
+		close(spool_fd);
+		spool_fd = -1;
 	}
 	
-	size = 	acct_config->tsfield ? records->nball + 1 : records->nball;
+	CHECK_POSIX_DO(pthread_key_delete(connk) , );
+	free(sql);
+	free(sql_head);
+	free(sql_row);
+}
+
+/* A dispatch thread is canceled while it waits in acct_db_insert, with acct_lock held again */
+static void acct_insert_cleanup(void * arg)
+{
+	struct acct_db_rec * rec = arg;
+	
+	if (rec->waited && !rec->done)
+		rec->waited = 0; /* the writer frees it */
+	else
+		free(rec); /* not queued, or already processed */
+	fd_cleanup_mutex(&acct_lock);
+}
+
+/* When a new message has been received, queue the content of the parsed mapping for the writers, and wait until it is saved (unless Answer_before_commit) */
+int acct_db_insert(struct acct_record_list * records)
+{
+	struct acct_db_rec * rec;
+	char tsbuf[48];
+	size_t size = 0, tslen = 0;
+	uint64_t ts;
+	uint8_t * p;
+	int i, ret = 0, spool = 0, own = 1;
 	
-	/* Alloc the arrays of parameters */
-	CHECK_MALLOC( val       = calloc(size, sizeof(const char *)) );
-	CHECK_MALLOC( val_len   = calloc(size, sizeof(const int)) );
-	CHECK_MALLOC( val_isbin = calloc(size, sizeof(const int)) );
+	TRACE_ENTRY("%p", records);
+	CHECK_PARAMS( records );
 	
 	if (acct_config->tsfield) {
-		val[idx] = "now";
-		val_len[idx] = 3;
-		val_isbin[idx] = 0;
-		idx++;
+		/* The time the record was received, not the time it is written */
+		struct timespec now;
+		CHECK_SYS( clock_gettime(CLOCK_REALTIME, &now) );
+		if (ts_binary) {
+			/* microseconds since 2000-01-01 00:00:00 UTC */
+			ts = htonll((now.tv_sec - PG_EPOCH) * 1000000LL + now.tv_nsec / 1000);
+			tslen = sizeof(uint64_t);
+		} else {
+			struct tm tm;
+			CHECK_PARAMS( localtime_r(&now.tv_sec, &tm) );
+			tslen = strftime(tsbuf, sizeof(tsbuf), "%Y-%m-%d %H:%M:%S", &tm);
+			tslen += snprintf(tsbuf + tslen, sizeof(tsbuf) - tslen, ".%06ld", now.tv_nsec / 1000);
+			tslen += strftime(tsbuf + tslen, sizeof(tsbuf) - tslen, "%z", &tm);
+		}
+		size += 2 * sizeof(int32_t) + tslen;
 	}
 	
-	/* Now write all the map'd records in these arrays */
-	for (li = records->all.next; li != &records->all; li = li->next) {
-		struct acct_record_item * r = (struct acct_record_item *)(li->o);
+	/* Compute the size of the values */
+	for (i = 0; i < records->nball; i++) {
+		struct acct_record_item * r = &records->items[i];
+		size += 2 * sizeof(int32_t);
 		if (r->value) {
-			val_isbin[idx] = 1; /* We always pass binary parameters */
 			switch (r->param->avptype) {
 				case AVP_TYPE_OCTETSTRING:
-					val[idx] = (void *)(r->value->os.data);
-					val_len[idx] = r->value->os.len;
+					size += r->value->os.len;
 					break;
-					
 				case AVP_TYPE_INTEGER32:
 				case AVP_TYPE_UNSIGNED32:
 				case AVP_TYPE_FLOAT32:
-					r->scalar.v32 = htonl(r->value->u32);
-					val[idx] = &r->scalar.c;
-					val_len[idx] = sizeof(uint32_t);
+					size += sizeof(uint32_t);
 					break;
-					
 				case AVP_TYPE_INTEGER64:
 				case AVP_TYPE_UNSIGNED64:
 				case AVP_TYPE_FLOAT64:
-					r->scalar.v64 = htonll(r->value->u64);
-					val[idx] = &r->scalar.c;
-					val_len[idx] = sizeof(uint64_t);
+					size += sizeof(uint64_t);
 					break;
-				
 				default:
 					ASSERT(0); /* detect bugs */
 			}
 		}
-		
-		idx++;
 	}
 	
-	/* OK, now execute the SQL statement */
-	res = PQexecPrepared(conn, stmt, size, (const char * const *)val, val_len, val_isbin, 1 /* We actually don't care here */);
+	CHECK_MALLOC( rec = malloc(sizeof(struct acct_db_rec) + size) );
+	memset(rec, 0, sizeof(struct acct_db_rec));
+	fd_list_init(&rec->chain, rec);
+	rec->size = size;
+	p = rec->data;
+	
+	/* This macro adds a parameter in the record */
+	#define ADD_PARAM( _len, _isbin, _val ) {			\
+		int32_t __l = (_len), __b = (_isbin);			\
+		memcpy(p, &__l, sizeof(int32_t));			\
+		memcpy(p + sizeof(int32_t), &__b, sizeof(int32_t));	\
+		p += 2 * sizeof(int32_t);				\
+		if (__l > 0) {						\
+			memcpy(p, (void *)(_val), __l);			\
+			p += __l;					\
+		}							\
+	}
 	
-	/* Done with the parameters */
-	free(val);
-	free(val_len);
-	free(val_isbin);
+	if (acct_config->tsfield) {
+		if (ts_binary) {
+			ADD_PARAM( tslen, 1, &ts );
+		} else {
+			ADD_PARAM( tslen, 0, tsbuf );
+		}
+	}
 	
-	/* Now check the result code */
-	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-		TRACE_DEBUG(INFO, "An error occurred while INSERTing in the database: %s", PQerrorMessage(conn));
-		PQclear(res);
-		return EINVAL; /* It was probably a mistake in configuration file... */
-        }
-	PQclear(res);
+	/* Now write all the map'd records, we always pass binary parameters */
+	for (i = 0; i < records->nball; i++) {
+		struct acct_record_item * r = &records->items[i];
+		if (!r->value) {
+			ADD_PARAM( -1, 1, "" );
+			continue;
+		}
+		switch (r->param->avptype) {
+			case AVP_TYPE_OCTETSTRING:
+				ADD_PARAM( r->value->os.len, 1, r->value->os.data );
+				break;
+
+			case AVP_TYPE_INTEGER32:
+			case AVP_TYPE_UNSIGNED32:
+			case AVP_TYPE_FLOAT32:
+				r->scalar.v32 = htonl(r->value->u32);
+				ADD_PARAM( sizeof(uint32_t), 1, &r->scalar.c );
+				break;
+
+			case AVP_TYPE_INTEGER64:
+			case AVP_TYPE_UNSIGNED64:
+			case AVP_TYPE_FLOAT64:
+				r->scalar.v64 = htonll(r->value->u64);
+				ADD_PARAM( sizeof(uint64_t), 1, &r->scalar.c );
+				break;
+
+			default:
+				ASSERT(0); /* detect bugs */
+		}
+	}
+	#undef ADD_PARAM
 	
-	/* Ok, we are done */
-	return 0;
+	/* Queue the record. The dispatch thread may be canceled in the waits, see acct_insert_cleanup */
+	CHECK_POSIX( pthread_mutex_lock(&acct_lock) );
+	pthread_cleanup_push( acct_insert_cleanup, rec );
+	while ((acct_queued >= acct_config->queue_size) && !acct_stop && (spool_fd < 0)) {
+		CHECK_POSIX_DO( ret = pthread_cond_wait(&acct_cond_room, &acct_lock), break );
+	}
+	if (!ret && acct_stop) {
+		ret = ESHUTDOWN;
+	} else if (!ret && (acct_queued >= acct_config->queue_size)) {
+		/* The database is too slow, save the record in the spool file */
+		spool = 1;
+	} else if (!ret) {
+		fd_list_insert_before(&acct_queue, &rec->chain);
+		acct_queued++;
+		CHECK_POSIX_DO( pthread_cond_signal(&acct_cond_rec), );
+		rec->waited = !acct_config->early_answer;
+		own = rec->waited;
+		
+		/* Wait until a writer has processed the record */
+		while (rec->waited && !rec->done) {
+			CHECK_POSIX_DO( ret = pthread_cond_wait(&acct_cond_done, &acct_lock), { rec->waited = 0; own = 0; } );
+		}
+		if (own)
+			ret = rec->ret;
+	}
+	pthread_cleanup_pop(0);
+	CHECK_POSIX( pthread_mutex_unlock(&acct_lock) );
+	
+	if (spool)
+		ret = acct_spool(&rec, 1);
+	if (own)
+		free(rec);
+	return ret;
 }
 
-
@@ -33,43 +33,127 @@
 * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
 *********************************************************************************************************/
 
-/* Functions to create a list of AVPs according to the configuration file */
+/* Functions to create the records of the Accounting-Requests according to the configuration file */
+
+/* The configuration is compiled once into an extraction plan: a hash table that gives, for each 
+(code, vendor) of a configured AVP, the items of the record where its occurrences are saved. The 
+AVPs of a message are then mapped in a single pass. Each thread reuses its own array of items. */
 
 #include "app_acct.h"
 
-/* Prepare a list of acct_record entries from the configuration, without mapping any value at this time */
-int acct_rec_prepare(struct acct_record_list * records)
+/* An entry of the plan */
+struct acct_plan_avp {
+	avp_code_t	code;
+	vendor_id_t	vendor;
+	int		nslots;		/* 0 if this entry of the table is free */
+	int	       *slots;		/* the indexes of the items for the 1st, 2nd, ... occurrences of the AVP */
+};
+
+static struct acct_plan_avp	*plan = NULL;
+static unsigned			 plan_size = 0;		/* size of the hash table, a power of 2 */
+static struct acct_record_item	*plan_items = NULL;	/* the items of an empty record */
+static int			 plan_nball = 0;
+static pthread_key_t		 plan_key;		/* the items of the thread */
+
+#define PLAN_HASH( _code, _vendor )	((((_code) * 31) + (_vendor)) & (plan_size - 1))
+
+/* Find the entry of an AVP in the plan, or the free entry where to add it */
+static struct acct_plan_avp * acct_plan_find(avp_code_t code, vendor_id_t vendor)
+{
+	unsigned h = PLAN_HASH(code, vendor);
+	while (plan[h].nslots && ((plan[h].code != code) || (plan[h].vendor != vendor)))
+		h = (h + 1) & (plan_size - 1);
+	return &plan[h];
+}
+
+/* Compile the extraction plan from the configuration */
+int acct_rec_init(void)
 {
 	struct fd_list * li;
-	TRACE_ENTRY("%p", records);
-	CHECK_PARAMS( records && acct_config );
+	int n = 0;
 	
-	/* Prepare the records structure */
-	memset(records, 0, sizeof(struct acct_record_list));
-	fd_list_init(&records->all, records);
-	fd_list_init(&records->unmaped, records);
+	TRACE_ENTRY();
+	CHECK_PARAMS( acct_config );
 	
-	/* for each entry in the configuration */
+	/* Count the items: as many as the 'multi' parameter requires for each entry in the configuration */
 	for (li = acct_config->avps.next; li != &acct_config->avps; li = li->next) {
 		struct acct_conf_avp * a = (struct acct_conf_avp *)li;
-		struct acct_record_item * new;
+		plan_nball += a->multi ?: 1;
+		n++;
+	}
+	CHECK_MALLOC( plan_items = calloc(plan_nball ?: 1, sizeof(struct acct_record_item)) );
+	for (plan_size = 1; plan_size < 2 * n; plan_size <<= 1)
+		;
+	CHECK_MALLOC( plan = calloc(plan_size, sizeof(struct acct_plan_avp)) );
+	
+	n = 0;
+	for (li = acct_config->avps.next; li != &acct_config->avps; li = li->next) {
+		struct acct_conf_avp * a = (struct acct_conf_avp *)li;
+		struct dict_avp_data dictdata;
+		struct acct_plan_avp * e;
 		int i = a->multi ? 1 : 0;
-		/* Create as many records as the 'multi' parameter requires */
+		
+		CHECK_FCT( fd_dict_getval( a->avpobj, &dictdata ) );
+		e = acct_plan_find(dictdata.avp_code, dictdata.avp_vendor);
+		e->code = dictdata.avp_code;
+		e->vendor = dictdata.avp_vendor;
+		
+		/* The occurrences of an AVP configured several times fill the entries in the order of the configuration */
 		do {
-			CHECK_MALLOC( new = malloc(sizeof(struct acct_record_item)) );
-			memset(new, 0, sizeof(struct acct_record_item));
-			fd_list_init(&new->chain, new);
-			fd_list_init(&new->unmapd, new);
-			new->param = a;
-			new->index = i;
-			fd_list_insert_before(&records->all, &new->chain);
-			fd_list_insert_before(&records->unmaped, &new->unmapd);
-			records->nball++;
-			records->nbunmap++;
+			CHECK_MALLOC( e->slots = realloc(e->slots, (e->nslots + 1) * sizeof(int)) );
+			e->slots[e->nslots++] = n;
+			plan_items[n].param = a;
+			plan_items[n].index = i;
+			n++;
 			i++;
 		} while (i <= a->multi);
 	}
 	
+	CHECK_POSIX( pthread_key_create(&plan_key, free) );
+	return 0;
+}
+
+/* Destroy the extraction plan */
+void acct_rec_free(void)
+{
+	unsigned i;
+	
+	if (!plan_items)
+		return;
+	
+	CHECK_POSIX_DO( pthread_key_delete(plan_key), );
+	for (i = 0; i < plan_size; i++)
+		free(plan[i].slots);
+	free(plan);
+	free(plan_items);
+	plan = NULL;
+	plan_items = NULL;
+	plan_size = 0;
+	plan_nball = 0;
+}
+
+/* Prepare an empty record of the calling thread, without mapping any value at this time */
+int acct_rec_prepare(struct acct_record_list * records)
+{
+	struct acct_record_item * items;
+	int i;
+	
+	TRACE_ENTRY("%p", records);
+	CHECK_PARAMS( records && plan_items );
+	
+	items = pthread_getspecific(plan_key);
+	if (!items) {
+		CHECK_MALLOC( items = malloc((plan_nball ?: 1) * sizeof(struct acct_record_item)) );
+		memcpy(items, plan_items, plan_nball * sizeof(struct acct_record_item));
+		CHECK_POSIX_DO( pthread_setspecific(plan_key, items), { free(items); return EINVAL; } );
+	}
+	for (i = 0; i < plan_nball; i++)
+		items[i].value = NULL;
+	
+	records->items = items;
+	records->nball = plan_nball;
+	records->nbunmap = plan_nball;
+	
 	return 0;
 }
 
@@ -80,31 +164,28 @@ int acct_rec_map(struct acct_record_list * records, struct msg * msg)
 	
 	TRACE_ENTRY("%p %p", records, msg);
 	
-	/* For each AVP in the message, search if we have a corresponding unmap'd record */
+	/* For each AVP in the message, search if we have a corresponding unmap'd item */
 	CHECK_FCT(  fd_msg_browse(msg, MSG_BRW_FIRST_CHILD, &avp, NULL)  );
 	while (avp) {
-		struct fd_list * li;
-		struct dict_object * model;
-		
-		CHECK_FCT( fd_msg_model(avp, &model) );
-		if (model != NULL) {	/* we ignore the AVPs we don't recognize */
+		struct avp_hdr * h;
 		
-			/* Search this model in the list */
-			for (li = records->unmaped.next; li != &records->unmaped; li = li->next) {
-				struct acct_record_item * r = (struct acct_record_item *)(li->o);
-				if (r->param->avpobj == model) {
-					/* It matches: save the AVP value and unlink this record from the unmap'd list */
-					struct avp_hdr * h;
-					CHECK_FCT( fd_msg_avp_hdr( avp, &h ) );
+		CHECK_FCT( fd_msg_avp_hdr( avp, &h ) );
+		if (h->avp_value != NULL) {	/* we ignore the AVPs we don't recognize */
+			struct acct_plan_avp * e = acct_plan_find(h->avp_code, (h->avp_flags & AVP_FLAG_VENDOR) ? h->avp_vendor : 0);
+			int i;
+			
+			/* Save the value in the first item of this AVP still free */
+			for (i = 0; i < e->nslots; i++) {
+				struct acct_record_item * r = &records->items[e->slots[i]];
+				if (!r->value) {
 					r->value = h->avp_value;
-					fd_list_unlink(&r->unmapd);
 					records->nbunmap -= 1;
 					break;
 				}
 			}
 
 			/* Continue only while there are some AVPs to map */
-			if (FD_IS_LIST_EMPTY(&records->unmaped))
+			if (!records->nbunmap)
 				break;
 		}
 		
@@ -119,7 +200,7 @@ int acct_rec_map(struct acct_record_list * records, struct msg * msg)
 /* Check that a mapped list is not empty and no required AVP is missing. Free the record list in case of error */
 int acct_rec_validate(struct acct_record_list * records)
 {
-	struct fd_list * li;
+	int i;
 	TRACE_ENTRY("%p", records);
 	CHECK_PARAMS( records );
 	
@@ -133,9 +214,9 @@ int acct_rec_validate(struct acct_record_list * records)
 	}
 	
 	/* Now, check there is no required AVP unmap'd */
-	for (li = records->unmaped.next; li != &records->unmaped; li = li->next) {
-		struct acct_record_item * r = (struct acct_record_item *)(li->o);
-		if (r->param->required && (r->index <= 1)) {
+	for (i = 0; i < records->nball; i++) {
+		struct acct_record_item * r = &records->items[i];
+		if (!r->value && r->param->required && (r->index <= 1)) {
 			fd_log_debug("The received ACR does not contain the required AVP '%s'.", r->param->avpname);
 			acct_rec_empty(records);
 			return EINVAL;
@@ -146,16 +227,13 @@ int acct_rec_validate(struct acct_record_list * records)
 	return 0;
 }
 
-/* Free all the items in an acct_record_list returned by acct_rec_prepare */
+/* Release a record returned by acct_rec_prepare; its items are kept for the next record of the thread */
 void acct_rec_empty(struct acct_record_list * records)
 {
 	TRACE_ENTRY("%p", records);
 	CHECK_PARAMS_DO( records, return );
 	
-	while (!FD_IS_LIST_EMPTY(&records->all)) {
-		struct acct_record_item * r = (struct acct_record_item *)(records->all.next);
-		fd_list_unlink( &r->chain );
-		fd_list_unlink( &r->unmapd );
-		free(r);
-	}
+	records->items = NULL;
+	records->nball = 0;
+	records->nbunmap = 0;
 }
@@ -123,7 +123,8 @@ static int acct_entry(char * conffile)
 	CHECK_FCT( acct_conf_check(conffile) );
 #endif /* TEST_DEBUG */
 	
-	/* Now initialize the database module */
+	/* Compile the extraction of the AVPs, then initialize the database module */
+	CHECK_FCT( acct_rec_init() );
 	CHECK_FCT( acct_db_init() );
 	
 	/* Search the AVPs we will need in this file */
@@ -147,6 +148,7 @@ void fd_ext_fini(void)
 {
 	/* Close the db connection */
 	acct_db_free();
+	acct_rec_free();
 	
 	/* Destroy the configuration */
 	acct_conf_free();
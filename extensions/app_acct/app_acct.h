@@ -62,6 +62,11 @@ struct acct_conf_avp {
 	enum dict_avp_basetype	 avptype;	/* this info is extracted from avpobj. GROUPED avps are not allowed yet */
 };
 
+/* Default values of the writers parameters */
+#define ACCT_DEF_WRITERS	2
+#define ACCT_DEF_BATCH_SIZE	50
+#define ACCT_DEF_QUEUE_SIZE	1000
+
 /* This is described only inside acct_db.c */
 struct acct_db;
 
@@ -75,12 +80,18 @@ struct acct_conf {
 	char 		*tablename;	/* the name of the table we are working with */
 	char 		*tsfield;	/* the name of the timestamp field, or NULL if not required */
 	char 		*srvnfield;	/* the name of the server name field, or NULL if not required */
+	
+	/* Writing of the records */
+	int		 writers;	/* the number of threads writing to the database */
+	int		 batch_size;	/* the maximum number of records saved by a single INSERT */
+	int		 batch_delay;	/* how long a writer waits for more records to fill a batch, in ms */
+	int		 queue_size;	/* the maximum number of records waiting for a writer */
+	int		 early_answer;	/* send the answer before the record is saved */
+	char		*spool;		/* the file where records are saved when the database is slow or down, or NULL */
 };
 
-/* A successfully parsed Accounting-Request produces a list of these: */
+/* A successfully parsed Accounting-Request produces an array of these, one per column: */
 struct acct_record_item {
-	struct fd_list		 chain;	/* link with all others */
-	struct fd_list		 unmapd;/* link with only unmap'd records */
 	struct acct_conf_avp 	*param;	/* the AVP entry this refers to. */
 	unsigned		 index;	/* in case of multi */
 	union avp_value		*value; /* If the AVP was found in the message, this points to its value. Otherwise, NULL */
@@ -91,12 +102,11 @@ struct acct_record_item {
 	} 			 scalar;/* for scalar AVP (all types except OCTETSTRING) we copy in this area the value in network byte order */
 };
 
-/* The sentinel for a list of acct_record_items */
+/* The record of an Accounting-Request. The items are in the order of the configuration, and are reused by the thread for the next request. */
 struct acct_record_list {
-	struct fd_list	all;	/* The list of records */
-	int		nball;	/* The number of records in all */
-	struct fd_list	unmaped;/* Only the records without a value */
-	int		nbunmap;/* The number of unmap'd records */
+	struct acct_record_item	*items;	/* The items of the record */
+	int		nball;	/* The number of items */
+	int		nbunmap;/* The number of items without a value */
 };
 
 /* Mapping of the data types between Diameter AVP and PQ types: */
@@ -115,6 +125,8 @@ int acct_db_insert(struct acct_record_list * records);
 void acct_db_free(void);
 
 /* In acct_records.c */
+int acct_rec_init(void);
+void acct_rec_free(void);
 int acct_rec_prepare(struct acct_record_list * records);
 int acct_rec_map(struct acct_record_list * records, struct msg * msg);
 int acct_rec_validate(struct acct_record_list * records);
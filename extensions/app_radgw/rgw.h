@@ -75,6 +75,7 @@ struct rgw_serv {
 	unsigned	:13; /* padding */
 	
 	uint16_t	port;	/* stored in network byte order */
+	int		sockets; /* number of sockets (each with its receiving thread) sharing the port */
 	
 	struct in_addr	ip_endpoint;
 	struct in6_addr	ip6_endpoint;
@@ -94,6 +95,10 @@ void rgw_servers_fini(void);
 
 /* Clients management */
 enum rgw_cli_type { RGW_CLI_NAS, RGW_CLI_PXY };
+extern struct rgw_dupl_conf {
+	int	lifetime; /* number of seconds the received requests are kept for duplicate checking */
+	int	max;	  /* max number of requests kept per client and server type, 0 for no limit */
+} rgw_dupl;
 int rgw_clients_auth_check(struct rgw_radius_msg_meta * msg, struct rgw_client * cli, uint8_t * req_auth);
 int rgw_clients_add( struct sockaddr * ip_port, unsigned char ** key, size_t keylen, enum rgw_cli_type type );
 int rgw_clients_getkey(struct rgw_client * cli, unsigned char **key, size_t *key_len);
@@ -105,6 +110,7 @@ int rgw_client_finish_send(struct radius_msg ** msg, struct rgw_radius_msg_meta
 int rgw_client_finish_nosend(struct rgw_radius_msg_meta * req, struct rgw_client * cli);
 void rgw_clients_dispose(struct rgw_client ** ref);
 void rgw_clients_dump(void);
+int rgw_clients_loaded(int ok);
 int rgw_clients_init(void);
 void rgw_clients_fini(void);
 int rgw_client_session_add(struct rgw_client * cli, struct session *sess, char * dest_realm, char * dest_host, application_id_t appid);
@@ -120,8 +126,9 @@ int rgw_plg_loop_ans(struct rgw_radius_msg_meta *req, struct msg **diam_ans, str
 void rgw_plg_fini(void);
 
 
-/* Parse configuration file */
-int rgw_conf_handle(char * conffile);
+/* Parse configuration file. On reload, only the clients and duplicate settings are updated. */
+int rgw_conf_handle(char * conffile, int reload);
+extern int rgw_reload_signal; /* signal that triggers the reload, 0 if disabled */
 
 
 /* Worker module, process incoming RADIUS messages (in separated threads) */
@@ -40,7 +40,13 @@
 #include "rgw.h"
 
 #define REVERSE_DNS_SIZE_MAX	512 /* length of our buffer for reverse DNS */
-#define DUPLICATE_CHECK_LIFETIME 60 /* number of seconds that the received RADIUS records are kept for duplicate checking . TODO: make it configurable if needed */
+#define DUPLICATE_CHECK_LIFETIME 60 /* default number of seconds that the received RADIUS records are kept for duplicate checking */
+#define DUPLICATE_CHECK_MAX	65536 /* default max number of records kept per client and server type */
+#define DUPL_HASH_MIN		16 /* initial number of buckets of the duplicate caches */
+#define DUPL_HASH_MAX		(1 << 20) /* the caches are not grown beyond this number of buckets */
+
+/* The duplicate detection configuration */
+struct rgw_dupl_conf rgw_dupl = { DUPLICATE_CHECK_LIFETIME, DUPLICATE_CHECK_MAX };
 
 /* Ordered lists of clients. The order relationship is a memcmp on the address zone. 
    For same addresses, the port is compared.
@@ -49,9 +55,29 @@
 static struct fd_list cli_ip = FD_LIST_INITIALIZER(cli_ip);
 static struct fd_list cli_ip6 = FD_LIST_INITIALIZER(cli_ip6);
 
+/* The lists being filled while the configuration is (re)loaded. They replace the previous ones at the end. */
+static struct fd_list cli_new_ip = FD_LIST_INITIALIZER(cli_new_ip);
+static struct fd_list cli_new_ip6 = FD_LIST_INITIALIZER(cli_new_ip6);
+
 /* Lock to protect the previous lists. We use a rwlock because this list is mostly static, to allow parallel reading */
 static pthread_rwlock_t cli_rwl = PTHREAD_RWLOCK_INITIALIZER;
 
+/* Hash index of the clients on their address and port, for the lookup of the received messages.
+   It is rebuilt each time the configuration is loaded, and published with an atomic pointer so that the 
+   lookups do not take the lock. A replaced index is freed once the lookups that could use it have 
+   ended, as counted in cli_grace. Each index holds a reference on its clients. */
+struct cli_index {
+	uint32_t		 mask;    /* number of slots - 1, the number of slots is a power of 2 */
+	struct rgw_client	*slots[]; /* open addressing, linear probing */
+};
+static struct cli_index * cli_idx = NULL;
+
+/* The lookups in progress, counted in the slot of the generation they started in */
+static struct {
+	uint32_t	gen;
+	long		readers[2];
+} cli_grace;
+
 /* Structure describing one received RADIUS message, for duplicate checks purpose. */
 struct req_info {
 	uint16_t	port; 	/* UDP source port of the request */
@@ -60,11 +86,21 @@ struct req_info {
 	struct radius_msg *ans; /* The replied answer if any, in case the previous answer got lost. */
 	
 	int		nbdup;  /* Number of times this request was received as a duplicate */
-	struct fd_list	by_id;	  /* The list of requests ordered by their id, port, and auth */
+	uint32_t	hash;	  /* The hash of id, port, and auth */
+	struct fd_list	by_id;	  /* The bucket of the hash table of the requests */
 	time_t 		received; /* When was the last duplicate received? */
 	struct fd_list  by_time;  /* The list of requests ordered by the 'received' value . */
 };
 
+/* The received requests of a client on one of the servers */
+struct dupl_cache {
+	pthread_mutex_t dupl_lock;    /* The mutex protecting the following data */
+	struct fd_list *dupl_hash;    /* The hash table of req_info structures, on their id, port, and auth */
+	uint32_t	dupl_hsize;   /* The number of buckets in dupl_hash, a power of 2 */
+	size_t		dupl_nb;      /* The number of req_info structures in the cache */
+	struct fd_list 	dupl_by_time; /* The list of req_info structures ordered by their time (approximative) */
+};
+
 static pthread_t dbt_expire = (pthread_t)NULL; /* The thread that will remove old requests information from all clients (one thread for all) */
 
 /* Structure describing one client */
@@ -72,7 +108,7 @@ struct rgw_client {
 	/* Link information in global list (cli_ip or cli_ip6) */
 	struct fd_list		chain;
 	
-	/* Reference count */
+	/* Reference count (lists, indexes, and messages being processed), updated atomically */
 	int			refcount;
 	
 	/* The address and optional port (alloc'd during configuration file parsing). */
@@ -102,11 +138,7 @@ struct rgw_client {
 	} 			key;
 	
 	/* information of previous msg received, for duplicate checks. */
-	struct {
-		pthread_mutex_t dupl_lock;    /* The mutex protecting the following lists */
-		struct fd_list 	dupl_by_id;   /* The list of req_info structures ordered by their id, port, and auth */
-		struct fd_list 	dupl_by_time; /* The list of req_info structures ordered by their time (approximative) */
-	} dupl_info[2]; /*[0] for auth, [1] for acct. */
+	struct dupl_cache	dupl_info[2]; /*[0] for auth, [1] for acct. */
 };
 
 
@@ -138,6 +170,125 @@ static void dupl_free_req_info(struct req_info * r) {
 	free(r);
 }
 
+/* Hash the key of a request. The authenticator is random for the Access-Request, and a MD5 digest otherwise. */
+static uint32_t dupl_hash(uint8_t id, uint16_t port, uint8_t * auth)
+{
+	uint32_t h;
+	memcpy(&h, auth, sizeof(h));
+	h ^= ((uint32_t)id << 16) ^ port;
+	return h * 0x9e3779b1;
+}
+
+/* Initialize and destroy a cache */
+static int dupl_cache_init(struct dupl_cache * c)
+{
+	int i;
+	CHECK_POSIX( pthread_mutex_init(&c->dupl_lock, NULL) );
+	CHECK_MALLOC( c->dupl_hash = malloc(DUPL_HASH_MIN * sizeof(struct fd_list)) );
+	for (i = 0; i < DUPL_HASH_MIN; i++)
+		fd_list_init(&c->dupl_hash[i], NULL);
+	c->dupl_hsize = DUPL_HASH_MIN;
+	c->dupl_nb = 0;
+	fd_list_init(&c->dupl_by_time, NULL);
+	return 0;
+}
+
+static void dupl_cache_fini(struct dupl_cache * c)
+{
+	CHECK_POSIX_DO( pthread_mutex_lock( &c->dupl_lock ), /* continue */ );
+	while (!FD_IS_LIST_EMPTY(&c->dupl_by_time)) {
+		struct req_info * r = (struct req_info *)(c->dupl_by_time.next->o);
+		fd_list_unlink( &r->by_id );
+		fd_list_unlink( &r->by_time );
+		dupl_free_req_info(r);
+	}
+	free(c->dupl_hash);
+	c->dupl_hash = NULL;
+	CHECK_POSIX_DO( pthread_mutex_unlock( &c->dupl_lock ), /* continue */ );
+	CHECK_POSIX_DO( pthread_mutex_destroy( &c->dupl_lock ), /* continue */ );
+}
+
+/* Search a request in the cache, the lock must be held */
+static struct req_info * dupl_search(struct dupl_cache * c, uint8_t id, uint16_t port, uint8_t * auth)
+{
+	uint32_t h = dupl_hash(id, port, auth);
+	struct fd_list * bucket = &c->dupl_hash[h & (c->dupl_hsize - 1)];
+	struct fd_list * li;
+	
+	for (li = bucket->next; li != bucket; li = li->next) {
+		struct req_info * r = (struct req_info *)(li->o);
+		if ((r->hash == h) && (r->id == id) && (r->port == port) && !memcmp(&r->auth[0], auth, 16))
+			return r;
+	}
+	return NULL;
+}
+
+/* Remove a request from the cache, the lock must be held */
+static void dupl_remove(struct dupl_cache * c, struct req_info * r)
+{
+	fd_list_unlink(&r->by_id);
+	fd_list_unlink(&r->by_time);
+	c->dupl_nb--;
+	dupl_free_req_info(r);
+}
+
+/* Double the number of buckets when the chains get long. If the memory is not available, we keep the current table */
+static void dupl_grow(struct dupl_cache * c)
+{
+	struct fd_list * h;
+	uint32_t i, nsize = c->dupl_hsize * 2;
+	
+	CHECK_MALLOC_DO( h = malloc(nsize * sizeof(struct fd_list)), return );
+	for (i = 0; i < nsize; i++)
+		fd_list_init(&h[i], NULL);
+	for (i = 0; i < c->dupl_hsize; i++) {
+		while (!FD_IS_LIST_EMPTY(&c->dupl_hash[i])) {
+			struct req_info * r = (struct req_info *)(c->dupl_hash[i].next->o);
+			fd_list_unlink(&r->by_id);
+			fd_list_insert_before(&h[r->hash & (nsize - 1)], &r->by_id);
+		}
+	}
+	free(c->dupl_hash);
+	c->dupl_hash = h;
+	c->dupl_hsize = nsize;
+}
+
+/* Save a new request in the cache, the lock must be held. The oldest requests are removed when the cache is full. */
+static void dupl_add(struct dupl_cache * c, struct req_info * r)
+{
+	while (rgw_dupl.max && (c->dupl_nb >= rgw_dupl.max)) {
+		struct req_info * old = (struct req_info *)(c->dupl_by_time.next->o);
+		TRACE_DEBUG(FULL, "Duplicate cache full, removing RADIUS request (id: %02hhx, port: %hu, age %ld secs)", old->id, ntohs(old->port), (long)(r->received - old->received));
+		dupl_remove(c, old);
+	}
+	
+	if ((c->dupl_nb >= 2 * c->dupl_hsize) && (c->dupl_hsize < DUPL_HASH_MAX))
+		dupl_grow(c);
+	
+	r->hash = dupl_hash(r->id, r->port, &r->auth[0]);
+	fd_list_insert_before(&c->dupl_hash[r->hash & (c->dupl_hsize - 1)], &r->by_id);
+	fd_list_insert_before(&c->dupl_by_time, &r->by_time); /* it is the most recent */
+	c->dupl_nb++;
+}
+
+/* Remove the requests older than the lifetime, the lock must be held */
+static void dupl_expire(struct dupl_cache * c, time_t now)
+{
+	while (!FD_IS_LIST_EMPTY(&c->dupl_by_time)) {
+	
+		/* Check the first item in the list */
+		struct req_info * r = (struct req_info *)(c->dupl_by_time.next->o);
+		
+		if (now - r->received <= rgw_dupl.lifetime)
+			break; /* We are done for this list */
+		
+		TRACE_DEBUG(ANNOYING + 1, "Purging RADIUS request (id: %02hhx, port: %hu, dup #%d, age %ld secs)", r->id, ntohs(r->port), r->nbdup, (long)(now - r->received));
+		
+		/* Remove this record */
+		dupl_remove(c, r);
+	}
+}
+
 /* The core of the purge thread */
 static int dupl_purge_list(struct fd_list * clients) {
 
@@ -150,29 +301,9 @@ static int dupl_purge_list(struct fd_list * clients) {
 		for (p=0; p<=1; p++) {
 		
 			/* Lock this list */
-			time_t now;
 			CHECK_POSIX( pthread_mutex_lock(&client->dupl_info[p].dupl_lock) );
 			
-			now = time(NULL);
-			
-			while (!FD_IS_LIST_EMPTY(&client->dupl_info[p].dupl_by_time)) {
-			
-				/* Check the first item in the list */
-				struct req_info * r = (struct req_info *)(client->dupl_info[p].dupl_by_time.next->o);
-				
-				if (now - r->received > DUPLICATE_CHECK_LIFETIME) {
-				
-					TRACE_DEBUG(ANNOYING + 1, "Purging RADIUS request (id: %02hhx, port: %hu, dup #%d, age %ld secs)", r->id, ntohs(r->port), r->nbdup, (long)(now - r->received));
-					
-					/* Remove this record */
-					fd_list_unlink(&r->by_time);
-					fd_list_unlink(&r->by_id);
-					dupl_free_req_info(r);
-				} else {
-					/* We are done for this list */
-					break;
-				}
-			}
+			dupl_expire(&client->dupl_info[p], time(NULL));
 			
 			CHECK_POSIX( pthread_mutex_unlock(&client->dupl_info[p].dupl_lock) );
 		}
@@ -247,9 +378,7 @@ static int client_create(struct rgw_client ** res, struct sockaddr ** ip_port, u
 	
 	/* Initialize the duplicate list info */
 	for (i=0; i<=1; i++) {
-		CHECK_POSIX( pthread_mutex_init(&tmp->dupl_info[i].dupl_lock, NULL) );
-		fd_list_init(&tmp->dupl_info[i].dupl_by_id, NULL);
-		fd_list_init(&tmp->dupl_info[i].dupl_by_time, NULL);
+		CHECK_FCT( dupl_cache_init(&tmp->dupl_info[i]) );
 	}
 	tmp->type = type;
 	
@@ -286,14 +415,12 @@ static int client_create(struct rgw_client ** res, struct sockaddr ** ip_port, u
 	return 0;
 }
 
-/* Decrease refcount on a client; the lock must be held when this function is called. */
+/* Decrease refcount on a client, and free it when it is no longer referenced. */
 static void client_unlink(struct rgw_client * client)
 {
-	client->refcount -= 1;
-	
-	if (client->refcount <= 0) {
+	if (__atomic_sub_fetch(&client->refcount, 1, __ATOMIC_ACQ_REL) <= 0) {
 		int idx;
-		/* to be sure: the refcount should be 0 only when client_fini is called */
+		/* to be sure: the refcount should be 0 only once the client is removed from the lists */
 		ASSERT( FD_IS_LIST_EMPTY(&client->chain) );
 		
 		/* Free the data */
@@ -306,29 +433,123 @@ static void client_unlink(struct rgw_client * client)
 		
 		/* Free the duplicate info */
 		for (idx=0; idx <= 1; idx++){
-			CHECK_POSIX_DO( pthread_mutex_lock( &client->dupl_info[idx].dupl_lock ), /* continue */ );
-			
-			while (!FD_IS_LIST_EMPTY(&client->dupl_info[idx].dupl_by_id)) {
-				struct req_info * r = (struct req_info *)(client->dupl_info[idx].dupl_by_id.next->o);
-				fd_list_unlink( &r->by_id );
-				fd_list_unlink( &r->by_time );
-				dupl_free_req_info(r);
-			}
-			
-			CHECK_POSIX_DO( pthread_mutex_unlock( &client->dupl_info[idx].dupl_lock ), /* continue */ );
-
+			dupl_cache_fini(&client->dupl_info[idx]);
 		}
 		
 		free(client);
 	}
 }
 
+/* Hash the address and port of a client */
+static uint32_t cli_hash(struct sockaddr * sa, uint16_t port)
+{
+	uint8_t key[sizeof(struct in6_addr) + sizeof(uint16_t)];
+	size_t len;
+	
+	if (sa->sa_family == AF_INET) {
+		len = sizeof(struct in_addr);
+		memcpy(&key[0], &((struct sockaddr_in *)sa)->sin_addr, len);
+	} else {
+		len = sizeof(struct in6_addr);
+		memcpy(&key[0], &((struct sockaddr_in6 *)sa)->sin6_addr, len);
+	}
+	memcpy(&key[len], &port, sizeof(port));
+	return fd_os_hash(&key[0], len + sizeof(port));
+}
+
+/* Does the client have this exact address and port (0 for a client defined without port)? */
+static int cli_match(struct rgw_client * cli, struct sockaddr * sa, uint16_t port)
+{
+	if (cli->sa->sa_family != sa->sa_family)
+		return 0;
+	if (sa->sa_family == AF_INET)
+		return (cli->sin->sin_port == port) 
+			&& !memcmp(&cli->sin->sin_addr, &((struct sockaddr_in *)sa)->sin_addr, sizeof(struct in_addr));
+	return (cli->sin6->sin6_port == port) 
+		&& !memcmp(&cli->sin6->sin6_addr, &((struct sockaddr_in6 *)sa)->sin6_addr, sizeof(struct in6_addr));
+}
+
+/* Search the client with this exact address and port in an index */
+static struct rgw_client * cli_index_get(struct cli_index * idx, struct sockaddr * sa, uint16_t port)
+{
+	uint32_t i;
+	
+	for (i = cli_hash(sa, port) & idx->mask; idx->slots[i]; i = (i + 1) & idx->mask) {
+		if (cli_match(idx->slots[i], sa, port))
+			return idx->slots[i];
+	}
+	return NULL;
+}
+
+/* Build the index of the clients in the lists, the lock must be held */
+static int cli_index_build(struct cli_index ** res)
+{
+	struct fd_list * senti[2] = { &cli_ip, &cli_ip6 };
+	struct fd_list * li;
+	struct cli_index * idx;
+	uint32_t nb = 0, size = 16;
+	int l;
+	
+	for (l = 0; l < 2; l++)
+		for (li = senti[l]->next; li != senti[l]; li = li->next)
+			nb++;
+	
+	/* Keep the index at most half full, so that the probe sequences are short */
+	while (size < 2 * nb)
+		size *= 2;
+	
+	CHECK_MALLOC( idx = calloc(1, sizeof(struct cli_index) + size * sizeof(struct rgw_client *)) );
+	idx->mask = size - 1;
+	
+	for (l = 0; l < 2; l++) {
+		for (li = senti[l]->next; li != senti[l]; li = li->next) {
+			struct rgw_client * cli = (struct rgw_client *)li;
+			uint16_t port = (cli->sa->sa_family == AF_INET) ? cli->sin->sin_port : cli->sin6->sin6_port;
+			uint32_t i;
+			
+			for (i = cli_hash(cli->sa, port) & idx->mask; idx->slots[i]; i = (i + 1) & idx->mask)
+				/* next slot */;
+			idx->slots[i] = cli;
+			__atomic_add_fetch(&cli->refcount, 1, __ATOMIC_RELAXED);
+		}
+	}
+	
+	*res = idx;
+	return 0;
+}
+
+/* Release the references of an index on its clients, and free it */
+static void cli_index_free(struct cli_index * idx)
+{
+	uint32_t i;
+	
+	for (i = 0; i <= idx->mask; i++) {
+		if (idx->slots[i])
+			client_unlink(idx->slots[i]);
+	}
+	free(idx);
+}
+
+/* Wait until no lookup uses an index that was replaced before this call. A lookup may read gen, then be 
+   delayed before incrementing the counter, and then use an index published after gen was flipped again:
+   so both counters are drained in turn. */
+static void cli_index_grace(void)
+{
+	int i;
+	for (i = 0; i < 2; i++) {
+		uint32_t old = __atomic_fetch_add(&cli_grace.gen, 1, __ATOMIC_SEQ_CST) & 1;
+		while (__atomic_load_n(&cli_grace.readers[old], __ATOMIC_SEQ_CST) != 0)
+			usleep(100);
+	}
+}
+
 
 /* Macro to avoid duplicating the code in the next function */
 #define client_search_family( _family_ )												\
 		case AF_INET##_family_: {												\
 			struct sockaddr_in##_family_ * sin##_family_ = (struct sockaddr_in##_family_ *)ip_port;				\
-			for (ref = cli_ip##_family_.next; ref != &cli_ip##_family_; ref = ref->next) {					\
+			struct fd_list * senti = loading ? &cli_new_ip##_family_ : &cli_ip##_family_;					\
+			for (ref = senti->next; ref != senti; ref = ref->next) {							\
 				cmp = memcmp(&sin##_family_->sin##_family_##_addr, 							\
 					     &((struct rgw_client *)ref)->sin##_family_->sin##_family_##_addr, 				\
 					     sizeof(struct in##_family_##_addr));							\
@@ -355,10 +576,11 @@ static void client_unlink(struct rgw_client * client)
 		}
 /* Function to look for an existing rgw_client, or the previous element. 
    The cli_rwl must be held for reading (at least) when calling this function. 
+   If loading is true, the search is done in the lists being loaded instead of the current ones.
    Returns ENOENT if the matching client does not exist, and res points to the previous element in the list. 
    Returns EEXIST if the matching client is found, and res points to this element. 
    Returns other error code on other error. */
-static int client_search(struct rgw_client ** res, struct sockaddr * ip_port )
+static int client_search(struct rgw_client ** res, struct sockaddr * ip_port, int loading )
 {
 	int cmp;
 	struct fd_list *ref = NULL;
@@ -397,16 +619,43 @@ int rgw_clients_gettype(struct rgw_client * cli, enum rgw_cli_type *type)
 int rgw_clients_search(struct sockaddr * ip_port, struct rgw_client ** ref)
 {
 	int ret = 0;
+	struct cli_index * idx;
+	long * readers;
+	uint16_t port;
 	
 	TRACE_ENTRY("%p %p", ip_port, ref);
 	
 	CHECK_PARAMS(ip_port && ref);
+	CHECK_PARAMS( (ip_port->sa_family == AF_INET) || (ip_port->sa_family == AF_INET6) );
+	
+	port = sSAport(ip_port);
+	
+	/* Prevent the index from being freed while we use it */
+	readers = &cli_grace.readers[__atomic_load_n(&cli_grace.gen, __ATOMIC_SEQ_CST) & 1];
+	__atomic_add_fetch(readers, 1, __ATOMIC_SEQ_CST);
+	idx = __atomic_load_n(&cli_idx, __ATOMIC_SEQ_CST);
 	
+	if (idx && port) {
+		/* The received messages: search the client with this port, then the client defined without port */
+		*ref = cli_index_get(idx, ip_port, port) ?: cli_index_get(idx, ip_port, 0);
+		if (*ref) {
+			__atomic_add_fetch(&(*ref)->refcount, 1, __ATOMIC_RELAXED);
+		} else {
+			ret = ENOENT;
+		}
+		__atomic_sub_fetch(readers, 1, __ATOMIC_SEQ_CST);
+		return ret;
+	}
+	
+	/* Not counted while waiting for the lock, the writer waits for the lookups with the lock held */
+	__atomic_sub_fetch(readers, 1, __ATOMIC_SEQ_CST);
+	
+	/* Without port, any client with this address matches */
 	CHECK_POSIX( pthread_rwlock_rdlock(&cli_rwl) );
 
-	ret = client_search(ref, ip_port);
+	ret = client_search(ref, ip_port, 0);
 	if (ret == EEXIST) {
-		(*ref)->refcount ++;
+		__atomic_add_fetch(&(*ref)->refcount, 1, __ATOMIC_RELAXED);
 		ret = 0;
 	} else {
 		*ref = NULL;
@@ -419,9 +668,9 @@ int rgw_clients_search(struct sockaddr * ip_port, struct rgw_client ** ref)
 
 int rgw_clients_check_dup(struct rgw_radius_msg_meta **msg, struct rgw_client *cli)
 {
-	int p, dup = 0;
-	struct fd_list * li;
+	int p;
 	struct req_info * r;
+	time_t now;
 	
 	TRACE_ENTRY("%p %p", msg, cli);
 	
@@ -434,29 +683,14 @@ int rgw_clients_check_dup(struct rgw_radius_msg_meta **msg, struct rgw_client *c
 	
 	CHECK_POSIX( pthread_mutex_lock( &cli->dupl_info[p].dupl_lock ) );
 	
+	/* Remove the expired requests first, they must not be reported as duplicates */
+	now = time(NULL);
+	dupl_expire(&cli->dupl_info[p], now);
+	
 	/* Search if we have this message in our list */
-	for (li = cli->dupl_info[p].dupl_by_id.next; li != &cli->dupl_info[p].dupl_by_id; li = li->next) {
-		int cmp = 0;
-		r = (struct req_info *)(li->o);
-		if (r->id < (*msg)->radius.hdr->identifier)
-			continue;
-		if (r->id > (*msg)->radius.hdr->identifier)
-			break;
-		if (r->port < (*msg)->port)
-			continue;
-		if (r->port > (*msg)->port)
-			break;
-		cmp = memcmp(&r->auth[0], &(*msg)->radius.hdr->authenticator[0], 16);
-		if (cmp < 0)
-			continue;
-		if (cmp > 0)
-			break;
-		dup = 1;
-		break;
-	}
+	r = dupl_search(&cli->dupl_info[p], (*msg)->radius.hdr->identifier, (*msg)->port, &(*msg)->radius.hdr->authenticator[0]);
 	
-	if (dup) {
-		time_t now = time(NULL);
+	if (r) {
 		r->nbdup += 1;
 		TRACE_DEBUG(INFO, "Received duplicated RADIUS message (id: %02hhx, port: %hu, dup #%d, previously seen %ld secs ago).", 
 				r->id, ntohs(r->port), r->nbdup, (long)(now - r->received));
@@ -478,10 +712,8 @@ int rgw_clients_check_dup(struct rgw_radius_msg_meta **msg, struct rgw_client *c
 		
 	} else {
 		/* The message was not a duplicate, we save it */
-		/* li currently points the the next entry in list_by_id */
 		CHECK_MALLOC_DO( r= dupl_new_req_info(*msg), { CHECK_POSIX_DO(pthread_mutex_unlock( &cli->dupl_info[p].dupl_lock ), ); return ENOMEM; } );
-		fd_list_insert_before(li, &r->by_id);
-		fd_list_insert_before(&cli->dupl_info[p].dupl_by_time, &r->by_time); /* it is the most recent */
+		dupl_add(&cli->dupl_info[p], r);
 	}
 		
 	CHECK_POSIX( pthread_mutex_unlock( &cli->dupl_info[p].dupl_lock ) );
@@ -901,10 +1133,8 @@ void rgw_clients_dispose(struct rgw_client ** ref)
 	TRACE_ENTRY("%p", ref);
 	CHECK_PARAMS_DO(ref, return);
 	
-	CHECK_POSIX_DO( pthread_rwlock_wrlock(&cli_rwl),  );
 	client_unlink(*ref);
 	*ref = NULL;
-	CHECK_POSIX_DO( pthread_rwlock_unlock(&cli_rwl), );
 }
 
 int rgw_clients_add( struct sockaddr * ip_port, unsigned char ** key, size_t keylen, enum rgw_cli_type type )
@@ -931,7 +1161,7 @@ int rgw_clients_add( struct sockaddr * ip_port, unsigned char ** key, size_t key
 	CHECK_POSIX( pthread_rwlock_wrlock(&cli_rwl) );
 	
 	/* Check if the same entry does not already exist */
-	ret = client_search(&prev, ip_port );
+	ret = client_search(&prev, ip_port, 1 );
 	if (ret == ENOENT) {
 		/* No duplicate found, Ok to add */
 		CHECK_FCT_DO( ret = client_create( &new, &ip_port, key, keylen, type ), goto end );
@@ -967,6 +1197,84 @@ end:
 	return ret;
 }
 
+/* Empty one of the lists of clients, the lock must be held */
+static void cli_list_empty(struct fd_list * senti)
+{
+	while (!FD_IS_LIST_EMPTY(senti)) {
+		struct rgw_client * client = (struct rgw_client *)(senti->next);
+		fd_list_unlink(&client->chain);
+		client_unlink(client);
+	}
+}
+
+/* Replace the clients by those being loaded. The clients that are kept with the same secret and type
+ are not replaced, so that they keep their duplicate caches and aliases. */
+static int cli_lists_replace(void)
+{
+	struct fd_list * senti[2] = { &cli_new_ip, &cli_new_ip6 };
+	struct cli_index * idx = NULL, * old_idx = cli_idx;
+	struct fd_list * li;
+	int l;
+	
+	if (cli_idx) {
+		for (l = 0; l < 2; l++) {
+			for (li = senti[l]->next; li != senti[l]; li = li->next) {
+				struct rgw_client * cli = (struct rgw_client *)li;
+				struct rgw_client * old;
+				uint16_t port = (cli->sa->sa_family == AF_INET) ? cli->sin->sin_port : cli->sin6->sin6_port;
+				
+				old = cli_index_get(cli_idx, cli->sa, port);
+				if ( (!old) || (old->type != cli->type) || (old->key.len != cli->key.len) 
+						|| memcmp(old->key.data, cli->key.data, cli->key.len) )
+					continue;
+				
+				/* Put the previous client in place of the new one */
+				fd_list_unlink(&old->chain);
+				fd_list_insert_before(li, &old->chain);
+				fd_list_unlink(li);
+				client_unlink(cli);
+				li = &old->chain;
+			}
+		}
+	}
+	
+	/* The remaining previous clients are removed */
+	cli_list_empty(&cli_ip);
+	cli_list_empty(&cli_ip6);
+	fd_list_move_end(&cli_ip, &cli_new_ip);
+	fd_list_move_end(&cli_ip6, &cli_new_ip6);
+	
+	/* Publish the new index, and free the previous one once the lookups in progress are done with it */
+	CHECK_FCT( cli_index_build(&idx) );
+	__atomic_store_n(&cli_idx, idx, __ATOMIC_SEQ_CST);
+	if (old_idx) {
+		cli_index_grace();
+		cli_index_free(old_idx);
+	}
+	
+	return 0;
+}
+
+/* Called when the configuration file has been parsed. If ok is false, the clients that were loaded are discarded. */
+int rgw_clients_loaded(int ok)
+{
+	int ret = 0;
+	
+	CHECK_POSIX( pthread_rwlock_wrlock(&cli_rwl) );
+	
+	if (ok) {
+		CHECK_FCT_DO( ret = cli_lists_replace(), );
+	}
+	
+	/* Clear what has not been used */
+	cli_list_empty(&cli_new_ip);
+	cli_list_empty(&cli_new_ip6);
+	
+	CHECK_POSIX( pthread_rwlock_unlock(&cli_rwl) );
+	
+	return ret;
+}
+
 static void dump_cli_list(struct fd_list *senti)
 {
 	struct rgw_client * client = NULL;
@@ -985,6 +1293,8 @@ void rgw_clients_dump(void)
 	if ( ! TRACE_BOOL(FULL) )
 		return;
 	
+	fd_log_debug(" RADIUS duplicate requests kept %d secs, max %d per client", rgw_dupl.lifetime, rgw_dupl.max);
+	
 	CHECK_POSIX_DO( pthread_rwlock_rdlock(&cli_rwl), /* ignore error */ );
 	
 	if (!FD_IS_LIST_EMPTY(&cli_ip))
@@ -1007,6 +1317,12 @@ void rgw_clients_fini(void)
 	CHECK_POSIX_DO( pthread_rwlock_wrlock(&cli_rwl), /* ignore error */ );
 	
 	CHECK_FCT_DO( fd_thr_term(&dbt_expire), /* continue */ );
+	
+	/* free the index */
+	if (cli_idx) {
+		cli_index_free(cli_idx);
+		cli_idx = NULL;
+	}
 
 	/* empty the lists */
 	while ( ! FD_IS_LIST_EMPTY(&cli_ip) ) {
@@ -1027,7 +1343,7 @@ void rgw_clients_fini(void)
 int rgw_client_finish_send(struct radius_msg ** msg, struct rgw_radius_msg_meta * req, struct rgw_client * cli)
 {
 	int p;
-	struct fd_list * li;
+	struct req_info * r;
 	
 	TRACE_ENTRY("%p %p %p", msg, req, cli);
 	CHECK_PARAMS( msg && *msg && cli );
@@ -1076,23 +1392,8 @@ int rgw_client_finish_send(struct radius_msg ** msg, struct rgw_radius_msg_meta
 	CHECK_POSIX( pthread_mutex_lock( &cli->dupl_info[p].dupl_lock ) );
 	
 	/* Search this message in our list */
-	for (li = cli->dupl_info[p].dupl_by_id.next; li != &cli->dupl_info[p].dupl_by_id; li = li->next) {
-		int cmp = 0;
-		struct req_info * r = (struct req_info *)(li->o);
-		if (r->id < req->radius.hdr->identifier)
-			continue;
-		if (r->id > req->radius.hdr->identifier)
-			break;
-		if (r->port < req->port)
-			continue;
-		if (r->port > req->port)
-			break;
-		cmp = memcmp(&r->auth[0], &req->radius.hdr->authenticator[0], 16);
-		if (cmp < 0)
-			continue;
-		if (cmp > 0)
-			break;
-		
+	r = dupl_search(&cli->dupl_info[p], req->radius.hdr->identifier, req->port, &req->radius.hdr->authenticator[0]);
+	if (r) {
 		/* We have the request in our duplicate cache */
 		/* This should not happen, but just in case... */
 		if (r->ans) {
@@ -1111,7 +1412,6 @@ int rgw_client_finish_send(struct radius_msg ** msg, struct rgw_radius_msg_meta
 			fd_list_unlink(&r->by_time); /* Move as last entry, since it is the most recent */
 			fd_list_insert_before(&cli->dupl_info[p].dupl_by_time, &r->by_time);
 		}
-		break;
 	}
 		
 	CHECK_POSIX( pthread_mutex_unlock( &cli->dupl_info[p].dupl_lock ) );
@@ -1135,7 +1435,7 @@ This is useful for example when a temporary error occurred in Diameter (like UNA
 int rgw_client_finish_nosend(struct rgw_radius_msg_meta * req, struct rgw_client * cli)
 {
 	int p;
-	struct fd_list * li;
+	struct req_info * r;
 	
 	TRACE_ENTRY("%p %p", req, cli);
 	CHECK_PARAMS( req && cli );
@@ -1149,28 +1449,10 @@ int rgw_client_finish_nosend(struct rgw_radius_msg_meta * req, struct rgw_client
 	CHECK_POSIX( pthread_mutex_lock( &cli->dupl_info[p].dupl_lock ) );
 	
 	/* Search this message in our list */
-	for (li = cli->dupl_info[p].dupl_by_id.next; li != &cli->dupl_info[p].dupl_by_id; li = li->next) {
-		int cmp = 0;
-		struct req_info * r = (struct req_info *)(li->o);
-		if (r->id < req->radius.hdr->identifier)
-			continue;
-		if (r->id > req->radius.hdr->identifier)
-			break;
-		if (r->port < req->port)
-			continue;
-		if (r->port > req->port)
-			break;
-		cmp = memcmp(&r->auth[0], &req->radius.hdr->authenticator[0], 16);
-		if (cmp < 0)
-			continue;
-		if (cmp > 0)
-			break;
-		
+	r = dupl_search(&cli->dupl_info[p], req->radius.hdr->identifier, req->port, &req->radius.hdr->authenticator[0]);
+	if (r) {
 		/* We have the request in our duplicate cache, remove it */
-		fd_list_unlink(&r->by_id);
-		fd_list_unlink(&r->by_time);
-		dupl_free_req_info(r);
-		break;
+		dupl_remove(&cli->dupl_info[p], r);
 	}
 		
 	CHECK_POSIX( pthread_mutex_unlock( &cli->dupl_info[p].dupl_lock ) );
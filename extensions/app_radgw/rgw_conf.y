@@ -58,11 +58,15 @@
 
 /* Forward declaration */
 int yyparse(char * conffile);
+void rgw_conf_reset(FILE * in);
+
+static int reloading = 0;
 
 /* Parse the configuration file */
-int rgw_conf_handle(char * conffile)
+int rgw_conf_handle(char * conffile, int reload)
 {
 	extern FILE * rgw_confin;
+	struct rgw_servs servs;
 	int ret;
 	
 	rgw_confin = fopen(conffile, "r");
@@ -71,10 +75,22 @@ int rgw_conf_handle(char * conffile)
 		fd_log_debug("Unable to open extension configuration file %s for reading: %s", conffile, strerror(ret));
 		return ret;
 	}
+	
+	/* The servers and plugins are already running, their configuration is not changed */
+	reloading = reload;
+	memcpy(&servs, &rgw_servers, sizeof(servs));
 
+	rgw_conf_reset(rgw_confin);
 	ret = rgw_confparse(conffile);
 
 	fclose(rgw_confin);
+	
+	if (reload)
+		memcpy(&rgw_servers, &servs, sizeof(servs));
+	reloading = 0;
+	
+	/* Replace the clients by those just parsed, or discard them on error */
+	CHECK_FCT( rgw_clients_loaded(ret == 0) );
 
 	if (ret != 0) {
 		return EINVAL;
@@ -158,10 +174,15 @@ static char * plgconffile = NULL;
 %token		AUTH_PORT
 %token		AUTH_IP4
 %token		AUTH_IP6
+%token		AUTH_SOCKETS
 %token		ACCT_ENABLE
 %token		ACCT_PORT
 %token		ACCT_IP4
 %token		ACCT_IP6
+%token		ACCT_SOCKETS
+%token		DUPL_LIFETIME
+%token		DUPL_MAX
+%token		RELOAD_SIGNAL
 
 /* In case of error in the lexical analysis */
 %token 		LEX_ERROR
@@ -176,6 +197,7 @@ conffile:		/* empty grammar is OK */
 			| conffile clientdef
 			| conffile authserv
 			| conffile acctserv
+			| conffile duplicates
 			;
 
 				
@@ -215,8 +237,12 @@ plugin:			{
 			}
 			PLG_PREFIX '=' FINDFILEEXT plg_attributes ';'
 			{
-				/* Add this extension in the list */
-				if ( rgw_plg_add( $4, plgconffile, port, &buf, buf_sz ) ) {
+				if (reloading) {
+					/* The plugins are not reloaded */
+					free($4);
+					free(plgconffile);
+				} else if ( rgw_plg_add( $4, plgconffile, port, &buf, buf_sz ) ) {
+					/* Adding this extension in the list failed */
 					yyerror (&yylloc, conffile, "Error parsing / adding extension !");
 					YYERROR;
 				}
@@ -324,6 +350,15 @@ authserv:		AUTH_ENABLE '=' INTEGER ';'
 					
 				rgw_servers.auth_serv.port = htons($3);
 			}
+			| AUTH_SOCKETS '=' INTEGER ';'
+			{
+				if ($3 <= 0 || $3 > 64) {
+					yyerror (&yylloc, conffile, "Invalid number of sockets (1 to 64) !");
+					YYERROR;
+				}
+					
+				rgw_servers.auth_serv.sockets = $3;
+			}
 			| AUTH_IP4 '=' DISABLED ';'
 			{
 				rgw_servers.auth_serv.ip_disabled = 1;
@@ -373,6 +408,15 @@ acctserv:		ACCT_ENABLE '=' INTEGER ';'
 					
 				rgw_servers.acct_serv.port = htons($3);
 			}
+			| ACCT_SOCKETS '=' INTEGER ';'
+			{
+				if ($3 <= 0 || $3 > 64) {
+					yyerror (&yylloc, conffile, "Invalid number of sockets (1 to 64) !");
+					YYERROR;
+				}
+					
+				rgw_servers.acct_serv.sockets = $3;
+			}
 			| ACCT_IP4 '=' DISABLED ';'
 			{
 				rgw_servers.acct_serv.ip_disabled = 1;
@@ -402,3 +446,28 @@ acctserv:		ACCT_ENABLE '=' INTEGER ';'
 				rgw_servers.acct_serv.ip6_disabled = 0;
 			}
 			;
+
+/* -------------------------------------- */
+
+duplicates:		DUPL_LIFETIME '=' INTEGER ';'
+			{
+				if ($3 <= 0) {
+					yyerror (&yylloc, conffile, "Invalid duplicate lifetime !");
+					YYERROR;
+				}
+				rgw_dupl.lifetime = $3;
+			}
+			| DUPL_MAX '=' INTEGER ';'
+			{
+				if ($3 < 0) {
+					yyerror (&yylloc, conffile, "Invalid duplicate cache size !");
+					YYERROR;
+				}
+				rgw_dupl.max = $3;
+			}
+			| RELOAD_SIGNAL '=' INTEGER ';'
+			{
+				if (!reloading)
+					rgw_reload_signal = $3;
+			}
+			;
@@ -38,6 +38,31 @@
 
 #include "rgw.h"
 
+int rgw_reload_signal = 0;
+static char * rgw_conffile = NULL;
+
+/* Each signal is handled in a new thread: the parser is not reentrant, and the extension may be unloading */
+static pthread_mutex_t rgw_reload_lock = PTHREAD_MUTEX_INITIALIZER;
+static int rgw_stopping = 0;
+
+/* Reload the clients from the configuration file */
+static void rgw_reload(void)
+{
+	CHECK_POSIX_DO( pthread_mutex_lock(&rgw_reload_lock), return );
+	if (rgw_stopping)
+		goto out;
+	
+	LOG_N( "Reloading the RADIUS clients from '%s'", rgw_conffile);
+	CHECK_FCT_DO( rgw_conf_handle(rgw_conffile, 1), 
+		{
+			LOG_E( "Error in '%s', the RADIUS clients are not changed", rgw_conffile);
+			goto out;
+		} );
+	rgw_clients_dump();
+out:
+	CHECK_POSIX_DO( pthread_mutex_unlock(&rgw_reload_lock), );
+}
+
 /* Extension entry point called by freeDiameter */
 static int rgw_main(char * conffile) 
 {
@@ -45,7 +70,8 @@ static int rgw_main(char * conffile)
 	
 	CHECK_FCT( rgw_servers_init() );
 	
-	CHECK_FCT( rgw_conf_handle(conffile) );
+	CHECK_FCT( rgw_conf_handle(conffile, 0) );
+	rgw_conffile = conffile;
 	
 	LOG_D( "Extension RADIUS Gateway initialized with configuration: '%s'", conffile);
 	rgw_servers_dump();
@@ -61,12 +87,21 @@ static int rgw_main(char * conffile)
 	/* Start the servers */
 	CHECK_FCT( rgw_servers_start() );
 	
+	if (rgw_reload_signal) {
+		CHECK_FCT( fd_event_trig_regcb(rgw_reload_signal, "app_radgw", rgw_reload) );
+	}
+	
 	return 0;
 }
 
 /* Unload */
 void fd_ext_fini(void)
 {
+	/* Wait for a reload in progress, and ignore the next signals */
+	CHECK_POSIX_DO( pthread_mutex_lock(&rgw_reload_lock), );
+	rgw_stopping = 1;
+	CHECK_POSIX_DO( pthread_mutex_unlock(&rgw_reload_lock), );
+	
 	rgw_servers_fini();
 	rgw_work_fini();
 	rgw_plg_fini();
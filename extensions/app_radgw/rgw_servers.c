@@ -38,6 +38,7 @@
 #include "rgw.h"
 
 #define RADIUS_MAX_MSG_LEN 	3000
+#define RADIUS_BATCH		32	/* max number of messages received or sent with a single system call */
 #define RADIUS_AUTH_PORT	1812
 #define RADIUS_ACCT_PORT	1813
 
@@ -53,6 +54,7 @@ void rgw_servers_dump(void)
 	LOG_D("    IP disabled.. : %s", rgw_servers.auth_serv.ip_disabled ? "TRUE":"false");
 	LOG_D("    IPv6 disabled : %s", rgw_servers.auth_serv.ip6_disabled ? "TRUE":"false");
 	LOG_D("    port......... : %hu", ntohs(rgw_servers.auth_serv.port));
+	LOG_D("    sockets...... : %d", rgw_servers.auth_serv.sockets);
 	inet_ntop(AF_INET, &rgw_servers.auth_serv.ip_endpoint,ipstr,sizeof(ipstr));
 	LOG_D("    IP bind...... : %s", ipstr);
 	inet_ntop(AF_INET6, &rgw_servers.auth_serv.ip6_endpoint,ipstr,sizeof(ipstr));
@@ -63,6 +65,7 @@ void rgw_servers_dump(void)
 	LOG_D("    IP disabled.. : %s", rgw_servers.acct_serv.ip_disabled ? "TRUE":"false");
 	LOG_D("    IPv6 disabled : %s", rgw_servers.acct_serv.ip6_disabled ? "TRUE":"false");
 	LOG_D("    port......... : %hu", ntohs(rgw_servers.acct_serv.port));
+	LOG_D("    sockets...... : %d", rgw_servers.acct_serv.sockets);
 	inet_ntop(AF_INET, &rgw_servers.acct_serv.ip_endpoint,ipstr,sizeof(ipstr));
 	LOG_D("    IP bind...... : %s", ipstr);
 	inet_ntop(AF_INET6, &rgw_servers.acct_serv.ip6_endpoint,ipstr,sizeof(ipstr));
@@ -70,21 +73,93 @@ void rgw_servers_dump(void)
 
 }
 
+#ifdef HAVE_RECVMMSG
+/* A reply waiting to be sent */
+struct snd_item {
+	struct sockaddr_storage	to;
+	size_t			len;
+	unsigned char		buf[RADIUS_MAX_MSG_LEN];
+};
+#endif /* HAVE_RECVMMSG */
+
 static struct servers_data {
 	int	type; /* auth or acct */
 	int	family; /* AF_INET or AF_INET6 */
 	int	sock; /* the socket number */
 	pthread_t th; /* the running server thread, or NULL */
-	char    name[10];
-} SERVERS[4];
+	char    name[24];
+#ifdef HAVE_RECVMMSG
+	/* The replies are sent on the first socket of each type / family. While a thread is sending, 
+	  the replies of the other threads are queued here and sent afterwards in a single batch. */
+	pthread_mutex_t	snd_lock;
+	int		snd_busy; /* a thread is sending on this socket */
+	int		snd_cur;  /* the queue receiving the new replies */
+	int		snd_nb;   /* the number of replies in this queue */
+	struct snd_item *snd_q[2];
+#endif /* HAVE_RECVMMSG */
+} * SERVERS = NULL;
+static int SERVERS_nb = 0;
 
 int rgw_servers_init(void)
 {
 	memset(&rgw_servers, 0, sizeof(rgw_servers));
-	memset(&SERVERS[0], 0, sizeof(SERVERS));
 
 	rgw_servers.auth_serv.port = htons(RADIUS_AUTH_PORT);
 	rgw_servers.acct_serv.port = htons(RADIUS_ACCT_PORT);
+	rgw_servers.auth_serv.sockets = 1;
+	rgw_servers.acct_serv.sockets = 1;
+	
+	return 0;
+}
+
+/* Parse and queue a received message. Returns an error only if the server thread must terminate. */
+static int server_rcv(struct servers_data * me, unsigned char * buf, int len, struct sockaddr_storage * from)
+{
+	char sa_buf[sSA_DUMP_STRLEN];
+	struct rgw_client * nas_info = NULL;
+	uint16_t port = 0;
+	struct rgw_radius_msg_meta *msg = NULL;
+	
+	/* Get the port */
+	port = sSAport(from);
+	if (!port) {
+		LOG_E("Invalid port (family: %d), discarding received %d bytes...", from->ss_family, len);
+		return 0;
+	}
+	
+	/* Do not format the address when it is not logged */
+	if (fd_log_enabled(FD_LOG_DEBUG)) {
+		fd_sa_sdump_numeric(sa_buf, (sSA*)from);
+		LOG_D("RADIUS: RCV %dB from %s", len, sa_buf);
+	}
+	
+	/* Search the associated client definition, if any */
+	CHECK_FCT_DO( rgw_clients_search((struct sockaddr *) from, &nas_info),
+		{
+			fd_sa_sdump_numeric(sa_buf, (sSA*)from);
+			LOG_E("Discarding %d bytes received from unknown IP: %s", len, sa_buf);
+			return 0;
+		} );
+			
+	
+	/* parse the message, return if message is invalid */
+	CHECK_FCT_DO( rgw_msg_parse(buf, len, &msg), 
+		{
+			DiamId_t cliname = NULL;
+			size_t clisz;
+			CHECK_FCT_DO( rgw_clients_get_origin(nas_info, &cliname, &clisz, NULL, NULL), );
+			LOG_E( "Discarding invalid RADIUS message from '%s'", cliname);
+			rgw_clients_dispose(&nas_info);
+			return 0; 
+		} );
+	
+	msg->serv_type = me->type;
+	msg->port = port;
+	
+	rgw_msg_dump(msg, 1);
+	
+	/* queue the message for a worker thread */
+	CHECK_FCT( rgw_work_add(msg, nas_info) );
 	
 	return 0;
 }
@@ -92,6 +167,13 @@ int rgw_servers_init(void)
 static void * server_thread(void * param)
 {
 	struct servers_data * me = (struct servers_data *)param;
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr msgs[RADIUS_BATCH];
+	struct iovec iovs[RADIUS_BATCH];
+	struct sockaddr_storage from[RADIUS_BATCH];
+	unsigned char (*bufs)[RADIUS_MAX_MSG_LEN] = NULL;
+	int i;
+#endif /* HAVE_RECVMMSG */
 	
 	TRACE_ENTRY("%p", param);
 	
@@ -104,68 +186,69 @@ static void * server_thread(void * param)
 		fd_log_threadname ( buf );
 	}
 	
+#ifdef HAVE_RECVMMSG
+	CHECK_MALLOC_DO( bufs = malloc(RADIUS_BATCH * sizeof(bufs[0])), return NULL );
+	pthread_cleanup_push(free, bufs);
+	
+	/* Now loop on this socket, parse and queue the messages received, until thread is cancelled. */
+	while (1) {
+		int nb;
+		
+		for (i = 0; i < RADIUS_BATCH; i++) {
+			iovs[i].iov_base = &bufs[i][0];
+			iovs[i].iov_len = sizeof(bufs[i]);
+			memset(&msgs[i], 0, sizeof(msgs[i]));
+			msgs[i].msg_hdr.msg_name = &from[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		
+		pthread_testcancel();
+		
+		/* receive the next message(s), without waiting once the first one is received */
+		nb = recvmmsg( me->sock, msgs, RADIUS_BATCH, MSG_WAITFORONE, NULL );
+		if (nb < 0) {
+			if (errno == EINTR)
+				continue;
+			CHECK_SYS_DO( nb, );
+			break;
+		}
+		
+		for (i = 0; i < nb; i++) {
+			CHECK_FCT_DO( server_rcv(me, &bufs[i][0], msgs[i].msg_len, &from[i]), goto out );
+		}
+		
+		/* Then wait for next incoming messages */
+	}
+out:
+	pthread_cleanup_pop(1);
+#else /* HAVE_RECVMMSG */
+	
 	/* Now loop on this socket, parse and queue each message received, until thread is cancelled. */
 	while (1) {
 		struct sockaddr_storage from;
-		char sa_buf[sSA_DUMP_STRLEN];
 		socklen_t fromlen = sizeof(from);
 		int len;
-		struct rgw_client * nas_info = NULL;
-		uint16_t port = 0;
 		unsigned char buf[RADIUS_MAX_MSG_LEN];
-		struct rgw_radius_msg_meta *msg = NULL;
 		
 		pthread_testcancel();
 		
 		/* receive the next message */
 		CHECK_SYS_DO( len = recvfrom( me->sock, &buf[0], sizeof(buf), 0, (struct sockaddr *) &from, &fromlen),  break );
 		
-		/* Get the port */
-		port = sSAport(&from);
-		if (!port) {
-			LOG_E("Invalid port (family: %d), discarding received %d bytes...", from.ss_family, len);
-			continue;
-		}
-		
-		fd_sa_sdump_numeric(sa_buf, (sSA*)&from);
-		LOG_D("RADIUS: RCV %dB from %s", len, sa_buf);
-		
-		/* Search the associated client definition, if any */
-		CHECK_FCT_DO( rgw_clients_search((struct sockaddr *) &from, &nas_info),
-			{
-				LOG_E("Discarding %d bytes received from unknown IP: %s", len, sa_buf);
-				continue;
-			} );
-				
-		
-		/* parse the message, loop if message is invalid */
-		CHECK_FCT_DO( rgw_msg_parse(&buf[0], len, &msg), 
-			{
-				DiamId_t cliname = NULL;
-				size_t clisz;
-				CHECK_FCT_DO( rgw_clients_get_origin(nas_info, &cliname, &clisz, NULL, NULL), );
-				LOG_E( "Discarding invalid RADIUS message from '%s'", cliname);
-				rgw_clients_dispose(&nas_info);
-				continue; 
-			} );
-		
-		msg->serv_type = me->type;
-		msg->port = port;
-		
-		rgw_msg_dump(msg, 1);
-		
-		/* queue the message for a worker thread */
-		CHECK_FCT_DO( rgw_work_add(msg, nas_info), break );
+		CHECK_FCT_DO( server_rcv(me, &buf[0], len, &from), break );
 		
 		/* Then wait for next incoming message */
 	}
+#endif /* HAVE_RECVMMSG */
 	
 	TRACE_DEBUG(INFO, "Server thread terminated.");
 	return NULL;
 }
 
 /* Set the socket options for UDP sockets, before bind is called */
-static int _udp_setsockopt(int family, int sk)
+static int _udp_setsockopt(int family, int sk, int shared)
 {
 	int ret = 0;
 	int opt;
@@ -183,14 +266,45 @@ static int _udp_setsockopt(int family, int sk)
 	}
 	#endif /* IPV6_V6ONLY */
 	
+	/* Several sockets are bound to the same port, the kernel spreads the clients between them */
+	if (shared) {
+	#ifdef SO_REUSEPORT
+		opt = 1;
+		ret = setsockopt(sk, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+		if (ret != 0) {
+			ret = errno;
+			TRACE_DEBUG(INFO, "Unable to set the socket SO_REUSEPORT option: %s", strerror(ret));
+			return ret;
+		}
+	#else /* SO_REUSEPORT */
+		TRACE_DEBUG(INFO, "Several sockets per server require the SO_REUSEPORT option, which is not available on this system");
+		return ENOTSUP;
+	#endif /* SO_REUSEPORT */
+	}
+	
 	return 0;
 }
 
-/* We reuse the same logic for all 4 possible servers (IP / IPv6, Auth / Acct ports) */
+#ifdef HAVE_RECVMMSG
+/* The first socket of each server also holds the queues of replies */
+#define SNDQ_INIT( _s_ ) {											\
+	if ( (_s_) == 0 ) {											\
+		CHECK_POSIX( pthread_mutex_init(&SERVERS[idx].snd_lock, NULL) );				\
+		CHECK_MALLOC( SERVERS[idx].snd_q[0] = calloc(2 * RADIUS_BATCH, sizeof(struct snd_item)) );	\
+		SERVERS[idx].snd_q[1] = SERVERS[idx].snd_q[0] + RADIUS_BATCH;					\
+	}													\
+}
+#else /* HAVE_RECVMMSG */
+#define SNDQ_INIT( _s_ )
+#endif /* HAVE_RECVMMSG */
+
+/* We reuse the same logic for all 4 possible servers (IP / IPv6, Auth / Acct ports), each with one or several sockets */
 #define UDPSERV( _type_, _portval_, _family_ ) {								\
 	/* Check that this type / family are not disabled by configuration */					\
 	if ( (! rgw_servers. _type_ ## _serv.disabled) 								\
 		&& ( ! rgw_servers. _type_ ## _serv.ip ## _family_ ## _disabled ) ) {				\
+		int _s_;											\
+		for (_s_ = 0; _s_ < rgw_servers. _type_ ## _serv.sockets; _s_++) {				\
 			struct sockaddr_in ## _family_	 sin ## _family_ ;					\
 			/* Create the socket */									\
 			CHECK_SYS( SERVERS[idx].sock = socket(AF_INET ## _family_, SOCK_DGRAM, 0) );		\
@@ -203,7 +317,8 @@ static int _udp_setsockopt(int family, int sk)
 					sizeof(struct in ## _family_ ## _addr) );				\
 			/* This sockopt must be set before binding */						\
 			TRACE_DEBUG(ANNOYING, "Setting socket options...");					\
-			CHECK_FCT( _udp_setsockopt(AF_INET ## _family_, SERVERS[idx].sock) );			\
+			CHECK_FCT( _udp_setsockopt(AF_INET ## _family_, SERVERS[idx].sock, 			\
+					rgw_servers. _type_ ## _serv.sockets > 1) );				\
 			/* OK, now, bind */									\
 			TRACE_DEBUG(ANNOYING, "Binding " #_type_ " ip" #_family_ " server...");			\
 			CHECK_SYS( bind( SERVERS[idx].sock,							\
@@ -212,10 +327,12 @@ static int _udp_setsockopt(int family, int sk)
 			/* Save the server information in SERVERS structure */					\
 			SERVERS[idx].type = _portval_;								\
 			SERVERS[idx].family = AF_INET ## _family_;						\
-			snprintf(&SERVERS[idx].name[0], sizeof(SERVERS[idx].name), # _type_ "/ip" #_family_);	\
+			snprintf(&SERVERS[idx].name[0], sizeof(SERVERS[idx].name), # _type_ "/ip" #_family_ "#%d", _s_);	\
+			SNDQ_INIT( _s_ );									\
 			/* Create the server thread */								\
 			CHECK_POSIX( pthread_create(&SERVERS[idx].th, NULL, server_thread, &SERVERS[idx]) );	\
 			idx++;											\
+		}												\
 	}													\
 }
 
@@ -225,6 +342,9 @@ int rgw_servers_start(void)
 	
 	TRACE_ENTRY();
 	
+	SERVERS_nb = 2 * (rgw_servers.auth_serv.sockets + rgw_servers.acct_serv.sockets);
+	CHECK_MALLOC( SERVERS = calloc(SERVERS_nb, sizeof(struct servers_data)) );
+	
 	UDPSERV( auth, RGW_PLG_TYPE_AUTH,  );
 	UDPSERV( auth, RGW_PLG_TYPE_AUTH, 6 );
 	UDPSERV( acct, RGW_PLG_TYPE_ACCT,  );
@@ -234,6 +354,57 @@ int rgw_servers_start(void)
 	return 0;
 }
 
+/* Send one RADIUS message on a socket */
+static int send_one(int sock, unsigned char *buf, size_t buflen, struct sockaddr_storage *sto)
+{
+	int ret;
+	
+	ret = sendto(sock, buf, buflen, 0, (struct sockaddr *)sto, sSAlen(sto));
+	if (ret < 0) {
+		ret = errno;
+		TRACE_DEBUG(INFO, "An error prevented sending of a RADIUS message: %s", strerror(ret));
+		return ret;
+	}
+	if (ret != buflen) {
+		TRACE_DEBUG(INFO, "Incomplete send: %d bytes / %zd", ret, buflen);
+		return EAGAIN;
+	}
+	
+	return 0;
+}
+
+#ifdef HAVE_RECVMMSG
+/* Send a batch of queued replies. A message that cannot be sent is skipped, there is nobody left to report to. */
+static void send_batch(int sock, struct snd_item * q, int nb)
+{
+	struct mmsghdr msgs[RADIUS_BATCH];
+	struct iovec iovs[RADIUS_BATCH];
+	int i, ret, sent = 0;
+	
+	for (i = 0; i < nb; i++) {
+		iovs[i].iov_base = &q[i].buf[0];
+		iovs[i].iov_len = q[i].len;
+		memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_name = &q[i].to;
+		msgs[i].msg_hdr.msg_namelen = sSAlen(&q[i].to);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	
+	while (sent < nb) {
+		ret = sendmmsg(sock, &msgs[sent], nb - sent, 0);
+		if (ret <= 0) {
+			if ((ret < 0) && (errno == EINTR))
+				continue;
+			TRACE_DEBUG(INFO, "An error prevented sending of a RADIUS message: %s", strerror(errno));
+			sent++;
+			continue;
+		}
+		sent += ret;
+	}
+}
+#endif /* HAVE_RECVMMSG */
+
 /* Send a RADIUS message */
 int rgw_servers_send(int type, unsigned char *buf, size_t buflen, struct sockaddr *to, uint16_t to_port)
 {
@@ -241,9 +412,10 @@ int rgw_servers_send(int type, unsigned char *buf, size_t buflen, struct sockadd
 	int ret = 0;
 	struct sockaddr_storage sto;
 	char sa_buf[sSA_DUMP_STRLEN];
+	struct servers_data * s;
 	
 	/* Find the appropriate socket to use (not sure if it is important) */
-	for (idx = 0; idx < sizeof(SERVERS) / sizeof(SERVERS[0]); idx++) {
+	for (idx = 0; idx < SERVERS_nb; idx++) {
 		if ( SERVERS[idx].sock && (type == SERVERS[idx].type) && (to->sa_family == SERVERS[idx].family) ) {
 			ret = 1;
 			break;
@@ -256,6 +428,7 @@ int rgw_servers_send(int type, unsigned char *buf, size_t buflen, struct sockadd
 				(to->sa_family == AF_INET)  ? "IP (v4)" : "IPv6");
 		return EINVAL;
 	}
+	s = &SERVERS[idx];
 	
 	/* Prepare the destination info */
 	memset(&sto, 0, sizeof(sto));
@@ -267,38 +440,80 @@ int rgw_servers_send(int type, unsigned char *buf, size_t buflen, struct sockadd
 		((struct sockaddr_in6 *)&sto)->sin6_port = to_port;
 	}
 	
-	fd_sa_sdump_numeric(sa_buf, (sSA*)&sto);
-	LOG_D("RADIUS: SND %zdB   to %s", buflen, sa_buf);
+	if (fd_log_enabled(FD_LOG_DEBUG)) {
+		fd_sa_sdump_numeric(sa_buf, (sSA*)&sto);
+		LOG_D("RADIUS: SND %zdB   to %s", buflen, sa_buf);
+	}
 	
-	/* Send */
-	ret = sendto(SERVERS[idx].sock, buf, buflen, 0, (struct sockaddr *)&sto, sSAlen(&sto));
-	if (ret < 0) {
-		ret = errno;
-		TRACE_DEBUG(INFO, "An error prevented sending of a RADIUS message: %s", strerror(ret));
-		return ret;
+#ifdef HAVE_RECVMMSG
+	CHECK_POSIX( pthread_mutex_lock(&s->snd_lock) );
+	if (s->snd_busy) {
+		/* Another thread is sending, it will also send this message after its own */
+		if ((s->snd_nb < RADIUS_BATCH) && (buflen <= RADIUS_MAX_MSG_LEN)) {
+			struct snd_item * item = &s->snd_q[s->snd_cur][s->snd_nb++];
+			memcpy(&item->to, &sto, sizeof(sto));
+			memcpy(&item->buf[0], buf, buflen);
+			item->len = buflen;
+			CHECK_POSIX( pthread_mutex_unlock(&s->snd_lock) );
+			return 0;
+		}
+		
+		/* The queue is full, send directly */
+		CHECK_POSIX( pthread_mutex_unlock(&s->snd_lock) );
+		return send_one(s->sock, buf, buflen, &sto);
 	}
-	if (ret != buflen) {
-		TRACE_DEBUG(INFO, "Incomplete send: %d bytes / %zd", ret, buflen);
-		return EAGAIN;
+	s->snd_busy = 1;
+	CHECK_POSIX( pthread_mutex_unlock(&s->snd_lock) );
+	
+	/* Send our own message */
+	ret = send_one(s->sock, buf, buflen, &sto);
+	
+	/* Then the replies queued meanwhile */
+	CHECK_POSIX( pthread_mutex_lock(&s->snd_lock) );
+	while (s->snd_nb) {
+		struct snd_item * q = s->snd_q[s->snd_cur];
+		int nb = s->snd_nb;
+		
+		/* The other threads fill the other queue while we send this one */
+		s->snd_cur ^= 1;
+		s->snd_nb = 0;
+		CHECK_POSIX( pthread_mutex_unlock(&s->snd_lock) );
+		
+		send_batch(s->sock, q, nb);
+		
+		CHECK_POSIX( pthread_mutex_lock(&s->snd_lock) );
 	}
+	s->snd_busy = 0;
+	CHECK_POSIX( pthread_mutex_unlock(&s->snd_lock) );
 	
-	/* Done :) */
-	return 0;
+	return ret;
+#else /* HAVE_RECVMMSG */
+	/* Send */
+	return send_one(s->sock, buf, buflen, &sto);
+#endif /* HAVE_RECVMMSG */
 }
 
 void rgw_servers_fini(void)
 {
 	int idx = 0;
 	
-	for (idx = 0; idx < sizeof(SERVERS) / sizeof(SERVERS[0]); idx++) {
+	for (idx = 0; idx < SERVERS_nb; idx++) {
 		if (SERVERS[idx].sock == 0)
 			break;
 		
 		CHECK_FCT_DO( fd_thr_term(&SERVERS[idx].th), /* continue */ );
 		close(SERVERS[idx].sock);
 		SERVERS[idx].sock = 0;
+#ifdef HAVE_RECVMMSG
+		if (SERVERS[idx].snd_q[0]) {
+			CHECK_POSIX_DO( pthread_mutex_destroy(&SERVERS[idx].snd_lock), );
+			free(SERVERS[idx].snd_q[0]);
+		}
+#endif /* HAVE_RECVMMSG */
 	}
 	
+	free(SERVERS);
+	SERVERS = NULL;
+	SERVERS_nb = 0;
 }
 
-
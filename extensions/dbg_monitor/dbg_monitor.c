@@ -71,6 +71,19 @@ static void display_info(char * queue_desc, char * peer, int current_count, int
 	}
 }
 
+/* Display the content of a latency histogram */
+static void display_histo(char * desc, enum fd_stat_histo h)
+{
+	struct fd_stat_histo_data data;
+	
+	CHECK_FCT_DO( fd_stat_histo_get(h, &data), return );
+	if (!data.count)
+		return;
+	TRACE_DEBUG(INFO, "'%s': %lld values, mean:%lldus, p50:<=%lldus, p90:<=%lldus, p99:<=%lldus",
+		desc, data.count, data.sum / data.count,
+		fd_stat_quantile(&data, 0.5), fd_stat_quantile(&data, 0.9), fd_stat_quantile(&data, 0.99));
+}
+
 /* Thread to display periodical debug information */
 static pthread_t thr;
 static void * mn_thr(void * arg)
@@ -106,14 +119,30 @@ static void * mn_thr(void * arg)
 		CHECK_FCT_DO( fd_stat_getstats(STAT_G_OUTGOING, NULL, &current_count, &limit_count, &highest_count, &total_count, &total, &blocking, &last), );
 		display_info("Total sending", NULL, current_count, limit_count, highest_count, total_count, &total, &blocking, &last);
 		
+		{
+			long long in = 0, out = 0, err = 0;
+			CHECK_FCT_DO( fd_stat_counter_get(FD_STAT_MSG_IN, &in), );
+			CHECK_FCT_DO( fd_stat_counter_get(FD_STAT_MSG_OUT, &out), );
+			CHECK_FCT_DO( fd_stat_counter_get(FD_STAT_PARSE_ERR, &err), );
+			TRACE_DEBUG(INFO, "Messages received:%lld, sent:%lld, parsing errors:%lld", in, out, err);
+		}
+		display_histo("Answer time", FD_STAT_H_ANSWER);
+		display_histo("Wait in incoming queue", FD_STAT_H_WAIT_INCOMING);
+		display_histo("Wait in outgoing queue", FD_STAT_H_WAIT_OUTGOING);
+		display_histo("Wait in local queue", FD_STAT_H_WAIT_LOCAL);
+		
 		
 		CHECK_FCT_DO( pthread_rwlock_rdlock(&fd_g_peers_rw), /* continue */ );
 
 		for (li = fd_g_peers.next; li != &fd_g_peers; li = li->next) {
 			struct peer_hdr * p = (struct peer_hdr *)li->o;
+			long long in = 0, out = 0;
 			
 			TRACE_DEBUG(INFO, "%s", fd_peer_dump(&buf, &len, NULL, p, 1));
 			
+			CHECK_FCT_DO( fd_stat_peer_get(p, &in, &out), );
+			TRACE_DEBUG(INFO, "'%s': messages received:%lld, sent:%lld", p->info.pi_diamid, in, out);
+			
 			CHECK_FCT_DO( fd_stat_getstats(STAT_P_PSM, p, &current_count, &limit_count, &highest_count, &total_count, &total, &blocking, &last), );
 			display_info("Events, incl. recept", p->info.pi_diamid, current_count, limit_count, highest_count, total_count, &total, &blocking, &last);
 			
@@ -0,0 +1,493 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2015, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* This extension serves the statistics of the framework over HTTP, in the Prometheus text exposition format:
+ - the message counters, per command and per Result-Code, and the latency histograms (see fd_stat_*),
+ - the length of the global queues,
+ - for each peer: its state, the number of messages exchanged, the length of its queues and the requests pending.
+ 
+ The peers list is only locked while these values are copied; the response is formatted after the lock is released.
+ 
+   The parameter on the LoadExtension line is a list of space-separated words:
+     addr=<IP>		: address to listen on (default 127.0.0.1)
+     port=<port>	: TCP port to listen on (default 9464)
+     unix=<path>	: listen on this unix socket instead of TCP
+   e.g.
+LoadExtension="dbg_prometheus.fdx":"addr=0.0.0.0 port=9464";
+ Any GET request on / or /metrics receives the metrics.
+*/
+
+#include <freeDiameter/extension.h>
+#include <sys/un.h>
+
+/* Default TCP port */
+#define PM_DEFAULT_PORT	9464
+
+/* How long a client has to send its request or read the response, in seconds */
+#define PM_TIMEOUT	5
+
+/* Size of the buffer for the HTTP request */
+#define PM_REQ_SZ	1024
+
+static char *		pm_addr = NULL;
+static uint16_t		pm_port = PM_DEFAULT_PORT;
+static char *		pm_unix = NULL;
+static int		pm_sock = -1;
+static pthread_t	pm_thr = (pthread_t)NULL;
+
+/* The values of a peer, copied while fd_g_peers_rw is held */
+struct pm_peer {
+	char *		id;		/* Diameter-Id, escaped for a label value */
+	int		state;
+	long long	in, out;
+	long		pending;	/* requests sent to the peer, waiting for an answer */
+	long		reqin;		/* requests received from the peer, not answered yet */
+	int		psm_cur;	/* events in the state machine queue, including the received messages */
+	int		tosend_cur;	/* messages waiting to be sent */
+};
+
+/* Escape a string for a label value (\, " and newline) */
+static char * pm_escape(const char * str)
+{
+	char * ret, * d;
+	
+	CHECK_MALLOC_DO( ret = malloc(2 * strlen(str) + 1), return NULL );
+	for (d = ret; *str; str++) {
+		if ((*str == '\\') || (*str == '"')) {
+			*d++ = '\\';
+			*d++ = *str;
+		} else if (*str == '\n') {
+			*d++ = '\\';
+			*d++ = 'n';
+		} else {
+			*d++ = *str;
+		}
+	}
+	*d = '\0';
+	return ret;
+}
+
+/* Copy the values of all the peers. The lock is held only for this. */
+static int pm_peers_snapshot(struct pm_peer ** peers, int * count)
+{
+	struct fd_list * li;
+	int n = 0, ret = 0;
+	
+	*peers = NULL;
+	*count = 0;
+	
+	CHECK_POSIX( pthread_rwlock_rdlock(&fd_g_peers_rw) );
+	for (li = fd_g_peers.next; li != &fd_g_peers; li = li->next)
+		n++;
+	if (n) {
+		CHECK_MALLOC_DO( *peers = calloc(n, sizeof(struct pm_peer)), ret = ENOMEM );
+	}
+	for (li = fd_g_peers.next; (ret == 0) && (li != &fd_g_peers); li = li->next) {
+		struct peer_hdr * p = (struct peer_hdr *)li->o;
+		struct pm_peer * pp = &(*peers)[*count];
+		
+		CHECK_MALLOC_DO( pp->id = pm_escape(p->info.pi_diamid), { ret = ENOMEM; break; } );
+		(*count)++;
+		pp->state = fd_peer_get_state(p);
+		CHECK_FCT_DO( fd_stat_peer_get(p, &pp->in, &pp->out), );
+		CHECK_FCT_DO( fd_peer_get_load_pending(p, &pp->pending, &pp->reqin), );
+		CHECK_FCT_DO( fd_stat_getstats(STAT_P_PSM, p, &pp->psm_cur, NULL, NULL, NULL, NULL, NULL, NULL), );
+		CHECK_FCT_DO( fd_stat_getstats(STAT_P_TOSEND, p, &pp->tosend_cur, NULL, NULL, NULL, NULL, NULL, NULL), );
+	}
+	CHECK_POSIX( pthread_rwlock_unlock(&fd_g_peers_rw) );
+	
+	return ret;
+}
+
+/* The buffer where the response is formatted, reused from one request to the next */
+static char *	pm_buf = NULL;
+static size_t	pm_len = 0;
+
+#define PM_PRINT( _offset, _format, _args... ) \
+	CHECK_MALLOC_DO( fd_dump_extend( &pm_buf, &pm_len, (_offset), (_format), ##_args ), return ENOMEM )
+
+/* Print a histogram. The values are in microseconds, the buckets are merged by powers of 2. */
+static int pm_histo(size_t * offset, const char * name, const char * labels, enum fd_stat_histo h)
+{
+	struct fd_stat_histo_data data;
+	long long cumul = 0;
+	const char * sep = *labels ? "," : "";
+	int i;
+	
+	CHECK_FCT( fd_stat_histo_get(h, &data) );
+	
+	for (i = 0; i < FD_STAT_BUCKETS - 1; i++) {
+		long long max;
+		cumul += data.buckets[i];
+		if ((i & ((1 << FD_STAT_SUB_BITS) - 1)) != (1 << FD_STAT_SUB_BITS) - 1)
+			continue;
+		max = fd_stat_bucket_max(i);
+		PM_PRINT( offset, "%s_bucket{%s%sle=\"%lld.%06lld\"} %lld\n", name, labels, sep, max / 1000000, max % 1000000, cumul );
+	}
+	PM_PRINT( offset, "%s_bucket{%s%sle=\"+Inf\"} %lld\n", name, labels, sep, data.count );
+	PM_PRINT( offset, "%s_sum%s%s%s %lld.%06lld\n", name, *labels ? "{" : "", labels, *labels ? "}" : "", data.sum / 1000000, data.sum % 1000000 );
+	PM_PRINT( offset, "%s_count%s%s%s %lld\n", name, *labels ? "{" : "", labels, *labels ? "}" : "", data.count );
+	return 0;
+}
+
+/* Callbacks for the commands and Result-Codes counters */
+struct pm_iter {
+	size_t *	offset;
+	int		ret;
+};
+
+static void pm_cmd_cb(void * data, command_code_t code, int is_req, long long in, long long out)
+{
+	struct pm_iter * it = data;
+	const char * type = is_req ? "request" : "answer";
+	if (it->ret)
+		return;
+	CHECK_MALLOC_DO( fd_dump_extend( &pm_buf, &pm_len, it->offset, 
+				"freediameter_command_messages_total{code=\"%u\",type=\"%s\",direction=\"in\"} %lld\n"
+				"freediameter_command_messages_total{code=\"%u\",type=\"%s\",direction=\"out\"} %lld\n",
+				code, type, in, code, type, out), it->ret = ENOMEM );
+}
+
+static void pm_rescode_cb(void * data, uint32_t rescode, long long in, long long out)
+{
+	struct pm_iter * it = data;
+	if (it->ret)
+		return;
+	CHECK_MALLOC_DO( fd_dump_extend( &pm_buf, &pm_len, it->offset, 
+				"freediameter_answers_total{result_code=\"%u\",direction=\"in\"} %lld\n"
+				"freediameter_answers_total{result_code=\"%u\",direction=\"out\"} %lld\n",
+				rescode, in, rescode, out), it->ret = ENOMEM );
+}
+
+/* Format all the metrics in pm_buf */
+static int pm_format(size_t * offset)
+{
+	struct pm_peer * peers = NULL;
+	int count = 0, i, ret = 0;
+	struct pm_iter it = { offset, 0 };
+	struct {
+		enum fd_stat_type	stat;
+		const char *		name;
+	} queues[] = { { STAT_G_INCOMING, "incoming" }, { STAT_G_OUTGOING, "outgoing" }, { STAT_G_LOCAL, "local" } };
+	long long in = 0, out = 0, err = 0;
+	
+	*offset = 0;
+	
+	/* Messages */
+	CHECK_FCT( fd_stat_counter_get(FD_STAT_MSG_IN, &in) );
+	CHECK_FCT( fd_stat_counter_get(FD_STAT_MSG_OUT, &out) );
+	CHECK_FCT( fd_stat_counter_get(FD_STAT_PARSE_ERR, &err) );
+	PM_PRINT( offset, "# HELP freediameter_messages_total Messages received from and sent to the peers.\n"
+			"# TYPE freediameter_messages_total counter\n"
+			"freediameter_messages_total{direction=\"in\"} %lld\n"
+			"freediameter_messages_total{direction=\"out\"} %lld\n", in, out );
+	PM_PRINT( offset, "# HELP freediameter_parsing_errors_total Received messages that could not be parsed.\n"
+			"# TYPE freediameter_parsing_errors_total counter\n"
+			"freediameter_parsing_errors_total %lld\n", err );
+	
+	PM_PRINT( offset, "# HELP freediameter_command_messages_total Messages received and sent, per command code.\n"
+			"# TYPE freediameter_command_messages_total counter\n" );
+	CHECK_FCT( fd_stat_iterate_cmd(&it, pm_cmd_cb) );
+	CHECK_FCT( it.ret );
+	PM_PRINT( offset, "# HELP freediameter_answers_total Answers received and sent, per Result-Code.\n"
+			"# TYPE freediameter_answers_total counter\n" );
+	CHECK_FCT( fd_stat_iterate_rescode(&it, pm_rescode_cb) );
+	CHECK_FCT( it.ret );
+	
+	/* Latencies */
+	PM_PRINT( offset, "# HELP freediameter_answer_time_seconds Time between sending a request and receiving its answer.\n"
+			"# TYPE freediameter_answer_time_seconds histogram\n" );
+	CHECK_FCT( pm_histo(offset, "freediameter_answer_time_seconds", "", FD_STAT_H_ANSWER) );
+	PM_PRINT( offset, "# HELP freediameter_queue_wait_seconds Time spent by the messages in the global queues.\n"
+			"# TYPE freediameter_queue_wait_seconds histogram\n" );
+	CHECK_FCT( pm_histo(offset, "freediameter_queue_wait_seconds", "queue=\"incoming\"", FD_STAT_H_WAIT_INCOMING) );
+	CHECK_FCT( pm_histo(offset, "freediameter_queue_wait_seconds", "queue=\"outgoing\"", FD_STAT_H_WAIT_OUTGOING) );
+	CHECK_FCT( pm_histo(offset, "freediameter_queue_wait_seconds", "queue=\"local\"", FD_STAT_H_WAIT_LOCAL) );
+	
+	/* Global queues */
+	PM_PRINT( offset, "# HELP freediameter_queue_length Number of messages in the global queues.\n"
+			"# TYPE freediameter_queue_length gauge\n" );
+	for (i = 0; i < sizeof(queues) / sizeof(queues[0]); i++) {
+		int cur = 0;
+		CHECK_FCT( fd_stat_getstats(queues[i].stat, NULL, &cur, NULL, NULL, NULL, NULL, NULL, NULL) );
+		PM_PRINT( offset, "freediameter_queue_length{queue=\"%s\"} %d\n", queues[i].name, cur );
+	}
+	
+	/* Peers */
+	CHECK_FCT( pm_peers_snapshot(&peers, &count) );
+	
+	#define PM_PEERS( _help_type, _format, _args... ) {							\
+		CHECK_MALLOC_DO( fd_dump_extend( &pm_buf, &pm_len, offset, _help_type ), { ret = ENOMEM; goto out; } );	\
+		for (i = 0; i < count; i++) {									\
+			struct pm_peer * pp = &peers[i];							\
+			CHECK_MALLOC_DO( fd_dump_extend( &pm_buf, &pm_len, offset, _format, ##_args ), { ret = ENOMEM; goto out; } );	\
+		}												\
+	}
+	PM_PEERS( "# HELP freediameter_peer_up Whether the connection with the peer is open.\n"
+		  "# TYPE freediameter_peer_up gauge\n",
+		  "freediameter_peer_up{peer=\"%s\"} %d\n", pp->id, 
+		  ((pp->state == STATE_OPEN) || (pp->state == STATE_OPEN_NEW) || (pp->state == STATE_OPEN_HANDSHAKE)) ? 1 : 0 );
+	PM_PEERS( "# HELP freediameter_peer_state Current state of the peer state machine.\n"
+		  "# TYPE freediameter_peer_state gauge\n",
+		  "freediameter_peer_state{peer=\"%s\",state=\"%s\"} 1\n", pp->id, STATE_STR(pp->state) );
+	PM_PEERS( "# HELP freediameter_peer_messages_total Messages received from and sent to the peer.\n"
+		  "# TYPE freediameter_peer_messages_total counter\n",
+		  "freediameter_peer_messages_total{peer=\"%s\",direction=\"in\"} %lld\n"
+		  "freediameter_peer_messages_total{peer=\"%s\",direction=\"out\"} %lld\n", pp->id, pp->in, pp->id, pp->out );
+	PM_PEERS( "# HELP freediameter_peer_pending_requests Requests sent to the peer and waiting for an answer.\n"
+		  "# TYPE freediameter_peer_pending_requests gauge\n",
+		  "freediameter_peer_pending_requests{peer=\"%s\"} %ld\n", pp->id, pp->pending );
+	PM_PEERS( "# HELP freediameter_peer_unanswered_requests Requests received from the peer and not answered yet.\n"
+		  "# TYPE freediameter_peer_unanswered_requests gauge\n",
+		  "freediameter_peer_unanswered_requests{peer=\"%s\"} %ld\n", pp->id, pp->reqin );
+	PM_PEERS( "# HELP freediameter_peer_queue_length Number of items in the queues of the peer.\n"
+		  "# TYPE freediameter_peer_queue_length gauge\n",
+		  "freediameter_peer_queue_length{peer=\"%s\",queue=\"events\"} %d\n"
+		  "freediameter_peer_queue_length{peer=\"%s\",queue=\"tosend\"} %d\n", pp->id, pp->psm_cur, pp->id, pp->tosend_cur );
+	#undef PM_PEERS
+	
+out:
+	for (i = 0; i < count; i++)
+		free(peers[i].id);
+	free(peers);
+	return ret;
+}
+
+/* Write the whole buffer */
+static int pm_write(int sock, const char * data, size_t len)
+{
+	while (len) {
+		ssize_t ret = send(sock, data, len, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		data += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Receive the request of a client and send the response */
+static void pm_serve(int sock)
+{
+	char req[PM_REQ_SZ], hdr[160];
+	size_t got = 0, offset = 0;
+	const char * status = "200 OK";
+	struct timeval tv = { PM_TIMEOUT, 0 };
+	int hlen;
+	
+	CHECK_SYS_DO( setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)), );
+	CHECK_SYS_DO( setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)), );
+	
+	/* Read the request line and headers; the body, if any, is ignored */
+	while (got < sizeof(req) - 1) {
+		ssize_t ret = recv(sock, req + got, sizeof(req) - 1 - got, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		if (ret == 0)
+			break;
+		got += ret;
+		req[got] = '\0';
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+			break;
+	}
+	req[got] = '\0';
+	
+	if (strncmp(req, "GET ", 4)) {
+		status = "405 Method Not Allowed";
+	} else if (strncmp(req + 4, "/ ", 2) && strncmp(req + 4, "/metrics ", 9) && strncmp(req + 4, "/metrics?", 9)) {
+		status = "404 Not Found";
+	} else if (pm_format(&offset)) {
+		status = "500 Internal Server Error";
+		offset = 0;
+	}
+	if (strncmp(status, "200", 3))
+		offset = 0;
+	
+	hlen = snprintf(hdr, sizeof(hdr), "HTTP/1.0 %s\r\n"
+					"Content-Type: text/plain; version=0.0.4\r\n"
+					"Content-Length: %zu\r\n"
+					"Connection: close\r\n\r\n", status, offset);
+	if (pm_write(sock, hdr, hlen) == 0)
+		(void) pm_write(sock, pm_buf, offset);
+}
+
+/* The server thread */
+static void * pm_server(void * arg)
+{
+	fd_log_threadname ( "dbg_prometheus server" );
+	
+	while (1) {
+		int cli, state;
+		
+		cli = accept(pm_sock, NULL, NULL);
+		if (cli < 0) {
+			if ((errno == EINTR) || (errno == ECONNABORTED))
+				continue;
+			LOG_E("dbg_prometheus: accept failed: %s", strerror(errno));
+			break;
+		}
+		
+		/* The thread is not canceled while it serves a client; the socket timeouts limit this time */
+		CHECK_POSIX_DO( pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state), );
+		pm_serve(cli);
+		shutdown(cli, SHUT_RDWR);
+		close(cli);
+		CHECK_POSIX_DO( pthread_setcancelstate(state, NULL), );
+	}
+	
+	return NULL;
+}
+
+/* Create the listening socket */
+static int pm_listen(void)
+{
+	if (pm_unix) {
+		struct sockaddr_un sun;
+		
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlen(pm_unix) >= sizeof(sun.sun_path)) {
+			LOG_E("dbg_prometheus: the socket path is too long: '%s'", pm_unix);
+			return EINVAL;
+		}
+		strcpy(sun.sun_path, pm_unix);
+		(void) unlink(pm_unix);
+		
+		CHECK_SYS( pm_sock = socket(AF_UNIX, SOCK_STREAM, 0) );
+		CHECK_SYS_DO( bind(pm_sock, (struct sockaddr *)&sun, sizeof(sun)), 
+			{ LOG_E("dbg_prometheus: cannot bind to '%s'", pm_unix); return errno; } );
+	} else {
+		struct addrinfo hints, *ai = NULL;
+		char port[6];
+		int ret, one = 1;
+		
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+		hints.ai_socktype = SOCK_STREAM;
+		snprintf(port, sizeof(port), "%hu", pm_port);
+		ret = getaddrinfo(pm_addr ?: "127.0.0.1", port, &hints, &ai);
+		if (ret) {
+			LOG_E("dbg_prometheus: invalid address '%s': %s", pm_addr ?: "127.0.0.1", gai_strerror(ret));
+			return EINVAL;
+		}
+		
+		CHECK_SYS_DO( pm_sock = socket(ai->ai_family, SOCK_STREAM, 0), { ret = errno; freeaddrinfo(ai); return ret; } );
+		CHECK_SYS_DO( setsockopt(pm_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)), );
+		CHECK_SYS_DO( bind(pm_sock, ai->ai_addr, ai->ai_addrlen), 
+			{ ret = errno; LOG_E("dbg_prometheus: cannot bind to port %hu", pm_port); freeaddrinfo(ai); return ret; } );
+		freeaddrinfo(ai);
+	}
+	
+	CHECK_SYS( listen(pm_sock, 5) );
+	return 0;
+}
+
+/* Parse the parameter of the extension */
+static int pm_conf(char * conffile)
+{
+	char * cf, * word, * save = NULL;
+	int ret = 0;
+	
+	if (!conffile)
+		return 0;
+	
+	CHECK_MALLOC( cf = strdup(conffile) );
+	for (word = strtok_r(cf, " \t", &save); word; word = strtok_r(NULL, " \t", &save)) {
+		if (!strncmp(word, "addr=", 5) && word[5]) {
+			free(pm_addr);
+			CHECK_MALLOC_DO( pm_addr = strdup(word + 5), { ret = ENOMEM; break; } );
+		} else if (!strncmp(word, "unix=", 5) && word[5]) {
+			free(pm_unix);
+			CHECK_MALLOC_DO( pm_unix = strdup(word + 5), { ret = ENOMEM; break; } );
+		} else if (!strncmp(word, "port=", 5)) {
+			char * endp;
+			unsigned long port = strtoul(word + 5, &endp, 10);
+			if ((*endp != '\0') || (port == 0) || (port > 65535)) {
+				LOG_E("dbg_prometheus: invalid port: '%s'", word);
+				ret = EINVAL;
+				break;
+			}
+			pm_port = port;
+		} else {
+			LOG_E("dbg_prometheus: unknown parameter '%s'", word);
+			ret = EINVAL;
+			break;
+		}
+	}
+	free(cf);
+	return ret;
+}
+
+/* entry point */
+static int pm_entry(char * conffile)
+{
+	TRACE_ENTRY("%p", conffile);
+	
+	CHECK_FCT( pm_conf(conffile) );
+	CHECK_FCT( pm_listen() );
+	CHECK_POSIX( pthread_create(&pm_thr, NULL, pm_server, NULL) );
+	
+	if (pm_unix) {
+		LOG_N("dbg_prometheus: serving the metrics on '%s'", pm_unix);
+	} else {
+		LOG_N("dbg_prometheus: serving the metrics on %s port %hu", pm_addr ?: "127.0.0.1", pm_port);
+	}
+	return 0;
+}
+
+/* Unload */
+void fd_ext_fini(void)
+{
+	TRACE_ENTRY();
+	
+	CHECK_FCT_DO( fd_thr_term(&pm_thr), /* continue */ );
+	if (pm_sock >= 0) {
+		close(pm_sock);
+		if (pm_unix)
+			(void) unlink(pm_unix);
+	}
+	free(pm_addr);
+	free(pm_unix);
+	free(pm_buf);
+	return ;
+}
+
+EXTENSION_ENTRY("dbg_prometheus", pm_entry);
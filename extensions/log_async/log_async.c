@@ -0,0 +1,504 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2015, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* This extension replaces the default logger of freeDiameter. The threads that log a message only format it 
+   in a ring buffer of their own; a background thread writes the messages to the output. So, a burst of log 
+   messages does not slow down the threads processing the Diameter messages.
+   
+   The parameter on the LoadExtension line is a list of space-separated words:
+     stdout		: write the messages on the standard output (default)
+     file=<path>	: append the messages to this file
+     syslog		: send the messages to syslog
+     ring=<KB>		: size of the buffer of each thread, 64KB by default. When it is full, messages are dropped and counted.
+   e.g.
+LoadExtension="log_async.fdx":"file=/var/log/freeDiameter.log ring=256";
+*/
+
+#include <freeDiameter/extension.h>
+#include <syslog.h>
+#include <fcntl.h>
+
+/* Default size of the ring buffer of a thread */
+#define LA_RING_DEFAULT	(64 * 1024)
+
+/* Size of the buffer where the writer thread prepares the output */
+#define LA_OUTBUF_SZ	(64 * 1024)
+
+/* How long the writer thread sleeps when no message was logged */
+#define LA_IDLE_MS	20
+
+/* The header of each record in a ring, followed by the text of the message and a '\0'. The records are aligned on 8 bytes. */
+struct la_rec {
+	uint32_t	len;		/* length of the text, or LA_PAD for the unused end of the buffer */
+	int32_t		level;
+	struct timespec	ts;
+};
+#define LA_PAD		((uint32_t)-1)
+#define LA_ALIGN(_l)	(((_l) + 7) & ~(size_t)7)
+#define LA_RECSZ(_len)	LA_ALIGN(sizeof(struct la_rec) + (_len) + 1)
+
+/* The ring buffer of a thread. Only this thread writes (head) and only the writer thread reads (tail). */
+struct la_ring {
+	struct fd_list	chain;		/* link in la_rings */
+	uint64_t	head;		/* where the next record is written */
+	uint64_t	tail;		/* first record not written to the output yet */
+	uint64_t	dropped;	/* messages lost because the ring was full */
+	uint64_t	reported;	/* value of dropped when it was last reported (writer thread only) */
+	int		orphan;		/* the thread has terminated, the ring is freed once empty */
+	uint8_t *	buf;		/* la_ringsz bytes */
+};
+
+static struct fd_list	la_rings = FD_LIST_INITIALIZER(la_rings);
+static pthread_mutex_t	la_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t	la_key;
+static struct la_ring **	la_snap = NULL;	/* copy of la_rings used by the writer without the lock */
+static int		la_snapsz = 0;
+static size_t		la_ringsz = LA_RING_DEFAULT;
+
+/* Output */
+static enum { LA_STDOUT, LA_FILE, LA_SYSLOG } la_dest = LA_STDOUT;
+static char *		la_path = NULL;
+static int		la_fd = -1;
+
+static pthread_t	la_thr = (pthread_t)NULL;
+static int		la_stop = 0;
+
+/* The writer thread sleeps when idle, it is woken up early when a ring is half full */
+static pthread_mutex_t	la_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	la_wake_cond = PTHREAD_COND_INITIALIZER;
+static int		la_sleeping = 0;
+
+/* The thread owning a ring terminated */
+static void la_ring_release(void * arg)
+{
+	struct la_ring * r = arg;
+	__atomic_store_n(&r->orphan, 1, __ATOMIC_RELEASE);
+}
+
+/* Get the ring of the calling thread, create it if needed */
+static struct la_ring * la_ring_get(void)
+{
+	struct la_ring * r = pthread_getspecific(la_key);
+	if (r)
+		return r;
+	
+	CHECK_MALLOC_DO( r = calloc(1, sizeof(struct la_ring)), return NULL );
+	CHECK_MALLOC_DO( r->buf = malloc(la_ringsz), { free(r); return NULL; } );
+	fd_list_init(&r->chain, r);
+	
+	CHECK_POSIX_DO( pthread_mutex_lock(&la_rings_lock), );
+	fd_list_insert_before(&la_rings, &r->chain);
+	CHECK_POSIX_DO( pthread_mutex_unlock(&la_rings_lock), );
+	
+	CHECK_POSIX_DO( pthread_setspecific(la_key, r), );
+	return r;
+}
+
+/* The logger registered in the framework. It is called with fd_log_lock held, but does not do any I/O. */
+static void la_logger(int loglevel, const char * format, va_list args)
+{
+	struct la_ring * r;
+	struct la_rec * rec;
+	uint64_t head, free_sz;
+	size_t off, contig, room, maxlen = la_ringsz / 4 - sizeof(struct la_rec) - 1;
+	va_list ap;
+	int n, wrapped = 0;
+	
+	if (loglevel < fd_g_debug_lvl)
+		return;
+	
+	if ((r = la_ring_get()) == NULL)
+		return;
+	
+	head = r->head;
+again:
+	free_sz = la_ringsz - (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+	off = head & (la_ringsz - 1);
+	contig = la_ringsz - off;
+	room = (contig < free_sz) ? contig : free_sz;
+	
+	/* Format the message directly in the ring */
+	if (room > sizeof(struct la_rec) + 1) {
+		size_t cap = room - sizeof(struct la_rec);
+		if (cap > maxlen + 1)
+			cap = maxlen + 1; /* longer messages are truncated */
+		va_copy(ap, args);
+		n = vsnprintf((char *)r->buf + off + sizeof(struct la_rec), cap, format, ap);
+		va_end(ap);
+		if (n < 0)
+			return;
+		if (((size_t)n < cap) || (cap == maxlen + 1)) {
+			rec = (struct la_rec *)(r->buf + off);
+			rec->len = ((size_t)n < cap) ? n : maxlen;
+			rec->level = loglevel;
+			(void) clock_gettime(CLOCK_REALTIME, &rec->ts);
+			__atomic_store_n(&r->head, head + LA_RECSZ(rec->len), __ATOMIC_RELEASE);
+			if ((free_sz < la_ringsz / 2) && __atomic_load_n(&la_sleeping, __ATOMIC_RELAXED)) {
+				CHECK_POSIX_DO( pthread_mutex_lock(&la_wake_lock), );
+				CHECK_POSIX_DO( pthread_cond_signal(&la_wake_cond), );
+				CHECK_POSIX_DO( pthread_mutex_unlock(&la_wake_lock), );
+			}
+			return;
+		}
+	} else {
+		va_copy(ap, args);
+		n = vsnprintf(NULL, 0, format, ap);
+		va_end(ap);
+		if (n < 0)
+			return;
+	}
+	
+	/* The message does not fit at the end of the buffer; skip this space if it fits at the beginning */
+	if (!wrapped && (contig < free_sz) && (LA_RECSZ((size_t)n < maxlen ? n : maxlen) <= free_sz - contig)) {
+		if (contig >= sizeof(struct la_rec))
+			((struct la_rec *)(r->buf + off))->len = LA_PAD;
+		head += contig;
+		wrapped = 1;
+		goto again;
+	}
+	if (wrapped)
+		__atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+	
+	/* The writer thread is late, drop this message */
+	__atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+}
+
+/* Write out the prepared data */
+static void la_flush(char * out, size_t * len)
+{
+	size_t done = 0;
+	int fd = (la_dest == LA_FILE) ? la_fd : STDOUT_FILENO;
+	
+	while (done < *len) {
+		ssize_t ret = write(fd, out + done, *len - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			break; /* nowhere to report this */
+		}
+		done += ret;
+	}
+	*len = 0;
+}
+
+/* Output one message */
+static void la_output(int level, struct timespec * ts, const char * text, size_t textlen, char * out, size_t * outlen)
+{
+	char tsbuf[25];
+	const char * lvl;
+	size_t need;
+	
+	if (la_dest == LA_SYSLOG) {
+		int prio;
+		switch (level) {
+			case FD_LOG_ANNOYING:
+			case FD_LOG_DEBUG:	prio = LOG_DEBUG; break;
+			case FD_LOG_NOTICE:	prio = LOG_NOTICE; break;
+			case FD_LOG_ERROR:	prio = LOG_ERR; break;
+			default:		prio = LOG_CRIT;
+		}
+		syslog(prio, "%.*s", (int)textlen, text);
+		return;
+	}
+	
+	/* Same format as the default logger */
+	switch (level) {
+		case FD_LOG_ANNOYING:	lvl = "	A   "; break;
+		case FD_LOG_DEBUG:	lvl = " DBG   "; break;
+		case FD_LOG_NOTICE:	lvl = "NOTI   "; break;
+		case FD_LOG_ERROR:	lvl = "ERROR  "; break;
+		case FD_LOG_FATAL:	lvl = "FATAL! "; break;
+		default:		lvl = " ???   ";
+	}
+	fd_log_time(ts, tsbuf, sizeof(tsbuf), 0, 0);
+	
+	need = strlen(tsbuf) + 2 + strlen(lvl) + textlen + 1;
+	if (*outlen + need > LA_OUTBUF_SZ)
+		la_flush(out, outlen);
+	if (need > LA_OUTBUF_SZ) {
+		/* A very long message, write it in pieces */
+		*outlen = snprintf(out, LA_OUTBUF_SZ, "%s  %s", tsbuf, lvl);
+		la_flush(out, outlen);
+		memcpy(out, text, textlen < LA_OUTBUF_SZ - 1 ? textlen : LA_OUTBUF_SZ - 1);
+		*outlen = textlen < LA_OUTBUF_SZ - 1 ? textlen : LA_OUTBUF_SZ - 1;
+		out[(*outlen)++] = '\n';
+		la_flush(out, outlen);
+		return;
+	}
+	*outlen += sprintf(out + *outlen, "%s  %s", tsbuf, lvl);
+	memcpy(out + *outlen, text, textlen);
+	*outlen += textlen;
+	out[(*outlen)++] = '\n';
+}
+
+/* Return the next record of a ring, or NULL if it is empty */
+static struct la_rec * la_ring_peek(struct la_ring * r)
+{
+	uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	
+	while (r->tail != head) {
+		size_t off = r->tail & (la_ringsz - 1);
+		struct la_rec * rec = (struct la_rec *)(r->buf + off);
+		if ((la_ringsz - off < sizeof(struct la_rec)) || (rec->len == LA_PAD)) {
+			/* skip the end of the buffer */
+			__atomic_store_n(&r->tail, r->tail + (la_ringsz - off), __ATOMIC_RELEASE);
+			continue;
+		}
+		return rec;
+	}
+	return NULL;
+}
+
+/* Write all the messages logged so far, in the order of their timestamps. Returns the number of messages. */
+static int la_drain(char * out)
+{
+	struct fd_list * li;
+	size_t outlen = 0;
+	uint64_t dropped = 0;
+	int count = 0, nb = 0, i;
+	
+	/* Copy the list of rings, so that the threads logging for the first time do not wait for the I/O. 
+	  The rings are only freed by this thread, below. */
+	CHECK_POSIX_DO( pthread_mutex_lock(&la_rings_lock), );
+	for (li = la_rings.next; li != &la_rings; li = li->next)
+		nb++;
+	if (nb > la_snapsz) {
+		struct la_ring ** snap = realloc(la_snap, 2 * nb * sizeof(struct la_ring *));
+		if (snap) {
+			la_snap = snap;
+			la_snapsz = 2 * nb;
+		}
+	}
+	for (nb = 0, li = la_rings.next; (li != &la_rings) && (nb < la_snapsz); li = li->next)
+		la_snap[nb++] = li->o;
+	CHECK_POSIX_DO( pthread_mutex_unlock(&la_rings_lock), );
+	
+	/* Merge the rings */
+	for (;;) {
+		struct la_ring * best = NULL;
+		struct la_rec * best_rec = NULL;
+		
+		for (i = 0; i < nb; i++) {
+			struct la_ring * r = la_snap[i];
+			struct la_rec * rec = la_ring_peek(r);
+			if (!rec)
+				continue;
+			if (!best_rec || (rec->ts.tv_sec < best_rec->ts.tv_sec) 
+			    || ((rec->ts.tv_sec == best_rec->ts.tv_sec) && (rec->ts.tv_nsec < best_rec->ts.tv_nsec))) {
+				best = r;
+				best_rec = rec;
+			}
+		}
+		if (!best)
+			break;
+		
+		la_output(best_rec->level, &best_rec->ts, (char *)(best_rec + 1), best_rec->len, out, &outlen);
+		__atomic_store_n(&best->tail, best->tail + LA_RECSZ(best_rec->len), __ATOMIC_RELEASE);
+		count++;
+	}
+	
+	/* Count the dropped messages and free the rings of terminated threads */
+	CHECK_POSIX_DO( pthread_mutex_lock(&la_rings_lock), );
+	for (li = la_rings.next; li != &la_rings; ) {
+		struct la_ring * r = li->o;
+		uint64_t d = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+		li = li->next;
+		dropped += d - r->reported;
+		r->reported = d;
+		if (__atomic_load_n(&r->orphan, __ATOMIC_ACQUIRE) && (la_ring_peek(r) == NULL)) {
+			fd_list_unlink(&r->chain);
+			free(r->buf);
+			free(r);
+		}
+	}
+	
+	CHECK_POSIX_DO( pthread_mutex_unlock(&la_rings_lock), );
+	
+	if (dropped) {
+		char text[80];
+		struct timespec now;
+		int len = snprintf(text, sizeof(text), "log_async: %llu log messages were dropped (buffer full)", (unsigned long long)dropped);
+		(void) clock_gettime(CLOCK_REALTIME, &now);
+		la_output(FD_LOG_ERROR, &now, text, len, out, &outlen);
+	}
+	
+	if (outlen)
+		la_flush(out, &outlen);
+	
+	return count;
+}
+
+/* The writer thread */
+static void * la_writer(void * arg)
+{
+	char * out = arg;
+	
+	/* Set the thread name */
+	fd_log_threadname ( "log_async writer" );
+	
+	while (!__atomic_load_n(&la_stop, __ATOMIC_ACQUIRE)) {
+		struct timespec ts;
+		
+		if (la_drain(out) != 0)
+			continue;
+		
+		/* Nothing was logged, wait a little */
+		CHECK_SYS_DO( clock_gettime(CLOCK_REALTIME, &ts), break );
+		ts.tv_nsec += LA_IDLE_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec += 1;
+			ts.tv_nsec -= 1000000000L;
+		}
+		CHECK_POSIX_DO( pthread_mutex_lock(&la_wake_lock), break );
+		__atomic_store_n(&la_sleeping, 1, __ATOMIC_RELAXED);
+		(void) pthread_cond_timedwait(&la_wake_cond, &la_wake_lock, &ts);
+		__atomic_store_n(&la_sleeping, 0, __ATOMIC_RELAXED);
+		CHECK_POSIX_DO( pthread_mutex_unlock(&la_wake_lock), break );
+	}
+	
+	/* Write what remains */
+	(void) la_drain(out);
+	free(out);
+	return NULL;
+}
+
+/* Parse the parameter of the extension */
+static int la_conf(char * conffile)
+{
+	char * cf, * word, * save = NULL;
+	int ret = 0;
+	
+	if (!conffile)
+		return 0;
+	
+	CHECK_MALLOC( cf = strdup(conffile) );
+	for (word = strtok_r(cf, " \t", &save); word; word = strtok_r(NULL, " \t", &save)) {
+		if (!strcmp(word, "stdout")) {
+			la_dest = LA_STDOUT;
+		} else if (!strcmp(word, "syslog")) {
+			la_dest = LA_SYSLOG;
+		} else if (!strncmp(word, "file=", 5) && word[5]) {
+			la_dest = LA_FILE;
+			free(la_path);
+			CHECK_MALLOC_DO( la_path = strdup(word + 5), { ret = ENOMEM; break; } );
+		} else if (!strncmp(word, "ring=", 5)) {
+			char * endp;
+			unsigned long kb = strtoul(word + 5, &endp, 10);
+			if ((*endp != '\0') || (kb < 4) || (kb > 65536) || (kb & (kb - 1))) {
+				LOG_E("log_async: the ring size must be a power of 2 between 4 and 65536 (KB): '%s'", word);
+				ret = EINVAL;
+				break;
+			}
+			la_ringsz = kb * 1024;
+		} else {
+			LOG_E("log_async: unknown parameter '%s'", word);
+			ret = EINVAL;
+			break;
+		}
+	}
+	free(cf);
+	return ret;
+}
+
+/* entry point */
+static int la_entry(char * conffile)
+{
+	char * out;
+	
+	TRACE_ENTRY("%p", conffile);
+	
+	CHECK_FCT( la_conf(conffile) );
+	
+	switch (la_dest) {
+		case LA_FILE:
+			CHECK_SYS_DO( la_fd = open(la_path, O_WRONLY | O_APPEND | O_CREAT, 0640), 
+				{ LOG_E("log_async: cannot open '%s'", la_path); return errno; } );
+			break;
+		case LA_SYSLOG:
+			openlog("freeDiameter", LOG_PID, LOG_DAEMON);
+			break;
+		default:
+			break;
+	}
+	
+	CHECK_POSIX( pthread_key_create(&la_key, la_ring_release) );
+	CHECK_MALLOC( out = malloc(LA_OUTBUF_SZ) );
+	CHECK_POSIX( pthread_create(&la_thr, NULL, la_writer, out) );
+	
+	/* From now on, the messages go through the rings */
+	CHECK_FCT( fd_log_handler_register(la_logger) );
+	fd_log_handler_honors_level = 1;
+	
+	return 0;
+}
+
+/* Unload */
+void fd_ext_fini(void)
+{
+	TRACE_ENTRY();
+	
+	CHECK_FCT_DO( fd_log_handler_unregister(), );
+	
+	/* No thread can be in la_logger after this */
+	CHECK_POSIX_DO( pthread_mutex_lock(&fd_log_lock), );
+	CHECK_POSIX_DO( pthread_mutex_unlock(&fd_log_lock), );
+	
+	/* Write the pending messages and stop the writer */
+	if (la_thr) {
+		__atomic_store_n(&la_stop, 1, __ATOMIC_RELEASE);
+		CHECK_POSIX_DO( pthread_join(la_thr, NULL), );
+		la_thr = (pthread_t)NULL;
+	}
+	
+	CHECK_POSIX_DO( pthread_key_delete(la_key), );
+	while (!FD_IS_LIST_EMPTY(&la_rings)) {
+		struct la_ring * r = la_rings.next->o;
+		fd_list_unlink(&r->chain);
+		free(r->buf);
+		free(r);
+	}
+	free(la_snap);
+	la_snap = NULL;
+	la_snapsz = 0;
+	
+	if (la_fd >= 0)
+		close(la_fd);
+	if (la_dest == LA_SYSLOG)
+		closelog();
+	free(la_path);
+	return ;
+}
+
+EXTENSION_ENTRY("log_async", la_entry);
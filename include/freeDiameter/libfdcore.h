@@ -134,6 +134,9 @@ struct fd_config {
 	int		 cnf_thr_srv;	/* Number of threads per servers handling the connection state machines */
 	struct fd_list	 cnf_apps;	/* Applications locally supported (except relay, see flags). Use fd_disp_app_support to add one. list of struct fd_app. */
 	uint16_t	 cnf_dispthr;	/* Number of dispatch threads to create */
+	uint16_t	 cnf_rtinthr;	/* Max number of routing-in threads, created when the incoming queue fills up */
+	uint16_t	 cnf_rtoutthr;	/* Max number of routing-out threads, created when the outgoing queue fills up */
+	uint16_t	 cnf_iothr;	/* Number of I/O threads receiving the messages of the TCP connections, 0 for one thread per connection */
 	struct {
 		unsigned no_fwd : 1;	/* the peer does not relay messages (0xffffff app id) */
 		unsigned no_ip4 : 1;	/* disable IP */
@@ -142,6 +145,8 @@ struct fd_config {
 		unsigned no_sctp: 1;	/* disable the use of SCTP */
 		unsigned pr_tcp	: 1;	/* prefer TCP over SCTP */
 		unsigned tls_alg: 1;	/* TLS algorithm for initiated cnx. 0: separate port. 1: inband-security (old) */
+		unsigned zero_copy: 1;	/* the AVP octetstring values of received messages point inside the received buffer, see fd_msg_parse_zerocopy */
+		unsigned fast_relay: 1;	/* the AVPs of received messages are parsed only when needed, see fd_msg_parse_lazy */
 	} 		 cnf_flags;
 	
 	struct {
@@ -1200,6 +1205,92 @@ int fd_stat_getstats(enum fd_stat_type stat, struct peer_hdr * peer,
 			int * current_count, int * limit_count, int * highest_count, long long * total_count,
 			struct timespec * total, struct timespec * blocking, struct timespec * last);
 
+/*
+ * In addition, the framework maintains counters and latency histograms on the processing path of the messages.
+ * Each thread updates its own copy of these values, which are summed when they are read, so there is no 
+ * contention between the threads processing the messages.
+ */
+enum fd_stat_counter {
+	FD_STAT_MSG_IN = 0,	/* Messages received from the peers */
+	FD_STAT_MSG_OUT,	/* Messages sent to the peers */
+	FD_STAT_PARSE_ERR,	/* Messages that could not be parsed (reported by HOOK_MESSAGE_PARSING_ERROR) */
+	FD_STAT_COUNTERS	/* (number of counters) */
+};
+
+enum fd_stat_histo {
+	FD_STAT_H_ANSWER = 0,	/* Time between sending a request to a peer and receiving its answer */
+	FD_STAT_H_WAIT_INCOMING,/* Time spent by the received messages in the queue of the routing-in stage */
+	FD_STAT_H_WAIT_OUTGOING,/* Time spent by the messages to send in the queue of the routing-out stage */
+	FD_STAT_H_WAIT_LOCAL,	/* Time spent by the messages in the queue of the local extensions */
+	FD_STAT_HISTOS		/* (number of histograms) */
+};
+
+/* The values of the histograms are in microseconds. Each power of 2 is split into 2^FD_STAT_SUB_BITS buckets, 
+ so the values are known with a precision of 1 / 2^FD_STAT_SUB_BITS. The last bucket also counts the values above 2^32us. */
+#define FD_STAT_SUB_BITS	3
+#define FD_STAT_BUCKETS		((32 - FD_STAT_SUB_BITS + 1) << FD_STAT_SUB_BITS)
+
+struct fd_stat_histo_data {
+	long long	count;				/* Number of values */
+	long long	sum;				/* Sum of the values */
+	long long	buckets[FD_STAT_BUCKETS];	/* Number of values in each bucket, see fd_stat_bucket_max */
+};
+
+/*
+ * FUNCTION:	fd_stat_counter_get, fd_stat_histo_get
+ *
+ * PARAMETERS:
+ *  c, h	  : Which counter or histogram is being queried
+ *  value, data	  : (out) The value of the counter or the content of the histogram, since startup.
+ *
+ * DESCRIPTION: 
+ *   Sum the values of all the threads. Use deltas for monitoring.
+ *
+ * RETURN VALUE:
+ *  0      	: The values have been retrieved.
+ *  EINVAL 	: A parameter is invalid.
+ */
+int fd_stat_counter_get(enum fd_stat_counter c, long long * value);
+int fd_stat_histo_get(enum fd_stat_histo h, struct fd_stat_histo_data * data);
+
+/* The highest value counted in a bucket of a histogram, e.g. for the "le" label of a Prometheus histogram */
+long long fd_stat_bucket_max(int bucket);
+
+/* An upper bound of the q-quantile (0 < q <= 1) of the values of a histogram, 0 if it is empty */
+long long fd_stat_quantile(struct fd_stat_histo_data * data, double q);
+
+/*
+ * FUNCTION:	fd_stat_peer_get
+ *
+ * PARAMETERS:
+ *  peer	  : The peer being queried
+ *  in, out	  : (out) The number of messages received from and sent to this peer (since it was created)
+ *
+ * RETURN VALUE:
+ *  0      	: The values have been retrieved.
+ *  EINVAL 	: A parameter is invalid.
+ */
+int fd_stat_peer_get(struct peer_hdr * peer, long long * in, long long * out);
+
+/*
+ * FUNCTION:	fd_stat_iterate_cmd, fd_stat_iterate_rescode
+ *
+ * PARAMETERS:
+ *  data	  : Opaque pointer passed to the callback
+ *  cb		  : Called for each command code (requests and answers separately), or each Result-Code of the 
+ *                  received and sent answers, with the number of messages received and sent.
+ *
+ * DESCRIPTION: 
+ *   Retrieve the number of messages per command and per Result-Code. Only the first few dozens of different 
+ *  codes seen are counted. The callbacks are called without lock held.
+ *
+ * RETURN VALUE:
+ *  0      	: The callback has been called for all the codes.
+ *  EINVAL 	: A parameter is invalid.
+ */
+int fd_stat_iterate_cmd(void * data, void (*cb)(void * data, command_code_t code, int is_req, long long in, long long out));
+int fd_stat_iterate_rescode(void * data, void (*cb)(void * data, uint32_t rescode, long long in, long long out));
+
 /*============================================================*/
 /*                         EOF                                */
 /*============================================================*/
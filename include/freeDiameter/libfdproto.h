@@ -224,6 +224,26 @@ int fd_log_handler_register ( void (*logger)(int loglevel, const char * format,
  */
 int fd_log_handler_unregister ( void );
 
+/* An external logger sets this to 1 if it discards the messages below fd_g_debug_lvl, as the default logger does.
+ These messages are then dropped before the logger is called. Reset by fd_log_handler_unregister. */
+extern int fd_log_handler_honors_level;
+
+/*
+ * FUNCTION:    fd_log_enabled
+ *
+ * PARAMETERS:
+ *  loglevel    : priority of a message
+ *
+ * DESCRIPTION:
+ *  Tell if a message of this priority would be output, so that the caller can skip building an expensive
+ * message (e.g. a dump) that the logger would discard. Messages are always passed to an external logger,
+ * unless it has set fd_log_handler_honors_level.
+ *
+ * RETURN VALUE:
+ *  1 if the message would be logged, 0 otherwise.
+ */
+int fd_log_enabled ( int loglevel );
+
 
 /* All dump functions follow this same prototype:
  * PARAMETERS:
@@ -2365,9 +2385,15 @@ int fd_msg_avp_add ( msg_or_avp * reference, enum msg_brw_dir dir, struct avp *a
  *
  * DESCRIPTION: 
  *   Search the first top-level AVP of a given model inside a message.
- * Note: only the first instance of the AVP is returned by this function.
+ * Note: only the first instance of the AVP is returned by this function, use fd_msg_search_avp_next for the others.
  * Note: only top-level AVPs are searched, not inside grouped AVPs.
  * Use msg_browse if you need more advanced research features.
+ *  When a message is searched several times, an index of its top-level AVPs is built so that the
+ * next searches do not go through all the AVPs. The index is dropped when AVPs are added to or removed from
+ * the message. The code and vendor in the header of these AVPs must not be changed meanwhile.
+ *  Several threads may search the same message at the same time, as long as none of them modifies it. The
+ * AVPs of a message received in lazy mode must have been created first (fd_msg_parse_dict or fd_msg_browse),
+ * since the first search creates them otherwise.
  *
  * RETURN VALUE:
  *  0      	: The AVP has been found.
@@ -2376,6 +2402,25 @@ int fd_msg_avp_add ( msg_or_avp * reference, enum msg_brw_dir dir, struct avp *a
  */
 int fd_msg_search_avp ( struct msg * msg, struct dict_object * what, struct avp ** avp );
 
+/*
+ * FUNCTION:	fd_msg_search_avp_next
+ *
+ * PARAMETERS:
+ *  prev 	: An AVP, typically returned by fd_msg_search_avp or a previous call to this function.
+ *  avp		: location where the AVP reference is stored if found.
+ *
+ * DESCRIPTION: 
+ *   Search the next AVP with the same code and vendor as "prev", at the same level. This allows to 
+ * iterate over all the instances of an AVP in a message: 
+ *   for (fd_msg_search_avp(msg, model, &avp); avp; fd_msg_search_avp_next(avp, &avp)) { ... }
+ *
+ * RETURN VALUE:
+ *  0      	: The AVP has been found.
+ *  EINVAL 	: A parameter is invalid.
+ *  ENOENT	: No AVP has been found, and "avp" was NULL (otherwise, *avp is set to NULL and 0 returned).
+ */
+int fd_msg_search_avp_next ( struct avp * prev, struct avp ** avp );
+
 /*
  * FUNCTION:	fd_msg_free
  *
@@ -2392,6 +2437,22 @@ int fd_msg_search_avp ( struct msg * msg, struct dict_object * what, struct avp
  */
 int fd_msg_free ( msg_or_avp * object );
 
+/*
+ * FUNCTION:	fd_msg_cache_getstats
+ *
+ * PARAMETERS:
+ *  objects     : if not NULL, the number of messages, AVPs and value buffers allocated so far is stored here.
+ *  sysallocs   : if not NULL, the number of allocations from the system done for these objects is stored here.
+ *
+ * DESCRIPTION: 
+ *   The messages and AVPs objects are allocated from per-thread caches that are filled by slabs of several
+ *  objects, and objects freed with fd_msg_free are reused. This function gives statistics about these caches.
+ *
+ * RETURN VALUE:
+ *  None.
+ */
+void fd_msg_cache_getstats ( long long * objects, long long * sysallocs );
+
 /***************************************/
 /*   Dump functions                    */
 /***************************************/
@@ -2465,7 +2526,9 @@ int fd_msg_hdr ( struct msg *msg, struct msg_hdr ** pdata );
  *  pdata 	: Upon success, pointer to the avp_hdr structure of this avp. The fields may be modified.
  *
  * DESCRIPTION: 
- *   Retrieve location of modifiable data of an avp. 
+ *   Retrieve location of modifiable data of an avp. Since the data may be modified, in zero-copy mode
+ *  (see fd_msg_parse_zerocopy) the avp is then always encoded again when the message is sent, instead
+ *  of being copied from the received buffer.
  *
  * RETURN VALUE:
  *  0      	: The location has been written.
@@ -2702,6 +2765,26 @@ int fd_msg_avp_value_interpret ( struct avp *avp, void *data );
  */
 int fd_msg_bufferize ( struct msg * msg, uint8_t ** buffer, size_t * len );
 
+/*
+ * FUNCTION:	fd_msg_bufferize_to
+ *
+ * PARAMETERS:
+ *  msg		: A valid msg object. All AVPs must have a value set. 
+ *  buffer 	: A buffer (malloc'd) owned by the caller, or NULL. It is reallocated if it is too small for the message.
+ *  bufsz	: The size of *buffer, updated if the buffer is reallocated.
+ *  len		: if not NULL, the size of the message is written here. In any case, this size is updated in the msg header.
+ *
+ * DESCRIPTION: 
+ *   Same as fd_msg_bufferize, but the message is written in a buffer that can be reused for several messages,
+ *  which saves an allocation per message on the sending path.
+ *
+ * RETURN VALUE:
+ *  0      	: The message has been written in *buffer.
+ *  EINVAL 	: A parameter is invalid.
+ *  ENOMEM	: Unable to grow the buffer. *buffer is still valid in this case.
+ */
+int fd_msg_bufferize_to ( struct msg * msg, uint8_t ** buffer, size_t * bufsz, size_t * len );
+
 /*
  * FUNCTION:	fd_msg_parse_buffer
  *
@@ -2724,6 +2807,73 @@ int fd_msg_bufferize ( struct msg * msg, uint8_t ** buffer, size_t * len );
  */
 int fd_msg_parse_buffer ( uint8_t ** buffer, size_t buflen, struct msg ** msg );
 
+/*
+ * FUNCTION:	fd_msg_parse_zerocopy
+ *
+ * PARAMETERS:
+ *  enable 	: 1 to enable the zero-copy mode for the messages parsed afterwards, 0 to disable it (default).
+ *
+ * DESCRIPTION: 
+ *   In zero-copy mode, the buffer saved by fd_msg_parse_buffer is kept after the message is parsed by fd_msg_parse_dict,
+ *  and the octetstring values of the AVPs (avp_value->os.data) point inside this buffer instead of a copy. The buffer is 
+ *  freed when no AVP references it anymore, so the AVPs can still be moved to other messages. Setting a new value with 
+ *  fd_msg_avp_setvalue or fd_msg_avp_value_encode creates a copy as usual.
+ *   When the message is sent again (relayed), the AVPs that were not modified (nor accessed with fd_msg_avp_hdr) are copied
+ *  from the received buffer with their children instead of being encoded again.
+ *   Note that in this mode, the octetstring values of the received AVPs are not NUL-terminated, and must not be modified in place.
+ *
+ * RETURN VALUE:
+ *  None.
+ */
+void fd_msg_parse_zerocopy ( int enable );
+
+/*
+ * FUNCTION:	fd_msg_parse_lazy
+ *
+ * PARAMETERS:
+ *  enable 	: 1 to enable the lazy parsing of the messages parsed afterwards, 0 to disable it (default).
+ *
+ * DESCRIPTION: 
+ *   In lazy mode, fd_msg_parse_buffer only checks that the AVPs of the message are well-formed, and keeps them in
+ *  the received buffer. The AVP objects are created the first time the AVPs of the message are accessed (fd_msg_browse,
+ *  fd_msg_parse_dict, fd_msg_search_avp, ...), transparently for the caller. Until then, the AVPs can be read
+ *  with fd_msg_wire_browse, AVPs can be added at the end of the message (fd_msg_avp_add with MSG_BRW_LAST_CHILD), 
+ *  and fd_msg_bufferize copies the received AVPs as is. This is intended for relaying messages without parsing them.
+ *
+ * RETURN VALUE:
+ *  None.
+ */
+void fd_msg_parse_lazy ( int enable );
+
+/* An AVP read directly from the received buffer of a lazily parsed message */
+struct avp_wirehdr {
+	avp_code_t	 avp_code;	/* the AVP Code */
+	uint8_t		 avp_flags;	/* the AVP Flags */
+	vendor_id_t	 avp_vendor;	/* the Vendor-ID, 0 if AVP_FLAG_VENDOR is not set */
+	uint8_t		*avp_data;	/* the AVP data, as received (network byte order, not NUL-terminated) */
+	size_t		 avp_datalen;	/* the size of the data, without padding */
+};
+
+/*
+ * FUNCTION:	fd_msg_wire_browse
+ *
+ * PARAMETERS:
+ *  msg		: A message parsed in lazy mode (see fd_msg_parse_lazy).
+ *  offset	: Position of the AVP to read; 0 for the first AVP. Updated to the position of the next AVP.
+ *  avp		: Upon success, the header and data of the AVP are written here.
+ *
+ * DESCRIPTION: 
+ *   Read the top-level AVPs of a lazily parsed message, from the received buffer, without creating the AVP objects. 
+ *  The AVPs added to the message since it was received are not returned.
+ *
+ * RETURN VALUE:
+ *  0      	: The AVP was read.
+ *  ENOENT	: There is no more AVP in the buffer.
+ *  ENOTSUP	: The AVP objects of the message were already created: use fd_msg_browse instead.
+ *  EINVAL 	: A parameter is invalid.
+ */
+int fd_msg_wire_browse ( struct msg * msg, size_t * offset, struct avp_wirehdr * avp );
+
 /* Parsing Error Information structure */
 struct fd_pei {
 	char *		pei_errcode;	/* name of the error code to use */
@@ -3031,6 +3181,33 @@ struct fifo;
  */
 int fd_fifo_new ( struct fifo ** queue, int max );
 
+/*
+ * FUNCTION:	fd_fifo_new_ring
+ *
+ * PARAMETERS:
+ *  queue	: Upon success, a pointer to the new queue is saved here.
+ *  max		: max number of items in the queue, must be > 0. Above this number, adding a new item becomes a blocking operation.
+ *  flags	: A combination of FIFO_RING_* flags.
+ *
+ * DESCRIPTION: 
+ *  Create a new empty queue whose items are stored in a preallocated ring of cells, so that posting and retrieving
+ * items does not take the lock of the queue nor allocate memory, except when a thread has to wait. It is used with
+ * the same functions as the queues created with fd_fifo_new, with the following differences:
+ *  - fd_fifo_move is not supported on this queue.
+ *  - fd_fifo_post_noblock can only exceed max up to the ring capacity (twice max), it returns ENOSPC afterwards.
+ *  - the thresholds callbacks are based on the count seen by the thread at the time of the operation, they may be 
+ *   skipped or called out of order when several threads use the queue concurrently.
+ *  - without FIFO_RING_STATS, the timing statistics of fd_fifo_getstats are not updated except the blocking time.
+ *
+ * RETURN VALUE :
+ *  0		: The queue has been initialized successfully.
+ *  EINVAL 	: A parameter is invalid.
+ *  ENOMEM	: Not enough memory to complete the creation.  
+ */
+int fd_fifo_new_ring ( struct fifo ** queue, int max, int flags );
+#define FIFO_RING_SPSC	0x01	/* Only one thread ever posts and one thread ever retrieves items at a time, the positions are claimed without atomic read-modify-write */
+#define FIFO_RING_STATS	0x02	/* Measure the time spent by the items in the queue, on a sample of the items */
+
 /*
  * FUNCTION:	fd_fifo_del
  *
@@ -3134,6 +3311,26 @@ int fd_fifo_length ( struct fifo * queue );
  */
 int fd_fifo_setthrhd ( struct fifo * queue, void * data, uint16_t high, void (*h_cb)(struct fifo *, void **), uint16_t low, void (*l_cb)(struct fifo *, void **) );
 
+/*
+ * FUNCTION:	fd_fifo_setwaitcb
+ *
+ * PARAMETERS:
+ *  queue	: The queue for which the callback is being set.
+ *  w_cb        : if not NULL, a callback receiving the time (in nanoseconds) an item spent in the queue.
+ *  w_data	: An opaque pointer that is passed to w_cb.
+ *
+ * DESCRIPTION: 
+ *  Allows to build statistics on the time spent by the items in a queue, for example latency histograms.
+ * The callback is called when an item is retrieved from the queue, for all the items, or only for the sampled
+ * items on a queue created by fd_fifo_new_ring with FIFO_RING_STATS (none without this flag). 
+ * It is called with the lock of the queue held, so it must be quick and not use the queue.
+ *
+ * RETURN VALUE:
+ *  0		: The callback has been set
+ *  EINVAL 	: A parameter is invalid.
+ */
+int fd_fifo_setwaitcb ( struct fifo * queue, void (*w_cb)(void *, long long), void * w_data );
+
 /*
  * FUNCTION:	fd_fifo_post
  *
@@ -3155,7 +3352,7 @@ int fd_fifo_post_int ( struct fifo * queue, void ** item );
 	fd_fifo_post_int((queue), (void *)(item))
 
 /* Similar function but does not block. It can cause the number of items in the queue to exceed the maximum set. Do not use for normal operation,
-only for failure recovery for example. */
+only for failure recovery for example. On a queue created with fd_fifo_new_ring, it returns ENOSPC when the ring is full. */
 int fd_fifo_post_noblock( struct fifo * queue, void ** item );
 
 /*
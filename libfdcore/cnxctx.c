@@ -40,11 +40,6 @@
 #include <ifaddrs.h> /* for getifaddrs */
 #include <sys/uio.h> /* writev */
 
-/* The maximum size of Diameter message we accept to receive (<= 2^24) to avoid too big mallocs in case of trashed headers */
-#ifndef DIAMETER_MSG_SIZE_MAX
-#define DIAMETER_MSG_SIZE_MAX	65535	/* in bytes */
-#endif /* DIAMETER_MSG_SIZE_MAX */
-
 
 /* Connections contexts (cnxctx) in freeDiameter are wrappers around the sockets and TLS operations .
  * They are used to hide the details of the processing to the higher layers of the daemon.
@@ -66,6 +61,7 @@
  *
  * 3) Usage
  *    - fd_cnx_receive, fd_cnx_send : exchange messages on this connection (send is synchronous, receive is not, but blocking).
+ *    - fd_cnx_sendv : send several messages at once, with a single write on TCP connections.
  *    - fd_cnx_recv_setaltfifo : when a message is received, the event is sent to an external fifo list. fd_cnx_receive does not work when the alt_fifo is set.
  *    - fd_cnx_getid : retrieve a descriptive string for the connection (for debug)
  *    - fd_cnx_getremoteid : identification of the remote peer (IP address or fqdn)
@@ -88,6 +84,7 @@ static struct cnxctx * fd_cnx_init(int full)
 
 	CHECK_MALLOC_DO( conn = malloc(sizeof(struct cnxctx)), return NULL );
 	memset(conn, 0, sizeof(struct cnxctx));
+	fd_list_init(&conn->cc_rx_chk, conn);
 
 	if (full) {
 		CHECK_FCT_DO( fd_fifo_new ( &conn->cc_incoming, 5 ), return NULL );
@@ -740,7 +737,7 @@ static int fd_cnx_init_msg_buffer(uint8_t * buffer, size_t expected_len, struct
 	return 0;
 }
 
-static uint8_t * fd_cnx_alloc_msg_buffer(size_t expected_len, struct fd_msg_pmdl ** pmdl)
+uint8_t * fd_cnx_alloc_msg_buffer(size_t expected_len, struct fd_msg_pmdl ** pmdl)
 {
 	uint8_t * ret = NULL;
 	
@@ -760,7 +757,7 @@ static uint8_t * fd_cnx_realloc_msg_buffer(uint8_t * buffer, size_t expected_len
 }
 #endif /* DISABLE_SCTP */
 
-static void free_rcvdata(void * arg) 
+void fd_cnx_free_rcvdata(void * arg) 
 {
 	struct fd_cnx_rcvdata * data = arg;
 	struct fd_msg_pmdl * pmdl = fd_msg_pmdl_get_inbuf(data->buffer, data->length);
@@ -768,10 +765,127 @@ static void free_rcvdata(void * arg)
 	free(data->buffer);
 }
 
+/* Prepare a framer. In exact mode, no data after the current message is read. */
+void fd_cnx_framer_init(struct fd_cnx_framer * fr, int exact)
+{
+	memset(fr, 0, sizeof(struct fd_cnx_framer));
+	fr->exact = exact;
+}
+
+/* Split out the next complete message from the received data. Returns EAGAIN if more data must be received first, EBADMSG if the data is not Diameter */
+int fd_cnx_framer_next(struct cnxctx * conn, struct fd_cnx_framer * fr, struct fd_cnx_rcvdata * rcv_data, struct fd_msg_pmdl ** pmdl)
+{
+	size_t avail = fr->end - fr->start;
+	size_t cpy;
+	
+	if (fr->rcv_data.buffer == NULL) {
+		uint8_t * header = fr->buf + fr->start;
+		size_t length;
+		
+		if (avail == 0)
+			return EAGAIN;
+		
+		if ((avail < 4) && (header[0] == DIAMETER_VERSION))
+			return EAGAIN; /* No need to wait for 4 bytes if the version is wrong */
+		
+		length = (avail < 4) ? 0 : ((size_t)header[1] << 16) + ((size_t)header[2] << 8) + (size_t)header[3];
+		
+		/* Check the received word is a valid begining of a Diameter message */
+		if ((header[0] != DIAMETER_VERSION)	/* defined in <libfdproto.h> */
+		   || (length < DIAMETER_MSG_SIZE_MIN)	/* would never complete, or lose the boundaries */
+		   || (length > DIAMETER_MSG_SIZE_MAX)) { /* to avoid too big mallocs */
+			/* The message is suspect */
+			LOG_E( "Received suspect header [ver: %d, size: %zd] from '%s', assuming disconnection", (int)header[0], length, conn->cc_remid);
+			return EBADMSG;
+		}
+		
+		CHECK_MALLOC( fr->rcv_data.buffer = fd_cnx_alloc_msg_buffer( length, &fr->pmdl ) );
+		fr->rcv_data.length = length;
+		fr->received = 0;
+	}
+	
+	/* Copy the part of the message already received */
+	cpy = fr->rcv_data.length - fr->received;
+	if (cpy > avail)
+		cpy = avail;
+	memcpy(fr->rcv_data.buffer + fr->received, fr->buf + fr->start, cpy);
+	fr->received += cpy;
+	fr->start += cpy;
+	if (fr->start == fr->end)
+		fr->start = fr->end = 0;
+	
+	if (fr->received < fr->rcv_data.length)
+		return EAGAIN;
+	
+	/* The message is complete, it now belongs to the caller */
+	*rcv_data = fr->rcv_data;
+	*pmdl = fr->pmdl;
+	memset(&fr->rcv_data, 0, sizeof(fr->rcv_data));
+	fr->pmdl = NULL;
+	fr->received = 0;
+	return 0;
+}
+
+/* Where the next received data must be written, after fd_cnx_framer_next returned EAGAIN */
+int fd_cnx_framer_space(struct fd_cnx_framer * fr, uint8_t ** ptr, size_t * len)
+{
+	if (fr->rcv_data.buffer) {
+		size_t missing = fr->rcv_data.length - fr->received;
+		
+		/* The end of a large message is received directly in its buffer, saving a copy */
+		if (fr->exact || (missing >= FRAMER_BUFSZ / 2)) {
+			fr->direct = 1;
+			*ptr = fr->rcv_data.buffer + fr->received;
+			*len = missing;
+			return 0;
+		}
+	}
+	
+	fr->direct = 0;
+	if (!fr->buf) {
+		CHECK_MALLOC( fr->buf = malloc(FRAMER_BUFSZ) );
+	}
+	
+	/* Move the beginning of the next message to the start of the buffer */
+	if (fr->start) {
+		memmove(fr->buf, fr->buf + fr->start, fr->end - fr->start);
+		fr->end -= fr->start;
+		fr->start = 0;
+	}
+	
+	*ptr = fr->buf + fr->end;
+	if (fr->exact)
+		*len = 4 - fr->end; /* only the header */
+	else
+		*len = FRAMER_BUFSZ - fr->end;
+	return 0;
+}
+
+/* Account for the len bytes received at the place given by fd_cnx_framer_space */
+void fd_cnx_framer_fill(struct fd_cnx_framer * fr, size_t len)
+{
+	if (fr->direct)
+		fr->received += len;
+	else
+		fr->end += len;
+}
+
+/* Release the data held by a framer (can be used as cleanup handler) */
+void fd_cnx_framer_free(void * arg)
+{
+	struct fd_cnx_framer * fr = arg;
+	if (fr->rcv_data.buffer)
+		fd_cnx_free_rcvdata(&fr->rcv_data);
+	free(fr->buf);
+	fd_cnx_framer_init(fr, fr->exact);
+}
+
 /* Receiver thread (TCP & noTLS) : incoming message is directly saved into the target queue */
 static void * rcvthr_notls_tcp(void * arg)
 {
 	struct cnxctx * conn = arg;
+	struct fd_cnx_framer fr;
+	int fatal = 0;
 	
 	TRACE_ENTRY("%p", arg);
 	CHECK_PARAMS_DO(conn && (conn->cc_socket > 0), goto out);
@@ -787,51 +901,37 @@ static void * rcvthr_notls_tcp(void * arg)
 	ASSERT( ! fd_cnx_teststate(conn, CC_STATUS_TLS ) );
 	ASSERT( fd_cnx_target_queue(conn) );
 	
+	/* In single message mode, the data after the first message may be the TLS handshake */
+	fd_cnx_framer_init(&fr, !conn->cc_loop);
+	pthread_cleanup_push(fd_cnx_framer_free, &fr); /* In case we are canceled, clean the partialy built buffer */
+	
 	/* Receive from a TCP connection: we have to rebuild the message boundaries */
 	do {
-		uint8_t header[4];
 		struct fd_cnx_rcvdata rcv_data;
 		struct fd_msg_pmdl *pmdl=NULL;
-		ssize_t ret = 0;
-		size_t	received = 0;
-
-		do {
-			ret = fd_cnx_s_recv(conn, &header[received], sizeof(header) - received);
-			if (ret <= 0) {
-				goto out; /* Stop the thread, the event was already sent */
-			}
-
-			received += ret;
+		int ret;
+		
+		/* Receive until a complete message is available. Several messages are usually received at once. */
+		while ((ret = fd_cnx_framer_next(conn, &fr, &rcv_data, &pmdl)) == EAGAIN) {
+			uint8_t * ptr;
+			size_t len;
+			ssize_t rcvd;
 			
-			if (header[0] != DIAMETER_VERSION)
-				break; /* No need to wait for 4 bytes in this case */
-		} while (received < sizeof(header));
-
-		rcv_data.length = ((size_t)header[1] << 16) + ((size_t)header[2] << 8) + (size_t)header[3];
-
-		/* Check the received word is a valid begining of a Diameter message */
-		if ((header[0] != DIAMETER_VERSION)	/* defined in <libfdproto.h> */
-		   || (rcv_data.length > DIAMETER_MSG_SIZE_MAX)) { /* to avoid too big mallocs */
-			/* The message is suspect */
-			LOG_E( "Received suspect header [ver: %d, size: %zd] from '%s', assuming disconnection", (int)header[0], rcv_data.length, conn->cc_remid);
+			CHECK_FCT_DO( fd_cnx_framer_space(&fr, &ptr, &len), { fatal = 1; goto stop; } );
+			rcvd = fd_cnx_s_recv(conn, ptr, len);
+			if (rcvd <= 0) {
+				goto stop; /* Stop the thread, the event was already sent */
+			}
+			fd_cnx_framer_fill(&fr, rcvd);
+		}
+		
+		if (ret == EBADMSG) {
 			fd_cnx_markerror(conn);
-			goto out; /* Stop the thread, the recipient of the event will cleanup */
+			goto stop; /* Stop the thread, the recipient of the event will cleanup */
 		}
-
-		/* Ok, now we can really receive the data */
-		CHECK_MALLOC_DO(  rcv_data.buffer = fd_cnx_alloc_msg_buffer( rcv_data.length, &pmdl ), goto fatal );
-		memcpy(rcv_data.buffer, header, sizeof(header));
-
-		while (received < rcv_data.length) {
-			pthread_cleanup_push(free_rcvdata, &rcv_data); /* In case we are canceled, clean the partialy built buffer */
-			ret = fd_cnx_s_recv(conn, rcv_data.buffer + received, rcv_data.length - received);
-			pthread_cleanup_pop(0);
-
-			if (ret <= 0) {
-				free_rcvdata(&rcv_data);
-				goto out;
-			}
-			received += ret;
+		if (ret) {
+			fatal = 1;
+			goto stop;
 		}
 		
 		fd_hook_call(HOOK_DATA_RECEIVED, NULL, NULL, &rcv_data, pmdl);
@@ -839,20 +939,24 @@ static void * rcvthr_notls_tcp(void * arg)
 		/* We have received a complete message, pass it to the daemon */
 		CHECK_FCT_DO( fd_event_send( fd_cnx_target_queue(conn), FDEVP_CNX_MSG_RECV, rcv_data.length, rcv_data.buffer), 
 			{ 
-				free_rcvdata(&rcv_data);
-				goto fatal; 
+				fd_cnx_free_rcvdata(&rcv_data);
+				fatal = 1;
+				goto stop; 
 			} );
 		
 	} while (conn->cc_loop);
 	
+stop:
+	;
+	pthread_cleanup_pop(1);
+	
+	if (fatal) {
+		/* An unrecoverable error occurred, stop the daemon */
+		CHECK_FCT_DO(fd_core_shutdown(), );
+	}
 out:
 	TRACE_DEBUG(FULL, "Thread terminated");	
 	return NULL;
-	
-fatal:
-	/* An unrecoverable error occurred, stop the daemon */
-	CHECK_FCT_DO(fd_core_shutdown(), );
-	goto out;
 }
 
 #ifndef DISABLE_SCTP
@@ -924,6 +1028,14 @@ int fd_cnx_start_clear(struct cnxctx * conn, int loop)
 	
 	switch (conn->cc_proto) {
 		case IPPROTO_TCP:
+			/* Use the reactor if it is running and we receive more than one message */
+			if (loop) {
+				int ret = fd_cnx_rx_start(conn);
+				if (ret != ENOTSUP) {
+					CHECK_FCT( ret );
+					break;
+				}
+			}
 			/* Start the tcp_notls thread */
 			CHECK_POSIX( pthread_create( &conn->cc_rcvthr, NULL, rcvthr_notls_tcp, conn ) );
 			break;
@@ -1051,64 +1163,57 @@ end:
 	   messages. */
 int fd_tls_rcvthr_core(struct cnxctx * conn, gnutls_session_t session)
 {
+	struct fd_cnx_framer fr;
+	int ret = 0;
+	
+	fd_cnx_framer_init(&fr, 0);
+	pthread_cleanup_push(fd_cnx_framer_free, &fr); /* In case we are canceled, clean the partialy built buffer */
+	
 	/* No guarantee that GnuTLS preserves the message boundaries, so we re-build it as in TCP. */
 	do {
-		uint8_t header[4];
 		struct fd_cnx_rcvdata rcv_data;
 		struct fd_msg_pmdl *pmdl=NULL;
-		ssize_t ret = 0;
-		size_t	received = 0;
-
-		do {
-			ret = fd_tls_recv_handle_error(conn, session, &header[received], sizeof(header) - received);
-			if (ret <= 0) {
+		
+		/* Receive until a complete message is available. A record often contains several messages. */
+		while ((ret = fd_cnx_framer_next(conn, &fr, &rcv_data, &pmdl)) == EAGAIN) {
+			uint8_t * ptr;
+			size_t len;
+			ssize_t rcvd;
+			
+			CHECK_FCT_DO( ret = fd_cnx_framer_space(&fr, &ptr, &len), goto stop );
+			rcvd = fd_tls_recv_handle_error(conn, session, ptr, len);
+			if (rcvd <= 0) {
 				/* The connection is closed */
-				goto out;
+				ret = ENOTCONN;
+				goto stop;
 			}
-			received += ret;
-		} while (received < sizeof(header));
-
-		rcv_data.length = ((size_t)header[1] << 16) + ((size_t)header[2] << 8) + (size_t)header[3];
-
-		/* Check the received word is a valid beginning of a Diameter message */
-		if ((header[0] != DIAMETER_VERSION)	/* defined in <libfreeDiameter.h> */
-		   || (rcv_data.length > DIAMETER_MSG_SIZE_MAX)) { /* to avoid too big mallocs */
-			/* The message is suspect */
-			LOG_E( "Received suspect header [ver: %d, size: %zd] from '%s', assume disconnection", (int)header[0], rcv_data.length, conn->cc_remid);
-			fd_cnx_markerror(conn);
-			goto out;
+			fd_cnx_framer_fill(&fr, rcvd);
 		}
-
-		/* Ok, now we can really receive the data */
-		CHECK_MALLOC(  rcv_data.buffer = fd_cnx_alloc_msg_buffer( rcv_data.length, &pmdl ) );
-		memcpy(rcv_data.buffer, header, sizeof(header));
-
-		while (received < rcv_data.length) {
-			pthread_cleanup_push(free_rcvdata, &rcv_data); /* In case we are canceled, clean the partialy built buffer */
-			ret = fd_tls_recv_handle_error(conn, session, rcv_data.buffer + received, rcv_data.length - received);
-			pthread_cleanup_pop(0);
-
-			if (ret <= 0) {
-				free_rcvdata(&rcv_data);
-				goto out;
-			}
-			received += ret;
+		
+		if (ret == EBADMSG) {
+			fd_cnx_markerror(conn);
+			ret = ENOTCONN;
+			goto stop;
 		}
+		if (ret)
+			goto stop;
 		
 		fd_hook_call(HOOK_DATA_RECEIVED, NULL, NULL, &rcv_data, pmdl);
 		
 		/* We have received a complete message, pass it to the daemon */
 		CHECK_FCT_DO( ret = fd_event_send( fd_cnx_target_queue(conn), FDEVP_CNX_MSG_RECV, rcv_data.length, rcv_data.buffer), 
 			{ 
-				free_rcvdata(&rcv_data);
+				fd_cnx_free_rcvdata(&rcv_data);
 				CHECK_FCT_DO(fd_core_shutdown(), );
-				return ret; 
+				goto stop; 
 			} );
 		
 	} while (1);
 	
-out:
-	return ENOTCONN;
+stop:
+	;
+	pthread_cleanup_pop(1);
+	return ret;
 }
 
 /* Receiver thread (TLS & 1 stream SCTP or TCP)  */
@@ -1747,6 +1852,11 @@ int fd_cnx_handshake(struct cnxctx * conn, int mode, int algo, char * priority,
 	} else {
 		/* Start decrypting the data */
 		if (!dtls) {
+			int ret = fd_cnx_rx_start(conn);
+			if (ret != ENOTSUP) {
+				CHECK_FCT( ret );
+				return 0;
+			}
 			CHECK_POSIX( pthread_create( &conn->cc_rcvthr, NULL, rcvthr_tls_single, conn ) );
 		} else {
 			TODO("Signal the dtls_push function that multiple streams can be used from this point.");
@@ -1788,7 +1898,7 @@ int fd_cnx_receive(struct cnxctx * conn, struct timespec * timeout, unsigned cha
 	
 	TRACE_ENTRY("%p %p %p %p", conn, timeout, buf, len);
 	CHECK_PARAMS(conn && (conn->cc_socket > 0) && buf && len);
-	CHECK_PARAMS(conn->cc_rcvthr != (pthread_t)NULL);
+	CHECK_PARAMS((conn->cc_rcvthr != (pthread_t)NULL) || conn->cc_rx);
 	CHECK_PARAMS(conn->cc_alt == NULL);
 
 	/* Now, pull the first event */
@@ -1947,6 +2057,105 @@ int fd_cnx_send(struct cnxctx * conn, unsigned char * buf, size_t len)
 }
 
 
+/* Size of the TLS records built when several messages are sent at once (maximum plaintext size of a record) */
+#define TLS_COALESCE_SZ	16384
+
+/* Send several buffers with as few TLS records as possible */
+static int send_tls_coalesce(struct cnxctx * conn, const struct iovec * iov, int iovcnt)
+{
+	unsigned char rec[TLS_COALESCE_SZ];
+	size_t used = 0;
+	int i;
+	
+	for (i = 0; i < iovcnt; i++) {
+		unsigned char * data = iov[i].iov_base;
+		size_t left = iov[i].iov_len;
+		
+		/* Large buffers are sent directly, GnuTLS splits them in full records */
+		if ((used == 0) && (left >= TLS_COALESCE_SZ)) {
+			CHECK_FCT( send_simple(conn, data, left) );
+			continue;
+		}
+		
+		while (left) {
+			size_t cpy = TLS_COALESCE_SZ - used;
+			if (cpy > left)
+				cpy = left;
+			memcpy(rec + used, data, cpy);
+			used += cpy;
+			data += cpy;
+			left -= cpy;
+			if (used == TLS_COALESCE_SZ) {
+				CHECK_FCT( send_simple(conn, rec, used) );
+				used = 0;
+			}
+		}
+	}
+	
+	if (used) {
+		CHECK_FCT( send_simple(conn, rec, used) );
+	}
+	
+	return 0;
+}
+
+/* Send several buffers with a single writev, continuing after partial writes */
+static int send_clear_vec(struct cnxctx * conn, struct iovec * iov, int iovcnt)
+{
+	ssize_t ret;
+	
+	while (iovcnt) {
+		CHECK_SYS_DO( ret = fd_cnx_s_sendv(conn, iov, iovcnt), );
+		if (ret <= 0)
+			return ENOTCONN;
+		
+		/* Skip what was written */
+		while (iovcnt && ((size_t)ret >= iov->iov_len)) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (ret) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	
+	return 0;
+}
+
+/* Send several messages at once, in this order. The iov array is modified. Same assumptions as fd_cnx_send. */
+int fd_cnx_sendv(struct cnxctx * conn, struct iovec * iov, int iovcnt)
+{
+	int i;
+	
+	TRACE_ENTRY("%p %p %d", conn, iov, iovcnt);
+	
+	CHECK_PARAMS(conn && (conn->cc_socket > 0) && (! fd_cnx_teststate(conn, CC_STATUS_ERROR)) && iov && (iovcnt > 0));
+	
+	if (iovcnt == 1)
+		return fd_cnx_send(conn, iov[0].iov_base, iov[0].iov_len);
+	
+	TRACE_DEBUG(FULL, "Sending %d %smessages on connection %s", iovcnt, fd_cnx_teststate(conn, CC_STATUS_TLS) ? "TLS-protected ":"", conn->cc_id);
+	
+	/* On TCP the messages boundaries are not relevant, we can merge the writes */
+	if (conn->cc_proto == IPPROTO_TCP) {
+		if (fd_cnx_teststate(conn, CC_STATUS_TLS)) {
+			CHECK_FCT( send_tls_coalesce(conn, iov, iovcnt) );
+		} else {
+			CHECK_FCT( send_clear_vec(conn, iov, iovcnt) );
+		}
+		return 0;
+	}
+	
+	/* Otherwise, each message is sent separately (SCTP preserves the boundaries and the stream selection is per message) */
+	for (i = 0; i < iovcnt; i++) {
+		CHECK_FCT( fd_cnx_send(conn, iov[i].iov_base, iov[i].iov_len) );
+	}
+	
+	return 0;
+}
+
 /**************************************/
 /*     Destruction of connection      */
 /**************************************/
@@ -2003,6 +2212,12 @@ void fd_cnx_destroy(struct cnxctx * conn)
 
 			if (! fd_cnx_teststate(conn, CC_STATUS_ERROR ) ) {
 				/* In this case, just wait for thread rcvthr_tls_single to terminate */
+				if (conn->cc_rx) {
+					/* or for the reactor to receive the end of the session */
+					int i;
+					for (i = 0; (i < MAX_HOTL_BLOCKING_TIME / 10) && !fd_cnx_teststate(conn, CC_STATUS_ERROR); i++)
+						usleep(10000);
+				}
 				if (conn->cc_rcvthr != (pthread_t)NULL) {
 					CHECK_POSIX_DO(  pthread_join(conn->cc_rcvthr, NULL), /* continue */  );
 					conn->cc_rcvthr = (pthread_t)NULL;
@@ -2012,6 +2227,9 @@ void fd_cnx_destroy(struct cnxctx * conn)
 				CHECK_FCT_DO( fd_thr_term(&conn->cc_rcvthr), /* continue */ );
 			}
 			
+			/* The reactor must not use the TLS session anymore */
+			fd_cnx_rx_stop(conn);
+			
 			/* Free the resources of the TLS session */
 			if (conn->cc_tls_para.session) {
 				GNUTLS_TRACE( gnutls_deinit(conn->cc_tls_para.session) );
@@ -2024,6 +2242,7 @@ void fd_cnx_destroy(struct cnxctx * conn)
 	
 	/* Terminate the thread in case it is not done yet -- is there any such case left ?*/
 	CHECK_FCT_DO( fd_thr_term(&conn->cc_rcvthr), /* continue */ );
+	fd_cnx_rx_stop(conn);
 		
 	/* Shut the connection down */
 	if (conn->cc_socket > 0) {
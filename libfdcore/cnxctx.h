@@ -41,6 +41,28 @@
 /* Maximum time we allow a connection to be blocked because of head-of-the-line buffers. After this delay, connection is considered in error. */
 #define MAX_HOTL_BLOCKING_TIME	1000	/* ms */
 
+/* The maximum size of Diameter message we accept to receive (<= 2^24) to avoid too big mallocs in case of trashed headers */
+#ifndef DIAMETER_MSG_SIZE_MAX
+#define DIAMETER_MSG_SIZE_MAX	65535	/* in bytes */
+#endif /* DIAMETER_MSG_SIZE_MAX */
+#define DIAMETER_MSG_SIZE_MIN	20	/* the header alone */
+
+/* Size of the buffer where the data received on a stream is accumulated before the messages are split out */
+#define FRAMER_BUFSZ	16384
+
+/* Rebuild the Diameter messages from the data received on a stream (TCP, or TLS over TCP). Large chunks are read in buf, and
+ all the complete messages they contain are split out without another read. */
+struct fd_cnx_framer {
+	uint8_t *	buf;		/* FRAMER_BUFSZ bytes, allocated on first use */
+	size_t		start;		/* first byte of buf not consumed yet */
+	size_t		end;		/* end of the received data in buf */
+	int		exact;		/* never read beyond the current message (the connection may switch to TLS after it) */
+	int		direct;		/* the last space returned is in the message being rebuilt, not in buf */
+	size_t		received;	/* number of bytes of the current message received so far */
+	struct fd_cnx_rcvdata rcv_data;	/* the current message, the buffer is allocated once the header is complete */
+	struct fd_msg_pmdl *pmdl;
+};
+
 /* The connection context structure */
 struct cnxctx {
 	char		cc_id[60];	/* The name of this connection. the first 5 chars are reserved for flags display (cc_state). */
@@ -60,6 +82,12 @@ struct cnxctx {
 	pthread_t	cc_rcvthr;	/* thread for receiving messages on the connection */
 	int		cc_loop;	/* tell the thread if it loops or stops after the first message is received */
 	
+	/* If the messages are received by the reactor instead of cc_rcvthr (see reactor.c) */
+	int		cc_rx;		/* 1 + index of the I/O thread receiving on this connection, 0 if not in the reactor */
+	struct fd_list	cc_rx_chk;	/* link in the list of connections that the I/O thread checks without waiting for the socket */
+	int		cc_rx_paused;	/* the socket is not polled because the target queue is full */
+	struct fd_cnx_framer cc_rx_fr;	/* the data received and not delivered yet */
+	
 	struct fifo *	cc_incoming;	/* FIFO queue of events received on the connection, FDEVP_CNX_* */
 	struct fifo *	cc_alt;		/* alternate fifo to send FDEVP_CNX_* events to. */
 
@@ -99,6 +127,20 @@ struct fifo * fd_cnx_target_queue(struct cnxctx * conn);
 ssize_t fd_cnx_s_recv(struct cnxctx * conn, void *buffer, size_t length);
 void fd_cnx_s_setto(int sock);
 
+/* Buffers of the received messages */
+uint8_t * fd_cnx_alloc_msg_buffer(size_t expected_len, struct fd_msg_pmdl ** pmdl);
+void fd_cnx_free_rcvdata(void * arg);
+void fd_cnx_framer_init(struct fd_cnx_framer * fr, int exact);
+int  fd_cnx_framer_next(struct cnxctx * conn, struct fd_cnx_framer * fr, struct fd_cnx_rcvdata * rcv_data, struct fd_msg_pmdl ** pmdl);
+int  fd_cnx_framer_space(struct fd_cnx_framer * fr, uint8_t ** ptr, size_t * len);
+void fd_cnx_framer_fill(struct fd_cnx_framer * fr, size_t len);
+void fd_cnx_framer_free(void * arg);
+#define fd_cnx_framer_pending(_fr) ((_fr)->start < (_fr)->end)
+
+/* Reactor */
+int fd_cnx_rx_start(struct cnxctx * conn);
+void fd_cnx_rx_stop(struct cnxctx * conn);
+
 /* TLS */
 int fd_tls_rcvthr_core(struct cnxctx * conn, gnutls_session_t session);
 int fd_tls_prepare(gnutls_session_t * session, int mode, int dtls, char * priority, void * alt_creds);
@@ -103,6 +103,7 @@ static void core_shutdown(void)
 	CHECK_FCT_DO( fd_servers_stop(), /* Stop accepting new connections */ );
 	CHECK_FCT_DO( fd_rtdisp_cleanstop(), /* Stop dispatch thread(s) after a clean loop if possible */ );
 	CHECK_FCT_DO( fd_peer_fini(), /* Stop all connections */ );
+	CHECK_FCT_DO( fd_cnx_reactor_fini(), /* Stop the I/O threads */ );
 	CHECK_FCT_DO( fd_rtdisp_fini(), /* Stop routing threads and destroy routing queues */ );
 	
 	CHECK_FCT_DO( fd_ext_term(), /* Cleanup all extensions */ );
@@ -215,6 +216,7 @@ int fd_core_initialize(void)
 	/* Initialize some modules */
 	CHECK_FCT( fd_hooks_init()  );
 	CHECK_FCT( fd_queues_init() );
+	CHECK_FCT( fd_stats_init()  );
 	CHECK_FCT( fd_sess_start()  );
 	CHECK_FCT( fd_p_expi_init() );
 	
@@ -296,6 +298,9 @@ int fd_core_waitstartcomplete(void)
 /* Start the server & client threads */
 static int fd_core_start_int(void)
 {
+	/* Start the I/O threads, if any */
+	CHECK_FCT( fd_cnx_reactor_init() );
+	
 	/* Start server threads */ 
 	CHECK_FCT( fd_servers_start() );
 	
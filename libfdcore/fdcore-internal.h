@@ -125,9 +125,16 @@ int fd_rtdisp_fini(void);
 int fd_rtdisp_cleanup(void);
 
 /* Sentinel for the sent requests list */
+struct sentreq;
 struct sr_list {
-	struct fd_list 	srs; /* requests ordered by hop-by-hop id */
-	struct fd_list  exp; /* requests that have a timeout set, ordered by timeout */
+	struct fd_list 	srs; /* requests in the order they were stored */
+	struct sentreq **hash; /* requests indexed by hop-by-hop id, allocated with the first request */
+	uint32_t	hash_mask; /* number of lines in the hash table - 1 */
+	struct fd_list *wheel; /* requests that have a timeout set, in a timer wheel; allocated with the thread */
+	uint64_t	tick; /* next tick of the wheel to be processed */
+	uint64_t	wake; /* tick when the thread wakes up, 0 if it waits for a request with a timeout */
+	long		wheel_cnt; /* number of requests in the wheel */
+	struct fd_list  exp; /* requests that have timed out, waiting for their expirecb to be called */
 	long            cnt; /* number of requests in the srs list */
 	long		cnt_lost; /* number of requests that have not been answered in time. 
 				     It is decremented when an unexpected answer is received, so this may not be accurate. */
@@ -149,6 +156,10 @@ struct fd_peer { /* The "real" definition of the peer structure */
 	/* Origin of this peer object, for debug */
 	char		*p_dbgorig;
 	
+	/* Chaining in the hash index of fd_g_peers, by case-folded Diameter-Id */
+	struct fd_peer	*p_hnext;
+	uint32_t	 p_hash;
+	
 	/* State of the peer, and its lock */
 	enum peer_state	 p_state;
 	pthread_mutex_t  p_state_mtx;
@@ -175,10 +186,12 @@ struct fd_peer { /* The "real" definition of the peer structure */
 	struct fifo	*p_events;	/* The mutex of this FIFO list protects also the state and timer information */
 	pthread_t	 p_psm;
 	struct timespec	 p_psm_timer;
+	long long	 p_stat_in;	/* Number of messages received, updated by the p_psm thread */
 	
 	/* Outgoing message queue, and thread managing sending the messages */
 	struct fifo	*p_tosend;
 	pthread_t	 p_outthr;
+	long long	 p_stat_out;	/* Number of messages sent */
 	
 	/* The next hop-by-hop id value for the link, only read & modified by p_outthr */
 	uint32_t	 p_hbh;
@@ -278,6 +291,7 @@ struct cnx_incoming {
 int  fd_peer_fini();
 int  fd_peer_alloc(struct fd_peer ** ptr);
 int  fd_peer_free(struct fd_peer ** ptr);
+void fd_peer_unlink(struct fd_peer * peer);
 int fd_peer_handle_newCER( struct msg ** cer, struct cnxctx ** cnx );
 /* fd_peer_add declared in freeDiameter.h */
 int fd_peer_validate( struct fd_peer * peer );
@@ -343,6 +357,8 @@ struct cnxctx * fd_cnx_serv_accept(struct cnxctx * serv);
 struct cnxctx * fd_cnx_cli_connect_tcp(sSA * sa, socklen_t addrlen);
 struct cnxctx * fd_cnx_cli_connect_sctp(int no_ip6, uint16_t port, struct fd_list * list);
 int             fd_cnx_start_clear(struct cnxctx * conn, int loop);
+int             fd_cnx_reactor_init(void);
+int             fd_cnx_reactor_fini(void);
 void		fd_cnx_sethostname(struct cnxctx * conn, DiamId_t hn);
 int		fd_cnx_proto_info(struct cnxctx * conn, char * buf, size_t len);
 #define ALGO_HANDSHAKE_DEFAULT	0 /* TLS for TCP, DTLS for SCTP */
@@ -360,11 +376,18 @@ char *          fd_cnx_getremoteid(struct cnxctx * conn);
 int             fd_cnx_receive(struct cnxctx * conn, struct timespec * timeout, unsigned char **buf, size_t * len);
 int             fd_cnx_recv_setaltfifo(struct cnxctx * conn, struct fifo * alt_fifo); /* send FDEVP_CNX_MSG_RECV event to the fifo list */
 int             fd_cnx_send(struct cnxctx * conn, unsigned char * buf, size_t len);
+int             fd_cnx_sendv(struct cnxctx * conn, struct iovec * iov, int iovcnt);
 void            fd_cnx_destroy(struct cnxctx * conn);
 #ifdef GNUTLS_VERSION_300
 int             fd_tls_verify_credentials_2(gnutls_session_t session);
 #endif /* GNUTLS_VERSION_300 */
 
+/* Statistics */
+int  fd_stats_init(void);
+void fd_stat_inc(enum fd_stat_counter c);
+void fd_stat_histo_add(enum fd_stat_histo h, long long ns);
+void fd_stat_msg(struct fd_peer * peer, struct msg * msg, int out);
+
 /* Internal calls of the hook mechanism */
 void   fd_hook_call(enum fd_hook_type type, struct msg * msg, struct fd_peer * peer, void * other, struct fd_msg_pmdl * pmdl);
 void   fd_hook_associate(struct msg * msg, struct fd_msg_pmdl * pmdl);
@@ -107,11 +107,16 @@ struct peer_info fddpi;
 %token		NOTLS
 %token		SCTPSTREAMS
 %token		APPSERVTHREADS
+%token		ROUTINGINTHREADS
+%token		ROUTINGOUTTHREADS
+%token		IOTHREADS
 %token		LISTENON
 %token		THRPERSRV
 %token		TCTIMER
 %token		TWTIMER
 %token		NORELAY
+%token		ZEROCOPY
+%token		RELAYFASTPATH
 %token		LOADEXT
 %token		CONNPEER
 %token		CONNTO
@@ -139,7 +144,12 @@ conffile:		/* Empty is OK -- for simplicity here, we reject in daemon later */
 			| conffile listenon
 			| conffile thrpersrv
 			| conffile norelay
+			| conffile zerocopy
+			| conffile relayfastpath
 			| conffile appservthreads
+			| conffile routinginthreads
+			| conffile routingoutthreads
+			| conffile iothreads
 			| conffile noip
 			| conffile noip6
 			| conffile notcp
@@ -254,6 +264,18 @@ norelay:		NORELAY ';'
 			}
 			;
 
+zerocopy:		ZEROCOPY ';'
+			{
+				conf->cnf_flags.zero_copy = 1;
+			}
+			;
+
+relayfastpath:		RELAYFASTPATH ';'
+			{
+				conf->cnf_flags.fast_relay = 1;
+			}
+			;
+
 appservthreads:		APPSERVTHREADS '=' INTEGER ';'
 			{
 				CHECK_PARAMS_DO( ($3 > 0) && ($3 < 256),
@@ -262,6 +284,30 @@ appservthreads:		APPSERVTHREADS '=' INTEGER ';'
 			}
 			;
 
+routinginthreads:	ROUTINGINTHREADS '=' INTEGER ';'
+			{
+				CHECK_PARAMS_DO( ($3 > 0) && ($3 < 256),
+					{ yyerror (&yylloc, conf, "Invalid value"); YYERROR; } );
+				conf->cnf_rtinthr = (uint16_t)$3;
+			}
+			;
+
+routingoutthreads:	ROUTINGOUTTHREADS '=' INTEGER ';'
+			{
+				CHECK_PARAMS_DO( ($3 > 0) && ($3 < 256),
+					{ yyerror (&yylloc, conf, "Invalid value"); YYERROR; } );
+				conf->cnf_rtoutthr = (uint16_t)$3;
+			}
+			;
+
+iothreads:		IOTHREADS '=' INTEGER ';'
+			{
+				CHECK_PARAMS_DO( ($3 >= 0) && ($3 < 256),
+					{ yyerror (&yylloc, conf, "Invalid value"); YYERROR; } );
+				conf->cnf_iothr = (uint16_t)$3;
+			}
+			;
+
 noip:			NOIP ';'
 			{
 				if (got_peer_noipv6) { 
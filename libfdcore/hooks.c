@@ -55,26 +55,81 @@ struct pmd_list_item {
 
 /* Now a hook registered by an extension */
 struct fd_hook_hdl {
-	struct fd_list chain[HOOK_LAST+1];
+	uint32_t type_mask;
 	void (*fd_hook_cb)(enum fd_hook_type type, struct msg * msg, struct peer_hdr * peer, void * other, struct fd_hook_permsgdata *pmd, void * regdata);
 	void  *regdata;
 	struct fd_hook_data_hdl *data_hdl;
 };
 
-/* Array of those hooks */
-struct {
-	struct fd_list sentinel;
-	pthread_rwlock_t rwlock;
-} HS_array[HOOK_LAST+1];
+/* The hooks registered for a type, in registration order. This array is never modified once published: 
+ registering or unregistering a hook publishes a new copy, so that fd_hook_call does not take any lock. */
+struct hook_set {
+	int			count;
+	struct fd_hook_hdl *	hdl[];
+};
 
-/* Initialize the array of sentinels for the hooks */
-int fd_hooks_init(void)
+/* Array of those sets, NULL when no hook is registered for the type */
+static struct hook_set * HS_array[HOOK_LAST+1];
+
+/* Serialize the updates of HS_array */
+static pthread_mutex_t HS_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The sets (and hooks) replaced in HS_array are freed only after all fd_hook_call that may still use them have returned. 
+ The callers increment the counter selected by the parity of gen while they use a set. A caller may read gen, 
+ then be delayed before incrementing the counter, and then use a set published after gen was flipped again: 
+ so the writers wait for both counters in turn, as SRCU does. */
+static struct {
+	uint32_t	gen;
+	long		readers[2];
+} HS_grace[HOOK_LAST+1];
+
+/* Wait until no fd_hook_call uses a set of this type that was replaced before this call (HS_lock is held) */
+static void hooks_grace(int type)
 {
 	int i;
-	for (i=0; i <= HOOK_LAST; i++) {
-		fd_list_init(&HS_array[i].sentinel, NULL);
-		CHECK_POSIX( pthread_rwlock_init(&HS_array[i].rwlock, NULL) );
+	for (i = 0; i < 2; i++) {
+		uint32_t old = __atomic_fetch_add(&HS_grace[type].gen, 1, __ATOMIC_SEQ_CST) & 1;
+		while (__atomic_load_n(&HS_grace[type].readers[old], __ATOMIC_SEQ_CST) != 0)
+			usleep(100);
+	}
+}
+
+/* Stop using the set (also called if the thread is canceled inside a callback) */
+static void hooks_release(void * arg)
+{
+	__atomic_sub_fetch((long *)arg, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Publish a copy of the set for type, with the hook added or removed. The previous set is returned, to be freed after hooks_grace. */
+static int hooks_update(int type, struct fd_hook_hdl * add, struct fd_hook_hdl * del, struct hook_set ** old)
+{
+	struct hook_set * cur = HS_array[type], * new = NULL;
+	int i, n = 0, count = (cur ? cur->count : 0) + (add ? 1 : 0);
+	
+	if (count) {
+		CHECK_MALLOC( new = malloc(sizeof(struct hook_set) + count * sizeof(struct fd_hook_hdl *)) );
+		for (i = 0; cur && (i < cur->count); i++) {
+			if (cur->hdl[i] != del)
+				new->hdl[n++] = cur->hdl[i];
+		}
+		if (add)
+			new->hdl[n++] = add;
+		new->count = n;
+		if (n == 0) {
+			free(new);
+			new = NULL;
+		}
 	}
+	
+	__atomic_store_n(&HS_array[type], new, __ATOMIC_SEQ_CST);
+	*old = cur;
+	return 0;
+}
+
+/* Initialize the array of sets for the hooks */
+int fd_hooks_init(void)
+{
+	memset(HS_array, 0, sizeof(HS_array));
 	return 0;
 }
 
@@ -115,7 +170,8 @@ int fd_hook_register (  uint32_t type_mask,
 			struct fd_hook_hdl ** handler )
 {
 	struct fd_hook_hdl * newhdl = NULL;
-	int i;
+	struct hook_set * old[HOOK_LAST+1];
+	int i, ret = 0;
 	
 	TRACE_ENTRY("%x %p %p %p %p", type_mask, fd_hook_cb, regdata, data_hdl, handler);
 	
@@ -128,14 +184,24 @@ int fd_hook_register (  uint32_t type_mask,
 	newhdl->regdata = regdata;
 	newhdl->data_hdl = data_hdl;
 	
+	memset(old, 0, sizeof(old));
+	CHECK_POSIX( pthread_mutex_lock(&HS_lock) );
 	for (i=0; i <= HOOK_LAST; i++) {
-		fd_list_init(&newhdl->chain[i], newhdl);
 		if (type_mask & (1<<i)) {
-			CHECK_POSIX( pthread_rwlock_wrlock(&HS_array[i].rwlock) );
-			fd_list_insert_before( &HS_array[i].sentinel, &newhdl->chain[i]);
-			CHECK_POSIX( pthread_rwlock_unlock(&HS_array[i].rwlock) );
+			CHECK_FCT_DO( ret = hooks_update(i, newhdl, NULL, &old[i]), break );
+			newhdl->type_mask |= (1<<i);
+			hooks_grace(i);
 		}
 	}
+	CHECK_POSIX( pthread_mutex_unlock(&HS_lock) );
+	
+	for (i=0; i <= HOOK_LAST; i++)
+		free(old[i]);
+	
+	if (ret) {
+		CHECK_FCT_DO( fd_hook_unregister(newhdl), );
+		return ret;
+	}
 	
 	*handler = newhdl;
 	return 0;
@@ -144,17 +210,28 @@ int fd_hook_register (  uint32_t type_mask,
 /* free this hook callback */
 int fd_hook_unregister( struct fd_hook_hdl * handler )
 {
-	int i;
+	struct hook_set * old[HOOK_LAST+1];
+	int i, ret = 0;
 	TRACE_ENTRY("%p", handler);
 	CHECK_PARAMS( handler );
 	
+	memset(old, 0, sizeof(old));
+	CHECK_POSIX( pthread_mutex_lock(&HS_lock) );
 	for (i=0; i <= HOOK_LAST; i++) {
-		if ( ! FD_IS_LIST_EMPTY(&handler->chain[i])) {
-			CHECK_POSIX( pthread_rwlock_wrlock(&HS_array[i].rwlock) );
-			fd_list_unlink(&handler->chain[i]);
-			CHECK_POSIX( pthread_rwlock_unlock(&HS_array[i].rwlock) );
+		if (handler->type_mask & (1<<i)) {
+			CHECK_FCT_DO( ret = hooks_update(i, NULL, handler, &old[i]), continue );
+			handler->type_mask &= ~(1<<i);
+			/* After this, the handler is not used anymore by fd_hook_call for this type */
+			hooks_grace(i);
 		}
 	}
+	CHECK_POSIX( pthread_mutex_unlock(&HS_lock) );
+	
+	for (i=0; i <= HOOK_LAST; i++)
+		free(old[i]);
+	
+	if (ret)
+		return ret; /* the handler is still registered for some types, we cannot free it */
 	
 	free(handler);
 	
@@ -284,24 +361,64 @@ static pthread_mutex_t hook_default_mtx = PTHREAD_MUTEX_INITIALIZER;
 static char * hook_default_buf = NULL;
 static size_t hook_default_len = 0;
 
+/* The default hooks skip building the dumps that the logger would discard */
+#ifdef DEBUG
+#define HOOK_LOG_A_ENABLED	(fd_log_enabled(FD_LOG_ANNOYING) || fd_debug_one_function || fd_debug_one_file)
+#else /* DEBUG */
+#define HOOK_LOG_A_ENABLED	0	/* LOG_A is not defined in release */
+#endif /* DEBUG */
+
+/* Which default hooks output something at the current log level */
+static int hook_default_enabled(enum fd_hook_type type)
+{
+	switch (type) {
+		case HOOK_DATA_RECEIVED:
+		case HOOK_MESSAGE_LOCAL:
+		case HOOK_MESSAGE_SENDING:
+			return HOOK_LOG_A_ENABLED;
+		
+		case HOOK_MESSAGE_RECEIVED:
+		case HOOK_MESSAGE_SENT:
+		case HOOK_MESSAGE_FAILOVER:
+		case HOOK_MESSAGE_ROUTING_FORWARD:
+		case HOOK_MESSAGE_ROUTING_LOCAL:
+			return fd_log_enabled(FD_LOG_DEBUG);
+		
+		case HOOK_PEER_CONNECT_FAILED: /* the dump, if any, is logged with LOG_N */
+		case HOOK_PEER_CONNECT_SUCCESS:
+			return fd_log_enabled(FD_LOG_NOTICE);
+		
+		default:
+			return fd_log_enabled(FD_LOG_ERROR);
+	}
+}
+
 /* The function that does the work of calling the extension's callbacks and also managing the permessagedata structures */
 void   fd_hook_call(enum fd_hook_type type, struct msg * msg, struct fd_peer * peer, void * other, struct fd_msg_pmdl * pmdl)
 {
-	struct fd_list * li;
+	struct hook_set * set;
 	ASSERT(type <= HOOK_LAST);
-	int call_default = 0;
-	
-	/* lock the list of hooks for this type */
-	CHECK_POSIX_DO( pthread_rwlock_rdlock(&HS_array[type].rwlock), );
 	
-	pthread_cleanup_push( fd_cleanup_rwlock, &HS_array[type].rwlock );
+	/* All the parsing errors are reported through this hook */
+	if (type == HOOK_MESSAGE_PARSING_ERROR)
+		fd_stat_inc(FD_STAT_PARSE_ERR);
 	
-	if (FD_IS_LIST_EMPTY(&HS_array[type].sentinel)) {
-		call_default = 1;
-	} else {
+	/* Fast path: nothing registered for this type */
+	if (__atomic_load_n(&HS_array[type], __ATOMIC_RELAXED) != NULL) {
+		long * readers;
+		int i;
+		
+		/* Prevent the set from being freed while we use it */
+		readers = &HS_grace[type].readers[__atomic_load_n(&HS_grace[type].gen, __ATOMIC_SEQ_CST) & 1];
+		__atomic_add_fetch(readers, 1, __ATOMIC_SEQ_CST);
+		
+		pthread_cleanup_push( hooks_release, readers );
+		
+		set = __atomic_load_n(&HS_array[type], __ATOMIC_SEQ_CST);
+		
 		/* for each registered hook */
-		for (li = HS_array[type].sentinel.next; li != &HS_array[type].sentinel; li = li->next) {
-			struct fd_hook_hdl * h = (struct fd_hook_hdl *)li->o;
+		for (i = 0; set && (i < set->count); i++) {
+			struct fd_hook_hdl * h = set->hdl[i];
 			struct fd_hook_permsgdata * pmd = NULL;
 
 			/* do we need to handle pmd ? */
@@ -312,14 +429,15 @@ void   fd_hook_call(enum fd_hook_type type, struct msg * msg, struct fd_peer * p
 			/* Now, call this callback */
 			(*h->fd_hook_cb)(type, msg, &peer->p_hdr, other, pmd, h->regdata);
 		}
+		
+		pthread_cleanup_pop(1);
+		
+		if (set)
+			return;
+		/* The last hook was unregistered meanwhile, use the default behavior */
 	}
 	
-	pthread_cleanup_pop(0);
-	
-	/* done */
-	CHECK_POSIX_DO( pthread_rwlock_unlock(&HS_array[type].rwlock), );
-	
-	if (call_default) {
+	if (hook_default_enabled(type)) {
 		CHECK_POSIX_DO( pthread_mutex_lock(&hook_default_mtx), );
 		
 		pthread_cleanup_push( fd_cleanup_mutex, &hook_default_mtx );
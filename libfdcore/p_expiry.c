@@ -68,7 +68,7 @@ static void * gc_th_fct(void * arg)
 			
 			/* Ok, the peer was expired, let's remove it */
 			li = li->prev; /* to avoid breaking the loop */
-			fd_list_unlink(&peer->p_hdr.chain);
+			fd_peer_unlink(peer);
 			fd_list_insert_before(&purge, &peer->p_hdr.chain);
 		}
 
@@ -35,19 +35,61 @@
 
 #include "fdcore-internal.h"
 
-/* Alloc a new hbh for requests, bufferize the message and send on the connection, save in sentreq if provided */
-static int do_send(struct msg ** msg, struct cnxctx * cnx, uint32_t * hbh, struct fd_peer * peer)
+/* The buffers kept by an out thread to bufferize the messages are released when they grow beyond this size */
+#define OUT_SNDBUF_MAX	65536
+
+/* The out thread sends at most this number of queued messages with a single write on the connection... */
+#define OUT_BATCH_MAX	32
+
+/* ... and stops adding messages to the batch when it reaches this size */
+#define OUT_BATCH_BYTES	65536
+
+/* The messages bufferized by an out thread and not sent yet */
+struct out_batch {
+	int		cnt;			/* number of messages in the batch */
+	struct msg *	ans[OUT_BATCH_MAX];	/* the answers, freed once sent. The requests are already saved in sentreq. */
+	uint8_t *	buf[OUT_BATCH_MAX];	/* the buffers are kept from one batch to the next */
+	size_t		bufsz[OUT_BATCH_MAX];
+	struct iovec	iov[OUT_BATCH_MAX];
+};
+
+/* Release a buffer */
+static void free_sndbuf(void * arg)
+{
+	free(*(uint8_t **)arg);
+}
+
+/* Release the buffers and pending answers of the out thread */
+static void free_batch(void * arg)
+{
+	struct out_batch * batch = arg;
+	int i;
+	
+	for (i = 0; i < OUT_BATCH_MAX; i++) {
+		if ((i < batch->cnt) && batch->ans[i]) {
+			CHECK_FCT_DO( fd_msg_free(batch->ans[i]), /* continue */ );
+		}
+		free(batch->buf[i]);
+	}
+}
+
+/* Report and free a message that could not be sent */
+static void drop_msg(struct msg * msg, int err)
+{
+	char buf[256];
+	snprintf(buf, sizeof(buf), "Error while sending this message: %s", strerror(err));
+	fd_hook_call(HOOK_MESSAGE_DROPPED, msg, NULL, buf, fd_msg_pmdl_get(msg));
+	fd_msg_free(msg);
+}
+
+/* Alloc a new hbh for requests, bufferize the message in *buf, and save it in sentreq if it is a request (*msg is then NULL) */
+static int prepare_send(struct msg ** msg, uint32_t * hbh, struct fd_peer * peer, uint8_t ** buf, size_t * bufsz, size_t * len)
 {
 	struct msg_hdr * hdr;
 	int msg_is_a_req;
-	uint8_t * buf;
-	size_t sz;
-	int ret;
 	uint32_t bkp_hbh = 0;
 	struct msg *cpy_for_logs_only;
 	
-	TRACE_ENTRY("%p %p %p %p", msg, cnx, hbh, peer);
-	
 	/* Retrieve the message header */
 	CHECK_FCT( fd_msg_hdr(*msg, &hdr) );
 	
@@ -61,19 +103,35 @@ static int do_send(struct msg ** msg, struct cnxctx * cnx, uint32_t * hbh, struc
 	}
 	
 	/* Create the message buffer */
-	CHECK_FCT(fd_msg_bufferize( *msg, &buf, &sz ));
-	pthread_cleanup_push( free, buf );
+	CHECK_FCT(fd_msg_bufferize_to( *msg, buf, bufsz, len ));
 	
 	cpy_for_logs_only = *msg;
+	fd_stat_msg(peer, *msg, 1);
 	
 	/* Save a request before sending so that there is no race condition with the answer */
 	if (msg_is_a_req) {
-		CHECK_FCT_DO( ret = fd_p_sr_store(&peer->p_sr, msg, &hdr->msg_hbhid, bkp_hbh), goto out );
+		CHECK_FCT( fd_p_sr_store(&peer->p_sr, msg, &hdr->msg_hbhid, bkp_hbh) );
 	}
 	
 	/* Log the message */
 	fd_hook_call(HOOK_MESSAGE_SENT, cpy_for_logs_only, peer, NULL, fd_msg_pmdl_get(cpy_for_logs_only));
 	
+	return 0;
+}
+
+/* Alloc a new hbh for requests, bufferize the message and send on the connection, save in sentreq if provided */
+static int do_send(struct msg ** msg, struct cnxctx * cnx, uint32_t * hbh, struct fd_peer * peer)
+{
+	uint8_t * buf = NULL;
+	size_t bufsz = 0, sz;
+	int ret;
+	
+	TRACE_ENTRY("%p %p %p %p", msg, cnx, hbh, peer);
+	
+	pthread_cleanup_push( free_sndbuf, &buf );
+	
+	CHECK_FCT_DO( ret = prepare_send(msg, hbh, peer, &buf, &bufsz, &sz), goto out );
+	
 	pthread_cleanup_push((void *)fd_msg_free, *msg /* might be NULL, no problem */);
 	
 	/* Send the message */
@@ -97,12 +155,35 @@ out:
 	return 0;
 }
 
+/* Send all the messages of the batch at once, then free the answers (or drop them on error) */
+static int send_batch(struct out_batch * batch, struct cnxctx * cnx)
+{
+	int ret, i;
+	
+	CHECK_FCT_DO( ret = fd_cnx_sendv(cnx, batch->iov, batch->cnt), );
+	
+	for (i = 0; i < batch->cnt; i++) {
+		if (batch->ans[i]) {
+			if (ret) {
+				drop_msg(batch->ans[i], ret);
+			} else {
+				CHECK_FCT_DO( fd_msg_free(batch->ans[i]), /* continue */ );
+			}
+			batch->ans[i] = NULL;
+		}
+	}
+	batch->cnt = 0;
+	
+	return ret;
+}
+
 /* The code of the "out" thread */
 static void * out_thr(void * arg)
 {
 	struct fd_peer * peer = arg;
 	int stop = 0;
 	struct msg * msg;
+	struct out_batch batch;
 	ASSERT( CHECK_PEER(peer) );
 	
 	/* Set the thread name */
@@ -112,25 +193,52 @@ static void * out_thr(void * arg)
 		fd_log_threadname ( buf );
 	}
 	
+	memset(&batch, 0, sizeof(batch));
+	pthread_cleanup_push( free_batch, &batch );
+	
 	/* Loop until cancelation */
 	while (!stop) {
-		int ret;
+		size_t total = 0;
+		int i;
 		
 		/* Retrieve next message to send */
 		CHECK_FCT_DO( fd_fifo_get(peer->p_tosend, &msg), goto error );
 		
-		/* Send the message, log any error */
-		CHECK_FCT_DO( ret = do_send(&msg, peer->p_cnxctx, &peer->p_hbh, peer),
-			{
-				if (msg) {
-					char buf[256];
-					snprintf(buf, sizeof(buf), "Error while sending this message: %s", strerror(ret));
-					fd_hook_call(HOOK_MESSAGE_DROPPED, msg, NULL, buf, fd_msg_pmdl_get(msg));
-					fd_msg_free(msg);
-				}
-				stop = 1;
-			} );
+		/* Bufferize it, and the messages already queued behind it, so that they are all sent with one write */
+		do {
+			int ret;
+			size_t sz;
 			
+			i = batch.cnt;
+			CHECK_FCT_DO( ret = prepare_send(&msg, &peer->p_hbh, peer, &batch.buf[i], &batch.bufsz[i], &sz),
+				{
+					if (msg)
+						drop_msg(msg, ret);
+					stop = 1;
+					goto send;
+				} );
+			
+			batch.ans[i] = msg;
+			batch.iov[i].iov_base = batch.buf[i];
+			batch.iov[i].iov_len  = sz;
+			batch.cnt++;
+			total += sz;
+			
+		} while ((batch.cnt < OUT_BATCH_MAX) && (total < OUT_BATCH_BYTES) && (fd_fifo_tryget(peer->p_tosend, &msg) == 0));
+send:
+		/* Send the messages, in order. The ones bufferized before an error are still sent. */
+		if (batch.cnt) {
+			CHECK_FCT_DO( send_batch(&batch, peer->p_cnxctx), stop = 1 );
+		}
+		
+		/* Do not keep large buffers after occasional large messages */
+		for (i = 0; i < OUT_BATCH_MAX; i++) {
+			if (batch.bufsz[i] > OUT_SNDBUF_MAX) {
+				free(batch.buf[i]);
+				batch.buf[i] = NULL;
+				batch.bufsz[i] = 0;
+			}
+		}
 	}
 	
 	/* If we're here it means there was an error on the socket. We need to continue to purge the fifo & until we are canceled */
@@ -155,6 +263,7 @@ static void * out_thr(void * arg)
 error:
 	/* It is not really a connection error, but the effect is the same, we are not able to send anymore message */
 	CHECK_FCT_DO( fd_event_send(peer->p_events, FDEVP_CNX_ERROR, 0, NULL), /* What do we do if it fails? */ );
+	pthread_cleanup_pop(1);
 	return NULL;
 }
 
@@ -196,11 +305,8 @@ int fd_out_send(struct msg ** msg, struct cnxctx * cnx, struct fd_peer * peer, i
 		/* Do send the message */
 		CHECK_FCT_DO( ret = do_send(msg, cnx, hbh, peer),
 			{
-				if (msg) {
-					char buf[256];
-					snprintf(buf, sizeof(buf), "Error while sending this message: %s", strerror(ret));
-					fd_hook_call(HOOK_MESSAGE_DROPPED, *msg, NULL, buf, fd_msg_pmdl_get(*msg));
-					fd_msg_free(*msg);
+				if (*msg) {
+					drop_msg(*msg, ret);
 					*msg = NULL;
 				}
 			} );
@@ -529,6 +529,7 @@ psm_loop:
 		}
 		
 		/* Log incoming message */
+		fd_stat_msg(peer, msg, 0);
 		fd_hook_call(HOOK_MESSAGE_RECEIVED, msg, peer, NULL, fd_msg_pmdl_get(msg));
 		
 		if (cur_state == STATE_OPEN_NEW) {
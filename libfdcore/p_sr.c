@@ -35,46 +35,86 @@
 
 #include "fdcore-internal.h"
 
+/* Initial number of lines in the hash table of sent requests (power of 2). It doubles each time there are more requests than lines. */
+#ifndef SR_HASH_INITIAL
+#define SR_HASH_INITIAL	64
+#endif /* SR_HASH_INITIAL */
+
+/* Resolution of the requests timeouts (in ms) and number of slots of the timer wheel (power of 2). 
+ Timeouts farther than SR_WHEEL_TICK * SR_WHEEL_SLOTS ms are checked each time the wheel turns until they expire. */
+#ifndef SR_WHEEL_TICK
+#define SR_WHEEL_TICK	10
+#endif /* SR_WHEEL_TICK */
+#ifndef SR_WHEEL_SLOTS
+#define SR_WHEEL_SLOTS	1024
+#endif /* SR_WHEEL_SLOTS */
+
+#define SR_TICK_NS	((uint64_t)SR_WHEEL_TICK * 1000000)
+#define SR_SLOT( _srlist, _tick ) (&(_srlist)->wheel[(_tick) & (SR_WHEEL_SLOTS - 1)])
+
 /* Structure to store a sent request */
 struct sentreq {
 	struct fd_list	chain; 	/* the "o" field points directly to the (new) hop-by-hop of the request (uint32_t *)  */
+	struct sentreq	*hnext;	/* next request in the same line of the hash table */
 	struct msg	*req;	/* A request that was sent and not yet answered. */
 	uint32_t	prevhbh;/* The value to set back in the hbh header when the message is retrieved */
-	struct fd_list  expire; /* the list of expiring requests */
+	struct fd_list  expire; /* the slot of the timer wheel, or the list of expired requests */
 	struct timespec timeout; /* Cache the expire date of the request so that the timeout thread does not need to get it each time. */
 	struct timespec added_on; /* the time the request was added */
 };
 
-/* Find an element in the hbh list, or the following one */
-static struct fd_list * find_or_next(struct fd_list * srlist, uint32_t hbh, int * match)
+/* Find an element in the hash table. Returns the location pointing to it, or to NULL at the end of the line if it is not found */
+static struct sentreq ** sr_hash_find(struct sr_list * srlist, uint32_t hbh)
 {
-	struct fd_list * li;
-	*match = 0;
-	for (li = srlist->next; li != srlist; li = li->next) {
-		uint32_t * nexthbh = li->o;
-		if (*nexthbh < hbh)
-			continue;
-		if (*nexthbh == hbh)
-			*match = 1;
-		break;
-	}
-	return li;
+	struct sentreq ** link = &srlist->hash[hbh & srlist->hash_mask];
+	while (*link && (*((uint32_t *)(*link)->chain.o) != hbh))
+		link = &(*link)->hnext;
+	return link;
 }
 
-/* Similar but start from the end, since we add requests in growing hbh order usually */
-static struct fd_list * find_or_prev(struct fd_list * srlist, uint32_t hbh, int * match)
+/* Double the number of lines of the hash table. On allocation failure, the lines simply become longer */
+static void sr_hash_grow(struct sr_list * srlist)
 {
-	struct fd_list * li;
-	*match = 0;
-	for (li = srlist->prev; li != srlist; li = li->prev) {
-		uint32_t * prevhbh = li->o;
-		if (*prevhbh > hbh)
-			continue;
-		if (*prevhbh == hbh)
-			*match = 1;
-		break;
+	uint32_t mask = (srlist->hash_mask << 1) | 1;
+	struct sentreq ** hash;
+	uint32_t i;
+	
+	CHECK_MALLOC_DO( hash = calloc(mask + 1, sizeof(struct sentreq *)), return );
+	for (i = 0; i <= srlist->hash_mask; i++) {
+		while (srlist->hash[i]) {
+			struct sentreq * sr = srlist->hash[i];
+			struct sentreq ** line = &hash[*((uint32_t *)sr->chain.o) & mask];
+			srlist->hash[i] = sr->hnext;
+			sr->hnext = *line;
+			*line = sr;
+		}
 	}
-	return li;
+	free(srlist->hash);
+	srlist->hash = hash;
+	srlist->hash_mask = mask;
+}
+
+/* Get the first tick of the wheel that is not before a date */
+static uint64_t sr_tick(const struct timespec * ts)
+{
+	return ((uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec + SR_TICK_NS - 1) / SR_TICK_NS;
+}
+
+/* Unlink a request from all the lists and restore its hop-by-hop id. The srlist->mtx must be held */
+static void sr_unlink(struct sr_list * srlist, struct sentreq * sr)
+{
+	uint32_t * hbhloc = sr->chain.o;
+	struct sentreq ** link = sr_hash_find(srlist, *hbhloc);
+	
+	ASSERT(*link == sr);
+	*link = sr->hnext;
+	*hbhloc = sr->prevhbh;
+	fd_list_unlink(&sr->chain);
+	srlist->cnt--;
+	
+	if (!FD_IS_LIST_EMPTY(&sr->expire) && (sr->expire.head != &srlist->exp))
+		srlist->wheel_cnt--;
+	fd_list_unlink(&sr->expire);
 }
 
 static void srl_dump(const char * text, struct fd_list * srlist)
@@ -125,45 +165,66 @@ static void * sr_expiry_th(void * arg) {
 loop:	
 		no_error = 0;
 
-		/* Check if there are expiring requests available */
+		/* Check if there are expired requests available */
 		if (FD_IS_LIST_EMPTY(&srlist->exp)) {
-			/* Just wait for a change or cancelation */
-			CHECK_POSIX_DO( pthread_cond_wait( &srlist->cnd, &srlist->mtx ), goto unlock );
-			/* Restart the loop on wakeup */
-			goto loop;
-		}
-		
-		/* Get the pointer to the request that expires first */
-		first = (struct sentreq *)(srlist->exp.next->o);
-		
-		/* Get the current time */
-		CHECK_SYS_DO(  clock_gettime(CLOCK_REALTIME, &now),  goto unlock  );
-
-		/* If first request is not expired, we just wait until it happens */
-		if ( TS_IS_INFERIOR( &now, &first->timeout ) ) {
+			uint64_t now_tick, t;
 			
-			CHECK_POSIX_DO2(  pthread_cond_timedwait( &srlist->cnd, &srlist->mtx, &first->timeout ),  
-					ETIMEDOUT, /* ETIMEDOUT is a normal return value, continue */,
-					/* on other error, */ goto unlock );
-	
-			/* on wakeup, loop */
-			goto loop;
+			if (srlist->wheel_cnt == 0) {
+				/* Just wait for a change or cancelation */
+				srlist->wake = 0;
+				CHECK_POSIX_DO( pthread_cond_wait( &srlist->cnd, &srlist->mtx ), goto unlock );
+				/* Restart the loop on wakeup */
+				goto loop;
+			}
+			
+			/* Get the current time */
+			CHECK_SYS_DO(  clock_gettime(CLOCK_REALTIME, &now),  goto unlock  );
+			now_tick = ((uint64_t)now.tv_sec * 1000000000 + now.tv_nsec) / SR_TICK_NS;
+			
+			/* Move all the requests expired up to now from the slots of the elapsed ticks (each slot once at most) to the exp list */
+			for (t = srlist->tick; (t <= now_tick) && (t < srlist->tick + SR_WHEEL_SLOTS); t++) {
+				struct fd_list * li, * next;
+				for (li = SR_SLOT(srlist, t)->next; li != SR_SLOT(srlist, t); li = next) {
+					next = li->next;
+					if (sr_tick(&((struct sentreq *)(li->o))->timeout) > now_tick)
+						continue; /* it expires in a later turn of the wheel */
+					fd_list_unlink(li);
+					fd_list_insert_before(&srlist->exp, li);
+					srlist->wheel_cnt--;
+				}
+			}
+			if (srlist->tick <= now_tick)
+				srlist->tick = now_tick + 1;
+			
+			/* If no request is expired, we just wait until the next slot that contains requests */
+			if (FD_IS_LIST_EMPTY(&srlist->exp)) {
+				for (t = srlist->tick; t < srlist->tick + SR_WHEEL_SLOTS - 1; t++) {
+					if (!FD_IS_LIST_EMPTY(SR_SLOT(srlist, t)))
+						break;
+				}
+				srlist->wake = t;
+				now.tv_sec  = t * SR_TICK_NS / 1000000000;
+				now.tv_nsec = t * SR_TICK_NS % 1000000000;
+				
+				CHECK_POSIX_DO2(  pthread_cond_timedwait( &srlist->cnd, &srlist->mtx, &now ),  
+						ETIMEDOUT, /* ETIMEDOUT is a normal return value, continue */,
+						/* on other error, */ goto unlock );
+		
+				/* on wakeup, loop */
+				goto loop;
+			}
 		}
 		
 		/* Now, the first request in the list is expired; remove it and call the expirecb for it */
+		first = (struct sentreq *)(srlist->exp.next->o);
 		request = first->req;
 		sentto = first->chain.head->o;
 		
 		TRACE_DEBUG(FULL, "Request %x was not answered by %s within the timer delay", *((uint32_t *)first->chain.o), sentto->p_hdr.info.pi_diamid);
 		
-		/* Restore the hbhid */
-		*((uint32_t *)first->chain.o) = first->prevhbh; 
-		
-		/* Free the sentreq information */
-		fd_list_unlink(&first->chain);
-		srlist->cnt--;
+		/* Restore the hbhid and free the sentreq information */
+		sr_unlink(srlist, first);
 		srlist->cnt_lost++; /* We are not waiting for this answer anymore, but the remote peer may still be processing it. */
-		fd_list_unlink(&first->expire);
 		free(first);
 		
 		no_error = 1;
@@ -201,8 +262,7 @@ unlock:
 int fd_p_sr_store(struct sr_list * srlist, struct msg **req, uint32_t *hbhloc, uint32_t hbh_restore)
 {
 	struct sentreq * sr;
-	struct fd_list * prev;
-	int match;
+	struct sentreq ** link;
 	struct timespec * ts;
 	
 	TRACE_ENTRY("%p %p %p %x", srlist, req, hbhloc, hbh_restore);
@@ -216,10 +276,28 @@ int fd_p_sr_store(struct sr_list * srlist, struct msg **req, uint32_t *hbhloc, u
 	fd_list_init(&sr->expire, sr);
 	CHECK_SYS( clock_gettime(CLOCK_REALTIME, &sr->added_on) );
 	
-	/* Search the place in the list */
+	/* In case of request with a timeout, it will also be stored in the timer wheel */
+	ts = fd_msg_anscb_gettimeout( sr->req );
+	if (ts)
+		memcpy(&sr->timeout, ts, sizeof(struct timespec));
+	
 	CHECK_POSIX( pthread_mutex_lock(&srlist->mtx) );
-	prev = find_or_prev(&srlist->srs, *hbhloc, &match);
-	if (match) {
+	
+	/* Allocate the hash table and the wheel when they are first needed */
+	if (!srlist->hash) {
+		CHECK_MALLOC_DO( srlist->hash = calloc(SR_HASH_INITIAL, sizeof(struct sentreq *)), goto error );
+		srlist->hash_mask = SR_HASH_INITIAL - 1;
+	}
+	if (ts && !srlist->wheel) {
+		int i;
+		CHECK_MALLOC_DO( srlist->wheel = malloc(SR_WHEEL_SLOTS * sizeof(struct fd_list)), goto error );
+		for (i = 0; i < SR_WHEEL_SLOTS; i++)
+			fd_list_init(&srlist->wheel[i], NULL);
+	}
+	
+	/* Search the place in the hash table */
+	link = sr_hash_find(srlist, *hbhloc);
+	if (*link) {
 		TRACE_DEBUG(INFO, "A request with the same hop-by-hop Id (0x%x) was already sent: error", *hbhloc);
 		free(sr);
 		srl_dump("Current list of SR: ", &srlist->srs);
@@ -227,33 +305,35 @@ int fd_p_sr_store(struct sr_list * srlist, struct msg **req, uint32_t *hbhloc, u
 		return EINVAL;
 	}
 	
-	/* Save in the list */
+	/* Save in the hash table and the list */
 	*req = NULL;
-	fd_list_insert_after(prev, &sr->chain);
+	*link = sr;
+	fd_list_insert_before(&srlist->srs, &sr->chain);
 	srlist->cnt++;
+	if (srlist->cnt > srlist->hash_mask + 1)
+		sr_hash_grow(srlist);
 	
-	/* In case of request with a timeout, also store in the timeout list */
-	ts = fd_msg_anscb_gettimeout( sr->req );
+	/* In case of request with a timeout, also store in the timer wheel */
 	if (ts) {
-		struct fd_list * li;
+		uint64_t t = sr_tick(ts);
 		
-		memcpy(&sr->timeout, ts, sizeof(struct timespec));
+		/* Restart the wheel from the current time if it was empty */
+		if (srlist->wheel_cnt == 0)
+			srlist->tick = ((uint64_t)sr->added_on.tv_sec * 1000000000 + sr->added_on.tv_nsec) / SR_TICK_NS;
 		
-		/* browse srlist->exp from the end */
-		for (li = srlist->exp.prev; li != &srlist->exp; li = li->prev) {
-			struct sentreq * s = (struct sentreq *)(li->o);
-			if (TS_IS_INFERIOR(&s->timeout, ts))
-				break;
-		}
+		/* if already expired, it will be processed with the next tick */
+		if (t < srlist->tick)
+			t = srlist->tick;
 		
-		fd_list_insert_after(li, &sr->expire);
+		fd_list_insert_before(SR_SLOT(srlist, t), &sr->expire);
+		srlist->wheel_cnt++;
 	
 		/* if the thread does not exist yet, create it */
 		if (srlist->thr == (pthread_t)NULL) {
 			CHECK_POSIX_DO( pthread_create(&srlist->thr, NULL, sr_expiry_th, srlist), /* continue anyway */);
 		} else {
-			/* or, if added in first position, signal the condvar to update the sleep time of the thread */
-			if (li == &srlist->exp) {
+			/* or, if it sleeps past this tick, signal the condvar to update the sleep time of the thread */
+			if ((srlist->wake == 0) || (t < srlist->wake)) {
 				CHECK_POSIX_DO( pthread_cond_signal(&srlist->cnd), /* continue anyway */);
 			}
 		}
@@ -261,21 +341,26 @@ int fd_p_sr_store(struct sr_list * srlist, struct msg **req, uint32_t *hbhloc, u
 	
 	CHECK_POSIX( pthread_mutex_unlock(&srlist->mtx) );
 	return 0;
+	
+error:
+	free(sr);
+	CHECK_POSIX_DO( pthread_mutex_unlock(&srlist->mtx), /* ignore */ );
+	return ENOMEM;
 }
 
 /* Fetch a request by hbh */
 int fd_p_sr_fetch(struct sr_list * srlist, uint32_t hbh, struct msg **req)
 {
 	struct sentreq * sr;
-	int match;
+	struct timespec added_on;
 	
 	TRACE_ENTRY("%p %x %p", srlist, hbh, req);
 	CHECK_PARAMS(srlist && req);
 	
-	/* Search the request in the list */
+	/* Search the request in the hash table */
 	CHECK_POSIX( pthread_mutex_lock(&srlist->mtx) );
-	sr = (struct sentreq *)find_or_next(&srlist->srs, hbh, &match);
-	if (!match) {
+	sr = srlist->hash ? *sr_hash_find(srlist, hbh) : NULL;
+	if (!sr) {
 		TRACE_DEBUG(INFO, "There is no saved request with this hop-by-hop id (%x)", hbh);
 		srl_dump("Current list of SR: ", &srlist->srs);
 		*req = NULL;
@@ -283,17 +368,21 @@ int fd_p_sr_fetch(struct sr_list * srlist, uint32_t hbh, struct msg **req)
 			srlist->cnt_lost--; /* This is probably an answer for a request we already timedout. */
 		} /* else, probably a bug in the remote peer */
 	} else {
-		/* Restore hop-by-hop id */
-		*((uint32_t *)sr->chain.o) = sr->prevhbh;
-		/* Unlink */
-		fd_list_unlink(&sr->chain);
-		srlist->cnt--;
-		fd_list_unlink(&sr->expire);
+		/* Restore hop-by-hop id and unlink */
+		sr_unlink(srlist, sr);
 		*req = sr->req;
+		memcpy(&added_on, &sr->added_on, sizeof(struct timespec));
 		free(sr);
 	}
 	CHECK_POSIX( pthread_mutex_unlock(&srlist->mtx) );
 	
+	/* Time to get the answer */
+	if (*req) {
+		struct timespec now;
+		CHECK_SYS_DO( clock_gettime(CLOCK_REALTIME, &now), return 0 );
+		fd_stat_histo_add(FD_STAT_H_ANSWER, (long long)(now.tv_sec - added_on.tv_sec) * 1000000000 + (now.tv_nsec - added_on.tv_nsec));
+	}
+	
 	/* do not stop the expire thread here, it might cause creating/destroying it very often otherwise */
 
 	/* Done */
@@ -306,9 +395,9 @@ void fd_p_sr_failover(struct sr_list * srlist)
 	CHECK_POSIX_DO( pthread_mutex_lock(&srlist->mtx), /* continue anyway */ );
 	while (!FD_IS_LIST_EMPTY(&srlist->srs)) {
 		struct sentreq * sr = (struct sentreq *)(srlist->srs.next);
-		fd_list_unlink(&sr->chain);
-		srlist->cnt--;
-		fd_list_unlink(&sr->expire);
+		
+		/* Unlink, and restore the original hop-by-hop id of the request */
+		sr_unlink(srlist, sr);
 		if (fd_msg_is_routable(sr->req)) {
 			struct msg_hdr * hdr = NULL;
 			int ret;
@@ -318,9 +407,6 @@ void fd_p_sr_failover(struct sr_list * srlist)
 			if (hdr)
 				hdr->msg_flags |= CMD_FLAG_RETRANSMIT;
 			
-			/* Restore the original hop-by-hop id of the request */
-			*((uint32_t *)sr->chain.o) = sr->prevhbh;
-			
 			fd_hook_call(HOOK_MESSAGE_FAILOVER, sr->req, (struct fd_peer *)srlist->srs.o, NULL, fd_msg_pmdl_get(sr->req));
 			
 			/* Requeue for sending to another peer */
@@ -338,8 +424,9 @@ void fd_p_sr_failover(struct sr_list * srlist)
 		}
 		free(sr);
 	}
-	/* The list of expiring requests must be empty now */
+	/* The list and wheel of expiring requests must be empty now */
 	ASSERT( FD_IS_LIST_EMPTY(&srlist->exp) );
+	ASSERT( srlist->wheel_cnt == 0 );
 	ASSERT( srlist->cnt == 0 ); /* debug the counter management if needed */
 	
 	CHECK_POSIX_DO( pthread_mutex_unlock(&srlist->mtx), /* continue anyway */ );
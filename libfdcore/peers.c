@@ -39,6 +39,13 @@
 struct fd_list   fd_g_peers = FD_LIST_INITIALIZER(fd_g_peers);
 pthread_rwlock_t fd_g_peers_rw = PTHREAD_RWLOCK_INITIALIZER;
 
+/* Hash index of fd_g_peers by Diameter-Id. The hash is computed on the case-folded value, so that the same line 
+ serves both the exact and case-insensitive searches. Protected by fd_g_peers_rw, as the list. */
+#define PEERS_HASH_INITIAL	64	/* initial number of lines, pow of 2. It doubles when there are more peers than lines */
+static struct fd_peer ** peers_hash = NULL;
+static uint32_t		 peers_hash_mask = 0;
+static uint32_t		 peers_hash_cnt = 0;
+
 /* List of active peers */
 struct fd_list   fd_g_activ_peers = FD_LIST_INITIALIZER(fd_g_activ_peers);	/* peers linked by their p_actives oredered by p_diamid */
 pthread_rwlock_t fd_g_activ_peers_rw = PTHREAD_RWLOCK_INITIALIZER;
@@ -48,6 +55,100 @@ static struct fd_list validators = FD_LIST_INITIALIZER(validators);	/* list item
 static pthread_rwlock_t validators_rw = PTHREAD_RWLOCK_INITIALIZER;
 
 
+/* Hash of a Diameter-Id, ignoring the case of ASCII letters as fd_os_almostcasesrch does (FNV-1a) */
+static uint32_t peers_hash_id(DiamId_t diamid, size_t diamidlen)
+{
+	uint32_t hash = 2166136261U;
+	size_t i;
+	
+	for (i = 0; i < diamidlen; i++) {
+		uint8_t c = (uint8_t)diamid[i];
+		if ((c >= 'A') && (c <= 'Z'))
+			c += 'a' - 'A';
+		hash = (hash ^ c) * 16777619U;
+	}
+	return hash;
+}
+
+/* Search a peer in the hash index. fd_g_peers_rw must be locked. */
+static struct fd_peer * peers_hash_search(DiamId_t diamid, size_t diamidlen, int igncase)
+{
+	struct fd_peer * p;
+	uint32_t hash;
+	
+	if (!peers_hash)
+		return NULL;
+	
+	hash = peers_hash_id(diamid, diamidlen);
+	for (p = peers_hash[hash & peers_hash_mask]; p; p = p->p_hnext) {
+		if (p->p_hash != hash)
+			continue;
+		if (igncase) {
+			if (!fd_os_almostcasesrch( diamid, diamidlen, p->p_hdr.info.pi_diamid, p->p_hdr.info.pi_diamidlen, NULL ))
+				break;
+		} else {
+			if (!fd_os_cmp( diamid, diamidlen, p->p_hdr.info.pi_diamid, p->p_hdr.info.pi_diamidlen ))
+				break;
+		}
+	}
+	return p;
+}
+
+/* Add a peer in the hash index, when it is inserted in fd_g_peers. fd_g_peers_rw must be write-locked. */
+static int peers_hash_link(struct fd_peer * peer)
+{
+	struct fd_peer ** line;
+	
+	if (!peers_hash) {
+		CHECK_MALLOC( peers_hash = calloc(PEERS_HASH_INITIAL, sizeof(struct fd_peer *)) );
+		peers_hash_mask = PEERS_HASH_INITIAL - 1;
+	}
+	
+	/* Double the number of lines if needed; on allocation failure, we just keep the longer lines */
+	if (peers_hash_cnt > peers_hash_mask) {
+		uint32_t mask = (peers_hash_mask << 1) | 1, i;
+		struct fd_peer ** hash;
+		CHECK_MALLOC_DO( hash = calloc(mask + 1, sizeof(struct fd_peer *)), goto link );
+		for (i = 0; i <= peers_hash_mask; i++) {
+			while (peers_hash[i]) {
+				struct fd_peer * p = peers_hash[i];
+				peers_hash[i] = p->p_hnext;
+				p->p_hnext = hash[p->p_hash & mask];
+				hash[p->p_hash & mask] = p;
+			}
+		}
+		free(peers_hash);
+		peers_hash = hash;
+		peers_hash_mask = mask;
+	}
+link:
+	peer->p_hash = peers_hash_id(peer->p_hdr.info.pi_diamid, peer->p_hdr.info.pi_diamidlen);
+	line = &peers_hash[peer->p_hash & peers_hash_mask];
+	peer->p_hnext = *line;
+	*line = peer;
+	peers_hash_cnt++;
+	return 0;
+}
+
+/* Remove a peer from fd_g_peers and its hash index. fd_g_peers_rw must be write-locked. */
+void fd_peer_unlink(struct fd_peer * peer)
+{
+	struct fd_peer ** line;
+	
+	fd_list_unlink(&peer->p_hdr.chain);
+	
+	if (!peers_hash)
+		return;
+	for (line = &peers_hash[peer->p_hash & peers_hash_mask]; *line; line = &(*line)->p_hnext) {
+		if (*line == peer) {
+			*line = peer->p_hnext;
+			peer->p_hnext = NULL;
+			peers_hash_cnt--;
+			break;
+		}
+	}
+}
+
 /* Alloc / reinit a peer structure. if *ptr is not NULL, it must already point to a valid struct fd_peer. */
 int fd_peer_alloc(struct fd_peer ** ptr)
 {
@@ -164,8 +265,11 @@ int fd_peer_add ( struct peer_info * info, const char * orig_dbg, void (*cb)(str
 	/* We can insert the new peer object */
 	if (! ret)
 		do {
+			/* Add in the hash index */
+			CHECK_FCT_DO( ret = peers_hash_link( p ), break );
+			
 			/* Update expiry list */
-			CHECK_FCT_DO( ret = fd_p_expi_update( p ), break );
+			CHECK_FCT_DO( ret = fd_p_expi_update( p ), { fd_peer_unlink(p); break; } );
 
 			/* Insert the new element in the list */
 			fd_list_insert_after( li_inf, &p->p_hdr.chain );
@@ -183,37 +287,14 @@ int fd_peer_add ( struct peer_info * info, const char * orig_dbg, void (*cb)(str
 /* Search for a peer */
 int fd_peer_getbyid( DiamId_t diamid, size_t diamidlen, int igncase, struct peer_hdr ** peer )
 {
-	struct fd_list * li;
+	struct fd_peer * p;
 	TRACE_ENTRY("%p %zd %d %p", diamid, diamidlen, igncase, peer);
 	CHECK_PARAMS( diamid && diamidlen && peer );
 	
-	*peer = NULL;
-	
-	/* Search in the list */
+	/* Search in the hash index */
 	CHECK_POSIX( pthread_rwlock_rdlock(&fd_g_peers_rw) );
-	if (igncase) {
-		for (li = fd_g_peers.next; li != &fd_g_peers; li = li->next) {
-			struct fd_peer * next = (struct fd_peer *)li;
-			int cmp, cont;
-			cmp = fd_os_almostcasesrch( diamid, diamidlen, next->p_hdr.info.pi_diamid, next->p_hdr.info.pi_diamidlen, &cont );
-			if (cmp == 0) {
-				*peer = &next->p_hdr;
-				break;
-			}
-			if (!cont)
-				break;
-		}
-	} else {
-		for (li = fd_g_peers.next; li != &fd_g_peers; li = li->next) {
-			struct fd_peer * next = (struct fd_peer *)li;
-			int cmp = fd_os_cmp( diamid, diamidlen, next->p_hdr.info.pi_diamid, next->p_hdr.info.pi_diamidlen );
-			if (cmp > 0)
-				continue;
-			if (cmp == 0)
-				*peer = &next->p_hdr;
-			break;
-		}
-	}
+	p = peers_hash_search(diamid, diamidlen, igncase);
+	*peer = p ? &p->p_hdr : NULL;
 	CHECK_POSIX( pthread_rwlock_unlock(&fd_g_peers_rw) );
 	
 	return 0;
@@ -350,6 +431,8 @@ int fd_peer_free(struct fd_peer ** ptr)
 	CHECK_POSIX_DO( pthread_mutex_destroy(&p->p_state_mtx), /* continue */);
 	CHECK_POSIX_DO( pthread_mutex_destroy(&p->p_sr.mtx), /* continue */);
 	CHECK_POSIX_DO( pthread_cond_destroy(&p->p_sr.cnd), /* continue */);
+	free(p->p_sr.hash);
+	free(p->p_sr.wheel);
 	
 	/* If the callback is still around... */
 	if (p->p_cb)
@@ -382,7 +465,7 @@ int fd_peer_fini()
 			CHECK_FCT_DO( fd_psm_terminate(peer, "REBOOTING"), /* continue */ );
 		} else {
 			li = li->prev; /* to avoid breaking the loop */
-			fd_list_unlink(&peer->p_hdr.chain);
+			fd_peer_unlink(peer);
 			fd_list_insert_before(&purge, &peer->p_hdr.chain);
 		}
 	}
@@ -408,7 +491,7 @@ int fd_peer_fini()
 			struct fd_peer * peer = (struct fd_peer *)li->o;
 			if (fd_peer_getstate(peer) == STATE_ZOMBIE) {
 				li = li->prev; /* to avoid breaking the loop */
-				fd_list_unlink(&peer->p_hdr.chain);
+				fd_peer_unlink(peer);
 				fd_list_insert_before(&purge, &peer->p_hdr.chain);
 			}
 		}
@@ -423,7 +506,7 @@ int fd_peer_fini()
 		while (!FD_IS_LIST_EMPTY(&fd_g_peers)) {
 			struct fd_peer * peer = (struct fd_peer *)(fd_g_peers.next->o);
 			fd_psm_abord(peer);
-			fd_list_unlink(&peer->p_hdr.chain);
+			fd_peer_unlink(peer);
 			fd_list_insert_before(&purge, &peer->p_hdr.chain);
 		}
 		CHECK_FCT_DO( pthread_rwlock_unlock(&fd_g_peers_rw), /* continue */ );
@@ -436,6 +519,13 @@ int fd_peer_fini()
 		fd_peer_free(&peer);
 	}
 	
+	/* The index is empty as well */
+	CHECK_FCT_DO( pthread_rwlock_wrlock(&fd_g_peers_rw), /* continue */ );
+	ASSERT( peers_hash_cnt == 0 );
+	free(peers_hash);
+	peers_hash = NULL;
+	CHECK_FCT_DO( pthread_rwlock_unlock(&fd_g_peers_rw), /* continue */ );
+	
 	/* Now empty the validators list */
 	CHECK_FCT_DO( pthread_rwlock_wrlock(&validators_rw), /* continue */ );
 	while (!FD_IS_LIST_EMPTY( &validators )) {
@@ -558,23 +648,22 @@ int fd_peer_handle_newCER( struct msg ** cer, struct cnxctx ** cnx )
 	 */
 	CHECK_POSIX( pthread_rwlock_wrlock(&fd_g_peers_rw) );
 	
-	li_inf = &fd_g_peers;
-	for (li = fd_g_peers.next; li != &fd_g_peers; li = li->next) {
-		int cmp, cont;
-		peer = (struct fd_peer *)li;
-		cmp = fd_os_almostcasesrch( avp_hdr->avp_value->os.data, avp_hdr->avp_value->os.len, peer->p_hdr.info.pi_diamid, peer->p_hdr.info.pi_diamidlen, &cont );
-		if (cmp > 0) {
-			li_inf = li;
-		}
-		if (cmp == 0) {
-			found = 1;
-			break;
-		}
-		if (!cont)
-			break;
-	}
+	peer = peers_hash_search((DiamId_t)avp_hdr->avp_value->os.data, avp_hdr->avp_value->os.len, 1);
+	found = (peer != NULL);
 	
 	if (!found) {
+		/* Find the position of the new peer in the list */
+		li_inf = &fd_g_peers;
+		for (li = fd_g_peers.next; li != &fd_g_peers; li = li->next) {
+			int cmp, cont;
+			cmp = fd_os_almostcasesrch( avp_hdr->avp_value->os.data, avp_hdr->avp_value->os.len, ((struct fd_peer *)li)->p_hdr.info.pi_diamid, ((struct fd_peer *)li)->p_hdr.info.pi_diamidlen, &cont );
+			if (cmp > 0) {
+				li_inf = li;
+			}
+			if (!cont)
+				break;
+		}
+		
 		/* Create a new peer entry for this new remote peer */
 		peer = NULL;
 		CHECK_FCT_DO( ret = fd_peer_alloc(&peer), goto out );
@@ -598,7 +687,8 @@ int fd_peer_handle_newCER( struct msg ** cer, struct cnxctx ** cnx )
 		CHECK_FCT_DO( ret = fd_p_expi_update( peer ), goto out );
 #endif /* DISABLE_PEER_EXPIRY */
 		
-		/* Insert the new peer in the list (the PSM will take care of setting the expiry after validation) */
+		/* Insert the new peer in the list and index (the PSM will take care of setting the expiry after validation) */
+		CHECK_FCT_DO( ret = peers_hash_link( peer ), goto out );
 		fd_list_insert_after( li_inf, &peer->p_hdr.chain );
 		
 		/* Start the PSM, which will receive the event below */
@@ -0,0 +1,497 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2013, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* This file contains the reactor: a pool of I/O threads receiving the messages of TCP connections (with or without TLS),
+ instead of one receiver thread per connection. It is used when IOThreads is set in the configuration, otherwise the
+ receiver threads of cnxctx.c are used. */
+
+#include "fdcore-internal.h"
+#include "cnxctx.h"
+
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/* Max number of messages received on a connection before serving the other ones */
+#define RX_BATCH		16
+
+/* How often the connections paused because their target queue was full are checked, in ms */
+#define RX_CHECK_PERIOD		100
+
+/* Each I/O thread has its own epoll instance, so that a connection is always served by the same thread */
+struct io_thr {
+	pthread_t	thr;
+	int		epfd;		/* epoll instance for the connections assigned to this thread */
+	int		evfd;		/* eventfd to wake up the thread */
+	
+	pthread_mutex_t	lock;		/* protects the fields below and the cc_rx_* fields of the connections */
+	pthread_cond_t	cond;		/* signaled after each loop of the thread */
+	struct fd_list	chk;		/* connections to check without waiting for the socket (paused, or data buffered by GnuTLS) */
+	unsigned long	loops;		/* number of loops completed: once it changed, the thread does not use a removed connection anymore */
+	int		nconn;		/* number of connections assigned to this thread */
+	int		running;
+};
+
+static struct io_thr * io_thrs = NULL;
+static int io_nthr = 0;
+static int io_stop = 0;
+
+/* Post an event without blocking: the I/O thread must not wait for one of the recipients, it serves the other connections */
+static int rx_event_send(struct fifo * queue, int code, size_t datasz, void * data)
+{
+	struct fd_event * ev;
+	CHECK_MALLOC( ev = malloc(sizeof(struct fd_event)) );
+	ev->code = code;
+	ev->size = datasz;
+	ev->data = data;
+	CHECK_FCT_DO( fd_fifo_post_noblock(queue, (void *)&ev), { free(ev); return __ret__; } );
+	return 0;
+}
+
+/* Same as fd_cnx_markerror, with a non-blocking post */
+static void rx_markerror(struct cnxctx * conn)
+{
+	TRACE_DEBUG(FULL, "Error flag set for socket %d (%s, %s)", conn->cc_socket, conn->cc_id, conn->cc_remid);
+	
+	fd_cnx_addstate(conn, CC_STATUS_ERROR);
+	
+	if (!fd_cnx_teststate(conn, CC_STATUS_CLOSING | CC_STATUS_SIGNALED ))  {
+		CHECK_FCT_DO( rx_event_send( fd_cnx_target_queue(conn), FDEVP_CNX_ERROR, 0, NULL), 
+			{ CHECK_FCT_DO(fd_core_shutdown(), ); return; } );
+		fd_cnx_addstate(conn, CC_STATUS_SIGNALED);
+	}
+}
+
+/* The recipient of the messages does not keep up: stop reading the socket for a while, so that TCP slows the remote peer down */
+static int rx_queue_full(struct cnxctx * conn)
+{
+	int cur = 0, limit = 0;
+	CHECK_FCT_DO( fd_fifo_getstats(fd_cnx_target_queue(conn), &cur, &limit, NULL, NULL, NULL, NULL, NULL), return 0 );
+	return (limit > 0) && (cur >= limit);
+}
+
+/* The GnuTLS pull function once the connection is in the reactor */
+static ssize_t rx_pull(gnutls_transport_ptr_t ptr, void * buffer, size_t length)
+{
+	struct cnxctx * conn = (struct cnxctx *)ptr;
+	ssize_t ret = recv(conn->cc_socket, buffer, length, MSG_DONTWAIT);
+	if (ret < 0)
+		gnutls_transport_set_errno(conn->cc_tls_para.session, errno);
+	return ret;
+}
+
+/* Read some data from the connection. Returns the number of bytes, 0 if nothing is available now, -1 if the connection is closed or in error. */
+static ssize_t rx_read(struct cnxctx * conn, void * buffer, size_t length)
+{
+	ssize_t ret;
+	
+	if (!fd_cnx_teststate(conn, CC_STATUS_TLS)) {
+		ret = recv(conn->cc_socket, buffer, length, MSG_DONTWAIT);
+		if ((ret < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+			return 0;
+		if (ret < 0) {
+			CHECK_SYS_DO(ret, /* continue, this is only used to log the error here */);
+		}
+		return ret ?: -1;
+	}
+	
+again:
+	ret = gnutls_record_recv(conn->cc_tls_para.session, buffer, length);
+	if (ret > 0)
+		return ret;
+	switch (ret) {
+		case GNUTLS_E_AGAIN:
+		case GNUTLS_E_INTERRUPTED:
+			return 0;
+		
+		case 0:
+			TRACE_DEBUG(FULL, "Got 0 size while reading the socket, probably connection closed...");
+			CHECK_GNUTLS_DO( gnutls_bye(conn->cc_tls_para.session, GNUTLS_SHUT_WR),  );
+			return -1;
+			
+		case GNUTLS_E_UNEXPECTED_PACKET_LENGTH:
+			TRACE_DEBUG(FULL, "Got 0 size while reading the socket, probably connection closed...");
+			return -1;
+		
+		default:
+			if (gnutls_error_is_fatal (ret) == 0) {
+				LOG_N("Ignoring non-fatal GNU TLS error: %s", gnutls_strerror (ret));
+				goto again;
+			}
+			LOG_E("Fatal GNUTLS error: %s", gnutls_strerror (ret));
+	}
+	return -1;
+}
+
+/* Receive the next message. Returns 1 if a message was received, 0 if no more data is available now, -1 on error. */
+static int rx_msg(struct cnxctx * conn)
+{
+	struct fd_cnx_rcvdata rcv_data;
+	struct fd_msg_pmdl *pmdl = NULL;
+	int ret;
+	
+	while ((ret = fd_cnx_framer_next(conn, &conn->cc_rx_fr, &rcv_data, &pmdl)) == EAGAIN) {
+		uint8_t * ptr;
+		size_t len;
+		ssize_t rcvd;
+		
+		CHECK_FCT_DO( fd_cnx_framer_space(&conn->cc_rx_fr, &ptr, &len), return -1 );
+		rcvd = rx_read(conn, ptr, len);
+		if (rcvd <= 0)
+			return rcvd;
+		fd_cnx_framer_fill(&conn->cc_rx_fr, rcvd);
+	}
+	if (ret)
+		return -1;
+	
+	fd_hook_call(HOOK_DATA_RECEIVED, NULL, NULL, &rcv_data, pmdl);
+	
+	/* We have received a complete message, pass it to the daemon */
+	CHECK_FCT_DO( rx_event_send( fd_cnx_target_queue(conn), FDEVP_CNX_MSG_RECV, rcv_data.length, rcv_data.buffer), 
+		{ 
+			fd_cnx_free_rcvdata(&rcv_data);
+			CHECK_FCT_DO(fd_core_shutdown(), );
+			return -1;
+		} );
+	return 1;
+}
+
+/* Add a connection to the list of the thread to check, if it was not removed meanwhile */
+static void rx_tocheck(struct io_thr * t, struct cnxctx * conn, int paused)
+{
+	CHECK_POSIX_DO( pthread_mutex_lock(&t->lock), );
+	if (conn->cc_rx && FD_IS_LIST_EMPTY(&conn->cc_rx_chk)) {
+		conn->cc_rx_paused = paused;
+		fd_list_insert_before(&t->chk, &conn->cc_rx_chk);
+	}
+	CHECK_POSIX_DO( pthread_mutex_unlock(&t->lock), );
+}
+
+/* Receive the data available on a connection */
+static void rx_conn(struct io_thr * t, struct cnxctx * conn)
+{
+	int n, ret;
+	
+	if (fd_cnx_teststate(conn, CC_STATUS_ERROR))
+		return;
+	
+	for (n = 0; n < RX_BATCH; n++) {
+		if (rx_queue_full(conn)) {
+			/* Stop polling the socket until the recipient has caught up */
+			struct epoll_event ev;
+			memset(&ev, 0, sizeof(ev));
+			ev.data.ptr = conn;
+			CHECK_SYS_DO( epoll_ctl(t->epfd, EPOLL_CTL_MOD, conn->cc_socket, &ev), );
+			rx_tocheck(t, conn, 1);
+			return;
+		}
+		
+		ret = rx_msg(conn);
+		if (ret < 0) {
+			/* Stop polling this socket, the recipient of the event will cleanup */
+			CHECK_SYS_DO( epoll_ctl(t->epfd, EPOLL_CTL_DEL, conn->cc_socket, NULL), );
+			fd_cnx_framer_free(&conn->cc_rx_fr);
+			rx_markerror(conn);
+			return;
+		}
+		if (ret == 0)
+			return;
+	}
+	
+	/* Other messages may be already received in the framer or deciphered by GnuTLS, the socket would not signal them */
+	if (fd_cnx_framer_pending(&conn->cc_rx_fr)
+	    || (fd_cnx_teststate(conn, CC_STATUS_TLS) && gnutls_record_check_pending(conn->cc_tls_para.session)))
+		rx_tocheck(t, conn, 0);
+}
+
+/* The I/O thread */
+static void * io_thr_loop(void * arg)
+{
+	struct io_thr * t = arg;
+	struct epoll_event evs[64];
+	int timeout = -1;
+	
+	/* Set the thread name */
+	{
+		char buf[48];
+		snprintf(buf, sizeof(buf), "I/O reactor %d", (int)(t - io_thrs));
+		fd_log_threadname ( buf );
+	}
+	
+	while (!__atomic_load_n(&io_stop, __ATOMIC_RELAXED)) {
+		struct fd_list todo, *li;
+		int n, i;
+		
+		n = epoll_wait(t->epfd, evs, sizeof(evs) / sizeof(evs[0]), timeout);
+		if ((n < 0) && (errno != EINTR)) {
+			CHECK_SYS_DO( n, );
+			break;
+		}
+		
+		for (i = 0; i < n; i++) {
+			if (evs[i].data.ptr == NULL) {
+				/* We were woken up */
+				uint64_t val;
+				(void) read(t->evfd, &val, sizeof(val));
+				continue;
+			}
+			rx_conn(t, evs[i].data.ptr);
+		}
+		
+		/* Now the connections in the list to check */
+		fd_list_init(&todo, NULL);
+		CHECK_POSIX_DO( pthread_mutex_lock(&t->lock), break );
+		fd_list_move_end(&todo, &t->chk);
+		CHECK_POSIX_DO( pthread_mutex_unlock(&t->lock), break );
+		
+		while (1) {
+			struct cnxctx * conn;
+			int paused;
+			
+			CHECK_POSIX_DO( pthread_mutex_lock(&t->lock), break );
+			if (FD_IS_LIST_EMPTY(&todo)) {
+				CHECK_POSIX_DO( pthread_mutex_unlock(&t->lock), );
+				break;
+			}
+			conn = todo.next->o;
+			fd_list_unlink(&conn->cc_rx_chk);
+			paused = conn->cc_rx_paused;
+			CHECK_POSIX_DO( pthread_mutex_unlock(&t->lock), break );
+			
+			if (paused) {
+				struct epoll_event ev;
+				if (rx_queue_full(conn)) {
+					rx_tocheck(t, conn, 1);
+					continue;
+				}
+				memset(&ev, 0, sizeof(ev));
+				ev.events = EPOLLIN;
+				ev.data.ptr = conn;
+				CHECK_SYS_DO( epoll_ctl(t->epfd, EPOLL_CTL_MOD, conn->cc_socket, &ev), );
+			}
+			rx_conn(t, conn);
+		}
+		
+		/* Signal the end of this loop, and compute how long we can wait next time */
+		CHECK_POSIX_DO( pthread_mutex_lock(&t->lock), break );
+		t->loops++;
+		timeout = -1;
+		for (li = t->chk.next; li != &t->chk; li = li->next) {
+			if (!((struct cnxctx *)li->o)->cc_rx_paused) {
+				timeout = 0;
+				break;
+			}
+			timeout = RX_CHECK_PERIOD;
+		}
+		CHECK_POSIX_DO( pthread_cond_broadcast(&t->cond), );
+		CHECK_POSIX_DO( pthread_mutex_unlock(&t->lock), break );
+	}
+	
+	CHECK_POSIX_DO( pthread_mutex_lock(&t->lock), );
+	t->running = 0;
+	CHECK_POSIX_DO( pthread_cond_broadcast(&t->cond), );
+	CHECK_POSIX_DO( pthread_mutex_unlock(&t->lock), );
+	TRACE_DEBUG(FULL, "Thread terminated");
+	return NULL;
+}
+
+static void io_wakeup(struct io_thr * t)
+{
+	uint64_t one = 1;
+	(void) write(t->evfd, &one, sizeof(one));
+}
+
+/* Start the I/O threads */
+int fd_cnx_reactor_init(void)
+{
+	int i;
+	
+	if (!fd_g_config->cnf_iothr)
+		return 0;
+	
+	CHECK_MALLOC( io_thrs = calloc(fd_g_config->cnf_iothr, sizeof(struct io_thr)) );
+	io_stop = 0;
+	
+	for (i = 0; i < fd_g_config->cnf_iothr; i++) {
+		struct io_thr * t = &io_thrs[i];
+		struct epoll_event ev;
+		
+		CHECK_SYS( t->epfd = epoll_create1(EPOLL_CLOEXEC) );
+		CHECK_SYS( t->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) );
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		CHECK_SYS( epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->evfd, &ev) );
+		CHECK_POSIX( pthread_mutex_init(&t->lock, NULL) );
+		CHECK_POSIX( pthread_cond_init(&t->cond, NULL) );
+		fd_list_init(&t->chk, NULL);
+		t->running = 1;
+		CHECK_POSIX( pthread_create(&t->thr, NULL, io_thr_loop, t) );
+		io_nthr = i + 1;
+	}
+	
+	return 0;
+}
+
+/* Stop the I/O threads, all the connections must have been destroyed already */
+int fd_cnx_reactor_fini(void)
+{
+	int i;
+	
+	if (!io_thrs)
+		return 0;
+	
+	__atomic_store_n(&io_stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < io_nthr; i++) {
+		struct io_thr * t = &io_thrs[i];
+		io_wakeup(t);
+		CHECK_POSIX_DO( pthread_join(t->thr, NULL), );
+		ASSERT(t->nconn == 0);
+		close(t->evfd);
+		close(t->epfd);
+		CHECK_POSIX_DO( pthread_cond_destroy(&t->cond), );
+		CHECK_POSIX_DO( pthread_mutex_destroy(&t->lock), );
+	}
+	free(io_thrs);
+	io_thrs = NULL;
+	io_nthr = 0;
+	
+	return 0;
+}
+
+/* Have the reactor receive the messages of this connection. Returns ENOTSUP if the reactor is not used. */
+int fd_cnx_rx_start(struct cnxctx * conn)
+{
+	struct io_thr * t = NULL;
+	struct epoll_event ev;
+	int i;
+	
+	TRACE_ENTRY("%p", conn);
+	
+	if (!io_nthr || (conn->cc_proto != IPPROTO_TCP))
+		return ENOTSUP;
+	
+	/* Use the least loaded thread */
+	for (i = 0; i < io_nthr; i++) {
+		if (!t || (__atomic_load_n(&io_thrs[i].nconn, __ATOMIC_RELAXED) < __atomic_load_n(&t->nconn, __ATOMIC_RELAXED)))
+			t = &io_thrs[i];
+	}
+	
+	if (fd_cnx_teststate(conn, CC_STATUS_TLS)) {
+		/* From now on, GnuTLS reads without blocking */
+		GNUTLS_TRACE( gnutls_transport_set_pull_function(conn->cc_tls_para.session, rx_pull) );
+	}
+	
+	fd_cnx_framer_init(&conn->cc_rx_fr, 0);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = conn;
+	
+	CHECK_POSIX( pthread_mutex_lock(&t->lock) );
+	conn->cc_rx = (t - io_thrs) + 1;
+	t->nconn++;
+	CHECK_SYS_DO( epoll_ctl(t->epfd, EPOLL_CTL_ADD, conn->cc_socket, &ev), 
+		{
+			conn->cc_rx = 0;
+			t->nconn--;
+			CHECK_POSIX_DO( pthread_mutex_unlock(&t->lock), );
+			return __ret__;
+		} );
+	/* Some data may be buffered already, check the connection right away */
+	conn->cc_rx_paused = 0;
+	fd_list_insert_before(&t->chk, &conn->cc_rx_chk);
+	CHECK_POSIX( pthread_mutex_unlock(&t->lock) );
+	
+	io_wakeup(t);
+	return 0;
+}
+
+/* Remove the connection from the reactor. When this returns, the I/O thread does not use the connection anymore. */
+void fd_cnx_rx_stop(struct cnxctx * conn)
+{
+	struct io_thr * t;
+	unsigned long loops;
+	
+	TRACE_ENTRY("%p", conn);
+	
+	if (!conn->cc_rx)
+		return;
+	
+	t = &io_thrs[conn->cc_rx - 1];
+	
+	CHECK_POSIX_DO( pthread_mutex_lock(&t->lock), return );
+	conn->cc_rx = 0;
+	t->nconn--;
+	fd_list_unlink(&conn->cc_rx_chk);
+	(void) epoll_ctl(t->epfd, EPOLL_CTL_DEL, conn->cc_socket, NULL); /* it may have been removed already after an error */
+	
+	/* Wait for the current loop of the thread to complete, it may still be using this connection */
+	loops = t->loops;
+	io_wakeup(t);
+	while (t->running && (t->loops == loops)) {
+		CHECK_POSIX_DO( pthread_cond_wait(&t->cond, &t->lock), break );
+	}
+	CHECK_POSIX_DO( pthread_mutex_unlock(&t->lock), );
+	
+	/* Free the partially received data */
+	fd_cnx_framer_free(&conn->cc_rx_fr);
+}
+
+#else /* HAVE_EPOLL */
+
+int fd_cnx_reactor_init(void)
+{
+	if (fd_g_config->cnf_iothr) {
+		LOG_N("IOThreads is not supported on this system, using one receiver thread per connection.");
+	}
+	return 0;
+}
+
+int fd_cnx_reactor_fini(void)
+{
+	return 0;
+}
+
+int fd_cnx_rx_start(struct cnxctx * conn)
+{
+	return ENOTSUP;
+}
+
+void fd_cnx_rx_stop(struct cnxctx * conn)
+{
+	return;
+}
+
+#endif /* HAVE_EPOLL */
@@ -227,10 +227,35 @@ static int score_destination_avp(void * cbdata, struct msg ** pmsg, struct fd_li
 	struct fd_list * li;
 	struct avp * avp;
 	union avp_value *dh = NULL, *dr = NULL;
+	union avp_value wdh, wdr;
+	size_t off = 0;
+	struct avp_wirehdr wavp;
+	int ret;
 	
 	TRACE_ENTRY("%p %p %p", cbdata, msg, candidates);
 	CHECK_PARAMS(msg && candidates);
 	
+	/* If the message was parsed lazily, read these AVPs in the received buffer */
+	while ((ret = fd_msg_wire_browse(msg, &off, &wavp)) == 0) {
+		if (wavp.avp_flags & AVP_FLAG_VENDOR)
+			continue;
+		if ((wavp.avp_code == AC_DESTINATION_HOST) && !dh) {
+			wdh.os.data = wavp.avp_data;
+			wdh.os.len  = wavp.avp_datalen;
+			dh = &wdh;
+		}
+		if ((wavp.avp_code == AC_DESTINATION_REALM) && !dr) {
+			wdr.os.data = wavp.avp_data;
+			wdr.os.len  = wavp.avp_datalen;
+			dr = &wdr;
+		}
+		if (dh && dr)
+			break;
+	}
+	if ((ret == 0) || (ret == ENOENT))
+		goto score;
+	dh = dr = NULL;
+	
 	/* Search the Destination-Host and Destination-Realm AVPs -- we could also use fd_msg_search_avp here, but this one is slightly more efficient */
 	CHECK_FCT(  fd_msg_browse(msg, MSG_BRW_FIRST_CHILD, &avp, NULL) );
 	while (avp) {
@@ -262,6 +287,7 @@ static int score_destination_avp(void * cbdata, struct msg ** pmsg, struct fd_li
 		CHECK_FCT(  fd_msg_browse(avp, MSG_BRW_NEXT, &avp, NULL) );
 	}
 	
+score:
 	/* Now, check each candidate against these AVP values */
 	for (li = candidates->next; li != candidates; li = li->next) {
 		struct rtd_candidate *c = (struct rtd_candidate *) li;
@@ -332,19 +358,20 @@ static void nai_get_indexes(union avp_value * un, int * excl_idx, int * at_idx)
 }	
 
 /* Test if a User-Name AVP contains a Decorated NAI -- RFC4282, RFC5729 */
-/* Create new User-Name and Destination-Realm values */
-static int process_decorated_NAI(int * was_nai, union avp_value * un, union avp_value * dr)
+/* Set new User-Name and Destination-Realm values */
+static int process_decorated_NAI(int * was_nai, struct avp * un, union avp_value * un_val, struct avp * dr)
 {
 	int at_idx, sep_idx;
-	unsigned char * old_un;
-	TRACE_ENTRY("%p %p %p", was_nai, un, dr);
-	CHECK_PARAMS(was_nai && un && dr);
+	unsigned char * old_un, * new_un;
+	union avp_value val;
+	TRACE_ENTRY("%p %p %p %p", was_nai, un, un_val, dr);
+	CHECK_PARAMS(was_nai && un && un_val && dr);
 	
 	/* Save the decorated User-Name, for example 'homerealm.example.net!user@otherrealm.example.net' */
-	old_un = un->os.data;
+	old_un = un_val->os.data;
 	
 	/* Search the positions of the first '!' and the '@' in the string */
-	nai_get_indexes(un, &sep_idx, &at_idx);
+	nai_get_indexes(un_val, &sep_idx, &at_idx);
 	if ((!sep_idx) || (sep_idx > at_idx) || !fd_os_is_valid_DiameterIdentity(old_un, sep_idx /* this is the new realm part */)) {
 		*was_nai = 0;
 		return 0;
@@ -353,23 +380,26 @@ static int process_decorated_NAI(int * was_nai, union avp_value * un, union avp_
 	*was_nai = 1;
 	
 	/* Create the new User-Name value */
-	CHECK_MALLOC( un->os.data = malloc( at_idx ) );
-	memcpy( un->os.data, old_un + sep_idx + 1, at_idx - sep_idx ); /* user@ */
-	memcpy( un->os.data + at_idx - sep_idx, old_un, sep_idx ); /* homerealm.example.net */
-	
-	/* Create the new Destination-Realm value */
-	CHECK_MALLOC( dr->os.data = realloc(dr->os.data, sep_idx) );
-	memcpy( dr->os.data, old_un, sep_idx );
-	dr->os.len = sep_idx;
+	CHECK_MALLOC( new_un = malloc( at_idx ) );
+	memcpy( new_un, old_un + sep_idx + 1, at_idx - sep_idx ); /* user@ */
+	memcpy( new_un + at_idx - sep_idx, old_un, sep_idx ); /* homerealm.example.net */
 	
 	TRACE_DEBUG(FULL, "Processed Decorated NAI : '%.*s' became '%.*s' (%.*s)",
-				(int)un->os.len, old_un,
-				(int)at_idx, un->os.data,
-				(int)dr->os.len, dr->os.data);
+				(int)un_val->os.len, old_un,
+				(int)at_idx, new_un,
+				(int)sep_idx, old_un);
 	
-	un->os.len = at_idx;
-	free(old_un);
+	/* Set the new Destination-Realm value, the storage of the values belongs to the AVPs */
+	val.os.data = old_un;
+	val.os.len = sep_idx;
+	CHECK_FCT_DO( fd_msg_avp_setvalue( dr, &val ), { free(new_un); return __ret__; } );
 	
+	/* Then the new User-Name value, old_un is released here */
+	val.os.data = new_un;
+	val.os.len = at_idx;
+	CHECK_FCT_DO( fd_msg_avp_setvalue( un, &val ), { free(new_un); return __ret__; } );
+	
+	free(new_un);
 	return 0;
 }
 
@@ -569,7 +599,7 @@ static int msg_rt_in(struct msg * msg)
 	
 	/* If it is a request, we must analyze its content to decide what we do with it */
 	if (is_req) {
-		struct avp * avp, *un = NULL;
+		struct avp * avp, *un = NULL, *dr = NULL;
 		union avp_value * un_val = NULL, *dr_val = NULL;
 		enum status { UNKNOWN, YES, NO };
 		/* Are we Destination-Host? */
@@ -590,6 +620,48 @@ static int msg_rt_in(struct msg * msg)
 			is_local_app = (app ? YES : NO);
 		}
 
+		/* Relay fast path: if the message was parsed lazily, read these AVPs directly in the received buffer */
+		{
+			size_t off = 0;
+			struct avp_wirehdr wavp;
+			int ret, has_un = 0;
+			
+			while ((ret = fd_msg_wire_browse(msgptr, &off, &wavp)) == 0) {
+				if (wavp.avp_flags & AVP_FLAG_VENDOR)
+					continue;
+				switch (wavp.avp_code) {
+					case AC_DESTINATION_HOST:
+						is_dest_host = fd_os_almostcasesrch(wavp.avp_data, wavp.avp_datalen, fd_g_config->cnf_diamid, fd_g_config->cnf_diamid_len, NULL) ? NO : YES;
+						break;
+					
+					case AC_DESTINATION_REALM:
+						is_dest_realm = fd_os_almostcasesrch(wavp.avp_data, wavp.avp_datalen, fd_g_config->cnf_diamrlm, fd_g_config->cnf_diamrlm_len, NULL) ? NO : YES;
+						break;
+					
+					case AC_USER_NAME:
+						has_un = 1;
+						break;
+					
+					case AC_ROUTE_RECORD:
+						if (!fd_os_almostcasesrch(wavp.avp_data, wavp.avp_datalen, fd_g_config->cnf_diamid, fd_g_config->cnf_diamid_len, NULL)) {
+							char * error = "DIAMETER_LOOP_DETECTED";
+							fd_hook_call(HOOK_MESSAGE_PARSING_ERROR, msgptr, NULL, error, fd_msg_pmdl_get(msgptr));
+							CHECK_FCT( return_error( &msgptr, error, NULL, NULL) );
+							return 0;
+						}
+						break;
+				}
+			}
+			
+			/* The message is parsed normally if it is not a plain relay case: missing Destination-Realm, or decorated NAI to check */
+			if ((ret == ENOENT) && (is_dest_realm != UNKNOWN) 
+			    && !(has_un && (is_dest_host == UNKNOWN) && (is_dest_realm == YES)))
+				goto decide;
+			
+			is_dest_host = UNKNOWN;
+			is_dest_realm = UNKNOWN;
+		}
+		
 		/* Parse the message for Dest-Host, Dest-Realm, and Route-Record */
 		CHECK_FCT(  fd_msg_browse(msgptr, MSG_BRW_FIRST_CHILD, &avp, NULL)  );
 		while (avp) {
@@ -641,6 +713,7 @@ static int msg_rt_in(struct msg * msg)
 								}
 							} );
 						ASSERT( ahdr->avp_value );
+						dr = avp;
 						dr_val = ahdr->avp_value;
 						/* Compare the Destination-Realm AVP of the message with our identity */
 						if (!fd_os_almostcasesrch(dr_val->os.data, dr_val->os.len, fd_g_config->cnf_diamrlm, fd_g_config->cnf_diamrlm_len, NULL)) {
@@ -707,6 +780,7 @@ static int msg_rt_in(struct msg * msg)
 			CHECK_FCT(  fd_msg_browse(avp, MSG_BRW_NEXT, &avp, NULL)  );
 		}
 
+decide:
 		/* OK, now decide what we do with the request */
 
 		/* Handle the missing routing AVPs first */
@@ -744,7 +818,7 @@ static int msg_rt_in(struct msg * msg)
 			/* test for decorated NAI  (RFC5729 section 4.4) */
 			/* Handle the decorated NAI */
 			if (un_val) {
-				CHECK_FCT_DO( process_decorated_NAI(&is_nai, un_val, dr_val),
+				CHECK_FCT_DO( process_decorated_NAI(&is_nai, un, un_val, dr),
 					{
 						/* If the process failed, we assume it is because of the AVP format */
 						fd_hook_call(HOOK_MESSAGE_PARSING_ERROR, msgptr, NULL, "Failed to process decorated NAI", fd_msg_pmdl_get(msgptr));
@@ -923,7 +997,22 @@ static int msg_rt_out(struct msg * msg)
 		}
 		CHECK_FCT( pthread_rwlock_unlock(&fd_g_activ_peers_rw) );
 
-		/* Now let's remove all peers from the Route-Records */
+		/* Now let's remove all peers from the Route-Records. If the message was parsed lazily, read them in the received buffer */
+		{
+			size_t off = 0;
+			struct avp_wirehdr wavp;
+			
+			while ((ret = fd_msg_wire_browse(msgptr, &off, &wavp)) == 0) {
+				if ((wavp.avp_code == AC_ROUTE_RECORD) && (! (wavp.avp_flags & AVP_FLAG_VENDOR)) )
+					fd_rtd_candidate_del(rtd, wavp.avp_data, wavp.avp_datalen);
+			}
+			if (ret == ENOENT) {
+				/* The Route-Record added on reception is not in the buffer, it contains the source peer */
+				if (qry_src)
+					fd_rtd_candidate_del(rtd, (uint8_t *)qry_src, qry_src_len);
+				goto rr_done;
+			}
+		}
 		CHECK_FCT(  fd_msg_browse(msgptr, MSG_BRW_FIRST_CHILD, &avp, NULL)  );
 		while (avp) {
 			struct avp_hdr * ahdr;
@@ -951,6 +1040,7 @@ static int msg_rt_out(struct msg * msg)
 			CHECK_FCT(  fd_msg_browse(avp, MSG_BRW_NEXT, &avp, NULL)  );
 		}
 		
+rr_done:
 		/* Save the routing information in the message */
 		CHECK_FCT( fd_msg_rt_associate ( msgptr, rtd ) );
 	}
@@ -1031,10 +1121,11 @@ static int msg_rt_out(struct msg * msg)
 /*                     Management of the threads                                */
 /********************************************************************************/
 
-/* Note: in the first version, we only create one thread of each kind.
- We could improve the scalability by using the threshold feature of the queues
- to create additional threads if a queue is filling up, or at least giving a configurable
- number of threads of each kind.
+/* Note: the routing stages start with one thread each. This thread retrieves the messages
+ from the stage queue and processes them. If the queue fills up and more threads are allowed
+ by the configuration (RoutingInThreads / RoutingOutThreads), it starts worker threads and only
+ distributes the messages to them afterwards. The messages are assigned to the workers by their 
+ Session-Id, so that the messages of a session are still processed one after the other.
  */
 
 /* Control of the threads */
@@ -1134,16 +1225,180 @@ static void * dispatch_thr(void * arg)
 	return process_thr(arg, msg_dispatch, fd_g_local, "Dispatch");
 }
 
+/* A routing stage: the head thread and the additional workers */
+struct rt_worker {
+	pthread_t		thr;
+	enum thread_state	state;
+	struct fifo *		queue;	/* The messages assigned to this worker */
+};
+
+struct rt_stage {
+	char *			name;
+	int		     (*action_cb)(struct msg * msg);
+	struct fifo **		queue;	/* The queue of the stage */
+	
+	pthread_t		head;
+	enum thread_state	head_state;
+	
+	int			max;	/* Configured number of threads */
+	int			active;	/* Number of workers receiving the messages, 0 while the head processes them. Only used by the head. */
+	int			grow;	/* Set when a queue of the stage reaches its high-water mark */
+	long			pending;/* Number of messages posted to the workers and not processed yet */
+	int			waiting;/* Set while the head waits for pending to reach 0 */
+	pthread_mutex_t		mtx;	/* Protects the wait on pending */
+	pthread_cond_t		cond;
+	struct rt_worker *	workers;
+};
+
+static struct rt_stage rt_in  = { "Routing-IN",  msg_rt_in,  &fd_g_incoming };
+static struct rt_stage rt_out = { "Routing-OUT", msg_rt_out, &fd_g_outgoing };
+
+/* The queues of the stages call this when they fill up */
+#define RT_QUEUE_HIGH	10
+static void rt_in_overload(struct fifo * queue, void ** data)
+{
+	__atomic_store_n(&rt_in.grow, 1, __ATOMIC_RELAXED);
+}
+static void rt_out_overload(struct fifo * queue, void ** data)
+{
+	__atomic_store_n(&rt_out.grow, 1, __ATOMIC_RELAXED);
+}
+
+/* The value used to assign a message to a worker. The messages with the same Session-Id get the same value. */
+static uint32_t msg_order_hash(struct msg * msg)
+{
+	size_t off = 0;
+	struct avp_wirehdr wavp;
+	struct session * sess = NULL;
+	struct msg_hdr * hdr;
+	int ret;
+	
+	/* If the message was parsed lazily, read the Session-Id in the received buffer */
+	while ((ret = fd_msg_wire_browse(msg, &off, &wavp)) == 0) {
+		if ((wavp.avp_code == AC_SESSION_ID) && !(wavp.avp_flags & AVP_FLAG_VENDOR))
+			return fd_os_hash(wavp.avp_data, wavp.avp_datalen);
+	}
+	if (ret == ENOTSUP) {
+		if ((fd_msg_sess_get(fd_g_config->cnf_dict, msg, &sess, NULL) == 0) && sess) {
+			os0_t sid;
+			size_t sidlen;
+			if (fd_sess_getsid(sess, &sid, &sidlen) == 0)
+				return fd_os_hash(sid, sidlen);
+		}
+	}
+	
+	/* Without Session-Id, the order does not matter */
+	CHECK_FCT_DO( fd_msg_hdr(msg, &hdr), return 0 );
+	return hdr->msg_hbhid;
+}
+
+/* The worker threads */
+static int stage_worker(struct rt_stage * st, struct msg * msg)
+{
+	int ret = (*st->action_cb)(msg);
+	if ((__atomic_sub_fetch(&st->pending, 1, __ATOMIC_SEQ_CST) == 0) && __atomic_load_n(&st->waiting, __ATOMIC_SEQ_CST)) {
+		CHECK_POSIX( pthread_mutex_lock(&st->mtx) );
+		CHECK_POSIX( pthread_cond_signal(&st->cond) );
+		CHECK_POSIX( pthread_mutex_unlock(&st->mtx) );
+	}
+	return ret;
+}
+static int rt_in_worker(struct msg * msg)
+{
+	return stage_worker(&rt_in, msg);
+}
+static int rt_out_worker(struct msg * msg)
+{
+	return stage_worker(&rt_out, msg);
+}
+static void * routing_in_worker_thr(void * arg)
+{
+	struct rt_worker * w = arg;
+	return process_thr(&w->state, rt_in_worker, w->queue, "Routing-IN worker");
+}
+static void * routing_out_worker_thr(void * arg)
+{
+	struct rt_worker * w = arg;
+	return process_thr(&w->state, rt_out_worker, w->queue, "Routing-OUT worker");
+}
+
+/* Start more workers in a stage, called by the head thread */
+static int stage_grow(struct rt_stage * st)
+{
+	int target, i, ret = 0;
+	
+	__atomic_store_n(&st->grow, 0, __ATOMIC_RELAXED);
+	if (st->active >= st->max)
+		return 0;
+	
+	/* A single worker would not be faster than the head thread alone */
+	target = st->active ? st->active + 1 : 2;
+	
+	for (i = st->active; i < target; i++) {
+		struct rt_worker * w = &st->workers[i];
+		CHECK_FCT_DO( ret = fd_fifo_new_ring(&w->queue, 20, 0), goto error );
+		CHECK_FCT_DO( ret = fd_fifo_setthrhd(w->queue, NULL, RT_QUEUE_HIGH, (st == &rt_in) ? rt_in_overload : rt_out_overload, 0, NULL), goto error );
+		CHECK_POSIX_DO( ret = pthread_create( &w->thr, NULL, (st == &rt_in) ? routing_in_worker_thr : routing_out_worker_thr, w ), goto error );
+	}
+	
+	/* The assignment of the sessions changes with the number of workers. Wait for the messages already posted to be processed, to keep the order. */
+	CHECK_POSIX( pthread_mutex_lock(&st->mtx) );
+	__atomic_store_n(&st->waiting, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&st->pending, __ATOMIC_SEQ_CST))
+		CHECK_POSIX_DO( pthread_cond_wait(&st->cond, &st->mtx), break );
+	__atomic_store_n(&st->waiting, 0, __ATOMIC_SEQ_CST);
+	CHECK_POSIX( pthread_mutex_unlock(&st->mtx) );
+	
+	st->active = target;
+	TRACE_DEBUG(INFO, "%s: the messages are now processed by %d threads", st->name, target);
+	return 0;
+
+error:
+	/* The new workers did not receive any message yet, remove them and continue with the current ones */
+	if (st->workers[i].queue) {
+		CHECK_FCT_DO( fd_queues_fini(&st->workers[i].queue), /* ignore */ );
+	}
+	while (i-- > st->active) {
+		CHECK_FCT_DO( fd_queues_fini(&st->workers[i].queue), /* ignore */ );
+		CHECK_FCT_DO( fd_thr_term(&st->workers[i].thr), /* ignore */ );
+	}
+	LOG_E("%s: unable to start more threads (%s), the messages are still processed by %d thread(s)", st->name, strerror(ret), st->active ?: 1);
+	return 0;
+}
+
+/* The head threads */
+static int stage_head(struct rt_stage * st, struct msg * msg)
+{
+	if (__atomic_load_n(&st->grow, __ATOMIC_RELAXED)) {
+		CHECK_FCT( stage_grow(st) );
+	}
+	
+	if (!st->active)
+		return (*st->action_cb)(msg);
+	
+	__atomic_add_fetch(&st->pending, 1, __ATOMIC_RELAXED);
+	CHECK_FCT( fd_fifo_post(st->workers[msg_order_hash(msg) % st->active].queue, &msg) );
+	return 0;
+}
+static int rt_in_head(struct msg * msg)
+{
+	return stage_head(&rt_in, msg);
+}
+static int rt_out_head(struct msg * msg)
+{
+	return stage_head(&rt_out, msg);
+}
+
 /* The (routing-in) thread -- see description in freeDiameter.h */
 static void * routing_in_thr(void * arg)
 {
-	return process_thr(arg, msg_rt_in, fd_g_incoming, "Routing-IN");
+	return process_thr(arg, rt_in_head, fd_g_incoming, "Routing-IN");
 }
 
 /* The (routing-out) thread -- see description in freeDiameter.h */
 static void * routing_out_thr(void * arg)
 {
-	return process_thr(arg, msg_rt_out, fd_g_outgoing, "Routing-OUT");
+	return process_thr(arg, rt_out_head, fd_g_outgoing, "Routing-OUT");
 }
 
 
@@ -1154,12 +1409,19 @@ static void * routing_out_thr(void * arg)
 static pthread_t * dispatch = NULL;
 static enum thread_state * disp_state = NULL;
 
-/* Later: make this more dynamic */
-static pthread_t rt_out = (pthread_t)NULL;
-static enum thread_state out_state = NOTRUNNING;
-
-static pthread_t rt_in  = (pthread_t)NULL;
-static enum thread_state in_state = NOTRUNNING;
+/* Start the head thread of a routing stage */
+static int stage_init(struct rt_stage * st, uint16_t max, void * (*head_thr)(void *), void (*overload_cb)(struct fifo *, void **))
+{
+	st->max = max;
+	CHECK_POSIX( pthread_mutex_init(&st->mtx, NULL) );
+	CHECK_POSIX( pthread_cond_init(&st->cond, NULL) );
+	if (max > 1) {
+		CHECK_MALLOC( st->workers = calloc(max, sizeof(struct rt_worker)) );
+		CHECK_FCT( fd_fifo_setthrhd(*st->queue, NULL, RT_QUEUE_HIGH, overload_cb, 0, NULL) );
+	}
+	CHECK_POSIX( pthread_create( &st->head, NULL, head_thr, &st->head_state) );
+	return 0;
+}
 
 /* Initialize the routing and dispatch threads */
 int fd_rtdisp_init(void)
@@ -1174,10 +1436,8 @@ int fd_rtdisp_init(void)
 	for (i=0; i < fd_g_config->cnf_dispthr; i++) {
 		CHECK_POSIX( pthread_create( &dispatch[i], NULL, dispatch_thr, &disp_state[i] ) );
 	}
-	CHECK_POSIX( pthread_create( &rt_out, NULL, routing_out_thr, &out_state) );
-	CHECK_POSIX( pthread_create( &rt_in,  NULL, routing_in_thr,  &in_state) );
-	
-	/* Later: TODO("Set the thresholds for the queues to create more threads as needed"); */
+	CHECK_FCT( stage_init(&rt_out, fd_g_config->cnf_rtoutthr, routing_out_thr, rt_out_overload) );
+	CHECK_FCT( stage_init(&rt_in,  fd_g_config->cnf_rtinthr,  routing_in_thr,  rt_in_overload) );
 	
 	/* Register the built-in callbacks */
 	CHECK_FCT( fd_rt_out_register( dont_send_if_no_common_app, NULL, 10, NULL ) );
@@ -1237,6 +1497,30 @@ static void stop_thread_delayed(enum thread_state *st, pthread_t * thr, char * t
 	
 }
 
+/* Stop the threads of a stage, after its queue has been destroyed */
+static void stage_stop(struct rt_stage * st, char * th_name)
+{
+	int i;
+	
+	/* First the head, so that it does not post to the workers anymore */
+	stop_thread_delayed(&st->head_state, &st->head, th_name);
+	
+	if (st->workers != NULL) {
+		for (i = 0; i < st->max; i++) {
+			if (st->workers[i].queue == NULL)
+				continue;
+			CHECK_FCT_DO( fd_queues_fini(&st->workers[i].queue), /* ignore */);
+			stop_thread_delayed(&st->workers[i].state, &st->workers[i].thr, th_name);
+		}
+		free(st->workers);
+		st->workers = NULL;
+	}
+	st->active = 0;
+	st->pending = 0;
+	CHECK_POSIX_DO( pthread_mutex_destroy(&st->mtx), /* ignore */ );
+	CHECK_POSIX_DO( pthread_cond_destroy(&st->cond), /* ignore */ );
+}
+
 /* Stop the thread after up to one second of wait */
 int fd_rtdisp_fini(void)
 {
@@ -1246,13 +1530,13 @@ int fd_rtdisp_fini(void)
 	CHECK_FCT_DO( fd_queues_fini(&fd_g_incoming), /* ignore */);
 	
 	/* Stop the routing IN thread */
-	stop_thread_delayed(&in_state, &rt_in, "IN routing");
+	stage_stop(&rt_in, "IN routing");
 	
 	/* Destroy the outgoing queue */
 	CHECK_FCT_DO( fd_queues_fini(&fd_g_outgoing), /* ignore */);
 	
 	/* Stop the routing OUT thread */
-	stop_thread_delayed(&out_state, &rt_out, "OUT routing");
+	stage_stop(&rt_out, "OUT routing");
 	
 	/* Destroy the local queue */
 	CHECK_FCT_DO( fd_queues_fini(&fd_g_local), /* ignore */);
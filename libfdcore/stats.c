@@ -0,0 +1,430 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2013, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* This file contains the statistics module: counters and latency histograms updated on the processing path of the messages.
+ Each thread updates its own copy of the values (a shard), without lock nor atomic read-modify-write operations. The shards 
+ are summed when the values are read. When a thread terminates, its values are added to the retired shard. */
+
+#include "fdcore-internal.h"
+
+/* Number of slots in the per command and per result code tables of each shard (power of 2). Codes beyond are not counted. */
+#define STAT_CMD_SLOTS	64
+#define STAT_RC_SLOTS	32
+
+/* A value counted per command or result code. key 0 means the slot is free */
+struct stat_slot {
+	uint32_t	key;
+	long long	in;
+	long long	out;
+};
+
+/* The values of one thread. It is aligned on cache lines so that the shards of different threads never share one. */
+struct stat_shard {
+	struct fd_list		chain;			/* link in stat_shards */
+	long long		cnt[FD_STAT_COUNTERS];
+	struct stat_slot	cmd[STAT_CMD_SLOTS];	/* key is (code << 1 | is_req) + 1 */
+	struct stat_slot	rc[STAT_RC_SLOTS];	/* key is the Result-Code */
+	struct {
+		long long	sum;			/* in microseconds */
+		long long	b[FD_STAT_BUCKETS];
+	}			h[FD_STAT_HISTOS];
+} __attribute__ ((aligned (64)));
+
+/* The shards of the running threads, and the sum of the terminated threads */
+static pthread_mutex_t   stat_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fd_list    stat_shards = FD_LIST_INITIALIZER(stat_shards);
+static struct stat_shard stat_retired;
+
+static pthread_key_t     stat_key;
+static int               stat_ready = 0;
+
+/* Only the owner thread of a shard modifies it; the readers may see a value slightly late, but never a torn one */
+#define STAT_ADD( _loc, _val ) \
+	__atomic_store_n(&(_loc), (_loc) + (_val), __ATOMIC_RELAXED)
+#define STAT_GET( _loc ) \
+	__atomic_load_n(&(_loc), __ATOMIC_RELAXED)
+
+/* Find the slot of a key in a table, claim a free one if needed. NULL if the table is full. */
+static struct stat_slot * stat_slot(struct stat_slot * tab, int size, uint32_t key)
+{
+	uint32_t h = key * 0x9E3779B1U;
+	int i;
+	
+	for (i = 0; i < size; i++) {
+		struct stat_slot * s = &tab[(h + i) & (size - 1)];
+		uint32_t k = __atomic_load_n(&s->key, __ATOMIC_ACQUIRE);
+		if (k == key)
+			return s;
+		if (k == 0) {
+			__atomic_store_n(&s->key, key, __ATOMIC_RELEASE);
+			return s;
+		}
+	}
+	return NULL;
+}
+
+/* Add the values of a table in another one, the stat_lock is held */
+static void stat_slots_add(struct stat_slot * to, struct stat_slot * from, int size)
+{
+	int i;
+	for (i = 0; i < size; i++) {
+		struct stat_slot * s;
+		uint32_t key = __atomic_load_n(&from[i].key, __ATOMIC_ACQUIRE);
+		if (!key)
+			continue;
+		s = stat_slot(to, size, key);
+		if (s) {
+			STAT_ADD(s->in, STAT_GET(from[i].in));
+			STAT_ADD(s->out, STAT_GET(from[i].out));
+		}
+	}
+}
+
+/* Called when a thread terminates */
+static void stat_shard_release(void * arg)
+{
+	struct stat_shard * sh = arg;
+	int i, j;
+	
+	CHECK_POSIX_DO( pthread_mutex_lock(&stat_lock), /* continue */ );
+	fd_list_unlink(&sh->chain);
+	for (i = 0; i < FD_STAT_COUNTERS; i++)
+		STAT_ADD(stat_retired.cnt[i], sh->cnt[i]);
+	stat_slots_add(stat_retired.cmd, sh->cmd, STAT_CMD_SLOTS);
+	stat_slots_add(stat_retired.rc, sh->rc, STAT_RC_SLOTS);
+	for (i = 0; i < FD_STAT_HISTOS; i++) {
+		STAT_ADD(stat_retired.h[i].sum, sh->h[i].sum);
+		for (j = 0; j < FD_STAT_BUCKETS; j++)
+			STAT_ADD(stat_retired.h[i].b[j], sh->h[i].b[j]);
+	}
+	CHECK_POSIX_DO( pthread_mutex_unlock(&stat_lock), /* continue */ );
+	
+	free(sh);
+}
+
+/* Retrieve the shard of the current thread, create it on first use */
+static struct stat_shard * stat_shard_get(void)
+{
+	struct stat_shard * sh;
+	
+	if (!stat_ready)
+		return NULL;
+	
+	sh = pthread_getspecific(stat_key);
+	if (sh)
+		return sh;
+	
+	CHECK_POSIX_DO( posix_memalign((void **)&sh, 64, sizeof(struct stat_shard)), return NULL );
+	memset(sh, 0, sizeof(struct stat_shard));
+	fd_list_init(&sh->chain, sh);
+	CHECK_POSIX_DO( pthread_setspecific(stat_key, sh), { free(sh); return NULL; } );
+	
+	CHECK_POSIX_DO( pthread_mutex_lock(&stat_lock), /* continue */ );
+	fd_list_insert_before(&stat_shards, &sh->chain);
+	CHECK_POSIX_DO( pthread_mutex_unlock(&stat_lock), /* continue */ );
+	
+	return sh;
+}
+
+/* The histograms are log-linear: 2^FD_STAT_SUB_BITS buckets for each power of 2, so the precision is 1 / 2^FD_STAT_SUB_BITS */
+static int stat_bucket(unsigned long long v)
+{
+	int e;
+	
+	if (v < (1 << FD_STAT_SUB_BITS))
+		return (int)v;
+	if (v >> 32)
+		return FD_STAT_BUCKETS - 1;
+	
+	e = 63 - __builtin_clzll(v);
+	return ((e - FD_STAT_SUB_BITS + 1) << FD_STAT_SUB_BITS) + (int)((v >> (e - FD_STAT_SUB_BITS)) & ((1 << FD_STAT_SUB_BITS) - 1));
+}
+
+/* Time spent by the messages in the global queues */
+static void stat_wait_cb(void * data, long long ns)
+{
+	fd_stat_histo_add((enum fd_stat_histo)(long)data, ns);
+}
+
+/* Initialize the module, called once from fd_core_initialize after the queues are created */
+int fd_stats_init(void)
+{
+	CHECK_POSIX( pthread_key_create(&stat_key, stat_shard_release) );
+	stat_ready = 1;
+	
+	CHECK_FCT( fd_fifo_setwaitcb(fd_g_incoming, stat_wait_cb, (void *)(long)FD_STAT_H_WAIT_INCOMING) );
+	CHECK_FCT( fd_fifo_setwaitcb(fd_g_outgoing, stat_wait_cb, (void *)(long)FD_STAT_H_WAIT_OUTGOING) );
+	CHECK_FCT( fd_fifo_setwaitcb(fd_g_local,    stat_wait_cb, (void *)(long)FD_STAT_H_WAIT_LOCAL) );
+	return 0;
+}
+
+/**************************************************************************************/
+/* Updates, from the processing threads */
+
+void fd_stat_inc(enum fd_stat_counter c)
+{
+	struct stat_shard * sh = stat_shard_get();
+	if (sh)
+		STAT_ADD(sh->cnt[c], 1);
+}
+
+void fd_stat_histo_add(enum fd_stat_histo h, long long ns)
+{
+	struct stat_shard * sh = stat_shard_get();
+	long long us = (ns > 0) ? ns / 1000 : 0;
+	if (sh) {
+		STAT_ADD(sh->h[h].b[stat_bucket(us)], 1);
+		STAT_ADD(sh->h[h].sum, us);
+	}
+}
+
+/* Get the Result-Code of an answer, 0 if there is none */
+static uint32_t stat_rescode(struct msg * msg)
+{
+	struct avp_wirehdr wavp;
+	struct avp * avp;
+	size_t off = 0;
+	int ret;
+	
+	/* If the message was parsed lazily, read it in the received buffer */
+	while ((ret = fd_msg_wire_browse(msg, &off, &wavp)) == 0) {
+		if ((wavp.avp_code == AC_RESULT_CODE) && !(wavp.avp_flags & AVP_FLAG_VENDOR) && (wavp.avp_datalen == sizeof(uint32_t))) {
+			uint32_t rc;
+			memcpy(&rc, wavp.avp_data, sizeof(uint32_t));
+			return ntohl(rc);
+		}
+	}
+	if (ret != ENOTSUP)
+		return 0;
+	
+	CHECK_FCT_DO( fd_msg_browse(msg, MSG_BRW_FIRST_CHILD, &avp, NULL), return 0 );
+	while (avp) {
+		struct avp_hdr * ahdr;
+		CHECK_FCT_DO( fd_msg_avp_hdr(avp, &ahdr), return 0 );
+		if ((ahdr->avp_code == AC_RESULT_CODE) && !(ahdr->avp_flags & AVP_FLAG_VENDOR)) {
+			/* The received messages are not parsed yet */
+			if ((ahdr->avp_value == NULL) && (fd_msg_parse_dict(avp, fd_g_config->cnf_dict, NULL) != 0))
+				return 0;
+			return ahdr->avp_value ? ahdr->avp_value->u32 : 0;
+		}
+		CHECK_FCT_DO( fd_msg_browse(avp, MSG_BRW_NEXT, &avp, NULL), return 0 );
+	}
+	return 0;
+}
+
+/* A message was received from a peer (out = 0), or is being sent (out = 1). The peer can be NULL before CER/CEA exchange */
+void fd_stat_msg(struct fd_peer * peer, struct msg * msg, int out)
+{
+	struct stat_shard * sh = stat_shard_get();
+	struct msg_hdr * hdr;
+	struct stat_slot * s;
+	int is_req;
+	
+	if (peer)
+		__atomic_add_fetch(out ? &peer->p_stat_out : &peer->p_stat_in, 1, __ATOMIC_RELAXED);
+	
+	if (!sh)
+		return;
+	
+	STAT_ADD(sh->cnt[out ? FD_STAT_MSG_OUT : FD_STAT_MSG_IN], 1);
+	
+	CHECK_FCT_DO( fd_msg_hdr(msg, &hdr), return );
+	is_req = (hdr->msg_flags & CMD_FLAG_REQUEST) ? 1 : 0;
+	
+	s = stat_slot(sh->cmd, STAT_CMD_SLOTS, ((hdr->msg_code << 1) | is_req) + 1);
+	if (s) {
+		if (out)
+			STAT_ADD(s->out, 1);
+		else
+			STAT_ADD(s->in, 1);
+	}
+	
+	if (!is_req) {
+		uint32_t rc = stat_rescode(msg);
+		if (rc && ((s = stat_slot(sh->rc, STAT_RC_SLOTS, rc)) != NULL)) {
+			if (out)
+				STAT_ADD(s->out, 1);
+			else
+				STAT_ADD(s->in, 1);
+		}
+	}
+}
+
+/**************************************************************************************/
+/* Reading, see include/freeDiameter/libfdcore.h for more information */
+
+int fd_stat_counter_get(enum fd_stat_counter c, long long * value)
+{
+	struct fd_list * li;
+	long long v;
+	
+	TRACE_ENTRY("%d %p", c, value);
+	CHECK_PARAMS( (c >= 0) && (c < FD_STAT_COUNTERS) && value );
+	
+	CHECK_POSIX( pthread_mutex_lock(&stat_lock) );
+	v = STAT_GET(stat_retired.cnt[c]);
+	for (li = stat_shards.next; li != &stat_shards; li = li->next)
+		v += STAT_GET(((struct stat_shard *)li->o)->cnt[c]);
+	CHECK_POSIX( pthread_mutex_unlock(&stat_lock) );
+	
+	*value = v;
+	return 0;
+}
+
+/* Add the values of a histogram of a shard, the stat_lock is held */
+static void stat_histo_sum(struct stat_shard * sh, enum fd_stat_histo h, struct fd_stat_histo_data * data)
+{
+	int i;
+	data->sum += STAT_GET(sh->h[h].sum);
+	for (i = 0; i < FD_STAT_BUCKETS; i++)
+		data->buckets[i] += STAT_GET(sh->h[h].b[i]);
+}
+
+int fd_stat_histo_get(enum fd_stat_histo h, struct fd_stat_histo_data * data)
+{
+	struct fd_list * li;
+	int i;
+	
+	TRACE_ENTRY("%d %p", h, data);
+	CHECK_PARAMS( (h >= 0) && (h < FD_STAT_HISTOS) && data );
+	
+	memset(data, 0, sizeof(struct fd_stat_histo_data));
+	
+	CHECK_POSIX( pthread_mutex_lock(&stat_lock) );
+	stat_histo_sum(&stat_retired, h, data);
+	for (li = stat_shards.next; li != &stat_shards; li = li->next)
+		stat_histo_sum(li->o, h, data);
+	CHECK_POSIX( pthread_mutex_unlock(&stat_lock) );
+	
+	for (i = 0; i < FD_STAT_BUCKETS; i++)
+		data->count += data->buckets[i];
+	
+	return 0;
+}
+
+long long fd_stat_bucket_max(int bucket)
+{
+	int shift;
+	
+	if (bucket < (1 << FD_STAT_SUB_BITS))
+		return bucket;
+	
+	shift = (bucket >> FD_STAT_SUB_BITS) - 1;
+	return ((long long)((1 << FD_STAT_SUB_BITS) + (bucket & ((1 << FD_STAT_SUB_BITS) - 1)) + 1) << shift) - 1;
+}
+
+long long fd_stat_quantile(struct fd_stat_histo_data * data, double q)
+{
+	long long rank, seen = 0;
+	int i;
+	
+	if (!data || (data->count == 0))
+		return 0;
+	
+	rank = (long long)(q * data->count);
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < FD_STAT_BUCKETS - 1; i++) {
+		seen += data->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+	return fd_stat_bucket_max(i);
+}
+
+int fd_stat_peer_get(struct peer_hdr * peer, long long * in, long long * out)
+{
+	struct fd_peer * p = (struct fd_peer *)peer;
+	
+	TRACE_ENTRY("%p %p %p", peer, in, out);
+	CHECK_PARAMS( CHECK_PEER(peer) );
+	
+	if (in)
+		*in = __atomic_load_n(&p->p_stat_in, __ATOMIC_RELAXED);
+	if (out)
+		*out = __atomic_load_n(&p->p_stat_out, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Sum the per-code tables of all the shards */
+static int stat_slots_sum(struct stat_slot * sum, int cmd)
+{
+	struct fd_list * li;
+	int size = cmd ? STAT_CMD_SLOTS : STAT_RC_SLOTS;
+	
+	memset(sum, 0, size * sizeof(struct stat_slot));
+	
+	CHECK_POSIX( pthread_mutex_lock(&stat_lock) );
+	stat_slots_add(sum, cmd ? stat_retired.cmd : stat_retired.rc, size);
+	for (li = stat_shards.next; li != &stat_shards; li = li->next) {
+		struct stat_shard * sh = li->o;
+		stat_slots_add(sum, cmd ? sh->cmd : sh->rc, size);
+	}
+	CHECK_POSIX( pthread_mutex_unlock(&stat_lock) );
+	
+	return 0;
+}
+
+int fd_stat_iterate_cmd(void * data, void (*cb)(void * data, command_code_t code, int is_req, long long in, long long out))
+{
+	struct stat_slot sum[STAT_CMD_SLOTS];
+	int i;
+	
+	TRACE_ENTRY("%p %p", data, cb);
+	CHECK_PARAMS( cb );
+	
+	CHECK_FCT( stat_slots_sum(sum, 1) );
+	for (i = 0; i < STAT_CMD_SLOTS; i++) {
+		if (sum[i].key)
+			(*cb)(data, (sum[i].key - 1) >> 1, (sum[i].key - 1) & 1, sum[i].in, sum[i].out);
+	}
+	return 0;
+}
+
+int fd_stat_iterate_rescode(void * data, void (*cb)(void * data, uint32_t rescode, long long in, long long out))
+{
+	struct stat_slot sum[STAT_RC_SLOTS];
+	int i;
+	
+	TRACE_ENTRY("%p %p", data, cb);
+	CHECK_PARAMS( cb );
+	
+	CHECK_FCT( stat_slots_sum(sum, 0) );
+	for (i = 0; i < STAT_RC_SLOTS; i++) {
+		if (sum[i].key)
+			(*cb)(data, sum[i].key, sum[i].in, sum[i].out);
+	}
+	return 0;
+}
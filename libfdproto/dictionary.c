@@ -126,6 +126,10 @@ struct dict_object {
 	 
 	 /* Sentinel for the dispatch callbacks */
 	 struct fd_list		disp_cbs;
+	 
+	 /* Link in the secondary index of the dictionary (vendors, applications, enumvals, avps and commands only) */
+	 uint32_t		hash;		/* hash of the key of this object, see hash_obj_key */
+	 struct dict_object *	hash_next;	/* next object in the same bucket */
 	
 };
 
@@ -144,8 +148,15 @@ struct dictionary {
 	struct dict_object	dict_cmd_error;		/* Special command object for answers with the 'E' bit set */
 	
 	int			dict_count[DICT_TYPE_MAX + 1]; /* Number of objects of each type */
+	
+	struct dict_object	**dict_hash;		/* Buckets of the index of objects by their key (id, code, value), see hash_obj_key */
+	size_t			dict_hash_size;		/* Number of buckets, always a power of 2 */
+	size_t			dict_hash_count;	/* Number of objects in the index */
 };
 
+/* Initial number of buckets in the index. It is doubled each time the number of objects reaches this number */
+#define DICT_HASH_INITIAL_SIZE	256
+
 /* Forward declarations of dump functions */
 static DECLARE_FD_DUMP_PROTOTYPE(dump_vendor_data, void * data );
 static DECLARE_FD_DUMP_PROTOTYPE(dump_application_data, void * data );
@@ -164,6 +175,10 @@ static int search_avp		( struct dictionary * dict, int criteria, const void * wh
 static int search_cmd		( struct dictionary * dict, int criteria, const void * what, struct dict_object **result );
 static int search_rule		( struct dictionary * dict, int criteria, const void * what, struct dict_object **result );
 
+/* Forward declarations of index functions */
+static void hash_link   ( struct dictionary * dict, struct dict_object * obj );
+static void hash_unlink ( struct dictionary * dict, struct dict_object * obj );
+
 /* The following array contains lot of data about the different types of objects, for automated handling */
 static struct {
 	enum dict_object_type 	type; 		/* information for this type */
@@ -397,9 +412,11 @@ static void destroy_object(struct dict_object * obj)
 	
 	/* TRACE_ENTRY("%p", obj); */
 	
-	/* Update global count */
-	if (obj->dico) 
+	/* Update global count and index */
+	if (obj->dico) {
 		obj->dico->dict_count[obj->type]--;
+		hash_unlink(obj->dico, obj);
+	}
 	
 	/* Mark the object as invalid */
 	obj->objeyec = 0xdead;
@@ -472,34 +489,30 @@ static int order_enum_by_name ( struct dict_object *o1, struct dict_object *o2 )
 	return fd_os_cmp( o1->data.enumval.enum_name, o1->datastr_len, o2->data.enumval.enum_name, o2->datastr_len );
 }
 
-/* Compare two type_enum objects by their values (checks already performed) */
-static int order_enum_by_val  ( struct dict_object *o1, struct dict_object *o2 )
+/* Compare two enum values of a given base type */
+static int cmp_enum_val ( enum dict_avp_basetype type_base, union avp_value * v1, union avp_value * v2 )
 {
-	TRACE_ENTRY("%p %p", o1, o2);
-	
-	/* The comparison function depends on the type of data */
-	switch ( o1->parent->data.type.type_base ) {
+	switch ( type_base ) {
 		case AVP_TYPE_OCTETSTRING:
-			return fd_os_cmp( o1->data.enumval.enum_value.os.data, o1->data.enumval.enum_value.os.len, 
-					  o2->data.enumval.enum_value.os.data, o2->data.enumval.enum_value.os.len);
+			return fd_os_cmp( v1->os.data, v1->os.len, v2->os.data, v2->os.len);
 		
 		case AVP_TYPE_INTEGER32:
-			return ORDER_scalar( o1->data.enumval.enum_value.i32, o2->data.enumval.enum_value.i32 );
+			return ORDER_scalar( v1->i32, v2->i32 );
 
 		case AVP_TYPE_INTEGER64:
-			return ORDER_scalar( o1->data.enumval.enum_value.i64, o2->data.enumval.enum_value.i64 );
+			return ORDER_scalar( v1->i64, v2->i64 );
 
 		case AVP_TYPE_UNSIGNED32:
-			return ORDER_scalar( o1->data.enumval.enum_value.u32, o2->data.enumval.enum_value.u32 );
+			return ORDER_scalar( v1->u32, v2->u32 );
 
 		case AVP_TYPE_UNSIGNED64:
-			return ORDER_scalar( o1->data.enumval.enum_value.u64, o2->data.enumval.enum_value.u64 );
+			return ORDER_scalar( v1->u64, v2->u64 );
 
 		case AVP_TYPE_FLOAT32:
-			return ORDER_scalar( o1->data.enumval.enum_value.f32, o2->data.enumval.enum_value.f32 );
+			return ORDER_scalar( v1->f32, v2->f32 );
 
 		case AVP_TYPE_FLOAT64:
-			return ORDER_scalar( o1->data.enumval.enum_value.f64, o2->data.enumval.enum_value.f64 );
+			return ORDER_scalar( v1->f64, v2->f64 );
 
 		case AVP_TYPE_GROUPED:
 		default:
@@ -508,6 +521,15 @@ static int order_enum_by_val  ( struct dict_object *o1, struct dict_object *o2 )
 	return 0;
 }
 
+/* Compare two type_enum objects by their values (checks already performed) */
+static int order_enum_by_val  ( struct dict_object *o1, struct dict_object *o2 )
+{
+	TRACE_ENTRY("%p %p", o1, o2);
+	
+	/* The comparison function depends on the type of data */
+	return cmp_enum_val( o1->parent->data.type.type_base, &o1->data.enumval.enum_value, &o2->data.enumval.enum_value );
+}
+
 /* Compare two avp objects by their codes (checks already performed) */
 static int order_avp_by_code  ( struct dict_object *o1, struct dict_object *o2 )
 {
@@ -562,6 +584,172 @@ static int order_rule_by_avpvc ( struct dict_object *o1, struct dict_object *o2
 		?: ORDER_scalar(o1->data.rule.rule_avp->data.avp.avp_code, o2->data.rule.rule_avp->data.avp.avp_code) ;
 }
 
+/*******************************************************************************************************/
+/*******************************************************************************************************/
+/*                                                                                                     */
+/*                                  Index functions                                                    */
+/*                                                                                                     */
+/*******************************************************************************************************/
+/*******************************************************************************************************/
+
+/* The ordered lists are kept as the reference, but searching them is linear. In order to speed up the 
+searches that are done for each message (AVP by code and vendor, command by code and flag, enum by value),
+the objects are also linked in a hash table of the dictionary, keyed as follow:
+   VENDOR      : vendor_id
+   APPLICATION : application_id
+   ENUMVAL     : parent type, value
+   AVP         : avp_vendor, avp_code
+   COMMAND     : cmd_code, 'R' flag
+ The index is protected by the dict_lock, as the lists. */
+
+/* Mix a 32 bits value in a hash */
+static __inline__ uint32_t hash_add(uint32_t h, uint32_t v)
+{
+	return h ^ (v + 0x9e3779b9 + (h << 6) + (h >> 2));
+}
+
+/* Finalize the hash so that all bits are used for the bucket selection */
+static __inline__ uint32_t hash_end(uint32_t h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+#define HASH_id( type, id ) \
+	hash_end(hash_add(type, id))
+
+#define HASH_codevnd( type, code, vnd ) \
+	hash_end(hash_add(hash_add(type, code), vnd))
+
+/* Compute the hash of an enum value for a given type object */
+static uint32_t hash_enumval(struct dict_object * type, union avp_value * val)
+{
+	uint32_t h = hash_add(DICT_ENUMVAL, (uint32_t)(uintptr_t)type);
+	
+	switch ( type->data.type.type_base ) {
+		case AVP_TYPE_OCTETSTRING:
+			h = hash_add(h, fd_os_hash(val->os.data, val->os.len));
+			break;
+		
+		case AVP_TYPE_INTEGER32:
+		case AVP_TYPE_UNSIGNED32:
+			h = hash_add(h, val->u32);
+			break;
+
+		case AVP_TYPE_INTEGER64:
+		case AVP_TYPE_UNSIGNED64:
+			h = hash_add(hash_add(h, (uint32_t)val->u64), (uint32_t)(val->u64 >> 32));
+			break;
+
+		case AVP_TYPE_FLOAT32:
+			/* 0.0 and -0.0 have different representations but are equal */
+			if (val->f32 != 0)
+				h = hash_add(h, val->u32);
+			break;
+
+		case AVP_TYPE_FLOAT64:
+			if (val->f64 != 0)
+				h = hash_add(hash_add(h, (uint32_t)val->u64), (uint32_t)(val->u64 >> 32));
+			break;
+
+		case AVP_TYPE_GROUPED:
+		default:
+			ASSERT(0);
+	}
+	
+	return hash_end(h);
+}
+
+/* Compute the key of an object. Returns 0 if this type of object is not indexed */
+static int hash_obj_key(struct dict_object * obj, uint32_t * hash)
+{
+	switch (obj->type) {
+		case DICT_VENDOR:
+			*hash = HASH_id( DICT_VENDOR, obj->data.vendor.vendor_id );
+			return 1;
+			
+		case DICT_APPLICATION:
+			*hash = HASH_id( DICT_APPLICATION, obj->data.application.application_id );
+			return 1;
+			
+		case DICT_ENUMVAL:
+			*hash = hash_enumval( obj->parent, &obj->data.enumval.enum_value );
+			return 1;
+			
+		case DICT_AVP:
+			*hash = HASH_codevnd( DICT_AVP, obj->data.avp.avp_code, obj->data.avp.avp_vendor );
+			return 1;
+			
+		case DICT_COMMAND:
+			*hash = HASH_codevnd( DICT_COMMAND, obj->data.cmd.cmd_code, obj->data.cmd.cmd_flag_val & CMD_FLAG_REQUEST );
+			return 1;
+		
+		default:
+			return 0;
+	}
+}
+
+/* Change the number of buckets of the index. On memory error, the previous table is kept (it still works, only slower) */
+static void hash_resize(struct dictionary * dict, size_t size)
+{
+	struct dict_object ** newtab;
+	size_t i;
+	
+	CHECK_MALLOC_DO( newtab = calloc(size, sizeof(struct dict_object *)), return );
+	
+	for (i = 0; i < dict->dict_hash_size; i++) {
+		struct dict_object * o, * next;
+		for (o = dict->dict_hash[i]; o != NULL; o = next) {
+			next = o->hash_next;
+			o->hash_next = newtab[o->hash & (size - 1)];
+			newtab[o->hash & (size - 1)] = o;
+		}
+	}
+	
+	free(dict->dict_hash);
+	dict->dict_hash = newtab;
+	dict->dict_hash_size = size;
+}
+
+/* Add an object in the index. The dict_lock must be held for writing, the object must be already linked in its lists (no duplicate key) */
+static void hash_link( struct dictionary * dict, struct dict_object * obj )
+{
+	struct dict_object ** bucket;
+	
+	if (!hash_obj_key(obj, &obj->hash))
+		return;
+	
+	if (dict->dict_hash_count >= dict->dict_hash_size)
+		hash_resize(dict, dict->dict_hash_size << 1);
+	
+	bucket = &dict->dict_hash[obj->hash & (dict->dict_hash_size - 1)];
+	obj->hash_next = *bucket;
+	*bucket = obj;
+	dict->dict_hash_count++;
+}
+
+/* Remove an object from the index, if it is there. The dict_lock must be held for writing. */
+static void hash_unlink( struct dictionary * dict, struct dict_object * obj )
+{
+	struct dict_object ** prev;
+	
+	if (!dict->dict_hash)
+		return;
+	
+	for (prev = &dict->dict_hash[obj->hash & (dict->dict_hash_size - 1)]; *prev != NULL; prev = &(*prev)->hash_next) {
+		if (*prev == obj) {
+			*prev = obj->hash_next;
+			obj->hash_next = NULL;
+			dict->dict_hash_count--;
+			return;
+		}
+	}
+}
+
 /*******************************************************************************************************/
 /*******************************************************************************************************/
 /*                                                                                                     */
@@ -669,55 +857,18 @@ in the local context where they are called. They are meant to be called only fro
 		ret = ENOENT;							\
 }
 
-/* For search of scalars in lists. isindex= 1 if the value is the ordering key of the list */
-#define SEARCH_scalar( value, sentinel, datafield, isindex, defaultobj ) {	\
-	int __cmp;								\
-	struct fd_list * __li;							\
-	ret = 0;								\
-	if (  ((defaultobj) != NULL) 						\
-		   && (_O(defaultobj)->data. datafield  == value)) {		\
-		if (result)							\
-			*result = _O(defaultobj);				\
-		goto end;							\
-	}									\
-	for  (__li = (sentinel)->next; __li != (sentinel); __li = __li->next) {	\
-		__cmp= ORDER_scalar(value, _O(__li->o)->data. datafield );	\
-		if (__cmp == 0) {						\
-			if (result)						\
-				*result = _O(__li->o);				\
-			goto end;						\
-		}								\
-		if ((isindex) && (__cmp < 0))					\
-			break;							\
-	}									\
-	if (result)								\
-		*result = NULL;							\
-	else									\
-		ret = ENOENT;							\
-}
-
-/* For search of commands in lists by code and flag. R_flag_val = 0 or CMD_FLAG_REQUEST */
-#define SEARCH_codefl( value, R_flag_val, sentinel) {					\
-	int __cmp;								\
-	struct fd_list * __li;							\
+/* For search of objects in the index. "match" is evaluated on each candidate object __o with the same hash value */
+#define SEARCH_hash( hashval, objtype, match ) {				\
+	struct dict_object * __o;						\
+	uint32_t __h = (hashval);						\
 	ret = 0;								\
-	for  (__li = (sentinel)->next; __li != (sentinel); __li = __li->next) {	\
-		__cmp = ORDER_scalar(value, 					\
-				_O(__li->o)->data.cmd.cmd_code );		\
-		if (__cmp == 0) {						\
-			uint8_t __mask, __val;					\
-			__mask = _O(__li->o)->data.cmd.cmd_flag_mask;		\
-			__val  = _O(__li->o)->data.cmd.cmd_flag_val;		\
-			if ( ! (__mask & CMD_FLAG_REQUEST) )			\
-				continue;					\
-			if ( ( __val & CMD_FLAG_REQUEST ) != R_flag_val )	\
-				continue;					\
+	for (__o = dict->dict_hash[__h & (dict->dict_hash_size - 1)]; 		\
+			__o != NULL; __o = __o->hash_next) {			\
+		if ((__o->hash == __h) && (__o->type == (objtype)) && (match)) {\
 			if (result)						\
-				*result = _O(__li->o);				\
+				*result = __o;					\
 			goto end;						\
 		}								\
-		if (__cmp < 0)							\
-			break;							\
 	}									\
 	if (result)								\
 		*result = NULL;							\
@@ -750,7 +901,13 @@ static int search_vendor ( struct dictionary * dict, int criteria, const void *
 	switch (criteria) {
 		case VENDOR_BY_ID:
 			id = *(vendor_id_t *) what;
-			SEARCH_scalar( id, &dict->dict_vendors.list[0], vendor.vendor_id, 1, &dict->dict_vendors );
+			if (id == 0) {
+				/* The sentinel is not in the index */
+				if (result)
+					*result = &dict->dict_vendors;
+				break;
+			}
+			SEARCH_hash( HASH_id( DICT_VENDOR, id ), DICT_VENDOR, __o->data.vendor.vendor_id == id );
 			break;
 				
 		case VENDOR_BY_NAME:
@@ -786,8 +943,13 @@ static int search_application ( struct dictionary * dict, int criteria, const vo
 	switch (criteria) {
 		case APPLICATION_BY_ID:
 			id = *(application_id_t *) what;
-
-			SEARCH_scalar( id, &dict->dict_applications.list[0],  application.application_id, 1, &dict->dict_applications );
+			if (id == 0) {
+				/* The sentinel is not in the index */
+				if (result)
+					*result = &dict->dict_applications;
+				break;
+			}
+			SEARCH_hash( HASH_id( DICT_APPLICATION, id ), DICT_APPLICATION, __o->data.application.application_id == id );
 			break;
 				
 		case APPLICATION_BY_NAME:
@@ -874,67 +1036,11 @@ static int search_enumval ( struct dictionary * dict, int criteria, const void *
 					SEARCH_os0(  _what->search.enum_name, &parent->list[1], enumval.enum_name, 1 );
 				} else {
 					/* We are looking for the value in enum_value */
-					switch (parent->data.type.type_base) {
-						case AVP_TYPE_OCTETSTRING:
-							SEARCH_os(	 _what->search.enum_value.os.data, 
-									 _what->search.enum_value.os.len, 
-									 &parent->list[2], 
-									 enumval.enum_value.os , 
-									 1 );
-							break;
-
-						case AVP_TYPE_INTEGER32:
-							SEARCH_scalar(	_what->search.enum_value.i32,
-									&parent->list[2],
-									enumval.enum_value.i32,
-									1,
-									(struct dict_object *)NULL);
-							break;
-							
-						case AVP_TYPE_INTEGER64:
-							SEARCH_scalar(	_what->search.enum_value.i64,
-									&parent->list[2],
-									enumval.enum_value.i64,
-									1,
-									(struct dict_object *)NULL);
-							break;
-							
-						case AVP_TYPE_UNSIGNED32:
-							SEARCH_scalar(	_what->search.enum_value.u32,
-									&parent->list[2],
-									enumval.enum_value.u32,
-									1,
-									(struct dict_object *)NULL);
-							break;
-							
-						case AVP_TYPE_UNSIGNED64:
-							SEARCH_scalar(	_what->search.enum_value.u64,
-									&parent->list[2],
-									enumval.enum_value.u64,
-									1,
-									(struct dict_object *)NULL);
-							break;
-							
-						case AVP_TYPE_FLOAT32:
-							SEARCH_scalar(	_what->search.enum_value.f32,
-									&parent->list[2],
-									enumval.enum_value.f32,
-									1,
-									(struct dict_object *)NULL);
-							break;
-							
-						case AVP_TYPE_FLOAT64:
-							SEARCH_scalar(	_what->search.enum_value.f64,
-									&parent->list[2],
-									enumval.enum_value.f64,
-									1,
-									(struct dict_object *)NULL);
-							break;
-							
-						default:
-							/* Invalid parent type basetype */
-							CHECK_PARAMS( parent = NULL );
-					}
+					CHECK_PARAMS( (parent->data.type.type_base != AVP_TYPE_GROUPED) 
+							&& (parent->data.type.type_base <= AVP_TYPE_MAX) );
+					SEARCH_hash( hash_enumval(parent, &_what->search.enum_value), DICT_ENUMVAL,
+							(__o->parent == parent) 
+							&& !cmp_enum_val(parent->data.type.type_base, &_what->search.enum_value, &__o->data.enumval.enum_value) );
 				}
 				
 			}
@@ -961,7 +1067,8 @@ static int search_avp ( struct dictionary * dict, int criteria, const void * wha
 				avp_code_t code;
 				code = *(avp_code_t *) what;
 
-				SEARCH_scalar( code, &dict->dict_vendors.list[1],  avp.avp_code, 1, (struct dict_object *)NULL );
+				SEARCH_hash( HASH_codevnd( DICT_AVP, code, 0 ), DICT_AVP, 
+						(__o->data.avp.avp_code == code) && (__o->data.avp.avp_vendor == 0) );
 			}
 			break;
 				
@@ -978,6 +1085,13 @@ static int search_avp ( struct dictionary * dict, int criteria, const void * wha
 				
 				CHECK_PARAMS( (criteria != AVP_BY_NAME_AND_VENDOR) || _what->avp_name  );
 				
+				if (criteria == AVP_BY_CODE_AND_VENDOR) {
+					/* Use the index directly. If the vendor does not exist, there is no AVP with this vendor either */
+					SEARCH_hash( HASH_codevnd( DICT_AVP, _what->avp_code, _what->avp_vendor ), DICT_AVP, 
+							(__o->data.avp.avp_code == _what->avp_code) && (__o->data.avp.avp_vendor == _what->avp_vendor) );
+					break;
+				}
+				
 				/* Now look for the vendor first */
 				CHECK_FCT( search_vendor( dict, VENDOR_BY_ID, &_what->avp_vendor, &vendor ) );
 				if (vendor == NULL) {
@@ -989,12 +1103,7 @@ static int search_avp ( struct dictionary * dict, int criteria, const void * wha
 				}
 				
 				/* We now have our vendor = head of the appropriate avp list */
-				if (criteria == AVP_BY_NAME_AND_VENDOR) {
-					SEARCH_os0( _what->avp_name, &vendor->list[2], avp.avp_name, 1);
-				} else {
-					/* AVP_BY_CODE_AND_VENDOR */
-					SEARCH_scalar( _what->avp_code, &vendor->list[1], avp.avp_code, 1, (struct dict_object *)NULL );
-				}
+				SEARCH_os0( _what->avp_name, &vendor->list[2], avp.avp_name, 1);
 			}
 			break;
 		
@@ -1028,7 +1137,8 @@ static int search_avp ( struct dictionary * dict, int criteria, const void * wha
 				/* We now have our vendor = head of the appropriate avp list */
 				if (_what->avp_data.avp_code) {
 					CHECK_PARAMS( ! _what->avp_data.avp_name );
-					SEARCH_scalar( _what->avp_data.avp_code, &vendor->list[1], avp.avp_code, 1, (struct dict_object *)NULL );
+					SEARCH_hash( HASH_codevnd( DICT_AVP, _what->avp_data.avp_code, vendor->data.vendor.vendor_id ), DICT_AVP, 
+							(__o->data.avp.avp_code == _what->avp_data.avp_code) && (__o->data.avp.avp_vendor == vendor->data.vendor.vendor_id) );
 				} else {
 					SEARCH_os0( _what->avp_data.avp_name, &vendor->list[2], avp.avp_name, 1);
 				}
@@ -1085,7 +1195,8 @@ static int search_cmd ( struct dictionary * dict, int criteria, const void * wha
 				}
 				
 				/* perform the search */
-				SEARCH_codefl( code, searchfl, &dict->dict_cmd_code );
+				SEARCH_hash( HASH_codevnd( DICT_COMMAND, code, searchfl ), DICT_COMMAND, 
+						(__o->data.cmd.cmd_code == code) && ((__o->data.cmd.cmd_flag_val & CMD_FLAG_REQUEST) == searchfl) );
 			}
 			break;
 				
@@ -1762,8 +1873,9 @@ int fd_dict_new ( struct dictionary * dict, enum dict_object_type type, void * d
 			ASSERT(0);
 	}
 	
-	/* A new object has been created, increment the global counter */
+	/* A new object has been created, increment the global counter and add it in the index */
 	dict->dict_count[type]++;
+	hash_link(dict, new);
 	
 	/* Unlock the dictionary */
 	CHECK_POSIX_DO(  ret = pthread_rwlock_unlock(&dict->dict_lock),  goto error_free  );
@@ -2147,6 +2259,10 @@ int fd_dict_init ( struct dictionary ** dict)
 	/* Initialize the lock for the dictionary */
 	CHECK_POSIX(  pthread_rwlock_init(&new->dict_lock, NULL)  );
 	
+	/* Initialize the index */
+	CHECK_MALLOC( new->dict_hash = calloc(DICT_HASH_INITIAL_SIZE, sizeof(struct dict_object *)) );
+	new->dict_hash_size = DICT_HASH_INITIAL_SIZE;
+	
 	/* Initialize the sentinel for vendors and AVP lists */
 	init_object( &new->dict_vendors, DICT_VENDOR );
 	#define NO_VENDOR_NAME	"(no vendor)"
@@ -2205,6 +2321,8 @@ int fd_dict_fini ( struct dictionary ** dict)
 		destroy_list ( &(*dict)->dict_applications.list[i] );
 		destroy_list ( &(*dict)->dict_vendors.list[i] );
 	}
+	ASSERT( (*dict)->dict_hash_count == 0 );
+	free((*dict)->dict_hash);
 	
 	/* Dictionary is empty, now destroy the lock */
 	CHECK_POSIX(  pthread_rwlock_unlock(&(*dict)->dict_lock)  );
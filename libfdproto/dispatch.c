@@ -48,6 +48,10 @@ static struct fd_list all_handlers = FD_LIST_INITIALIZER( all_handlers );
 /* List of handlers registered for DISP_HOW_ANY. Other handlers are stored in the dictionary */
 static struct fd_list any_handlers = FD_LIST_INITIALIZER( any_handlers );
 
+/* Number of handlers registered for DISP_HOW_AVP and DISP_HOW_AVP_ENUMVAL. When there is none, 
+ * fd_msg_dispatch does not need to walk the AVPs of the messages at all. */
+int fd_disp_avp_hdl = 0;
+
 /* The structure to store a callback */
 struct disp_hdl {
 	int		 eyec;	/* Eye catcher, DISP_EYEC */
@@ -114,6 +118,17 @@ int fd_disp_call_cb_int( struct fd_list * cb_list, struct msg ** msg, struct avp
 	return 0;
 }
 
+/* Check if some handlers in a cb_list are registered for specific enumerated values -- must have locked fd_disp_lock before */
+int fd_disp_need_enumval(struct fd_list * cb_list)
+{
+	struct fd_list * li;
+	for (li = cb_list->next; li != cb_list; li = li->next) {
+		if (((struct disp_hdl *)(li->o))->when.value)
+			return 1;
+	}
+	return 0;
+}
+
 /**************************************************************************************/
 
 /* Create a new handler and link it */
@@ -187,6 +202,8 @@ int fd_disp_register ( int (*cb)( struct msg **, struct avp *, struct session *,
 	CHECK_POSIX( pthread_rwlock_wrlock(&fd_disp_lock) );
 	fd_list_insert_before(&all_handlers, &new->all);
 	fd_list_insert_before(cb_list, &new->parent);
+	if ((how == DISP_HOW_AVP) || (how == DISP_HOW_AVP_ENUMVAL))
+		fd_disp_avp_hdl++;
 	CHECK_POSIX( pthread_rwlock_unlock(&fd_disp_lock) );
 	
 	/* We're done */
@@ -208,6 +225,8 @@ int fd_disp_unregister ( struct disp_hdl ** handle, void ** opaque )
 	CHECK_POSIX( pthread_rwlock_wrlock(&fd_disp_lock) );
 	fd_list_unlink(&del->all);
 	fd_list_unlink(&del->parent);
+	if ((del->how == DISP_HOW_AVP) || (del->how == DISP_HOW_AVP_ENUMVAL))
+		fd_disp_avp_hdl--;
 	CHECK_POSIX( pthread_rwlock_unlock(&fd_disp_lock) );
 	
 	if (opaque)
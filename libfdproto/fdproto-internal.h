@@ -44,6 +44,7 @@
 /* Internal to the library */
 extern const char * type_base_name[];
 void fd_msg_eteid_init(void);
+int fd_msg_cache_init(void);
 int fd_sess_init(void);
 void fd_sess_fini(void);
 
@@ -57,6 +58,8 @@ int fd_disp_call_cb_int( struct fd_list * cb_list, struct msg ** msg, struct avp
 			struct dict_object * obj_app, struct dict_object * obj_cmd, struct dict_object * obj_avp, struct dict_object * obj_enu,
 			char ** drop_reason, struct msg ** drop_msg);
 extern pthread_rwlock_t fd_disp_lock;
+extern int fd_disp_avp_hdl;
+int fd_disp_need_enumval(struct fd_list * cb_list);
 
 /* Messages / sessions API */
 int fd_sess_reclaim_msg ( struct session ** session );
@@ -43,6 +43,12 @@
  *  -> pthread_cancel any thread that could be waiting on the queue.
  *  -> consume any element that is in the queue, using fd_qu_tryget_int.
  *  -> then destroy the queue using fd_mq_del.
+ *
+ * The queues created with fd_fifo_new_ring store the items in a bounded array of cells instead of a list. 
+ * Each cell has a sequence number telling if it is ready to be written or read for a given position, so 
+ * that the threads claim the positions with a compare-and-swap (or a simple store if there is a single producer
+ * and a single consumer), without taking the mutex. The mutex and condition variables are only used by threads
+ * that must wait (queue empty or full), and by those that wake them up when they are registered in thrs / thrs_push.
  */
 
 #include "fdproto-internal.h"
@@ -74,7 +80,10 @@ struct fifo {
 	struct timespec total_time;    /* Cumulated time all items spent in this queue, including blocking time (always growing, use deltas for monitoring) */
 	struct timespec blocking_time; /* Cumulated time threads trying to post new items were blocked (queue full). */
 	struct timespec last_time;     /* For the last element retrieved from the queue, how long it take between posting (including blocking) and poping */
+	void		(*w_cb)(void *, long long); /* If not NULL, called with the time each measured item spent in the queue */
+	void		*w_data; /* Opaque pointer for w_cb */
 	
+	struct fifo_ring *ring;	/* If not NULL, the items are stored in this ring instead of the list */
 };
 
 struct fifo_item {
@@ -82,6 +91,30 @@ struct fifo_item {
 	struct timespec  posted_on;
 };
 
+/* In ring mode, the timings are measured for 1 item out of FIFO_RING_SAMPLING (pow of 2) only, when FIFO_RING_STATS is set */
+#define FIFO_RING_SAMPLING	64
+
+struct fifo_cell {
+	size_t		 seq;	/* == position: free for writing at this position; == position + 1: contains the item for this position */
+	void		*item;
+	struct timespec  posted_on; /* for sampled items */
+};
+
+struct fifo_ring {
+	size_t		 mask;	/* number of cells - 1 */
+	int		 flags;	/* FIFO_RING_* */
+	size_t		 enq __attribute__ ((aligned (64))); /* next position to post, only increasing */
+	size_t		 deq __attribute__ ((aligned (64))); /* next position to get, only increasing. It is also the total number of items */
+	struct fifo_cell cells[] __attribute__ ((aligned (64)));
+};
+
+/* Number of items in a ring, including those being posted or retrieved. deq is read first so the result is never negative */
+static __inline__ int ring_count(struct fifo_ring * r)
+{
+	size_t deq = __atomic_load_n(&r->deq, __ATOMIC_ACQUIRE);
+	return (int)(__atomic_load_n(&r->enq, __ATOMIC_ACQUIRE) - deq);
+}
+
 /* The eye catcher value */
 #define FIFO_EYEC	0xe7ec1130
 
@@ -117,6 +150,37 @@ int fd_fifo_new ( struct fifo ** queue, int max )
 	return 0;
 }
 
+/* Create a new queue in ring mode */
+int fd_fifo_new_ring ( struct fifo ** queue, int max, int flags )
+{
+	struct fifo * new;
+	struct fifo_ring * ring;
+	size_t size = 2, i;
+	
+	TRACE_ENTRY( "%p %d %x", queue, max, flags );
+	
+	CHECK_PARAMS( queue && (max > 0) && !(flags & ~(FIFO_RING_SPSC | FIFO_RING_STATS)) );
+	
+	/* The ring has room for twice max items, so that fd_fifo_post_noblock can exceed max as in list mode */
+	while (size < 2 * (size_t)max)
+		size <<= 1;
+	CHECK_POSIX( posix_memalign((void **)&ring, 64, sizeof(struct fifo_ring) + size * sizeof(struct fifo_cell)) );
+	memset(ring, 0, sizeof(struct fifo_ring));
+	ring->mask = size - 1;
+	ring->flags = flags;
+	for (i = 0; i < size; i++) {
+		ring->cells[i].seq = i;
+		ring->cells[i].item = NULL;
+	}
+	
+	CHECK_FCT_DO( fd_fifo_new(&new, max), { free(ring); return __ret__; } );
+	new->ring = ring;
+	
+	/* We're done */
+	*queue = new;
+	return 0;
+}
+
 /* Dump the content of a queue */
 DECLARE_FD_DUMP_PROTOTYPE(fd_fifo_dump, char * name, struct fifo * queue, fd_fifo_dump_item_cb dump_item)
 {
@@ -133,14 +197,15 @@ DECLARE_FD_DUMP_PROTOTYPE(fd_fifo_dump, char * name, struct fifo * queue, fd_fif
 	}
 	
 	CHECK_POSIX_DO(  pthread_mutex_lock( &queue->mtx ), /* continue */  );
-	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "items:%d,%d,%d threads:%d,%d stats:%lld/%ld.%06ld,%ld.%06ld,%ld.%06ld thresholds:%d,%d,%d,%p,%p,%p", 
-						queue->count, queue->highest_ever, queue->max,
+	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "%sitems:%d,%d,%d threads:%d,%d stats:%lld/%ld.%06ld,%ld.%06ld,%ld.%06ld thresholds:%d,%d,%d,%p,%p,%p", 
+						queue->ring ? "ring " : "",
+						queue->ring ? ring_count(queue->ring) : queue->count, queue->highest_ever, queue->max,
 						queue->thrs, queue->thrs_push,
-						queue->total_items,(long)queue->total_time.tv_sec,(long)(queue->total_time.tv_nsec/1000),(long)queue->blocking_time.tv_sec,(long)(queue->blocking_time.tv_nsec/1000),(long)queue->last_time.tv_sec,(long)(queue->last_time.tv_nsec/1000),
+						queue->ring ? (long long)__atomic_load_n(&queue->ring->deq, __ATOMIC_RELAXED) : queue->total_items,(long)queue->total_time.tv_sec,(long)(queue->total_time.tv_nsec/1000),(long)queue->blocking_time.tv_sec,(long)(queue->blocking_time.tv_nsec/1000),(long)queue->last_time.tv_sec,(long)(queue->last_time.tv_nsec/1000),
 						queue->high, queue->low, queue->highest, queue->h_cb, queue->l_cb, queue->data), 
 			 goto error);
 	
-	if (dump_item) {
+	if (dump_item && !queue->ring) { /* the items in a ring may be retrieved by other threads meanwhile */
 		struct fd_list * li;
 		int i = 0;
 		for (li = queue->list.next; li != &queue->list; li = li->next) {
@@ -173,8 +238,8 @@ int fd_fifo_del ( struct fifo  ** queue )
 	
 	CHECK_POSIX(  pthread_mutex_lock( &q->mtx )  );
 	
-	if ((q->count != 0) || (q->data != NULL)) {
-		TRACE_DEBUG(INFO, "The queue cannot be destroyed (%d, %p)", q->count, q->data);
+	if ((q->count != 0) || (q->ring && ring_count(q->ring)) || (q->data != NULL)) {
+		TRACE_DEBUG(INFO, "The queue cannot be destroyed (%d, %p)", q->ring ? ring_count(q->ring) : q->count, q->data);
 		CHECK_POSIX_DO(  pthread_mutex_unlock( &q->mtx ), /* no fallback */  );
 		return EINVAL;
 	}
@@ -204,6 +269,7 @@ int fd_fifo_del ( struct fifo  ** queue )
 	
 	CHECK_POSIX_DO(  pthread_mutex_destroy( &q->mtx ),  );
 	
+	free(q->ring);
 	free(q);
 	*queue = NULL;
 	
@@ -219,6 +285,7 @@ int fd_fifo_move ( struct fifo * old, struct fifo * new, struct fifo ** loc_upda
 	CHECK_PARAMS( CHECK_FIFO( old ) && CHECK_FIFO( new ));
 	
 	CHECK_PARAMS( ! old->data );
+	CHECK_PARAMS( ! old->ring && ! new->ring );
 	if (new->high) {
 		TODO("Implement support for thresholds in fd_fifo_move...");
 	}
@@ -295,7 +362,7 @@ int fd_fifo_getstats( struct fifo * queue, int * current_count, int * limit_coun
 	CHECK_POSIX(  pthread_mutex_lock( &queue->mtx )  );
 	
 	if (current_count)
-		*current_count = queue->count;
+		*current_count = queue->ring ? ring_count(queue->ring) : queue->count;
 	
 	if (limit_count)
 		*limit_count = queue->max;
@@ -304,7 +371,7 @@ int fd_fifo_getstats( struct fifo * queue, int * current_count, int * limit_coun
 		*highest_count = queue->highest_ever;
 	
 	if (total_count)
-		*total_count = queue->total_items;
+		*total_count = queue->ring ? (long long)__atomic_load_n(&queue->ring->deq, __ATOMIC_RELAXED) : queue->total_items;
 	
 	if (total)
 		memcpy(total, &queue->total_time, sizeof(struct timespec));
@@ -329,6 +396,9 @@ int fd_fifo_length ( struct fifo * queue )
 	if ( !CHECK_FIFO( queue ) )
 		return 0;
 	
+	if (queue->ring)
+		return ring_count(queue->ring);
+	
 	return queue->count; /* Let's hope it's read atomically, since we are not locking... */
 }
 
@@ -358,6 +428,22 @@ int fd_fifo_setthrhd ( struct fifo * queue, void * data, uint16_t high, void (*h
 }
 
 
+/* Set the callback receiving the time spent by the items in the queue */
+int fd_fifo_setwaitcb ( struct fifo * queue, void (*w_cb)(void *, long long), void * w_data )
+{
+	TRACE_ENTRY( "%p %p %p", queue, w_cb, w_data );
+	
+	/* Check the parameters */
+	CHECK_PARAMS( CHECK_FIFO( queue ) );
+	
+	CHECK_POSIX(  pthread_mutex_lock( &queue->mtx )  );
+	queue->w_cb = w_cb;
+	queue->w_data = w_data;
+	CHECK_POSIX(  pthread_mutex_unlock( &queue->mtx )  );
+	
+	return 0;
+}
+
 /* This handler is called when a thread is blocked on a queue, and cancelled */
 static void fifo_cleanup_push(void * queue)
 {
@@ -365,7 +451,7 @@ static void fifo_cleanup_push(void * queue)
 	TRACE_ENTRY( "%p", queue );
 	
 	/* The thread has been cancelled, therefore it does not wait on the queue anymore */
-	q->thrs_push--;
+	__atomic_sub_fetch(&q->thrs_push, 1, __ATOMIC_SEQ_CST); /* read without the lock in ring mode */
 	
 	/* Now unlock the queue, and we're done */
 	CHECK_POSIX_DO(  pthread_mutex_unlock( &q->mtx ),  /* nothing */  );
@@ -375,13 +461,262 @@ static void fifo_cleanup_push(void * queue)
 }
 
 
+/* This handler is called when a thread is blocked on a queue, and cancelled */
+static void fifo_cleanup(void * queue)
+{
+	struct fifo * q = (struct fifo *)queue;
+	TRACE_ENTRY( "%p", queue );
+	
+	/* The thread has been cancelled, therefore it does not wait on the queue anymore */
+	__atomic_sub_fetch(&q->thrs, 1, __ATOMIC_SEQ_CST); /* read without the lock in ring mode */
+	
+	/* Now unlock the queue, and we're done */
+	CHECK_POSIX_DO(  pthread_mutex_unlock( &q->mtx ),  /* nothing */  );
+	
+	/* End of cleanup handler */
+	return;
+}
+
+/* Add elapsed time since *from to *acc, multiplied by mult. Returns the elapsed time in ns. */
+static long long add_elapsed(struct timespec * acc, struct timespec * from, int mult)
+{
+	struct timespec now;
+	long long elapsed, total;
+	
+	CHECK_SYS_DO(  clock_gettime(CLOCK_REALTIME, &now), return 0  );
+	elapsed = (now.tv_sec - from->tv_sec) * 1000000000;
+	elapsed += now.tv_nsec - from->tv_nsec;
+	
+	total = elapsed * mult + acc->tv_nsec;
+	acc->tv_sec += total / 1000000000;
+	acc->tv_nsec = total % 1000000000;
+	return elapsed;
+}
+
+/* Ring mode: claim the next position and store the item. Returns ENOSPC if all the cells are in use. */
+static int ring_push(struct fifo_ring * r, void * item, size_t * ppos)
+{
+	struct fifo_cell * c;
+	size_t pos = __atomic_load_n(&r->enq, __ATOMIC_RELAXED);
+	
+	for (;;) {
+		ssize_t dif;
+		c = &r->cells[pos & r->mask];
+		dif = (ssize_t)(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - pos);
+		if (dif == 0) {
+			/* The cell is free for this position, claim it */
+			if (r->flags & FIFO_RING_SPSC) {
+				__atomic_store_n(&r->enq, pos + 1, __ATOMIC_RELAXED);
+				break;
+			}
+			if (__atomic_compare_exchange_n(&r->enq, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+			/* pos was updated by the failed CAS */
+		} else if (dif < 0) {
+			/* The cell still holds the item from the previous round */
+			return ENOSPC;
+		} else {
+			/* Another producer took this position */
+			pos = __atomic_load_n(&r->enq, __ATOMIC_RELAXED);
+		}
+	}
+	
+	c->item = item;
+	if ((r->flags & FIFO_RING_STATS) && !(pos & (FIFO_RING_SAMPLING - 1))) {
+		CHECK_SYS_DO(  clock_gettime(CLOCK_REALTIME, &c->posted_on), /* continue */  );
+	}
+	
+	/* Publish */
+	__atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+	*ppos = pos;
+	return 0;
+}
+
+/* Ring mode: retrieve the oldest published item. Returns EWOULDBLOCK if there is none. */
+static int ring_pop(struct fifo_ring * r, void ** item, size_t * ppos, struct timespec * posted_on)
+{
+	struct fifo_cell * c;
+	size_t pos = __atomic_load_n(&r->deq, __ATOMIC_RELAXED);
+	
+	for (;;) {
+		ssize_t dif;
+		c = &r->cells[pos & r->mask];
+		dif = (ssize_t)(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+		if (dif == 0) {
+			if (r->flags & FIFO_RING_SPSC) {
+				__atomic_store_n(&r->deq, pos + 1, __ATOMIC_RELAXED);
+				break;
+			}
+			if (__atomic_compare_exchange_n(&r->deq, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			/* Empty, or the producer of this position has not published yet */
+			return EWOULDBLOCK;
+		} else {
+			pos = __atomic_load_n(&r->deq, __ATOMIC_RELAXED);
+		}
+	}
+	
+	*item = c->item;
+	if ((r->flags & FIFO_RING_STATS) && !(pos & (FIFO_RING_SAMPLING - 1)))
+		memcpy(posted_on, &c->posted_on, sizeof(struct timespec));
+	
+	/* Release the cell for the position in the next round */
+	__atomic_store_n(&c->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+	*ppos = pos;
+	return 0;
+}
+
+/* Ring mode: wake up one thread waiting on the condition, if any. The fence pairs with the one in the waiting thread. */
+static __inline__ void ring_wake(struct fifo * queue, int * thrs, pthread_cond_t * cond)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(thrs, __ATOMIC_RELAXED) > 0) {
+		CHECK_POSIX_DO(  pthread_mutex_lock( &queue->mtx ), return  );
+		CHECK_POSIX_DO(  pthread_cond_signal( cond ), );
+		CHECK_POSIX_DO(  pthread_mutex_unlock( &queue->mtx ), );
+	}
+}
+
+/* Ring mode: post an item */
+static int ring_post(struct fifo * queue, void * item, int skip_max)
+{
+	struct fifo_ring * r = queue->ring;
+	size_t pos;
+	int cnt, h, ret;
+	
+	for (;;) {
+		if (skip_max || (ring_count(r) < queue->max)) {
+			ret = ring_push(r, item, &pos);
+			if (ret == 0)
+				break;
+			if (skip_max)
+				return ret;
+		}
+		
+		/* We have to wait for an item to be pulled */
+		CHECK_POSIX(  pthread_mutex_lock( &queue->mtx )  );
+		__atomic_add_fetch(&queue->thrs_push, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (ring_count(r) >= queue->max) {
+			struct timespec blocked_on;
+			CHECK_SYS_DO(  clock_gettime(CLOCK_REALTIME, &blocked_on), /* continue */  );
+			pthread_cleanup_push( fifo_cleanup_push, queue);
+			ret = pthread_cond_wait( &queue->cond_push, &queue->mtx );
+			pthread_cleanup_pop(0);
+			ASSERT( ret == 0 );
+			(void) add_elapsed(&queue->blocking_time, &blocked_on, 1);
+		}
+		__atomic_sub_fetch(&queue->thrs_push, 1, __ATOMIC_SEQ_CST);
+		CHECK_POSIX(  pthread_mutex_unlock( &queue->mtx )  );
+	}
+	
+	ring_wake(queue, &queue->thrs, &queue->cond_pull);
+	
+	/* Update the highest count and call the high-watermark cb as needed. The count is only approximate when several threads use the queue. */
+	cnt = (int)(pos + 1 - __atomic_load_n(&r->deq, __ATOMIC_RELAXED));
+	if (cnt <= 0)
+		return 0;
+	h = __atomic_load_n(&queue->highest_ever, __ATOMIC_RELAXED);
+	while ((cnt > h) && !__atomic_compare_exchange_n(&queue->highest_ever, &h, cnt, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		/* h was updated */ ;
+	if (queue->high && ((cnt % queue->high) == 0)) {
+		CHECK_POSIX(  pthread_mutex_lock( &queue->mtx )  );
+		queue->highest = cnt;
+		CHECK_POSIX(  pthread_mutex_unlock( &queue->mtx )  );
+		if (queue->h_cb)
+			(*queue->h_cb)(queue, &queue->data);
+	}
+	
+	return 0;
+}
+
+/* Ring mode: retrieve an item, waiting for one if needed. abstime is only used if istimed is set. */
+static int ring_get(struct fifo * queue, void ** item, int wait, int istimed, const struct timespec *abstime)
+{
+	struct fifo_ring * r = queue->ring;
+	struct timespec posted_on = { 0, 0 };
+	size_t pos;
+	int ret = 0, cnt, got, call_cb = 0;
+	
+	while (ring_pop(r, item, &pos, &posted_on)) {
+		if (!wait)
+			return EWOULDBLOCK;
+		
+		/* We have to wait for a new item */
+		CHECK_POSIX(  pthread_mutex_lock( &queue->mtx )  );
+		if (!CHECK_FIFO( queue )) {
+			/* The queue is being destroyed */
+			CHECK_POSIX(  pthread_mutex_unlock( &queue->mtx )  );
+			TRACE_DEBUG(FULL, "The queue is being destroyed -> EPIPE");
+			return EPIPE;
+		}
+		__atomic_add_fetch(&queue->thrs, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		got = !ring_pop(r, item, &pos, &posted_on);
+		if (!got) {
+			pthread_cleanup_push( fifo_cleanup, queue);
+			if (istimed) {
+				ret = pthread_cond_timedwait( &queue->cond_pull, &queue->mtx, abstime );
+			} else {
+				ret = pthread_cond_wait( &queue->cond_pull, &queue->mtx );
+			}
+			pthread_cleanup_pop(0);
+		}
+		__atomic_sub_fetch(&queue->thrs, 1, __ATOMIC_SEQ_CST);
+		CHECK_POSIX(  pthread_mutex_unlock( &queue->mtx )  );
+		
+		if (got)
+			break;
+		
+		if (ret != 0)
+			return ret; /* ETIMEDOUT / other error */
+		
+		/* test for spurious wake-ups */
+	}
+	
+	ring_wake(queue, &queue->thrs_push, &queue->cond_push);
+	
+	cnt = (int)(__atomic_load_n(&r->enq, __ATOMIC_RELAXED) - (pos + 1));
+	
+	if (posted_on.tv_sec || ((queue->high != 0) && (queue->low != 0) && (queue->l_cb != 0) && ((cnt % queue->high) == queue->low))) {
+		CHECK_POSIX(  pthread_mutex_lock( &queue->mtx )  );
+		if (posted_on.tv_sec) {
+			/* Sampled item: account for all the items it represents */
+			long long elapsed = add_elapsed(&queue->total_time, &posted_on, FIFO_RING_SAMPLING);
+			queue->last_time.tv_sec = elapsed / 1000000000;
+			queue->last_time.tv_nsec = elapsed % 1000000000;
+			if (queue->w_cb)
+				(*queue->w_cb)(queue->w_data, elapsed);
+		}
+		if ((queue->high != 0) && (queue->low != 0) && (queue->l_cb != 0) && ((cnt % queue->high) == queue->low) && (queue->highest > cnt)) {
+			queue->highest -= queue->high;
+			call_cb = 1;
+		}
+		CHECK_POSIX(  pthread_mutex_unlock( &queue->mtx )  );
+	}
+	
+	/* Call low watermark callback as needed */
+	if (call_cb)
+		(*queue->l_cb)(queue, &queue->data);
+	
+	return 0;
+}
+
 /* Post a new item in the queue */
 int fd_fifo_post_internal ( struct fifo * queue, void ** item, int skip_max )
 {
 	struct fifo_item * new;
-	int call_cb = 0;
+	int call_cb = 0, blocked = 0;
 	struct timespec posted_on, queued_on;
 	
+	if (queue->ring) {
+		int ret = ring_post(queue, *item, skip_max);
+		if (ret == 0)
+			*item = NULL;
+		return ret;
+	}
+	
 	/* Get the timing of this call */
 	CHECK_SYS(  clock_gettime(CLOCK_REALTIME, &posted_on)  );
 	
@@ -398,6 +733,7 @@ int fd_fifo_post_internal ( struct fifo * queue, void ** item, int skip_max )
 			ret = pthread_cond_wait( &queue->cond_push, &queue->mtx );
 			pthread_cleanup_pop(0);
 			queue->thrs_push-- ;
+			blocked = 1;
 			
 			ASSERT( ret == 0 );
 		}
@@ -425,8 +761,8 @@ int fd_fifo_post_internal ( struct fifo * queue, void ** item, int skip_max )
 	/* store timing */
 	memcpy(&new->posted_on, &posted_on, sizeof(struct timespec));
 	
-	/* update queue timing info "blocking time" */
-	{
+	/* update queue timing info "blocking time", only when the queue was full */
+	if (blocked) {
 		long long blocked_ns;
 		CHECK_SYS(  clock_gettime(CLOCK_REALTIME, &queued_on)  );
 		blocked_ns = (queued_on.tv_sec - posted_on.tv_sec) * 1000000000;
@@ -504,6 +840,9 @@ static void * mq_pop(struct fifo * queue)
 		queue->last_time.tv_sec = elapsed / 1000000000;
 		queue->last_time.tv_nsec = elapsed % 1000000000;
 		
+		if (queue->w_cb)
+			(*queue->w_cb)(queue->w_data, elapsed);
+		
 		elapsed += queue->total_time.tv_nsec;
 		queue->total_time.tv_sec += elapsed / 1000000000;
 		queue->total_time.tv_nsec = elapsed % 1000000000;
@@ -543,6 +882,13 @@ int fd_fifo_tryget_int ( struct fifo * queue, void ** item )
 	/* Check the parameters */
 	CHECK_PARAMS( CHECK_FIFO( queue ) && item );
 	
+	if (queue->ring) {
+		int ret = ring_get(queue, item, 0, 0, NULL);
+		if (ret)
+			*item = NULL;
+		return ret;
+	}
+	
 	/* lock the queue */
 	CHECK_POSIX(  pthread_mutex_lock( &queue->mtx )  );
 	
@@ -578,22 +924,6 @@ got_item:
 	return wouldblock ? EWOULDBLOCK : 0;
 }
 
-/* This handler is called when a thread is blocked on a queue, and cancelled */
-static void fifo_cleanup(void * queue)
-{
-	struct fifo * q = (struct fifo *)queue;
-	TRACE_ENTRY( "%p", queue );
-	
-	/* The thread has been cancelled, therefore it does not wait on the queue anymore */
-	q->thrs--;
-	
-	/* Now unlock the queue, and we're done */
-	CHECK_POSIX_DO(  pthread_mutex_unlock( &q->mtx ),  /* nothing */  );
-	
-	/* End of cleanup handler */
-	return;
-}
-
 /* The internal function for fd_fifo_timedget and fd_fifo_get */
 static int fifo_tget ( struct fifo * queue, void ** item, int istimed, const struct timespec *abstime)
 {
@@ -606,6 +936,13 @@ static int fifo_tget ( struct fifo * queue, void ** item, int istimed, const str
 	/* Initialize the return value */
 	*item = NULL;
 	
+	if (queue->ring) {
+		ret = ring_get(queue, item, 1, istimed, abstime);
+		if (ret)
+			*item = NULL;
+		return ret;
+	}
+	
 	/* lock the queue */
 	CHECK_POSIX(  pthread_mutex_lock( &queue->mtx )  );
 	
@@ -676,14 +1013,20 @@ int fd_fifo_select ( struct fifo * queue, const struct timespec *abstime )
 	CHECK_POSIX_DO(  pthread_mutex_lock( &queue->mtx ), return -__ret__  );
 	
 awaken:	
-	ret = (queue->count > 0 ) ? queue->count : 0;
-	if ((ret == 0) && (abstime != NULL)) {
+	ret = queue->ring ? ring_count(queue->ring) : queue->count;
+	if ((ret <= 0) && (abstime != NULL)) {
 		/* We have to wait for a new item */
-		queue->thrs++ ;
+		__atomic_add_fetch(&queue->thrs, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (queue->ring && ring_count(queue->ring)) {
+			/* posted meanwhile */
+			__atomic_sub_fetch(&queue->thrs, 1, __ATOMIC_SEQ_CST);
+			goto awaken;
+		}
 		pthread_cleanup_push( fifo_cleanup, queue);
 		ret = pthread_cond_timedwait( &queue->cond_pull, &queue->mtx, abstime );
 		pthread_cleanup_pop(0);
-		queue->thrs-- ;
+		__atomic_sub_fetch(&queue->thrs, 1, __ATOMIC_SEQ_CST);
 		if (ret == 0)
 			goto awaken;  /* test for spurious wake-ups */
 		
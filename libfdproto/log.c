@@ -54,6 +54,7 @@ int fd_breakhere(void) { return ++fd_breaks; }
 
 /* Allow passing of the log and debug information from base stack to extensions */
 void (*fd_logger)( int loglevel, const char * format, va_list args ) = fd_internal_logger;
+int fd_log_handler_honors_level = 0;
 
 /* Register an external call back for tracing and debug */
 int fd_log_handler_register( void (*logger)(int loglevel, const char * format, va_list args) )
@@ -76,9 +77,16 @@ int fd_log_handler_register( void (*logger)(int loglevel, const char * format, v
 int fd_log_handler_unregister ( void )
 {
         fd_logger = fd_internal_logger;
+        fd_log_handler_honors_level = 0;
         return 0; /* Successfull in all cases. */
 }
 
+/* The internal logger discards the messages below fd_g_debug_lvl, other loggers decide by themselves */
+int fd_log_enabled ( int loglevel )
+{
+	return ((fd_logger != fd_internal_logger) && !fd_log_handler_honors_level) || (loglevel >= fd_g_debug_lvl);
+}
+
 static void fd_cleanup_mutex_silent( void * mutex )
 {
 	(void)pthread_mutex_unlock((pthread_mutex_t *)mutex);
@@ -130,6 +138,10 @@ void fd_log ( int loglevel, const char * format, ... )
 {
 	va_list ap;
 	
+	/* Do not even take the lock if the message would be discarded */
+	if (!fd_log_enabled(loglevel))
+		return;
+	
 	(void)pthread_mutex_lock(&fd_log_lock);
 	
 	pthread_cleanup_push(fd_cleanup_mutex_silent, &fd_log_lock);
@@ -146,6 +158,9 @@ void fd_log ( int loglevel, const char * format, ... )
 /* Log a debug message */
 void fd_log_va ( int loglevel, const char * format, va_list args )
 {
+	if (!fd_log_enabled(loglevel))
+		return;
+	
 	(void)pthread_mutex_lock(&fd_log_lock);
 	
 	pthread_cleanup_push(fd_cleanup_mutex_silent, &fd_log_lock);
@@ -98,7 +98,21 @@ struct avp {
 	uint8_t			*avp_rawdata;		/* when the data can not be interpreted, the raw data is copied here. The header is not part of it. */
 	size_t			 avp_rawlen;		/* The length of the raw buffer. */
 	union avp_value		 avp_storage;		/* To avoid many alloc/free, store the integer values here and set avp_public.avp_data to &storage */
-	int			 avp_mustfreeos;	/* 1 if an octetstring is malloc'd in avp_storage and must be freed. */
+	int			 avp_mustfreeos;	/* OS_MALLOCD or OS_FROM_CACHE if the octetstring in avp_storage must be freed, OS_REFERENCED if it points inside avp_rawref. */
+	struct msg_rawbuf	*avp_rawref;		/* The received buffer referenced by the octetstring value or avp_wire (zero-copy) */
+	uint8_t			*avp_wire;		/* In zero-copy mode, the AVP as received (header included) while it is not modified. */
+};
+
+/* Values of avp_mustfreeos */
+#define OS_MALLOCD	1	/* allocated by a type_encode callback */
+#define OS_FROM_CACHE	2	/* allocated with os_new */
+#define OS_REFERENCED	3	/* points inside the received buffer avp_rawref */
+
+/* In zero-copy mode, the buffer received for a message is shared between the message and the AVPs whose octetstring values point inside it */
+struct msg_rawbuf {
+	uint8_t			*data;			/* the buffer received */
+	size_t			 len;
+	int			 refcnt;		/* the message until its AVPs are parsed, and the AVPs that reference it. Updated atomically */
 };
 
 /* Macro to compute the AVP header size */
@@ -123,6 +137,8 @@ struct msg {
 	struct msg_hdr		 msg_public;		/* Message data that can be managed by extensions. */
 	
 	uint8_t			*msg_rawbuffer;		/* data buffer that was received, saved during fd_msg_parse_buffer and freed in fd_msg_parse_dict */
+	struct msg_rawbuf	*msg_rawref;		/* In zero-copy mode, msg_rawbuffer is shared with the AVPs through this */
+	size_t			 msg_lazylen;		/* In lazy mode, size of the AVPs in msg_rawbuffer not parsed yet. msg_chain.children contains only the AVPs added after them. */
 	int			 msg_routable;		/* Is this a routable message? (0: undef, 1: routable, 2: non routable) */
 	struct msg		*msg_query;		/* the associated query if the message is a received answer */
 	int			 msg_associated;	/* and the counter part information in the query, to avoid double free */
@@ -134,10 +150,29 @@ struct msg {
 			void * data;
 			struct timespec timeout;
 		}		 msg_cb;		/* Callback to be called when an answer is received, or timeout expires, if not NULL */
-	DiamId_t		 msg_src_id;		/* Diameter Id of the peer this message was received from. This string is malloc'd and must be freed */
+	DiamId_t		 msg_src_id;		/* Diameter Id of the peer this message was received from. This string is allocated with os_new and must be freed */
 	size_t			 msg_src_id_len;	/* cached length of this string */
 	struct fd_msg_pmdl	 msg_pmdl;		/* list of permessagedata structures. */
+	struct msg_avp_index	*msg_index;		/* Index of the top-level AVPs for fd_msg_search_avp, dropped when the AVPs are added or removed */
+	int			 msg_searches;		/* number of searches since the last modification, to decide when to build msg_index */
+};
+
+/* The index of the top-level AVPs of a message, by code and vendor. It is built when a message with enough AVPs is searched
+ several times (typically by the applications that read most of the AVPs of the request one after the other). */
+#define MSG_INDEX_SEARCHES	2	/* build the index at the second search */
+#define MSG_INDEX_MIN_AVPS	8	/* a linear search is fine for the short messages */
+struct msg_avp_index {
+	int		 size;		/* number of buckets, a power of 2 */
+	int		*heads;		/* first entry of each bucket, or -1 */
+	struct {
+		avp_code_t	 code;
+		vendor_id_t	 vendor;
+		struct avp	*avp;
+		int		 next;	/* next entry in the same bucket, in the order of the message, or -1 */
+	}		 ent[];
 };
+#define MSG_INDEX_HASH( _code, _vendor, _size ) \
+	( ( ((uint32_t)(_code) ^ ((uint32_t)(_vendor) * 0x9E3779B1U)) * 0x9E3779B1U >> 16 ) & ((_size) - 1) )
 
 /* Macro to compute the message header size */
 #define GETMSGHDRSZ() 	20
@@ -171,6 +206,383 @@ static int avp_value_sizes[] = {
 
 /* Forward declaration */
 static int parsedict_do_msg(struct dictionary * dict, struct msg * msg, int only_hdr, struct fd_pei *error_info);
+static int msg_expand(struct msg * msg);
+static int wire_read(unsigned char * buf, size_t buflen, size_t * offset, struct avp_wirehdr * avp);
+
+/***************************************************************************************************************/
+/* Caches of objects */
+
+/* The msg and avp objects, and the small buffers for their octet strings values, raw data and source Diameter-Id,
+ * are not allocated one by one with malloc. Each thread keeps lists of free objects of a few size classes, that 
+ * are filled from slabs of CACHE_SLAB objects allocated at once. Since a message is usually freed in a different 
+ * thread than the one that created it, the threads exchange batches of CACHE_BATCH objects through a global depot.
+ * The slabs are never given back to the system, the caches grow up to the peak number of objects in use. */
+#define CACHE_SLAB	64	/* number of objects allocated from the system at once */
+#define CACHE_BATCH	32	/* number of objects exchanged at once between a thread and the depot */
+
+/* The classes of objects */
+enum {
+	CACHE_AVP = 0,
+	CACHE_MSG,
+	CACHE_BUF32,	/* buffers, including the os_hdr */
+	CACHE_BUF64,
+	CACHE_BUF128,
+	CACHE_BUF256,
+	CACHE_BUF512,
+	CACHE_CLASSES
+};
+#define CACHE_BUF_MAX	512
+#define CACHE_BUF_LARGE	CACHE_CLASSES	/* buffers that are too big for the classes are malloc'd */
+
+/* A free object */
+struct cache_obj {
+	struct cache_obj * next;	/* next free object */
+	struct cache_obj * next_batch;	/* in the depot, on the first object of a batch: the next batch */
+	int		   count;	/* in the depot, on the first object of a batch: number of objects in the batch */
+};
+
+/* The global depot of free objects, for each class */
+static struct cache_depot {
+	pthread_mutex_t	   lock;
+	struct cache_obj * batches;	/* list of batches of free objects */
+	size_t		   size;	/* size of the objects of this class */
+} cache_depots[CACHE_CLASSES] = {
+	{ PTHREAD_MUTEX_INITIALIZER, NULL, sizeof(struct avp) },
+	{ PTHREAD_MUTEX_INITIALIZER, NULL, sizeof(struct msg) },
+	{ PTHREAD_MUTEX_INITIALIZER, NULL, 32 },
+	{ PTHREAD_MUTEX_INITIALIZER, NULL, 64 },
+	{ PTHREAD_MUTEX_INITIALIZER, NULL, 128 },
+	{ PTHREAD_MUTEX_INITIALIZER, NULL, 256 },
+	{ PTHREAD_MUTEX_INITIALIZER, NULL, 512 }
+};
+
+/* The cache of a thread */
+struct cache_thr {
+	struct fd_list	   chain;	/* link in cache_thrs */
+	struct cache_obj * free[CACHE_CLASSES];	/* free objects for each class */
+	int		   cnt[CACHE_CLASSES];	/* and their number */
+	long long	   gets;	/* number of objects handed out by this cache */
+};
+
+static pthread_key_t	cache_key;	/* the cache_thr of the current thread */
+static pthread_mutex_t	cache_thrs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fd_list	cache_thrs = FD_LIST_INITIALIZER(cache_thrs);	/* all the thread caches, for the statistics */
+static long long	cache_gets;	/* objects handed out by the caches of the terminated threads, protected by cache_thrs_lock */
+static long long	cache_sysallocs;	/* number of allocations from the system, updated atomically */
+static long long	cache_large;	/* number of these allocations that were for large buffers */
+
+/* The header of the buffers allocated from the caches */
+union os_hdr {
+	size_t		   class;	/* CACHE_BUF* or CACHE_BUF_LARGE */
+	uint64_t	   align;
+};
+
+/* Give a list of free objects back to the depot */
+static void cache_depot_put(int class, struct cache_obj * first, int count)
+{
+	struct cache_depot * d = &cache_depots[class];
+	
+	first->count = count;
+	CHECK_POSIX_DO( pthread_mutex_lock(&d->lock), /* continue */ );
+	first->next_batch = d->batches;
+	d->batches = first;
+	CHECK_POSIX_DO( pthread_mutex_unlock(&d->lock), /* continue */ );
+}
+
+/* Called when a thread terminates: return all its free objects to the depot */
+static void cache_thr_release(void * arg)
+{
+	struct cache_thr * ct = arg;
+	int c;
+	
+	for (c = 0; c < CACHE_CLASSES; c++) {
+		if (ct->free[c])
+			cache_depot_put(c, ct->free[c], ct->cnt[c]);
+	}
+	
+	CHECK_POSIX_DO( pthread_mutex_lock(&cache_thrs_lock), /* continue */ );
+	fd_list_unlink(&ct->chain);
+	cache_gets += ct->gets;
+	CHECK_POSIX_DO( pthread_mutex_unlock(&cache_thrs_lock), /* continue */ );
+	
+	free(ct);
+}
+
+/* Initialize the caches, called once from fd_libproto_init */
+int fd_msg_cache_init(void)
+{
+	CHECK_POSIX( pthread_key_create(&cache_key, cache_thr_release) );
+	return 0;
+}
+
+/* Retrieve the cache of the current thread, create it on first use */
+static struct cache_thr * cache_thr_get(void)
+{
+	struct cache_thr * ct = pthread_getspecific(cache_key);
+	
+	if (ct)
+		return ct;
+	
+	CHECK_MALLOC_DO( ct = calloc(1, sizeof(struct cache_thr)), return NULL );
+	fd_list_init(&ct->chain, ct);
+	CHECK_POSIX_DO( pthread_setspecific(cache_key, ct), { free(ct); return NULL; } );
+	
+	CHECK_POSIX_DO( pthread_mutex_lock(&cache_thrs_lock), /* continue */ );
+	fd_list_insert_before(&cache_thrs, &ct->chain);
+	CHECK_POSIX_DO( pthread_mutex_unlock(&cache_thrs_lock), /* continue */ );
+	
+	return ct;
+}
+
+/* Fill the empty cache of a thread for a class, from the depot or a new slab */
+static int cache_refill(struct cache_thr * ct, int class)
+{
+	struct cache_depot * d = &cache_depots[class];
+	struct cache_obj * batch;
+	uint8_t * slab;
+	int i;
+	
+	CHECK_POSIX( pthread_mutex_lock(&d->lock) );
+	batch = d->batches;
+	if (batch)
+		d->batches = batch->next_batch;
+	CHECK_POSIX( pthread_mutex_unlock(&d->lock) );
+	
+	if (batch) {
+		ct->free[class] = batch;
+		ct->cnt[class] = batch->count;
+		return 0;
+	}
+	
+	/* The depot is empty, allocate a new slab */
+	CHECK_MALLOC( slab = malloc(CACHE_SLAB * d->size) );
+	__atomic_add_fetch(&cache_sysallocs, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < CACHE_SLAB; i++) {
+		struct cache_obj * o = (struct cache_obj *)(slab + i * d->size);
+		o->next = (i < CACHE_SLAB - 1) ? (struct cache_obj *)(slab + (i + 1) * d->size) : NULL;
+	}
+	ct->free[class] = (struct cache_obj *)slab;
+	ct->cnt[class] = CACHE_SLAB;
+	return 0;
+}
+
+/* Get a new object of a class. Its content is undefined. */
+static void * cache_get(int class)
+{
+	struct cache_thr * ct;
+	struct cache_obj * o;
+	
+	CHECK_MALLOC_DO( ct = cache_thr_get(), return NULL );
+	
+	if (!ct->free[class]) {
+		CHECK_FCT_DO( cache_refill(ct, class), return NULL );
+	}
+	
+	o = ct->free[class];
+	ct->free[class] = o->next;
+	ct->cnt[class]--;
+	__atomic_store_n(&ct->gets, ct->gets + 1, __ATOMIC_RELAXED); /* read by fd_msg_cache_getstats */
+	return o;
+}
+
+/* Give back an object to the cache of the current thread */
+static void cache_put(void * obj, int class)
+{
+	struct cache_thr * ct = cache_thr_get();
+	struct cache_obj * o = obj;
+	
+	if (!ct) {
+		/* No cache for this thread, give the object directly to the depot */
+		o->next = NULL;
+		cache_depot_put(class, o, 1);
+		return;
+	}
+	
+	o->next = ct->free[class];
+	ct->free[class] = o;
+	
+	if (++ct->cnt[class] >= 2 * CACHE_BATCH) {
+		/* Too many free objects in this thread, give a batch to the other ones */
+		struct cache_obj * last = o;
+		int i;
+		for (i = 1; i < CACHE_BATCH; i++)
+			last = last->next;
+		ct->free[class] = last->next;
+		ct->cnt[class] -= CACHE_BATCH;
+		last->next = NULL;
+		cache_depot_put(class, o, CACHE_BATCH);
+	}
+}
+
+/* Allocate a buffer for len bytes */
+static uint8_t * os_new(size_t len)
+{
+	union os_hdr * h;
+	size_t class;
+	
+	len += sizeof(union os_hdr);
+	if (len > CACHE_BUF_MAX) {
+		CHECK_MALLOC_DO( h = malloc(len), return NULL );
+		__atomic_add_fetch(&cache_sysallocs, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&cache_large, 1, __ATOMIC_RELAXED);
+		class = CACHE_BUF_LARGE;
+	} else {
+		for (class = CACHE_BUF32; cache_depots[class].size < len; class++)
+			/* find the smallest class */ ;
+		CHECK_MALLOC_DO( h = cache_get(class), return NULL );
+	}
+	h->class = class;
+	return (uint8_t *)(h + 1);
+}
+
+/* Same as os0dup, with a buffer from the caches */
+static uint8_t * os_dup(uint8_t * s, size_t len)
+{
+	uint8_t * r;
+	CHECK_MALLOC_DO( r = os_new(len + 1), return NULL );
+	if (len)
+		memcpy(r, s, len);
+	r[len] = '\0';
+	return r;
+}
+
+/* Free a buffer allocated with os_new */
+static void os_free(void * os)
+{
+	union os_hdr * h;
+	
+	if (!os)
+		return;
+	
+	h = (union os_hdr *)os - 1;
+	if (h->class == CACHE_BUF_LARGE)
+		free(h);
+	else
+		cache_put(h, h->class);
+}
+
+/* Zero-copy mode for the octetstring values of the received messages */
+static int msg_zerocopy = 0;
+
+void fd_msg_parse_zerocopy ( int enable )
+{
+	TRACE_ENTRY("%d", enable);
+	msg_zerocopy = enable;
+}
+
+/* Release a reference on a received buffer */
+static void rawbuf_unref(struct msg_rawbuf * rb)
+{
+	if (__atomic_sub_fetch(&rb->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(rb->data);
+		os_free(rb);
+	}
+}
+
+/* Return the received buffer containing source, if the AVP belongs to a message whose buffer is shared. */
+static struct msg_rawbuf * avp_rawbuf(struct avp * avp, uint8_t * source)
+{
+	struct msg_avp_chain * obj = _C(avp);
+	struct msg_rawbuf * rb;
+	
+	/* Go up to the message */
+	while (obj->type == MSG_AVP) {
+		if (obj->chaining.head == &obj->chaining)
+			return NULL; /* not linked */
+		obj = obj->chaining.head->o;
+		if (obj == NULL)
+			return NULL; /* in a list, not a message */
+	}
+	
+	rb = _M(obj)->msg_rawref;
+	if ((rb == NULL) || (source < rb->data) || (source >= rb->data + rb->len))
+		return NULL; /* for example, the source is the avp_rawdata */
+	
+	return rb;
+}
+
+/* Release the received buffer once neither the value nor the wire copy of the AVP use it */
+static void avp_release_rawref(struct avp * avp)
+{
+	if (avp->avp_rawref && !avp->avp_wire && (avp->avp_mustfreeos != OS_REFERENCED)) {
+		rawbuf_unref(avp->avp_rawref);
+		avp->avp_rawref = NULL;
+	}
+}
+
+/* Free the octetstring value of an AVP if needed */
+static void avp_free_os(struct avp * avp)
+{
+	if (avp->avp_mustfreeos == OS_MALLOCD)
+		free(avp->avp_storage.os.data);
+	else if (avp->avp_mustfreeos == OS_FROM_CACHE)
+		os_free(avp->avp_storage.os.data);
+	avp->avp_mustfreeos = 0;
+	avp_release_rawref(avp);
+}
+
+/* The AVP may have been modified: its wire copy, and the ones of the grouped AVPs that contain it, cannot be used anymore */
+static void avp_modified(struct avp * avp)
+{
+	/* If an AVP is modified, its parents are already, so we stop at the first one */
+	while (avp->avp_wire) {
+		struct msg_avp_chain * parent;
+		
+		avp->avp_wire = NULL;
+		avp_release_rawref(avp);
+		
+		if (avp->avp_chain.chaining.head == &avp->avp_chain.chaining)
+			break; /* not linked */
+		parent = avp->avp_chain.chaining.head->o;
+		if ((parent == NULL) || (parent->type != MSG_AVP))
+			break;
+		avp = _A(parent);
+	}
+}
+
+/* The top-level AVPs of the message have changed, its index cannot be used anymore */
+static void msg_index_drop(struct msg * msg)
+{
+	free(msg->msg_index);
+	msg->msg_index = NULL;
+	msg->msg_searches = 0;
+}
+
+/* Same, for the parent of an object that is added or removed */
+static void parent_modified(struct msg_avp_chain * obj)
+{
+	struct msg_avp_chain * parent;
+	
+	if (obj->chaining.head == &obj->chaining)
+		return;
+	parent = obj->chaining.head->o;
+	if (parent && (parent->type == MSG_AVP))
+		avp_modified(_A(parent));
+	if (parent && (parent->type == MSG_MSG))
+		msg_index_drop(_M(parent));
+}
+
+/* Statistics on the caches */
+void fd_msg_cache_getstats(long long * objects, long long * sysallocs)
+{
+	struct fd_list * li;
+	long long gets;
+	
+	TRACE_ENTRY("%p %p", objects, sysallocs);
+	
+	CHECK_POSIX_DO( pthread_mutex_lock(&cache_thrs_lock), /* continue */ );
+	gets = cache_gets;
+	for (li = cache_thrs.next; li != &cache_thrs; li = li->next) {
+		struct cache_thr * ct = li->o;
+		gets += __atomic_load_n(&ct->gets, __ATOMIC_RELAXED);
+	}
+	CHECK_POSIX_DO( pthread_mutex_unlock(&cache_thrs_lock), /* continue */ );
+	
+	if (objects)
+		*objects = gets + __atomic_load_n(&cache_large, __ATOMIC_RELAXED);
+	if (sysallocs)
+		*sysallocs = __atomic_load_n(&cache_sysallocs, __ATOMIC_RELAXED);
+}
 
 /***************************************************************************************************************/
 /* Creating objects */
@@ -223,7 +635,7 @@ int fd_msg_avp_new ( struct dict_object * model, int flags, struct avp ** avp )
 	}
 	
 	/* Create a new object */
-	CHECK_MALLOC(  new = malloc (sizeof(struct avp))  );
+	CHECK_MALLOC(  new = cache_get(CACHE_AVP)  );
 	
 	/* Initialize the fields */
 	init_avp(new);
@@ -231,7 +643,7 @@ int fd_msg_avp_new ( struct dict_object * model, int flags, struct avp ** avp )
 	if (model) {
 		struct dict_avp_data dictdata;
 		
-		CHECK_FCT_DO(  fd_dict_getval(model, &dictdata), { free(new); return __ret__; }  );
+		CHECK_FCT_DO(  fd_dict_getval(model, &dictdata), { cache_put(new, CACHE_AVP); return __ret__; }  );
 	
 		new->avp_model = model;
 		new->avp_public.avp_code    = dictdata.avp_code;
@@ -247,7 +659,7 @@ int fd_msg_avp_new ( struct dict_object * model, int flags, struct avp ** avp )
 	if (flags & AVPFL_SET_RAWDATA_FROM_AVP) {
 		new->avp_rawlen = (*avp)->avp_public.avp_len - GETAVPHDRSZ( (*avp)->avp_public.avp_flags );
 		if (new->avp_rawlen) {
-			CHECK_MALLOC_DO(  new->avp_rawdata = malloc(new->avp_rawlen), { free(new); return __ret__; }  );
+			CHECK_MALLOC_DO(  new->avp_rawdata = os_new(new->avp_rawlen), { cache_put(new, CACHE_AVP); return __ret__; }  );
 			memset(new->avp_rawdata, 0x00, new->avp_rawlen);
 		}
 	}
@@ -273,7 +685,7 @@ int fd_msg_new ( struct dict_object * model, int flags, struct msg ** msg )
 	}
 	
 	/* Create a new object */
-	CHECK_MALLOC(  new = malloc (sizeof(struct msg))  );
+	CHECK_MALLOC(  new = cache_get(CACHE_MSG)  );
 	
 	/* Initialize the fields */
 	init_msg(new);
@@ -285,18 +697,18 @@ int fd_msg_new ( struct dict_object * model, int flags, struct msg ** msg )
 		struct dict_cmd_data     dictdata;
 		struct dict_object     	*dictappl;
 		
-		CHECK_FCT_DO( fd_dict_getdict(model, &dict), { free(new); return __ret__; } );
-		CHECK_FCT_DO( fd_dict_getval(model, &dictdata), { free(new); return __ret__; }  );
+		CHECK_FCT_DO( fd_dict_getdict(model, &dict), { cache_put(new, CACHE_MSG); return __ret__; } );
+		CHECK_FCT_DO( fd_dict_getval(model, &dictdata), { cache_put(new, CACHE_MSG); return __ret__; }  );
 		
 		new->msg_model = model;
 		new->msg_public.msg_flags	= dictdata.cmd_flag_val;
 		new->msg_public.msg_code	= dictdata.cmd_code;
 
 		/* Initialize application from the parent, if any */
-		CHECK_FCT_DO(  fd_dict_search( dict, DICT_APPLICATION, APPLICATION_OF_COMMAND, model, &dictappl, 0), { free(new); return __ret__; }  );
+		CHECK_FCT_DO(  fd_dict_search( dict, DICT_APPLICATION, APPLICATION_OF_COMMAND, model, &dictappl, 0), { cache_put(new, CACHE_MSG); return __ret__; }  );
 		if (dictappl != NULL) {
 			struct dict_application_data appdata;
-			CHECK_FCT_DO(  fd_dict_getval(dictappl, &appdata), { free(new); return __ret__; }  );
+			CHECK_FCT_DO(  fd_dict_getval(dictappl, &appdata), { cache_put(new, CACHE_MSG); return __ret__; }  );
 			new->msg_public.msg_appl = appdata.application_id;
 		}
 	}
@@ -364,16 +776,16 @@ int fd_msg_new_answer_from_req ( struct dictionary * dict, struct msg ** msg, in
 		union avp_value val;
 		
 		if (!sess_id_avp) {
-			CHECK_FCT_DO( fd_dict_search( dict, DICT_AVP, AVP_BY_NAME, "Session-Id", &sess_id_avp, ENOENT), { free(ans); return __ret__; } );
+			CHECK_FCT_DO( fd_dict_search( dict, DICT_AVP, AVP_BY_NAME, "Session-Id", &sess_id_avp, ENOENT), { cache_put(ans, CACHE_MSG); return __ret__; } );
 		}
-		CHECK_FCT_DO( fd_sess_getsid ( sess, &sid, &sidlen ), { free(ans); return __ret__; } );
-		CHECK_FCT_DO( fd_msg_avp_new ( sess_id_avp, 0, &avp ), { free(ans); return __ret__; } );
+		CHECK_FCT_DO( fd_sess_getsid ( sess, &sid, &sidlen ), { cache_put(ans, CACHE_MSG); return __ret__; } );
+		CHECK_FCT_DO( fd_msg_avp_new ( sess_id_avp, 0, &avp ), { cache_put(ans, CACHE_MSG); return __ret__; } );
 		val.os.data = sid;
 		val.os.len  = sidlen;
-		CHECK_FCT_DO( fd_msg_avp_setvalue( avp, &val ), { free(avp); free(ans); return __ret__; } );
-		CHECK_FCT_DO( fd_msg_avp_add( ans, MSG_BRW_FIRST_CHILD, avp ), { free(avp); free(ans); return __ret__; } );
+		CHECK_FCT_DO( fd_msg_avp_setvalue( avp, &val ), { cache_put(avp, CACHE_AVP); cache_put(ans, CACHE_MSG); return __ret__; } );
+		CHECK_FCT_DO( fd_msg_avp_add( ans, MSG_BRW_FIRST_CHILD, avp ), { cache_put(avp, CACHE_AVP); cache_put(ans, CACHE_MSG); return __ret__; } );
 		ans->msg_sess = sess;
-		CHECK_FCT_DO( fd_sess_ref_msg(sess), { free(ans); return __ret__; }  );
+		CHECK_FCT_DO( fd_sess_ref_msg(sess), { cache_put(ans, CACHE_MSG); return __ret__; }  );
 	}
 	
 	/* Add all Proxy-Info AVPs from the query if any */
@@ -382,7 +794,7 @@ int fd_msg_new_answer_from_req ( struct dictionary * dict, struct msg ** msg, in
 		struct fd_pei pei;
 		struct fd_list avpcpylist = FD_LIST_INITIALIZER(avpcpylist);
 		
-		CHECK_FCT_DO(  fd_msg_browse(qry, MSG_BRW_FIRST_CHILD, &avp, NULL) , { free(ans); return __ret__; } );
+		CHECK_FCT_DO(  fd_msg_browse(qry, MSG_BRW_FIRST_CHILD, &avp, NULL) , { cache_put(ans, CACHE_MSG); return __ret__; } );
 		while (avp) {
 			if ( (avp->avp_public.avp_code   == AC_PROXY_INFO)
 			  && (avp->avp_public.avp_vendor == 0) ) {
@@ -393,15 +805,15 @@ int fd_msg_new_answer_from_req ( struct dictionary * dict, struct msg ** msg, in
 				size_t offset = 0;
 
 				/* Create a buffer with the content of the AVP. This is easier than going through the list */
-				CHECK_FCT_DO(  fd_msg_update_length(avp), { free(ans); return __ret__; }  );
-				CHECK_MALLOC_DO(  buf = malloc(avp->avp_public.avp_len), { free(ans); return __ret__; }  );
-				CHECK_FCT_DO( bufferize_avp(buf, avp->avp_public.avp_len, &offset, avp), { free(buf); free(ans); return __ret__; }  );
+				CHECK_FCT_DO(  fd_msg_update_length(avp), { cache_put(ans, CACHE_MSG); return __ret__; }  );
+				CHECK_MALLOC_DO(  buf = malloc(avp->avp_public.avp_len), { cache_put(ans, CACHE_MSG); return __ret__; }  );
+				CHECK_FCT_DO( bufferize_avp(buf, avp->avp_public.avp_len, &offset, avp), { free(buf); cache_put(ans, CACHE_MSG); return __ret__; }  );
 
 				/* Now we parse this buffer to create a copy AVP */
-				CHECK_FCT_DO( parsebuf_list(buf, avp->avp_public.avp_len, &avpcpylist), { free(buf); free(ans); return __ret__; } );
+				CHECK_FCT_DO( parsebuf_list(buf, avp->avp_public.avp_len, &avpcpylist), { free(buf); cache_put(ans, CACHE_MSG); return __ret__; } );
 				
 				/* Parse dictionary objects now to remove the dependency on the buffer */
-				CHECK_FCT_DO( parsedict_do_chain(dict, &avpcpylist, 0, &pei), { /* leaking the avpcpylist -- this should never happen anyway */ free(buf); free(ans); return __ret__; } );
+				CHECK_FCT_DO( parsedict_do_chain(dict, &avpcpylist, 0, &pei), { /* leaking the avpcpylist -- this should never happen anyway */ free(buf); cache_put(ans, CACHE_MSG); return __ret__; } );
 
 				/* Done for this AVP */
 				free(buf);
@@ -410,7 +822,7 @@ int fd_msg_new_answer_from_req ( struct dictionary * dict, struct msg ** msg, in
 				fd_list_move_end(&ans->msg_chain.children, &avpcpylist);
 			}
 			/* move to next AVP in the message, we can have several Proxy-Info instances */
-			CHECK_FCT_DO( fd_msg_browse(avp, MSG_BRW_NEXT, &avp, NULL), { free(ans); return __ret__; } );
+			CHECK_FCT_DO( fd_msg_browse(avp, MSG_BRW_NEXT, &avp, NULL), { cache_put(ans, CACHE_MSG); return __ret__; } );
 		}
 	}
 
@@ -441,6 +853,18 @@ int fd_msg_browse_internal ( msg_or_avp * reference, enum msg_brw_dir dir, msg_o
 	/* Check the parameters */
 	CHECK_PARAMS(  VALIDATE_OBJ(reference)  );
 	
+	/* The AVPs of a lazily parsed message are created when they are browsed */
+	if (_C(reference)->type == MSG_MSG) {
+		if (dir != MSG_BRW_PARENT) {
+			CHECK_FCT( msg_expand(_M(reference)) );
+		}
+	} else if (_C(reference)->chaining.head != &_C(reference)->chaining) {
+		struct msg_avp_chain * parent = _C(reference)->chaining.head->o;
+		if (parent && (parent->type == MSG_MSG)) {
+			CHECK_FCT( msg_expand(_M(parent)) );
+		}
+	}
+	
 	TRACE_DEBUG(FCTS, "chaining(%p): nxt:%p prv:%p hea:%p top:%p", 
 			&_C(reference)->chaining,
 			_C(reference)->chaining.next,
@@ -579,6 +1003,10 @@ int fd_msg_avp_add ( msg_or_avp * reference, enum msg_brw_dir dir, struct avp *a
 			break;
 
 		case MSG_BRW_FIRST_CHILD:
+			/* The received AVPs of a lazily parsed message must be created first */
+			if (_C(reference)->type == MSG_MSG) {
+				CHECK_FCT( msg_expand(_M(reference)) );
+			}
 			/* Insert the new avp after the children sentinel */
 			fd_list_insert_after( &_C(reference)->children, &avp->avp_chain.chaining );
 			break;
@@ -592,14 +1020,79 @@ int fd_msg_avp_add ( msg_or_avp * reference, enum msg_brw_dir dir, struct avp *a
 			/* Other directions are invalid */
 			CHECK_PARAMS( dir = 0 );
 	}
+	
+	/* The grouped AVP that receives the new one is modified */
+	parent_modified(&avp->avp_chain);
 			
 	return 0;
 }
 
+/* Build the index of the top-level AVPs of a message, if it has enough of them. */
+static int msg_index_build(struct msg * msg)
+{
+	struct msg_avp_index * idx;
+	struct fd_list * li;
+	int count = 0, size, i;
+	
+	/* The received AVPs must have been created already */
+	ASSERT( msg->msg_lazylen == 0 );
+	
+	for (li = msg->msg_chain.children.next; li != &msg->msg_chain.children; li = li->next)
+		count++;
+	if (count < MSG_INDEX_MIN_AVPS)
+		return 0;
+	
+	for (size = 16; size < 2 * count; size <<= 1)
+		/* keep the buckets mostly empty */ ;
+	
+	CHECK_MALLOC( idx = malloc(sizeof(struct msg_avp_index) + count * sizeof(idx->ent[0]) + size * sizeof(int)) );
+	idx->size = size;
+	idx->heads = (int *)&idx->ent[count];
+	memset(idx->heads, 0xff, size * sizeof(int));
+	
+	for (i = 0, li = msg->msg_chain.children.next; li != &msg->msg_chain.children; i++, li = li->next) {
+		struct avp * a = _A(li->o);
+		idx->ent[i].code   = a->avp_public.avp_code;
+		idx->ent[i].vendor = a->avp_public.avp_vendor;
+		idx->ent[i].avp    = a;
+	}
+	
+	/* Link the entries of each bucket in the order of the message */
+	for (i = count - 1; i >= 0; i--) {
+		int h = MSG_INDEX_HASH(idx->ent[i].code, idx->ent[i].vendor, size);
+		idx->ent[i].next = idx->heads[h];
+		idx->heads[h] = i;
+	}
+	
+	/* Concurrent searches may read it from now on, it is not modified anymore */
+	__atomic_store_n(&msg->msg_index, idx, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Find the first AVP with this code and vendor in the index, or the first one after the AVP "prev" */
+static struct avp * msg_index_find(struct msg_avp_index * idx, avp_code_t code, vendor_id_t vendor, struct avp * prev)
+{
+	int i;
+	
+	for (i = idx->heads[MSG_INDEX_HASH(code, vendor, idx->size)]; i >= 0; i = idx->ent[i].next) {
+		if ((idx->ent[i].code != code) || (idx->ent[i].vendor != vendor))
+			continue;
+		if (prev) {
+			if (idx->ent[i].avp == prev)
+				prev = NULL;
+			continue;
+		}
+		return idx->ent[i].avp;
+	}
+	
+	return NULL;
+}
+
 /* Search a given AVP model in a message */
 int fd_msg_search_avp ( struct msg * msg, struct dict_object * what, struct avp ** avp )
 {
 	struct avp * nextavp;
+	struct msg_avp_index * idx;
 	struct dict_avp_data 	dictdata;
 	enum dict_object_type 	dicttype;
 	
@@ -612,6 +1105,16 @@ int fd_msg_search_avp ( struct msg * msg, struct dict_object * what, struct avp
 	
 	/* Loop on all top AVPs */
 	CHECK_FCT(  fd_msg_browse(msg, MSG_BRW_FIRST_CHILD, (void *)&nextavp, NULL)  );
+	
+	/* Use the index when the message is searched repeatedly. Only the search that reaches the count builds it, so that several threads can search the same message. */
+	idx = __atomic_load_n(&msg->msg_index, __ATOMIC_ACQUIRE);
+	if ((idx == NULL) && (__atomic_add_fetch(&msg->msg_searches, 1, __ATOMIC_RELAXED) == MSG_INDEX_SEARCHES)) {
+		CHECK_FCT( msg_index_build(msg) );
+		idx = msg->msg_index;
+	}
+	if (idx)
+		nextavp = msg_index_find(idx, dictdata.avp_code, dictdata.avp_vendor, NULL);
+	
 	while (nextavp) {
 		
 		if ( (nextavp->avp_public.avp_code   == dictdata.avp_code)
@@ -637,6 +1140,49 @@ int fd_msg_search_avp ( struct msg * msg, struct dict_object * what, struct avp
 		return ENOENT;
 }
 
+/* Search the next instance of an AVP at the same level */
+int fd_msg_search_avp_next ( struct avp * prev, struct avp ** avp )
+{
+	struct avp * nextavp = NULL;
+	struct msg_avp_chain * parent = NULL;
+	struct msg_avp_index * idx = NULL;
+	
+	TRACE_ENTRY("%p %p", prev, avp);
+	
+	CHECK_PARAMS( CHECK_AVP(prev) );
+	
+	if (prev->avp_chain.chaining.head != &prev->avp_chain.chaining)
+		parent = prev->avp_chain.chaining.head->o;
+	if (parent && (parent->type == MSG_MSG))
+		idx = __atomic_load_n(&_M(parent)->msg_index, __ATOMIC_ACQUIRE);
+	
+	if (idx) {
+		nextavp = msg_index_find(idx, prev->avp_public.avp_code, prev->avp_public.avp_vendor, prev);
+	} else {
+		CHECK_FCT( fd_msg_browse(prev, MSG_BRW_NEXT, (void *)&nextavp, NULL) );
+		while (nextavp) {
+			if ( (nextavp->avp_public.avp_code   == prev->avp_public.avp_code)
+			  && (nextavp->avp_public.avp_vendor == prev->avp_public.avp_vendor) )
+				break;
+			CHECK_FCT( fd_msg_browse(nextavp, MSG_BRW_NEXT, (void *)&nextavp, NULL) );
+		}
+	}
+	
+	if (avp)
+		*avp = nextavp;
+	
+	if (avp && nextavp && prev->avp_model) {
+		struct dictionary * dict;
+		CHECK_FCT( fd_dict_getdict( prev->avp_model, &dict) );
+		CHECK_FCT_DO( fd_msg_parse_dict( nextavp, dict, NULL ), /* nothing */ );
+	}
+	
+	if (avp || nextavp)
+		return 0;
+	else
+		return ENOENT;
+}
+
 
 /***************************************************************************************************************/
 /* Deleting objects */
@@ -652,20 +1198,27 @@ static int destroy_obj (struct msg_avp_chain * obj )
 	/* Unlink this object if needed */
 	fd_list_unlink( &obj->chaining );
 	
-	/* Free the octetstring if needed */
-	if ((obj->type == MSG_AVP) && (_A(obj)->avp_mustfreeos == 1)) {
-		free(_A(obj)->avp_storage.os.data);
+	/* Free the octetstring if needed, and release the received buffer */
+	if (obj->type == MSG_AVP) {
+		_A(obj)->avp_wire = NULL;
+		avp_free_os(_A(obj));
 	}
 	/* Free the rawdata if needed */
 	if ((obj->type == MSG_AVP) && (_A(obj)->avp_rawdata != NULL)) {
-		free(_A(obj)->avp_rawdata);
+		os_free(_A(obj)->avp_rawdata);
 	}
-	if ((obj->type == MSG_MSG) && (_M(obj)->msg_rawbuffer != NULL)) {
+	if ((obj->type == MSG_MSG) && (_M(obj)->msg_rawref != NULL)) {
+		rawbuf_unref(_M(obj)->msg_rawref);
+	} else if ((obj->type == MSG_MSG) && (_M(obj)->msg_rawbuffer != NULL)) {
 		free(_M(obj)->msg_rawbuffer);
 	}
 	
+	if ((obj->type == MSG_MSG) && (_M(obj)->msg_index != NULL)) {
+		free(_M(obj)->msg_index);
+	}
+	
 	if ((obj->type == MSG_MSG) && (_M(obj)->msg_src_id != NULL)) {
-		free(_M(obj)->msg_src_id);
+		os_free(_M(obj)->msg_src_id);
 	}
 	
 	if ((obj->type == MSG_MSG) && (_M(obj)->msg_rtdata != NULL)) {
@@ -680,8 +1233,8 @@ static int destroy_obj (struct msg_avp_chain * obj )
 		((void (*)(struct fd_msg_pmdl *))_M(obj)->msg_pmdl.sentinel.o)(&_M(obj)->msg_pmdl);
 	}
 	
-	/* free the object */
-	free(obj);
+	/* give the object back to the cache */
+	cache_put(obj, (obj->type == MSG_MSG) ? CACHE_MSG : CACHE_AVP);
 	
 	return 0;
 }
@@ -720,6 +1273,9 @@ int fd_msg_free ( msg_or_avp * object )
 				return 0;
 			}
 		}
+	} else {
+		/* Removing an AVP modifies its parent */
+		parent_modified(_C(object));
 	}
 	
 	destroy_tree(_C(object));
@@ -1149,9 +1705,45 @@ end:
 	return *buf;
 }
 
+/* Same display for a lazily parsed message, read from the received buffer instead of creating the AVPs */
+static DECLARE_FD_DUMP_PROTOTYPE( msg_dump_summary_lazy, struct msg * msg )
+{
+	size_t pos = 0;
+	struct avp_wirehdr avp;
+	struct fd_list * li;
+	int first = 1;
+	
+	FD_DUMP_HANDLE_OFFSET();
+	
+	CHECK_MALLOC_DO( msg_format_summary(FD_DUMP_STD_PARAMS, msg), return NULL);
+	
+	while (wire_read(msg->msg_rawbuffer + GETMSGHDRSZ(), msg->msg_lazylen, &pos, &avp) == 0) {
+		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, first ? " {" : ","), return NULL);
+		if (avp.avp_flags & AVP_FLAG_VENDOR) {
+			CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "V:%u/", avp.avp_vendor), return NULL);
+		}
+		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "C:%u/l:%zd", avp.avp_code, avp.avp_datalen + GETAVPHDRSZ(avp.avp_flags)), return NULL);
+		first = 0;
+	}
+	
+	/* The AVPs added after the reception */
+	for (li = msg->msg_chain.children.next; li != &msg->msg_chain.children; li = li->next) {
+		CHECK_MALLOC_DO( avp_format_summary(FD_DUMP_STD_PARAMS, _A(li->o), 1, first, li->next == &msg->msg_chain.children), return NULL);
+		first = 0;
+	}
+	if ((!first) && FD_IS_LIST_EMPTY(&msg->msg_chain.children)) {
+		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "}"), return NULL);
+	}
+	
+	return *buf;
+}
+
 /* This one only prints a short display, does not go into the complete tree */
 DECLARE_FD_DUMP_PROTOTYPE( fd_msg_dump_summary, msg_or_avp *obj, struct dictionary *dict, int force_parsing, int recurse )
 {
+	if (recurse && (!force_parsing) && CHECK_MSG(obj) && _M(obj)->msg_lazylen)
+		return msg_dump_summary_lazy(FD_DUMP_STD_PARAMS, obj);
+	
 	return msg_dump_process(FD_DUMP_STD_PARAMS, msg_format_summary, avp_format_summary, obj, dict, force_parsing, recurse);
 }
 
@@ -1199,6 +1791,9 @@ int fd_msg_avp_hdr ( struct avp *avp, struct avp_hdr **pdata )
 	TRACE_ENTRY("%p %p", avp, pdata);
 	CHECK_PARAMS(  CHECK_AVP(avp) && pdata  );
 	
+	/* The caller may modify the header or the value, so we cannot rely on the received data for this AVP anymore */
+	avp_modified(avp);
+	
 	*pdata = &avp->avp_public;
 	return 0;
 }
@@ -1378,7 +1973,7 @@ int fd_msg_source_set( struct msg * msg, DiamId_t diamid, size_t diamidlen )
 	CHECK_PARAMS( CHECK_MSG(msg) );
 	
 	/* Cleanup any previous source */
-	free(msg->msg_src_id); msg->msg_src_id = NULL; msg->msg_src_id_len = 0;
+	os_free(msg->msg_src_id); msg->msg_src_id = NULL; msg->msg_src_id_len = 0;
 	
 	/* If the request is to cleanup the source, we are done */
 	if (diamid == NULL) {
@@ -1386,7 +1981,7 @@ int fd_msg_source_set( struct msg * msg, DiamId_t diamid, size_t diamidlen )
 	}
 	
 	/* Otherwise save the new informations */
-	CHECK_MALLOC( msg->msg_src_id = os0dup(diamid, diamidlen) );
+	CHECK_MALLOC( msg->msg_src_id = (DiamId_t)os_dup((uint8_t *)diamid, diamidlen) );
 	msg->msg_src_id_len = diamidlen;
 	/* done */
 	return 0;
@@ -1492,6 +2087,26 @@ int fd_msg_sess_get(struct dictionary * dict, struct msg * msg, struct session *
 		return 0;
 	}
 	
+	/* In lazy mode, read the Session-Id directly in the received buffer */
+	if (msg->msg_lazylen) {
+		size_t offset = 0;
+		struct avp_wirehdr wavp;
+		
+		while (wire_read(msg->msg_rawbuffer + GETMSGHDRSZ(), msg->msg_lazylen, &offset, &wavp) == 0) {
+			if ((wavp.avp_code == AC_SESSION_ID) && !(wavp.avp_flags & AVP_FLAG_VENDOR)) {
+				if (wavp.avp_datalen > 0) {
+					CHECK_FCT( fd_sess_fromsid_msg ( wavp.avp_data, wavp.avp_datalen, &msg->msg_sess, new) );
+					*session = msg->msg_sess;
+				} else {
+					TRACE_DEBUG(FULL, "Session-Id AVP with 0-byte length found in message %p", msg);
+					*session = NULL;
+				}
+				return 0;
+			}
+		}
+		/* Otherwise, search also the AVPs added since the reception */
+	}
+	
 	/* OK, we have to search for Session-Id AVP -- it is usually the first AVP, but let's be permissive here */
 	/* -- note: we accept messages that have not yet been dictionary parsed... */
 	CHECK_FCT(  fd_msg_browse(msg, MSG_BRW_FIRST_CHILD, &avp, NULL)  );
@@ -1567,6 +2182,7 @@ uint32_t fd_msg_eteid_get ( void )
 int fd_msg_avp_setvalue ( struct avp *avp, union avp_value *value )
 {
 	enum dict_avp_basetype type = -1;
+	union avp_value newval;
 	
 	TRACE_ENTRY("%p %p", avp, value);
 	
@@ -1584,12 +2200,19 @@ int fd_msg_avp_setvalue ( struct avp *avp, union avp_value *value )
 		CHECK_PARAMS(  type != AVP_TYPE_GROUPED  );
 	}
 	
-	/* First, clean any previous value */
-	if (avp->avp_mustfreeos != 0) {
-		free(avp->avp_storage.os.data);
-		avp->avp_mustfreeos = 0;
+	/* Duplicate an octetstring first: the new value may be taken from the previous one, for example when the
+	 previous value references the received buffer and is being modified (copy-on-write) */
+	if (value) {
+		memcpy(&newval, value, sizeof(union avp_value));
+		if (type == AVP_TYPE_OCTETSTRING) {
+			CHECK_MALLOC(  newval.os.data = os_dup(value->os.data, value->os.len)  );
+		}
 	}
 	
+	/* Then, clean any previous value */
+	avp_modified(avp);
+	avp_free_os(avp);
+	
 	memset(&avp->avp_storage, 0, sizeof(union avp_value));
 	
 	/* If the request was to delete a value: */
@@ -1599,13 +2222,9 @@ int fd_msg_avp_setvalue ( struct avp *avp, union avp_value *value )
 	}
 	
 	/* Now we have to set the value */
-	memcpy(&avp->avp_storage, value, sizeof(union avp_value));
-	
-	/* Duplicate an octetstring if needed. */
-	if (type == AVP_TYPE_OCTETSTRING) {
-		CHECK_MALLOC(  avp->avp_storage.os.data = os0dup(value->os.data, value->os.len)  );
-		avp->avp_mustfreeos = 1;
-	}
+	memcpy(&avp->avp_storage, &newval, sizeof(union avp_value));
+	if (type == AVP_TYPE_OCTETSTRING)
+		avp->avp_mustfreeos = OS_FROM_CACHE;
 	
 	/* Set the data pointer of the public part */
 	avp->avp_public.avp_value = &avp->avp_storage;
@@ -1650,10 +2269,8 @@ int fd_msg_avp_value_encode ( void *data, struct avp *avp )
 	/* Ok, now we can encode the value */
 	
 	/* First, clean any previous value */
-	if (avp->avp_mustfreeos != 0) {
-		free(avp->avp_storage.os.data);
-		avp->avp_mustfreeos = 0;
-	}
+	avp_modified(avp);
+	avp_free_os(avp);
 	avp->avp_public.avp_value = NULL;
 	memset(&avp->avp_storage, 0, sizeof(union avp_value));
 	
@@ -1662,7 +2279,7 @@ int fd_msg_avp_value_encode ( void *data, struct avp *avp )
 	
 	/* If an octetstring has been allocated, let's mark it to be freed */
 	if (type == AVP_TYPE_OCTETSTRING)
-		avp->avp_mustfreeos = 1;
+		avp->avp_mustfreeos = OS_MALLOCD;
 	
 	/* Set the data pointer of the public part */
 	avp->avp_public.avp_value = &avp->avp_storage;
@@ -1758,6 +2375,14 @@ static int bufferize_avp(unsigned char * buffer, size_t buflen, size_t * offset,
 	if ((buflen - *offset) < avp->avp_public.avp_len)
 		return ENOSPC;
 	
+	if (avp->avp_wire) {
+		/* The AVP and its children were not modified since they were received, copy them at once */
+		memcpy(&buffer[*offset], avp->avp_wire, avp->avp_public.avp_len);
+		memset(&buffer[*offset + avp->avp_public.avp_len], 0, PAD4(avp->avp_public.avp_len) - avp->avp_public.avp_len);
+		*offset += PAD4(avp->avp_public.avp_len);
+		return 0;
+	}
+	
 	/* Write the header */
 	PUT_in_buf_32(avp->avp_public.avp_code, buffer + *offset);
 	*offset += 4;
@@ -1780,11 +2405,13 @@ static int bufferize_avp(unsigned char * buffer, size_t buflen, size_t * offset,
 		if ( avp->avp_rawdata != NULL ) {
 			/* the content was stored in rawdata */
 			memcpy(&buffer[*offset], avp->avp_rawdata, avp->avp_rawlen);
+			memset(&buffer[*offset + avp->avp_rawlen], 0, PAD4(avp->avp_rawlen) - avp->avp_rawlen);
 			*offset += PAD4(avp->avp_rawlen);
 		} else {
 			/* the message was not parsed completely */
 			size_t datalen = avp->avp_public.avp_len - GETAVPHDRSZ(avp->avp_public.avp_flags);
 			memcpy(&buffer[*offset], avp->avp_source, datalen);
+			memset(&buffer[*offset + datalen], 0, PAD4(datalen) - datalen);
 			*offset += PAD4(datalen);
 		}
 		
@@ -1801,6 +2428,7 @@ static int bufferize_avp(unsigned char * buffer, size_t buflen, size_t * offset,
 			case AVP_TYPE_OCTETSTRING:
 				if (avp->avp_public.avp_value->os.len)
 					memcpy(&buffer[*offset], avp->avp_public.avp_value->os.data, avp->avp_public.avp_value->os.len);
+				memset(&buffer[*offset + avp->avp_public.avp_value->os.len], 0, PAD4(avp->avp_public.avp_value->os.len) - avp->avp_public.avp_value->os.len);
 				*offset += PAD4(avp->avp_public.avp_value->os.len);
 				break;
 
@@ -1859,12 +2487,37 @@ static int bufferize_chain(unsigned char * buffer, size_t buflen, size_t * offse
 	return 0;
 }
 
-/* Create the message buffer, in network-byte order. We browse the tree twice, this could be probably improved if needed */
+/* Write the message in a buffer, in network-byte order. The lengths of the AVPs not modified since they were received are already known. */
+static int bufferize_in(struct msg * msg, unsigned char * buf, size_t * len)
+{
+	size_t offset = 0;
+	
+	/* Write the message header in the buffer */
+	CHECK_FCT( bufferize_msg(buf, msg->msg_public.msg_length, &offset, msg) );
+	
+	/* The received AVPs that were not parsed are copied as is */
+	if (msg->msg_lazylen) {
+		memcpy(buf + offset, msg->msg_rawbuffer + GETMSGHDRSZ(), msg->msg_lazylen);
+		offset += msg->msg_lazylen;
+	}
+	
+	/* Write the list of AVPs */
+	CHECK_FCT( bufferize_chain(buf, msg->msg_public.msg_length, &offset, &msg->msg_chain.children) );
+	
+	ASSERT(offset == msg->msg_public.msg_length); /* or the msg_update_length is buggy */
+		
+	if (len) {
+		*len = offset;
+	}
+	
+	return 0;
+}
+
+/* Create the message buffer */
 int fd_msg_bufferize ( struct msg * msg, unsigned char ** buffer, size_t * len )
 {
 	int ret = 0;
 	unsigned char * buf = NULL;
-	size_t offset = 0;
 	
 	TRACE_ENTRY("%p %p %p", msg, buffer, len);
 	
@@ -1877,30 +2530,38 @@ int fd_msg_bufferize ( struct msg * msg, unsigned char ** buffer, size_t * len )
 	/* Now allocate a buffer to store the message */
 	CHECK_MALLOC(  buf = malloc(msg->msg_public.msg_length)  );
 	
-	/* Clear the memory, so that the padding is always 0 (should not matter) */
-	memset(buf, 0, msg->msg_public.msg_length);
-	
-	/* Write the message header in the buffer */
-	CHECK_FCT_DO( ret = bufferize_msg(buf, msg->msg_public.msg_length, &offset, msg), 
+	CHECK_FCT_DO( ret = bufferize_in(msg, buf, len), 
 		{
 			free(buf);
 			return ret;
 		}  );
 	
-	/* Write the list of AVPs */
-	CHECK_FCT_DO( ret = bufferize_chain(buf, msg->msg_public.msg_length, &offset, &msg->msg_chain.children),
-		{
-			free(buf);
-			return ret;
-		}  );
+	*buffer = buf;
+	return 0;
+}
+
+/* Same, reusing the buffer of the caller when it is large enough */
+int fd_msg_bufferize_to ( struct msg * msg, unsigned char ** buffer, size_t * bufsz, size_t * len )
+{
+	TRACE_ENTRY("%p %p %p %p", msg, buffer, bufsz, len);
 	
-	ASSERT(offset == msg->msg_public.msg_length); /* or the msg_update_length is buggy */
-		
-	if (len) {
-		*len = offset;
+	/* Check the parameters */
+	CHECK_PARAMS(  buffer && bufsz && (*buffer || !*bufsz) && CHECK_MSG(msg)  );
+	
+	/* Update the length. This also checks that all AVP have their values set */
+	CHECK_FCT(  fd_msg_update_length(msg)  );
+	
+	/* Grow the buffer if needed */
+	if (*bufsz < msg->msg_public.msg_length) {
+		size_t sz = (msg->msg_public.msg_length + 1023) & ~(size_t)1023;
+		unsigned char * buf;
+		CHECK_MALLOC( buf = realloc(*buffer, sz) );
+		*buffer = buf;
+		*bufsz = sz;
 	}
 	
-	*buffer = buf;
+	CHECK_FCT( bufferize_in(msg, *buffer, len) );
+	
 	return 0;
 }
 
@@ -1924,7 +2585,7 @@ static int parsebuf_list(unsigned char * buf, size_t buflen, struct fd_list * he
 		}
 		
 		/* Create a new AVP object */
-		CHECK_MALLOC(  avp = malloc (sizeof(struct avp))  );
+		CHECK_MALLOC(  avp = cache_get(CACHE_AVP)  );
 		
 		init_avp(avp);
 		
@@ -1938,7 +2599,7 @@ static int parsebuf_list(unsigned char * buf, size_t buflen, struct fd_list * he
 		if (avp->avp_public.avp_flags & AVP_FLAG_VENDOR) {
 			if (buflen - offset < 4) {
 				TRACE_DEBUG(INFO, "truncated buffer: remaining only %zd bytes for vendor and data", buflen - offset);
-				free(avp);
+				cache_put(avp, CACHE_AVP);
 				return EBADMSG;
 			}
 			avp->avp_public.avp_vendor  = ntohl(*(uint32_t *)(buf + offset));
@@ -1951,7 +2612,7 @@ static int parsebuf_list(unsigned char * buf, size_t buflen, struct fd_list * he
 			TRACE_DEBUG(INFO, "truncated buffer: remaining only %zd bytes for data, and avp data size is %d", 
 					buflen - offset, 
 					avp->avp_public.avp_len - GETAVPHDRSZ(avp->avp_public.avp_flags));
-			free(avp);
+			cache_put(avp, CACHE_AVP);
 			return EBADMSG;
 		}
 		
@@ -1968,6 +2629,96 @@ static int parsebuf_list(unsigned char * buf, size_t buflen, struct fd_list * he
 	return 0;
 }
 
+/* Lazy parsing of the received messages */
+static int msg_lazy = 0;
+
+void fd_msg_parse_lazy ( int enable )
+{
+	TRACE_ENTRY("%d", enable);
+	msg_lazy = enable;
+}
+
+/* Read the header of the AVP at *offset in a buffer, without creating an object. */
+static int wire_read(unsigned char * buf, size_t buflen, size_t * offset, struct avp_wirehdr * avp)
+{
+	size_t hdrsz;
+	uint32_t len;
+	
+	if (*offset >= buflen)
+		return ENOENT;
+	
+	if (buflen - *offset < AVPHDRSZ_NOVEND)
+		return EBADMSG;
+	
+	buf += *offset;
+	avp->avp_code  = ntohl(*(uint32_t *)buf);
+	avp->avp_flags = buf[4];
+	len = ((uint32_t)buf[5]) << 16 |  ((uint32_t)buf[6]) << 8 |  ((uint32_t)buf[7]) ;
+	hdrsz = GETAVPHDRSZ(avp->avp_flags);
+	
+	if ((len < hdrsz) || (buflen - *offset < len))
+		return EBADMSG;
+	
+	avp->avp_vendor  = (avp->avp_flags & AVP_FLAG_VENDOR) ? ntohl(*(uint32_t *)(buf + 8)) : 0;
+	avp->avp_data    = buf + hdrsz;
+	avp->avp_datalen = len - hdrsz;
+	
+	/* Skip the data and padding */
+	*offset += PAD4(len);
+	return 0;
+}
+
+/* Check that a buffer contains a well-formed list of AVPs */
+static int wire_check(unsigned char * buf, size_t buflen)
+{
+	size_t offset = 0;
+	struct avp_wirehdr avp;
+	int ret;
+	
+	while ((ret = wire_read(buf, buflen, &offset, &avp)) == 0)
+		/* continue */;
+	
+	return (ret == ENOENT) ? 0 : ret;
+}
+
+/* In lazy mode, create the objects of the received AVPs when they are first needed. The AVPs added meanwhile go after them. */
+static int msg_expand(struct msg * msg)
+{
+	struct fd_list added = FD_LIST_INITIALIZER(added);
+	int ret;
+	
+	if (!msg->msg_lazylen)
+		return 0;
+	
+	fd_list_move_end(&added, &msg->msg_chain.children);
+	
+	CHECK_FCT_DO( ret = parsebuf_list(msg->msg_rawbuffer + GETMSGHDRSZ(), msg->msg_lazylen, &msg->msg_chain.children),
+		{
+			while (!FD_IS_LIST_EMPTY(&msg->msg_chain.children))
+				destroy_tree(_C(msg->msg_chain.children.next->o));
+			fd_list_move_end(&msg->msg_chain.children, &added);
+			return ret;
+		} );
+	
+	fd_list_move_end(&msg->msg_chain.children, &added);
+	msg->msg_lazylen = 0;
+	msg_index_drop(msg);
+	return 0;
+}
+
+/* Browse the received AVPs of a lazily parsed message */
+int fd_msg_wire_browse ( struct msg * msg, size_t * offset, struct avp_wirehdr * avp )
+{
+	TRACE_ENTRY("%p %p %p", msg, offset, avp);
+	
+	CHECK_PARAMS(  CHECK_MSG(msg) && offset && avp  );
+	
+	if (!msg->msg_lazylen)
+		return ENOTSUP;
+	
+	return wire_read(msg->msg_rawbuffer + GETMSGHDRSZ(), msg->msg_lazylen, offset, avp);
+}
+
 /* Create a message object from a buffer. Dictionary objects are not resolved, AVP contents are not interpreted, buffer is saved in msg */
 int fd_msg_parse_buffer ( unsigned char ** buffer, size_t buflen, struct msg ** msg )
 {
@@ -1993,7 +2744,7 @@ int fd_msg_parse_buffer ( unsigned char ** buffer, size_t buflen, struct msg **
 	}
 	
 	/* Create a new object */
-	CHECK_MALLOC( new = malloc (sizeof(struct msg)) );
+	CHECK_MALLOC( new = cache_get(CACHE_MSG) );
 	
 	/* Initialize the fields */
 	init_msg(new);
@@ -2009,10 +2760,22 @@ int fd_msg_parse_buffer ( unsigned char ** buffer, size_t buflen, struct msg **
 	new->msg_public.msg_hbhid = ntohl(*(uint32_t *)(buf+12));
 	new->msg_public.msg_eteid = ntohl(*(uint32_t *)(buf+16));
 	
-	/* Parse the AVP list */
-	CHECK_FCT_DO( ret = parsebuf_list(buf + GETMSGHDRSZ(), buflen - GETMSGHDRSZ(), &new->msg_chain.children), { destroy_tree(_C(new)); return ret; }  );
+	/* Parse the AVP list, or only check it in lazy mode. Anything unusual is left to the complete parsing. */
+	if (msg_lazy && (msglen > GETMSGHDRSZ()) && (wire_check(buf + GETMSGHDRSZ(), msglen - GETMSGHDRSZ()) == 0)) {
+		new->msg_lazylen = msglen - GETMSGHDRSZ();
+	} else {
+		CHECK_FCT_DO( ret = parsebuf_list(buf + GETMSGHDRSZ(), buflen - GETMSGHDRSZ(), &new->msg_chain.children), { destroy_tree(_C(new)); return ret; }  );
+	}
 	
 	/* Parsing successful */
+	if (msg_zerocopy) {
+		struct msg_rawbuf * rb;
+		CHECK_MALLOC_DO( rb = (struct msg_rawbuf *)os_new(sizeof(struct msg_rawbuf)), { destroy_tree(_C(new)); return ENOMEM; } );
+		rb->data = buf;
+		rb->len = msglen;
+		rb->refcnt = 1;
+		new->msg_rawref = rb;
+	}
 	new->msg_rawbuffer = buf;
 	*buffer = NULL;
 	*msg = new;
@@ -2045,6 +2808,14 @@ static int parsedict_do_avp(struct dictionary * dict, struct avp * avp, int mand
 	/* First check we received an AVP as input */
 	CHECK_PARAMS(  CHECK_AVP(avp) );
 	
+	/* In zero-copy mode, keep the AVP as received, so that it is copied as is if the message is sent again */
+	if (avp->avp_source && !avp->avp_rawref) {
+		if ((avp->avp_rawref = avp_rawbuf(avp, avp->avp_source)) != NULL) {
+			__atomic_add_fetch(&avp->avp_rawref->refcnt, 1, __ATOMIC_RELAXED);
+			avp->avp_wire = avp->avp_source - GETAVPHDRSZ( avp->avp_public.avp_flags );
+		}
+	}
+	
 	if (avp->avp_model != NULL) {
 		/* the model has already been resolved. we do check it is still valid */
 
@@ -2106,7 +2877,7 @@ static int parsedict_do_avp(struct dictionary * dict, struct avp * avp, int mand
 			avp->avp_rawlen = avp->avp_public.avp_len - GETAVPHDRSZ( avp->avp_public.avp_flags );
 			
 			if (avp->avp_rawlen) {
-				CHECK_MALLOC(  avp->avp_rawdata = malloc(avp->avp_rawlen)  );
+				CHECK_MALLOC(  avp->avp_rawdata = os_new(avp->avp_rawlen)  );
 			
 				memcpy(avp->avp_rawdata, avp->avp_source, avp->avp_rawlen);
 			}
@@ -2187,8 +2958,14 @@ static int parsedict_do_avp(struct dictionary * dict, struct avp * avp, int mand
 					return EBADMSG;
 				} );
 			avp->avp_storage.os.len = avp->avp_public.avp_len - GETAVPHDRSZ( avp->avp_public.avp_flags );
-			CHECK_MALLOC(  avp->avp_storage.os.data = os0dup(source, avp->avp_storage.os.len)  );
-			avp->avp_mustfreeos = 1;
+			if (avp->avp_rawref && (source >= avp->avp_rawref->data) && (source < avp->avp_rawref->data + avp->avp_rawref->len)) {
+				/* Zero-copy: point inside the received buffer, which is not NUL-terminated */
+				avp->avp_storage.os.data = source;
+				avp->avp_mustfreeos = OS_REFERENCED;
+			} else {
+				CHECK_MALLOC(  avp->avp_storage.os.data = os_dup(source, avp->avp_storage.os.len)  );
+				avp->avp_mustfreeos = OS_FROM_CACHE;
+			}
 			break;
 		
 		case AVP_TYPE_INTEGER32:
@@ -2319,12 +3096,21 @@ static int parsedict_do_msg(struct dictionary * dict, struct msg * msg, int only
 		} );
 chain:	
 	if (!only_hdr) {
+		/* Create the AVPs if the message was parsed lazily */
+		CHECK_FCT( msg_expand(msg) );
+		
 		/* Then process the children */
 		ret = parsedict_do_chain(dict, &msg->msg_chain.children, 1, error_info);
 
 		/* Free the raw buffer if any */
 		if ((ret == 0) && (msg->msg_rawbuffer != NULL)) {
-			free(msg->msg_rawbuffer);
+			if (msg->msg_rawref) {
+				/* The buffer lives as long as AVPs reference it */
+				rawbuf_unref(msg->msg_rawref);
+				msg->msg_rawref = NULL;
+			} else {
+				free(msg->msg_rawbuffer);
+			}
 			msg->msg_rawbuffer=NULL;
 		}
 	}
@@ -2665,6 +3451,10 @@ int fd_msg_update_length ( msg_or_avp * object )
 	
 	TRACE_ENTRY("%p", object);
 	
+	/* The length of an AVP that was not modified since it was received is already known */
+	if (CHECK_AVP(object) && _A(object)->avp_wire)
+		return 0;
+	
 	/* Get the model of the object. This also validates the object */
 	CHECK_FCT( fd_msg_model ( object, &model ) );
 	
@@ -2714,7 +3504,7 @@ int fd_msg_update_length ( msg_or_avp * object )
 		if (_C(object)->type == MSG_AVP) {
 			sz = GETAVPHDRSZ( _A(object)->avp_public.avp_flags );
 		} else {
-			sz = GETMSGHDRSZ( );
+			sz = GETMSGHDRSZ( ) + _M(object)->msg_lazylen;
 		}
 		
 		/* Recurse in all children and update the sz information */
@@ -2789,8 +3579,11 @@ int fd_msg_dispatch ( struct msg ** msg, struct session * session, enum disp_act
 		goto out;
 	}
 	
-	/* So start browsing the message */
-	CHECK_FCT_DO( ret = fd_msg_browse( *msg, MSG_BRW_FIRST_CHILD, &avp, NULL ), goto out );
+	/* So start browsing the message, unless no callback is registered on any AVP */
+	avp = NULL;
+	if (fd_disp_avp_hdl) {
+		CHECK_FCT_DO( ret = fd_msg_browse( *msg, MSG_BRW_FIRST_CHILD, &avp, NULL ), goto out );
+	}
 	while (avp != NULL) {
 		/* For unknown AVP, we don't have a callback registered, so just skip */
 		if (avp->avp_model) {
@@ -2799,8 +3592,12 @@ int fd_msg_dispatch ( struct msg ** msg, struct session * session, enum disp_act
 			/* Get the list of callback for this AVP */
 			CHECK_FCT_DO( ret = fd_dict_disp_cb(DICT_AVP, avp->avp_model, &cb_list), goto out );
 			
-			/* We search enumerated values only in case of non-grouped AVP */
-			if ( avp->avp_public.avp_value ) {
+			/* Most AVPs have no callback, there is nothing else to do for them */
+			if (FD_IS_LIST_EMPTY(cb_list))
+				goto next;
+			
+			/* We search enumerated values only in case of non-grouped AVP, and if a callback needs it */
+			if ( avp->avp_public.avp_value && fd_disp_need_enumval(cb_list) ) {
 				struct dict_object * type;
 				/* Check if the AVP has a constant value */
 				CHECK_FCT_DO( ret = fd_dict_search(dict, DICT_TYPE, TYPE_OF_AVP, avp->avp_model, &type, 0), goto out );
@@ -2817,6 +3614,7 @@ int fd_msg_dispatch ( struct msg ** msg, struct session * session, enum disp_act
 			CHECK_FCT_DO( ret = fd_disp_call_cb_int( cb_list, msg, avp, session, action, app, cmd, avp->avp_model, enumval, drop_reason, drop_msg ), goto out );
 			TEST_ACTION_STOP();
 		}
+next:
 		/* Go to next AVP */
 		CHECK_FCT_DO(  ret = fd_msg_browse( avp, MSG_BRW_WALK, &avp, NULL ), goto out );
 	}
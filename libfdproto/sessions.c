@@ -42,16 +42,37 @@
 
 /*********************** Parameters **********************/
 
-/* Size of the hash table containing the session objects (pow of 2. ex: 6 => 2^6 = 64). must be between 0 and 31. */
+/* Initial size of the hash table containing the session objects (pow of 2. ex: 10 => 2^10 = 1024). must be between 0 and 20. 
+ This is also the number of locks protecting the table, and the number of lines added at a time in the table when it grows. */
 #ifndef SESS_HASH_SIZE
-#define SESS_HASH_SIZE	6
+#define SESS_HASH_SIZE	10
 #endif /* SESS_HASH_SIZE */
 
+/* Maximum number of segments of (1 << SESS_HASH_SIZE) lines in the hash table. The default allows 8M lines. */
+#ifndef SESS_HASH_SEGMENTS
+#define SESS_HASH_SEGMENTS	8192
+#endif /* SESS_HASH_SEGMENTS */
+
+/* The hash table grows when the average number of sessions per line exceeds this value */
+#ifndef SESS_HASH_LOAD
+#define SESS_HASH_LOAD	2
+#endif /* SESS_HASH_LOAD */
+
 /* Default lifetime of a session, in seconds. (31 days = 2678400 seconds) */
 #ifndef SESS_DEFAULT_LIFETIME
 #define SESS_DEFAULT_LIFETIME	2678400
 #endif /* SESS_DEFAULT_LIFETIME */
 
+/* Number of threads destroying the expired sessions. The sessions are spread between them by their hash. */
+#ifndef SESS_EXP_SHARDS
+#define SESS_EXP_SHARDS	4
+#endif /* SESS_EXP_SHARDS */
+
+/* Resolution of the sessions timeouts, in milliseconds */
+#ifndef SESS_EXP_TICK
+#define SESS_EXP_TICK	10
+#endif /* SESS_EXP_TICK */
+
 /********************** /Parameters **********************/
 
 /* Eyescatchers definitions */
@@ -98,7 +119,7 @@ struct session {
 	struct fd_list	chain_h;/* chaining in the hash table of sessions. */
 	
 	struct timespec	timeout;/* Timeout date for the session */
-	struct fd_list	expire;	/* List of expiring sessions, ordered by timeouts. */
+	struct fd_list	expire;	/* Chaining in the expiry wheel of the session's shard, or in its list of expired sessions. */
 	
 	pthread_mutex_t stlock;	/* A lock to protect the list of states associated with this session */
 	struct fd_list	states;	/* Sentinel for the list of states of this session. */
@@ -106,36 +127,160 @@ struct session {
 	int		is_destroyed; /* boolean telling if fd_sess_detroy has been called on this */
 };
 
-/* Sessions hash table, to allow fast sid to session retrieval */
-static struct {
-	struct fd_list	sentinel;	/* sentinel element for this sublist. The sublist is ordered by hash value, then fd_os_cmp(sid). */
-	pthread_mutex_t lock;		/* the mutex for this sublist -- we might probably change it to rwlock for a little optimization */
-} sess_hash [ 1 << SESS_HASH_SIZE ] ;
-#define H_MASK( __hash ) ((__hash) & (( 1 << SESS_HASH_SIZE ) - 1))
-#define H_LIST( _hash ) (&(sess_hash[H_MASK(_hash)].sentinel))
-#define H_LOCK( _hash ) (&(sess_hash[H_MASK(_hash)].lock    ))
+/* Sessions hash table, to allow fast sid to session retrieval.
+ * The number of lines grows with the number of sessions, one line at a time (linear hashing): when the line n is added
+ * (with 2^k <= n < 2^(k+1)), the sessions of line (n - 2^k) having the bit k set in their hash are moved to the new line. 
+ * The lines are allocated by segments that are never moved, so the table is never copied.
+ * The lines are protected by a fixed set of rwlocks, selected by the low bits of the hash. A line and the new line created 
+ * when it is split share these bits, so a split only holds the lock of the line being split, and does not block the other ones. */
+static struct fd_list *	sess_hash[SESS_HASH_SEGMENTS];		/* Segments of (1 << SESS_HASH_SIZE) lines. Each line is ordered by hash value, then fd_os_cmp(sid). */
+static pthread_rwlock_t	sess_hash_locks[1 << SESS_HASH_SIZE];	/* The locks of the lines: rdlock to search, wrlock to link or unlink a session. */
+static uint32_t		sess_hash_lines;			/* Current number of lines. Accessed atomically, since it is changed by splits under a different lock. */
+static pthread_mutex_t	sess_hash_grow_lock = PTHREAD_MUTEX_INITIALIZER;	/* Only one thread splits the lines at a time */
+#define H_SEG_MASK	(( 1 << SESS_HASH_SIZE ) - 1)
+#define H_LINE( _line ) (&(sess_hash[(_line) >> SESS_HASH_SIZE][(_line) & H_SEG_MASK]))
+#define H_LEVEL( _lines ) (1U << (31 - __builtin_clz(_lines))) /* the 2^k such that 2^k <= _lines < 2^(k+1) */
+#define H_LIST( _hash ) (sess_hash_line(_hash))
+#define H_LOCK( _hash ) (&(sess_hash_locks[(_hash) & H_SEG_MASK]))
 
-static uint32_t		sess_cnt = 0; /* counts all active session (that are in the expiry list) */
+static uint32_t		sess_cnt = 0; /* counts all active session (that are in the expiry wheels). Accessed atomically. */
 
 /* The following are used to generate sid values that are eternaly unique */
 static uint32_t   	sid_h;	/* initialized to the current time in fd_sess_init */
 static uint32_t   	sid_l;	/* incremented each time a session id is created */
 static pthread_mutex_t 	sid_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* Expiring sessions management */
-static struct fd_list	exp_sentinel = FD_LIST_INITIALIZER(exp_sentinel);	/* list of sessions ordered by their timeout date */
-static pthread_mutex_t	exp_lock = PTHREAD_MUTEX_INITIALIZER;	/* lock protecting the list. */
-static pthread_cond_t	exp_cond = PTHREAD_COND_INITIALIZER;	/* condvar used by the expiry mecahinsm. */
-static pthread_t	exp_thr = (pthread_t)NULL; 	/* The expiry thread that handles cleanup of expired sessions */
+/* Expiring sessions management.
+ * The sessions are spread by their hash over SESS_EXP_SHARDS shards, each with its own lock and its own thread destroying the expired sessions.
+ * In a shard, the sessions are stored in a hierarchical timing wheel, so that linking or unlinking a session does not depend on the number of sessions.
+ * The time is counted in ticks of SESS_EXP_TICK ms. A session expiring at tick t is stored in the lowest level l such as t is less than 
+ * 2^((l+1)*SESS_WHEEL_BITS) ticks ahead, in the slot selected by the bits l*SESS_WHEEL_BITS and above of t. When the index of a level 
+ * wraps to 0, the sessions of the current slot of the level above are moved down (cascade), so each session is moved at most 
+ * SESS_WHEEL_LEVELS - 1 times. All sessions of the level 0 slot of the current tick are expired. */
+#define SESS_WHEEL_BITS		8
+#define SESS_WHEEL_MASK		((1 << SESS_WHEEL_BITS) - 1)
+#define SESS_WHEEL_LEVELS	4	/* 2^32 ticks ahead; farther timeouts are linked again when their slot is cascaded */
+#define SESS_WHEEL_SPAN		((uint64_t)1 << (SESS_WHEEL_BITS * SESS_WHEEL_LEVELS))
+#define TICK_NS			((uint64_t)SESS_EXP_TICK * 1000000)
+
+static struct exp_shard {
+	pthread_mutex_t	lock;		/* lock protecting the shard. */
+	pthread_cond_t	cond;		/* condvar used to wake up the thread when a session expires earlier than planned. */
+	pthread_t	thr;		/* The expiry thread that handles cleanup of the expired sessions of this shard */
+	uint32_t	cnt;		/* number of sessions linked in the wheel and the expired list */
+	uint64_t	tick;		/* next tick to be processed */
+	uint64_t	wake;		/* tick when the thread wakes up next, 0 if it waits for a session to be linked */
+	struct fd_list	expired;	/* sessions already expired, that the thread is destroying */
+	struct fd_list	wheel[SESS_WHEEL_LEVELS][1 << SESS_WHEEL_BITS];
+} exp_shards[SESS_EXP_SHARDS];
+#define EXP_SHARD( _hash ) (&exp_shards[(_hash) % SESS_EXP_SHARDS])
 
 /* Hierarchy of the locks, to avoid deadlocks:
- *  hash lock > state lock > expiry lock
+ *  grow lock > hash lock > state lock > expiry lock
  * i.e. state lock can be taken while holding the hash lock, but not while holding the expiry lock.
  * As well, the hash lock cannot be taken while holding a state lock.
  */
 
 /********************************************************************************************************/
 
+/* Get the line of the hash table for a hash value. The H_LOCK(hash) must be held. */
+static struct fd_list * sess_hash_line(uint32_t hash)
+{
+	uint32_t lines = __atomic_load_n(&sess_hash_lines, __ATOMIC_ACQUIRE);
+	uint32_t level = H_LEVEL(lines);
+	uint32_t line = hash & ((level << 1) - 1);
+	
+	/* This line is not split yet */
+	if (line >= lines)
+		line = hash & (level - 1);
+	
+	return H_LINE(line);
+}
+
+/* Search a session in the hash table. The H_LOCK(hash) must be held. 
+ If not found, returns NULL and *pos is the element before which the session must be inserted. */
+static struct session * sess_hash_search(uint32_t hash, os0_t sid, size_t sidlen, struct fd_list ** pos)
+{
+	struct fd_list * li;
+	
+	for (li = H_LIST(hash)->next; li != H_LIST(hash); li = li->next) {
+		int cmp;
+		struct session * s = (struct session *)(li->o);
+		
+		/* The list is ordered by hash and sid (in case of collisions) */
+		if (s->hash < hash)
+			continue;
+		if (s->hash > hash)
+			break;
+		
+		cmp = fd_os_cmp(s->sid, s->sidlen, sid, sidlen);
+		if (cmp < 0)
+			continue;
+		if (cmp > 0)
+			break;
+		
+		/* A session with the same sid is in the hash table */
+		return s;
+	}
+	
+	if (pos)
+		*pos = li;
+	return NULL;
+}
+
+/* Add one line to the hash table, by splitting an existing line. The grow lock must be held. */
+static int sess_hash_split(void)
+{
+	uint32_t lines = sess_hash_lines; /* we are the only writer */
+	uint32_t level = H_LEVEL(lines);
+	uint32_t from = lines - level;
+	struct fd_list * src, * dst, * li, * next;
+	
+	if ((lines >> SESS_HASH_SIZE) >= SESS_HASH_SEGMENTS)
+		return ENOSPC; /* The table has its maximum size already */
+	
+	/* Allocate the segment if needed. It is not visible before sess_hash_lines is updated */
+	if (sess_hash[lines >> SESS_HASH_SIZE] == NULL) {
+		struct fd_list * seg;
+		int i;
+		CHECK_MALLOC( seg = malloc(sizeof(struct fd_list) << SESS_HASH_SIZE) );
+		for (i = 0; i < (1 << SESS_HASH_SIZE); i++)
+			fd_list_init(&seg[i], NULL);
+		sess_hash[lines >> SESS_HASH_SIZE] = seg;
+	}
+	
+	src = H_LINE(from);
+	dst = H_LINE(lines);
+	
+	/* The new line uses the same lock as the one we split. The order is preserved in both lines. */
+	CHECK_POSIX( pthread_rwlock_wrlock( H_LOCK(from) ) );
+	for (li = src->next; li != src; li = next) {
+		next = li->next;
+		if ((((struct session *)(li->o))->hash & ((level << 1) - 1)) == lines) {
+			fd_list_unlink(li);
+			fd_list_insert_before(dst, li);
+		}
+	}
+	__atomic_store_n(&sess_hash_lines, lines + 1, __ATOMIC_RELEASE);
+	CHECK_POSIX( pthread_rwlock_unlock( H_LOCK(from) ) );
+	
+	return 0;
+}
+
+/* Grow the hash table as long as the average number of sessions per line is too high. If another thread is already doing it, return immediately. */
+static void sess_hash_grow(uint32_t cnt)
+{
+	if (pthread_mutex_trylock(&sess_hash_grow_lock))
+		return;
+	
+	while (cnt > sess_hash_lines * SESS_HASH_LOAD) {
+		if (sess_hash_split())
+			break;
+	}
+	
+	CHECK_POSIX_DO( pthread_mutex_unlock(&sess_hash_grow_lock), /* continue */ );
+}
+
 /* Initialize a session object. It is not linked now. sid must be already malloc'ed. The hash has already been computed. */
 static struct session * new_session(os0_t sid, size_t sidlen, uint32_t hash)
 {
@@ -175,39 +320,162 @@ static void del_session(struct session * s)
 	free(s);
 }
 	
-/* The expiry thread */
+/* Get the first tick not before a date */
+static uint64_t exp_tick(const struct timespec * ts)
+{
+	return ((uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec + TICK_NS - 1) / TICK_NS;
+}
+
+/* Link a session in the wheel, relatively to the current tick of the shard. The shard lock must be held. 
+ Returns the tick when the session is expired or cascaded, whichever comes first. */
+static uint64_t exp_wheel_link(struct exp_shard * sh, struct session * sess)
+{
+	uint64_t t = exp_tick(&sess->timeout);
+	int l;
+	
+	if (t < sh->tick)
+		t = sh->tick; /* already expired, it will be processed with the next tick */
+	if (t - sh->tick >= SESS_WHEEL_SPAN)
+		t = sh->tick + SESS_WHEEL_SPAN - 1; /* out of range, it will be linked again when cascaded */
+	
+	for (l = 0; l < SESS_WHEEL_LEVELS - 1; l++) {
+		if (t - sh->tick < ((uint64_t)1 << ((l + 1) * SESS_WHEEL_BITS)))
+			break;
+	}
+	
+	fd_list_insert_before(&sh->wheel[l][(t >> (l * SESS_WHEEL_BITS)) & SESS_WHEEL_MASK], &sess->expire);
+	return t;
+}
+
+/* Process the next tick of a shard: cascade the upper levels if the lower ones wrap, then move the sessions expiring in this tick to the expired list. */
+static void exp_wheel_tick(struct exp_shard * sh)
+{
+	int l;
+	
+	for (l = 1; l < SESS_WHEEL_LEVELS; l++) {
+		struct fd_list moved = FD_LIST_INITIALIZER(moved);
+		
+		if ((sh->tick >> ((l - 1) * SESS_WHEEL_BITS)) & SESS_WHEEL_MASK)
+			break;
+		
+		fd_list_move_end(&moved, &sh->wheel[l][(sh->tick >> (l * SESS_WHEEL_BITS)) & SESS_WHEEL_MASK]);
+		while (!FD_IS_LIST_EMPTY(&moved)) {
+			struct session * s = (struct session *)(moved.next->o);
+			fd_list_unlink(&s->expire);
+			(void) exp_wheel_link(sh, s);
+		}
+	}
+	
+	fd_list_move_end(&sh->expired, &sh->wheel[0][sh->tick & SESS_WHEEL_MASK]);
+	sh->tick++;
+}
+
+/* Get the next tick that has something to process: a non-empty slot in level 0, or a cascade */
+static uint64_t exp_wheel_next(struct exp_shard * sh)
+{
+	uint64_t t;
+	
+	for (t = sh->tick; t & SESS_WHEEL_MASK; t++) {
+		if (!FD_IS_LIST_EMPTY(&sh->wheel[0][t & SESS_WHEEL_MASK]))
+			break;
+	}
+	
+	return t;
+}
+
+/* Link a session in the expiry wheel of its shard according to its timeout, or move it if it is already linked. 
+ The new timeout, if any, is set under the lock of the shard, since its expiry thread reads it. The hash lock and state lock may be held. */
+static int exp_link(struct session * sess, const struct timespec * timeout)
+{
+	struct exp_shard * sh = EXP_SHARD(sess->hash);
+	uint64_t t;
+	
+	CHECK_POSIX( pthread_mutex_lock( &sh->lock ) );
+	
+	if (timeout)
+		memcpy(&sess->timeout, timeout, sizeof(struct timespec));
+	
+	if (FD_IS_LIST_EMPTY(&sess->expire)) {
+		if (sh->cnt == 0) {
+			/* The wheel was idle, restart it from the current time */
+			struct timespec now;
+			CHECK_SYS_DO( clock_gettime(CLOCK_REALTIME, &now), { ASSERT(0); } );
+			sh->tick = ((uint64_t)now.tv_sec * 1000000000 + now.tv_nsec) / TICK_NS;
+		}
+		sh->cnt++;
+		__atomic_add_fetch(&sess_cnt, 1, __ATOMIC_RELAXED);
+	} else {
+		fd_list_unlink(&sess->expire);
+	}
+	
+	t = exp_wheel_link(sh, sess);
+	
+	/* If the thread is sleeping past this tick, wake it up */
+	if ((sh->wake == 0) || (t < sh->wake)) {
+		CHECK_POSIX_DO( pthread_cond_signal(&sh->cond), { ASSERT(0); } );
+	}
+	
+	CHECK_POSIX( pthread_mutex_unlock( &sh->lock ) );
+	return 0;
+}
+
+/* Unlink a session from the expiry wheel or the expired list of its shard, if it is linked. */
+static void exp_unlink(struct session * sess)
+{
+	struct exp_shard * sh = EXP_SHARD(sess->hash);
+	
+	CHECK_POSIX_DO( pthread_mutex_lock( &sh->lock ), { ASSERT(0); /* otherwise cleanup handler is not pop'd */ } );
+	if (!FD_IS_LIST_EMPTY(&sess->expire)) {
+		fd_list_unlink( &sess->expire ); /* no need to signal the condition here */
+		sh->cnt--;
+		__atomic_sub_fetch(&sess_cnt, 1, __ATOMIC_RELAXED);
+	}
+	CHECK_POSIX_DO( pthread_mutex_unlock( &sh->lock ), { ASSERT(0); /* otherwise cleanup handler is not pop'd */ } );
+}
+
+/* The expiry threads, one per shard */
 static void * exp_fct(void * arg)
 {
+	struct exp_shard * sh = arg;
+	
 	fd_log_threadname ( "Session/expire" );
-	TRACE_ENTRY( "" );
+	TRACE_ENTRY( "%p", arg );
 	
 	
 	do {
 		struct timespec	now;
 		struct session * first;
 		
-		CHECK_POSIX_DO( pthread_mutex_lock(&exp_lock),  break );
-		pthread_cleanup_push( fd_cleanup_mutex, &exp_lock );
+		CHECK_POSIX_DO( pthread_mutex_lock(&sh->lock),  break );
+		pthread_cleanup_push( fd_cleanup_mutex, &sh->lock );
 again:		
 		/* Check if there are expiring sessions available */
-		if (FD_IS_LIST_EMPTY(&exp_sentinel)) {
+		if (sh->cnt == 0) {
 			/* Just wait for a change or cancelation */
-			CHECK_POSIX_DO( pthread_cond_wait( &exp_cond, &exp_lock ), break /* this might not pop the cleanup handler, but since we ASSERT(0), it is not the big issue... */ );
+			sh->wake = 0;
+			CHECK_POSIX_DO( pthread_cond_wait( &sh->cond, &sh->lock ), break /* this might not pop the cleanup handler, but since we ASSERT(0), it is not the big issue... */ );
 			/* Restart the loop on wakeup */
 			goto again;
 		}
 		
-		/* Get the pointer to the session that expires first */
-		first = (struct session *)(exp_sentinel.next->o);
-		ASSERT( VALIDATE_SI(first) );
+		/* Once the previous batch is destroyed, collect all the sessions expired up to now */
+		if (FD_IS_LIST_EMPTY(&sh->expired)) {
+			uint64_t now_tick;
+			
+			CHECK_SYS_DO(  clock_gettime(CLOCK_REALTIME, &now),  break  );
+			now_tick = ((uint64_t)now.tv_sec * 1000000000 + now.tv_nsec) / TICK_NS;
+			
+			while (sh->tick <= now_tick)
+				exp_wheel_tick(sh);
+		}
 		
-		/* Get the current time */
-		CHECK_SYS_DO(  clock_gettime(CLOCK_REALTIME, &now),  break  );
-
-		/* If first session is not expired, we just wait until it happens */
-		if ( TS_IS_INFERIOR( &now, &first->timeout ) ) {
+		/* If no session is expired, we just wait until the next tick to process */
+		if (FD_IS_LIST_EMPTY(&sh->expired)) {
+			sh->wake = exp_wheel_next(sh);
+			now.tv_sec  = sh->wake * TICK_NS / 1000000000;
+			now.tv_nsec = sh->wake * TICK_NS % 1000000000;
 			
-			CHECK_POSIX_DO2(  pthread_cond_timedwait( &exp_cond, &exp_lock, &first->timeout ),  
+			CHECK_POSIX_DO2(  pthread_cond_timedwait( &sh->cond, &sh->lock, &now ),  
 					ETIMEDOUT, /* ETIMEDOUT is a normal error, continue */,
 					/* on other error, */ break );
 	
@@ -215,9 +483,12 @@ again:
 			goto again;
 		}
 		
-		/* Now, the first session in the list is expired; destroy it */
+		/* Now, the first session in the expired list is destroyed, which unlinks it */
+		first = (struct session *)(sh->expired.next->o);
+		ASSERT( VALIDATE_SI(first) );
+		
 		pthread_cleanup_pop( 0 );
-		CHECK_POSIX_DO( pthread_mutex_unlock(&exp_lock),  break );
+		CHECK_POSIX_DO( pthread_mutex_unlock(&sh->lock),  break );
 		
 		CHECK_FCT_DO( fd_sess_destroy( &first ), break );
 		
@@ -243,10 +514,24 @@ int fd_sess_init(void)
 	sid_h = (uint32_t) time(NULL);
 	sid_l = 0;
 	
-	/* Initialize the hash table */
-	for (i = 0; i < sizeof(sess_hash) / sizeof(sess_hash[0]); i++) {
-		fd_list_init( &sess_hash[i].sentinel, NULL );
-		CHECK_POSIX(  pthread_mutex_init(&sess_hash[i].lock, NULL)  );
+	/* Initialize the hash table with its first segment */
+	CHECK_MALLOC( sess_hash[0] = malloc(sizeof(struct fd_list) << SESS_HASH_SIZE) );
+	for (i = 0; i < (1 << SESS_HASH_SIZE); i++) {
+		fd_list_init( &sess_hash[0][i], NULL );
+		CHECK_POSIX(  pthread_rwlock_init(&sess_hash_locks[i], NULL)  );
+	}
+	sess_hash_lines = 1 << SESS_HASH_SIZE;
+	
+	/* Initialize the expiry shards */
+	for (i = 0; i < SESS_EXP_SHARDS; i++) {
+		struct exp_shard * sh = &exp_shards[i];
+		int l, j;
+		CHECK_POSIX(  pthread_mutex_init(&sh->lock, NULL)  );
+		CHECK_POSIX(  pthread_cond_init(&sh->cond, NULL)  );
+		fd_list_init( &sh->expired, NULL );
+		for (l = 0; l < SESS_WHEEL_LEVELS; l++)
+			for (j = 0; j <= SESS_WHEEL_MASK; j++)
+				fd_list_init( &sh->wheel[l][j], NULL );
 	}
 	
 	return 0;
@@ -255,8 +540,12 @@ int fd_sess_init(void)
 /* Run this when initializations are complete. */
 int fd_sess_start(void)
 {
-	/* Start session garbage collector (expiry) */
-	CHECK_POSIX(  pthread_create(&exp_thr, NULL, exp_fct, NULL)  );
+	int i;
+	
+	/* Start session garbage collectors (expiry) */
+	for (i = 0; i < SESS_EXP_SHARDS; i++) {
+		CHECK_POSIX(  pthread_create(&exp_shards[i].thr, NULL, exp_fct, &exp_shards[i])  );
+	}
 	
 	return 0;
 }
@@ -264,8 +553,12 @@ int fd_sess_start(void)
 /* Terminate */
 void fd_sess_fini(void)
 {
+	int i;
+	
 	TRACE_ENTRY("");
-	CHECK_FCT_DO( fd_thr_term(&exp_thr), /* continue */ );
+	for (i = 0; i < SESS_EXP_SHARDS; i++) {
+		CHECK_FCT_DO( fd_thr_term(&exp_shards[i].thr), /* continue */ );
+	}
 	
 	/* Destroy all sessions in the hash table, and the hash table itself? -- How to do it without a race condition ? */
 	
@@ -315,30 +608,35 @@ int fd_sess_handler_destroy ( struct session_handler ** handler, void ** opaque
 	del->eyec = 0xdead; /* The handler is not valid anymore for any other operation */
 	
 	/* Now find all sessions with data registered for this handler, and move this data to the deleted_states list. */
-	for (i = 0; i < sizeof(sess_hash) / sizeof(sess_hash[0]); i++) {
-		struct fd_list * li_si;
-		CHECK_POSIX(  pthread_mutex_lock(&sess_hash[i].lock)  );
+	for (i = 0; i < (1 << SESS_HASH_SIZE); i++) {
+		uint32_t line, lines;
+		CHECK_POSIX(  pthread_rwlock_rdlock(&sess_hash_locks[i])  );
 		
-		for (li_si = sess_hash[i].sentinel.next; li_si != &sess_hash[i].sentinel; li_si = li_si->next) { /* for each session in the hash line */
-			struct fd_list * li_st;
-			struct session * sess = (struct session *)(li_si->o);
-			CHECK_POSIX(  pthread_mutex_lock(&sess->stlock)  );
-			for (li_st = sess->states.next; li_st != &sess->states; li_st = li_st->next) { /* for each state in this session */
-				struct state * st = (struct state *)(li_st->o);
-				/* The list is ordered */
-				if (st->hdl->id < del->id)
-					continue;
-				if (st->hdl->id == del->id) {
-					/* This state belongs to the handler we are deleting, move the item to the deleted_states list */
-					fd_list_unlink(&st->chain);
-					st->sid = sess->sid;
-					fd_list_insert_before(&deleted_states, &st->chain);
+		/* all the lines protected by this lock */
+		lines = __atomic_load_n(&sess_hash_lines, __ATOMIC_ACQUIRE);
+		for (line = i; line < lines; line += (1 << SESS_HASH_SIZE)) {
+			struct fd_list * li_si;
+			for (li_si = H_LINE(line)->next; li_si != H_LINE(line); li_si = li_si->next) { /* for each session in the hash line */
+				struct fd_list * li_st;
+				struct session * sess = (struct session *)(li_si->o);
+				CHECK_POSIX(  pthread_mutex_lock(&sess->stlock)  );
+				for (li_st = sess->states.next; li_st != &sess->states; li_st = li_st->next) { /* for each state in this session */
+					struct state * st = (struct state *)(li_st->o);
+					/* The list is ordered */
+					if (st->hdl->id < del->id)
+						continue;
+					if (st->hdl->id == del->id) {
+						/* This state belongs to the handler we are deleting, move the item to the deleted_states list */
+						fd_list_unlink(&st->chain);
+						st->sid = sess->sid;
+						fd_list_insert_before(&deleted_states, &st->chain);
+					}
+					break;
 				}
-				break;
+				CHECK_POSIX(  pthread_mutex_unlock(&sess->stlock)  );
 			}
-			CHECK_POSIX(  pthread_mutex_unlock(&sess->stlock)  );
 		}
-		CHECK_POSIX(  pthread_mutex_unlock(&sess_hash[i].lock)  );
+		CHECK_POSIX(  pthread_rwlock_unlock(&sess_hash_locks[i])  );
 	}
 	
 	/* Now, delete all states after calling their cleanup handler */
@@ -370,6 +668,8 @@ int fd_sess_new ( struct session ** session, DiamId_t diamid, size_t diamidlen,
 	struct session * sess;
 	struct fd_list * li;
 	int found = 0;
+	uint32_t cnt, grow = 0;
+	struct timespec timeout, * newtimeout = NULL;
 	int ret = 0;
 	
 	TRACE_ENTRY("%p %p %zd %p %zd", session, diamid, diamidlen, opt, optlen);
@@ -426,31 +726,32 @@ int fd_sess_new ( struct session ** session, DiamId_t diamid, size_t diamidlen,
 	
 	hash = fd_os_hash(sid, sidlen);
 	
-	/* Now find the place to add this object in the hash table. */
-	CHECK_POSIX( pthread_mutex_lock( H_LOCK(hash) ) );
-	pthread_cleanup_push( fd_cleanup_mutex, H_LOCK(hash) );
-	
-	for (li = H_LIST(hash)->next; li != H_LIST(hash); li = li->next) {
-		int cmp;
-		struct session * s = (struct session *)(li->o);
-		
-		/* The list is ordered by hash and sid (in case of collisions) */
-		if (s->hash < hash)
-			continue;
-		if (s->hash > hash)
-			break;
-		
-		cmp = fd_os_cmp(s->sid, s->sidlen, sid, sidlen);
-		if (cmp < 0)
-			continue;
-		if (cmp > 0)
-			break;
-		
-		/* A session with the same sid was already in the hash table */
+	/* First, search an active session with this sid, only the read lock is needed in that case (most frequent for received messages). */
+	CHECK_POSIX( pthread_rwlock_rdlock( H_LOCK(hash) ) );
+	pthread_cleanup_push( fd_cleanup_rwlock, H_LOCK(hash) );
+	sess = sess_hash_search(hash, sid, sidlen, NULL);
+	if (sess && !sess->is_destroyed) {
+		CHECK_POSIX_DO( pthread_mutex_lock(&sess->stlock), { ASSERT(0); /* otherwise cleanup handler is not pop'd */ } );
+		sess->msg_cnt++;
+		CHECK_POSIX_DO( pthread_mutex_unlock(&sess->stlock), { ASSERT(0); /* otherwise cleanup handler is not pop'd */ } );
 		found = 1;
-		*session = s;
-		break;
 	}
+	pthread_cleanup_pop(0);
+	CHECK_POSIX( pthread_rwlock_unlock( H_LOCK(hash) ) );
+	
+	if (found) {
+		free(sid);
+		*session = sess;
+		return EALREADY;
+	}
+	
+	/* Now find the place to add this object in the hash table. */
+	CHECK_POSIX( pthread_rwlock_wrlock( H_LOCK(hash) ) );
+	pthread_cleanup_push( fd_cleanup_rwlock, H_LOCK(hash) );
+	
+	/* The session may have been created or destroyed meanwhile */
+	*session = sess_hash_search(hash, sid, sidlen, &li);
+	found = (*session != NULL);
 	
 	/* If the session did not exist, we can create it & link it in global tables */
 	if (!found) {
@@ -480,41 +781,32 @@ int fd_sess_new ( struct session ** session, DiamId_t diamid, size_t diamidlen,
 			sess->is_destroyed = 0;
 			
 			/* update the expiry time */
-			CHECK_SYS_DO( clock_gettime(CLOCK_REALTIME, &sess->timeout), { ASSERT(0); } );
-			sess->timeout.tv_sec += SESS_DEFAULT_LIFETIME;
+			CHECK_SYS_DO( clock_gettime(CLOCK_REALTIME, &timeout), { ASSERT(0); } );
+			timeout.tv_sec += SESS_DEFAULT_LIFETIME;
+			newtimeout = &timeout;
 		}
 	}
 		
-	/* We must insert in the expiry list */
-	CHECK_POSIX( pthread_mutex_lock( &exp_lock ) );
-	pthread_cleanup_push( fd_cleanup_mutex, &exp_lock );
-
-	/* Find the position in that list. We take it in reverse order */
-	for (li = exp_sentinel.prev; li != &exp_sentinel; li = li->prev) {
-		struct session * s = (struct session *)(li->o);
-		if (TS_IS_INFERIOR( &s->timeout, &sess->timeout ) )
-			break;
-	}
-	fd_list_insert_after( li, &sess->expire );
-	sess_cnt++;
-
-	/* We added a new expiring element, we must signal */
-	if (li == &exp_sentinel) {
-		CHECK_POSIX_DO( pthread_cond_signal(&exp_cond), { ASSERT(0); } ); /* if it fails, we might not pop the cleanup handlers, but this should not happen -- and we'd have a serious problem otherwise */
-	}
-
-	/* We're done with the locked part */
-	pthread_cleanup_pop(0);
-	CHECK_POSIX_DO( pthread_mutex_unlock( &exp_lock ), { ASSERT(0); } ); /* if it fails, we might not pop the cleanup handler, but this should not happen -- and we'd have a serious problem otherwise */
+	/* We must link in the expiry wheel */
+	CHECK_FCT_DO( ret = exp_link(sess, newtimeout), goto out );
+	
+	/* Check if the hash table should grow */
+	cnt = __atomic_load_n(&sess_cnt, __ATOMIC_RELAXED);
+	if (cnt > __atomic_load_n(&sess_hash_lines, __ATOMIC_RELAXED) * SESS_HASH_LOAD)
+		grow = cnt;
 
 out:
 	;
 	pthread_cleanup_pop(0);
-	CHECK_POSIX( pthread_mutex_unlock( H_LOCK(hash) ) );
+	CHECK_POSIX( pthread_rwlock_unlock( H_LOCK(hash) ) );
 	
 	if (ret) /* in case of error */
 		return ret;
 	
+	/* Now that we don't hold any lock, add lines in the hash table if needed */
+	if (grow)
+		sess_hash_grow(grow);
+	
 	*session = sess;
 	return 0;
 }
@@ -565,38 +857,11 @@ int fd_sess_getsid ( struct session * session, os0_t * sid, size_t * sidlen )
 /* Change the timeout value of a session */
 int fd_sess_settimeout( struct session * session, const struct timespec * timeout )
 {
-	struct fd_list * li;
-	
 	TRACE_ENTRY("%p %p", session, timeout);
 	CHECK_PARAMS( VALIDATE_SI(session) && timeout );
 	
-	/* Lock -- do we need to lock the hash table as well? I don't think so... */
-	CHECK_POSIX( pthread_mutex_lock( &exp_lock ) );
-	pthread_cleanup_push( fd_cleanup_mutex, &exp_lock );
-	
-	/* Update the timeout */
-	fd_list_unlink(&session->expire);
-	memcpy(&session->timeout, timeout, sizeof(struct timespec));
-	
-	/* Find the new position in expire list. We take it in normal order */
-	for (li = exp_sentinel.next; li != &exp_sentinel; li = li->next) {
-		struct session * s = (struct session *)(li->o);
-
-		if (TS_IS_INFERIOR( &s->timeout, &session->timeout ) )
-			continue;
-
-		break;
-	}
-	fd_list_insert_before( li, &session->expire );
-
-	/* We added a new expiring element, we must signal if it was in first position */
-	if (session->expire.prev == &exp_sentinel) {
-		CHECK_POSIX_DO( pthread_cond_signal(&exp_cond), { ASSERT(0); /* so that we don't have a pending cancellation handler */ } );
-	}
-
-	/* We're done */
-	pthread_cleanup_pop(0);
-	CHECK_POSIX( pthread_mutex_unlock( &exp_lock ) );
+	/* Update the timeout and move the session in the expiry wheel */
+	CHECK_FCT( exp_link(session, timeout) );
 	
 	return 0;
 }
@@ -619,16 +884,11 @@ int fd_sess_destroy ( struct session ** session )
 	*session = NULL;
 	
 	/* Lock the hash line */
-	CHECK_POSIX( pthread_mutex_lock( H_LOCK(sess->hash) ) );
-	pthread_cleanup_push( fd_cleanup_mutex, H_LOCK(sess->hash) );
+	CHECK_POSIX( pthread_rwlock_wrlock( H_LOCK(sess->hash) ) );
+	pthread_cleanup_push( fd_cleanup_rwlock, H_LOCK(sess->hash) );
 	
-	/* Unlink from the expiry list */
-	CHECK_POSIX_DO( pthread_mutex_lock( &exp_lock ), { ASSERT(0); /* otherwise cleanup handler is not pop'd */ } );
-	if (!FD_IS_LIST_EMPTY(&sess->expire)) {
-		sess_cnt--;
-		fd_list_unlink( &sess->expire ); /* no need to signal the condition here */
-	}
-	CHECK_POSIX_DO( pthread_mutex_unlock( &exp_lock ), { ASSERT(0); /* otherwise cleanup handler is not pop'd */ } );
+	/* Unlink from the expiry wheel */
+	exp_unlink(sess);
 	
 	/* Now move all states associated to this session into deleted_states */
 	CHECK_POSIX_DO( pthread_mutex_lock( &sess->stlock ), { ASSERT(0); /* otherwise cleanup handler is not pop'd */ } );
@@ -649,7 +909,7 @@ int fd_sess_destroy ( struct session ** session )
 		CHECK_MALLOC_DO( sid = os0dup(sess->sid, sess->sidlen), ret = ENOMEM );
 	}
 	pthread_cleanup_pop(0);
-	CHECK_POSIX( pthread_mutex_unlock( H_LOCK(sess->hash) ) );
+	CHECK_POSIX( pthread_rwlock_unlock( H_LOCK(sess->hash) ) );
 	
 	if (ret)
 		return ret;
@@ -687,16 +947,15 @@ int fd_sess_reclaim ( struct session ** session )
 	hash = sess->hash;
 	*session = NULL;
 	
-	CHECK_POSIX( pthread_mutex_lock( H_LOCK(hash) ) );
-	pthread_cleanup_push( fd_cleanup_mutex, H_LOCK(hash) );
+	CHECK_POSIX( pthread_rwlock_wrlock( H_LOCK(hash) ) );
+	pthread_cleanup_push( fd_cleanup_rwlock, H_LOCK(hash) );
 	CHECK_POSIX_DO( pthread_mutex_lock( &sess->stlock ), { ASSERT(0); /* otherwise, cleanup not poped on FreeBSD */ } );
 	pthread_cleanup_push( fd_cleanup_mutex, &sess->stlock );
-	CHECK_POSIX_DO( pthread_mutex_lock( &exp_lock ), { ASSERT(0); /* otherwise, cleanup not poped on FreeBSD */ } );
 	
 	/* We only do something if the states list is empty */
 	if (FD_IS_LIST_EMPTY(&sess->states)) {
 		/* In this case, we do as in destroy */
-		fd_list_unlink( &sess->expire );
+		exp_unlink(sess);
 		destroy_now = (sess->msg_cnt == 0);
 		if (destroy_now) {
 			fd_list_unlink(&sess->chain_h);
@@ -706,11 +965,10 @@ int fd_sess_reclaim ( struct session ** session )
 		}
 	}
 	
-	CHECK_POSIX_DO( pthread_mutex_unlock( &exp_lock ), { ASSERT(0); /* otherwise, cleanup not poped on FreeBSD */ } );
 	pthread_cleanup_pop(0);
 	CHECK_POSIX_DO( pthread_mutex_unlock( &sess->stlock ), { ASSERT(0); /* otherwise, cleanup not poped on FreeBSD */ } );
 	pthread_cleanup_pop(0);
-	CHECK_POSIX( pthread_mutex_unlock( H_LOCK(hash) ) );
+	CHECK_POSIX( pthread_rwlock_unlock( H_LOCK(hash) ) );
 	
 	if (destroy_now)
 		del_session(sess);
@@ -847,10 +1105,11 @@ int fd_sess_reclaim_msg ( struct session ** session )
 	TRACE_ENTRY("%p", session);
 	CHECK_PARAMS( session && VALIDATE_SI(*session) );
 	
-	/* Lock the hash line to avoid possibility that session is freed while we are reclaiming */
+	/* Lock the hash line to avoid possibility that session is freed while we are reclaiming. 
+	  The read lock is enough since the session is only freed with the write lock. */
 	hash = (*session)->hash;
-	CHECK_POSIX( pthread_mutex_lock( H_LOCK(hash)) );
-	pthread_cleanup_push( fd_cleanup_mutex, H_LOCK(hash) ); 
+	CHECK_POSIX( pthread_rwlock_rdlock( H_LOCK(hash)) );
+	pthread_cleanup_push( fd_cleanup_rwlock, H_LOCK(hash) ); 
 
 	/* Update the msg refcount */
 	CHECK_POSIX( pthread_mutex_lock(&(*session)->stlock) );
@@ -860,7 +1119,7 @@ int fd_sess_reclaim_msg ( struct session ** session )
 	
 	/* Ok, now unlock the hash line */
 	pthread_cleanup_pop( 0 );
-	CHECK_POSIX( pthread_mutex_unlock( H_LOCK(hash) ) );
+	CHECK_POSIX( pthread_rwlock_unlock( H_LOCK(hash) ) );
 	
 	/* and reclaim if no message references the session anymore */
 	if (reclaim == 1) {
@@ -933,8 +1192,6 @@ DECLARE_FD_DUMP_PROTOTYPE(fd_sess_dump_hdl, struct session_handler * handler)
 int fd_sess_getcount(uint32_t *cnt)
 {
 	CHECK_PARAMS(cnt);
-	CHECK_POSIX( pthread_mutex_lock( &exp_lock ) );
-	*cnt = sess_cnt;
-	CHECK_POSIX( pthread_mutex_unlock( &exp_lock ) );
+	*cnt = __atomic_load_n(&sess_cnt, __ATOMIC_RELAXED);
 	return 0;
 }
@@ -760,6 +760,128 @@ int main(int argc, char *argv[])
 		fd_cnx_destroy(client_side);
 		fd_cnx_destroy(server_side);
 	}
+	
+	/* A header with a length smaller than the header itself closes the connection */
+	for (i = 0; i < 2; i++) {
+		struct connect_flags cf;
+		uint8_t bad_buf[20];
+		
+		memset(&cf, 0, sizeof(cf));
+		cf.proto = IPPROTO_TCP;
+		
+		CHECK( 0, pthread_create(&thr, NULL, connect_thr, &cf) );
+		server_side = fd_cnx_serv_accept(listener);
+		CHECK( 1, server_side ? 1 : 0 );
+		CHECK( 0, fd_cnx_start_clear(server_side, 0) );
+		CHECK( 0, pthread_join( thr, (void *)&client_side ) );
+		CHECK( 1, client_side ? 1 : 0 );
+		CHECK( 0, fd_cnx_start_clear(client_side, 0) );
+		
+		/* A length of 0, then of 4 */
+		memset(bad_buf, 0, sizeof(bad_buf));
+		bad_buf[0] = DIAMETER_VERSION;
+		bad_buf[3] = i * 4;
+		CHECK( 0, fd_cnx_send(client_side, bad_buf, sizeof(bad_buf)));
+		CHECK( ENOTCONN, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
+		
+		fd_cnx_destroy(client_side);
+		fd_cnx_destroy(server_side);
+	}
+	
+#ifdef HAVE_EPOLL
+	/* Same test, with the messages received by the I/O threads of the reactor */
+	{
+		struct connect_flags cf;
+		
+		fd_g_config->cnf_iothr = 2;
+		CHECK( 0, fd_cnx_reactor_init() );
+		
+		memset(&cf, 0, sizeof(cf));
+		cf.proto = IPPROTO_TCP;
+		
+		/* Start the client thread */
+		CHECK( 0, pthread_create(&thr, NULL, connect_thr, &cf) );
+
+		/* Accept the connection of the client */
+		server_side = fd_cnx_serv_accept(listener);
+		CHECK( 1, server_side ? 1 : 0 );
+		CHECK( 0, fd_cnx_start_clear(server_side, 1) );
+		
+		/* Retrieve the client connection object */
+		CHECK( 0, pthread_join( thr, (void *)&client_side ) );
+		CHECK( 1, client_side ? 1 : 0 );
+		CHECK( 0, fd_cnx_start_clear(client_side, 1) );
+		
+		/* Send several messages at once, more than the target queue can hold, and receive them */
+		for (i = 0; i < 50; i++) {
+			CHECK( 0, fd_cnx_send(server_side, cer_buf, cer_sz));
+		}
+		for (i = 0; i < 50; i++) {
+			CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
+			CHECK( cer_sz, rcv_sz );
+			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+			free(rcv_buf);
+		}
+		
+		/* Do it in the other direction */
+		CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
+		CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
+		CHECK( cer_sz, rcv_sz );
+		CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+		free(rcv_buf);
+		
+		/* Send several messages with a single write */
+		{
+			struct iovec iov[3];
+			for (i = 0; i < 3; i++) {
+				iov[i].iov_base = cer_buf;
+				iov[i].iov_len  = cer_sz;
+			}
+			CHECK( 0, fd_cnx_sendv(server_side, iov, 3));
+			for (i = 0; i < 3; i++) {
+				CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
+				CHECK( cer_sz, rcv_sz );
+				CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+				free(rcv_buf);
+			}
+		}
+		
+		/* A large message between small ones is received partly in its own buffer */
+		{
+			struct iovec iov[3];
+			size_t big_sz = 40000;
+			uint8_t * big_buf;
+			
+			CHECK( 1, (big_buf = calloc(1, big_sz)) ? 1 : 0 );
+			memcpy(big_buf, cer_buf, cer_sz);
+			big_buf[1] = (big_sz >> 16) & 0xff;
+			big_buf[2] = (big_sz >> 8) & 0xff;
+			big_buf[3] = big_sz & 0xff;
+			iov[0].iov_base = cer_buf;
+			iov[0].iov_len  = cer_sz;
+			iov[1].iov_base = big_buf;
+			iov[1].iov_len  = big_sz;
+			iov[2].iov_base = cer_buf;
+			iov[2].iov_len  = cer_sz;
+			CHECK( 0, fd_cnx_sendv(client_side, iov, 3));
+			for (i = 0; i < 3; i++) {
+				CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
+				CHECK( (i == 1) ? big_sz : cer_sz, rcv_sz );
+				CHECK( 0, memcmp( rcv_buf, (i == 1) ? big_buf : cer_buf, rcv_sz ) );
+				free(rcv_buf);
+			}
+			free(big_buf);
+		}
+		
+		/* Closing one side is reported on the other one */
+		fd_cnx_destroy(client_side);
+		CHECK( ENOTCONN, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
+		fd_cnx_destroy(server_side);
+		
+		CHECK( 0, fd_cnx_reactor_fini() );
+		fd_g_config->cnf_iothr = 0;
+	}
+#endif /* HAVE_EPOLL */
 		
 #ifndef DISABLE_SCTP
 	/* Simple SCTP client / server test (no TLS) */
@@ -883,6 +1005,21 @@ int main(int argc, char *argv[])
 			free(rcv_buf);
 		}
 		
+		/* Send several messages at once, they are merged in TLS records */
+		{
+			struct iovec iov[8];
+			for (i = 0; i < 8; i++) {
+				iov[i].iov_base = cer_buf;
+				iov[i].iov_len  = cer_sz;
+			}
+			CHECK( 0, fd_cnx_sendv(client_side, iov, 8));
+			for (i = 0; i < 8; i++) {
+				CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
+				CHECK( cer_sz, rcv_sz );
+				CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+				free(rcv_buf);
+			}
+		}
 		
 		/* Now close the connection */
 		CHECK( 0, pthread_create(&thr, NULL, destroy_thr, client_side) );
@@ -1046,6 +1183,81 @@ int main(int argc, char *argv[])
 		gnutls_certificate_free_credentials(hf.creds);
 	}
 	
+#ifdef HAVE_EPOLL
+	/* Same test, with the messages deciphered by the I/O threads of the reactor */
+	{
+		struct connect_flags cf;
+		struct handshake_flags hf;
+		
+		fd_g_config->cnf_iothr = 2;
+		CHECK( 0, fd_cnx_reactor_init() );
+		
+		memset(&cf, 0, sizeof(cf));
+		cf.proto = IPPROTO_TCP;
+		
+		memset(&hf, 0, sizeof(hf));
+		
+		/* Initialize remote certificate */
+		CHECK_GNUTLS_DO( ret = gnutls_certificate_allocate_credentials (&hf.creds), );
+		CHECK( GNUTLS_E_SUCCESS, ret );
+		/* Set the CA */
+		CHECK_GNUTLS_DO( ret = gnutls_certificate_set_x509_trust_mem( hf.creds, &ca, GNUTLS_X509_FMT_PEM), );
+		CHECK( 1, ret );
+		/* Set the key */
+		CHECK_GNUTLS_DO( ret = gnutls_certificate_set_x509_key_mem( hf.creds, &client_cert, &client_priv, GNUTLS_X509_FMT_PEM), );
+		CHECK( GNUTLS_E_SUCCESS, ret );
+		
+		/* Start the client thread */
+		CHECK( 0, pthread_create(&thr, NULL, connect_thr, &cf) );
+
+		/* Accept the connection of the client */
+		server_side = fd_cnx_serv_accept(listener);
+		CHECK( 1, server_side ? 1 : 0 );
+		
+		/* Retrieve the client connection object */
+		CHECK( 0, pthread_join( thr, (void *)&client_side ) );
+		CHECK( 1, client_side ? 1 : 0 );
+		hf.cnx = client_side;
+		
+		/* Start the handshake directly */
+		CHECK( 0, pthread_create(&thr, NULL, handshake_thr, &hf) );
+		CHECK( 0, fd_cnx_handshake(server_side, GNUTLS_SERVER, ALGO_HANDSHAKE_DEFAULT, NULL, NULL) );
+		CHECK( 0, pthread_join(thr, NULL) );
+		CHECK( 0, hf.ret );
+		
+		/* Send several messages at once, they may be deciphered together by GnuTLS */
+		for (i = 0; i < 50; i++) {
+			CHECK( 0, fd_cnx_send(server_side, cer_buf, cer_sz));
+		}
+		for (i = 0; i < 50; i++) {
+			CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
+			CHECK( cer_sz, rcv_sz );
+			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+			free(rcv_buf);
+		}
+		
+		/* Do it in the other direction */
+		CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
+		CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
+		CHECK( cer_sz, rcv_sz );
+		CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+		free(rcv_buf);
+		
+		/* Now close the connection */
+		CHECK( 0, pthread_create(&thr, NULL, destroy_thr, client_side) );
+		fd_cnx_destroy(server_side);
+		CHECK( 0, pthread_join(thr, NULL) );
+		
+		CHECK( 0, fd_cnx_reactor_fini() );
+		fd_g_config->cnf_iothr = 0;
+		
+		/* Free the credentials */
+		gnutls_certificate_free_keys(hf.creds);
+		gnutls_certificate_free_cas(hf.creds);
+		gnutls_certificate_free_credentials(hf.creds);
+	}
+#endif /* HAVE_EPOLL */
+	
 #ifndef DISABLE_SCTP
 	
 	
@@ -46,9 +46,51 @@ int iter_test(void * data, struct dict_rule_data * rule)
 	return 0;
 }
 
+/* The number of times all the AVP and commands are searched in the benchmark */
+#define DEFAULT_NUMBER_OF_LOOPS	20
+
+static void display_result(int nr, struct timespec * start, struct timespec * end, char * fct)
+{
+	long double dur = (long double)end->tv_sec + (long double)end->tv_nsec/1000000000;
+	dur -= (long double)start->tv_sec + (long double)start->tv_nsec/1000000000;
+	long double thrp = (long double)nr / dur;
+	printf("%-26s: %d searches in %.6LFs (%.1Lfsearch/s)\n", fct, nr, dur, thrp);
+}
+
+/* Search an object by walking one of the ordered lists of the dictionary, as fd_dict_search was doing before the index was added. */
+static struct dict_object * list_search_avp(struct fd_list * sentinel, avp_code_t code)
+{
+	struct fd_list * li;
+	struct dict_avp_data data;
+	for (li = sentinel->next; li != sentinel; li = li->next) {
+		CHECK( 0, fd_dict_getval(li->o, &data) );
+		if (data.avp_code == code)
+			return li->o;
+		if (data.avp_code > code)
+			break;
+	}
+	return NULL;
+}
+
+static struct dict_object * list_search_cmd(struct fd_list * sentinel, command_code_t code, uint8_t rfl)
+{
+	struct fd_list * li;
+	struct dict_cmd_data data;
+	for (li = sentinel->next; li != sentinel; li = li->next) {
+		CHECK( 0, fd_dict_getval(li->o, &data) );
+		if ((data.cmd_code == code) && ((data.cmd_flag_val & CMD_FLAG_REQUEST) == rfl))
+			return li->o;
+		if (data.cmd_code > code)
+			break;
+	}
+	return NULL;
+}
+
 /* Main test routine */
 int main(int argc, char *argv[])
 {
+	test_parameter = DEFAULT_NUMBER_OF_LOOPS;
+	
 	/* First, initialize the daemon modules */
 	INIT_FD();
 	
@@ -193,7 +235,13 @@ int main(int argc, char *argv[])
 #if 1
 		fd_log_debug("%s", fd_dict_dump_object(FD_DUMP_TEST_PARAMS, obj));
 #endif
-		CHECK( 0, fd_dict_delete(obj) );
+		{
+			struct dict_avp_data data;
+			CHECK( 0, fd_dict_getval(obj, &data) );
+			CHECK( 0, fd_dict_delete(obj) );
+			/* The object must not be found anymore by its code either */
+			CHECK( ENOENT, fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_CODE, &data.avp_code, NULL, ENOENT) );
+		}
 		cntbkp = count;
 		count = 0;
 		for (li = sentinel->next; li != sentinel; li = li->next) {
@@ -203,6 +251,109 @@ int main(int argc, char *argv[])
 		
 	}
 	
+	/* Compare the searches by code in the index with the walk of the ordered lists, on the full dictionary */
+	{
+		struct avp_key {
+			struct dict_avp_request	req;
+			struct fd_list *	sentinel;	/* AVP_BY_CODE list of the vendor */
+			struct dict_object *	obj;
+		} * avps = NULL;
+		struct cmd_key {
+			command_code_t		code;
+			uint8_t			rfl;
+			struct dict_object *	obj;
+		} * cmds = NULL;
+		int nb_avps = 0, nb_cmds = 0;
+		struct fd_list * vli = NULL, * vsentinel = NULL, * li = NULL, * sentinel = NULL;
+		struct dict_object * obj = NULL;
+		vendor_id_t vid = 0;
+		struct timespec start, end;
+		int i, l;
+		
+		load_all_extensions("dict_");
+		
+		/* Collect all the AVPs of all vendors, including vendor 0 */
+		CHECK( 0, fd_dict_search(fd_g_config->cnf_dict, DICT_VENDOR, VENDOR_BY_ID, &vid, &obj, ENOENT) );
+		CHECK( 0, fd_dict_getlistof(VENDOR_BY_ID, fd_g_config->cnf_dict, &vsentinel) );
+		vli = vsentinel;
+		do {
+			struct dict_vendor_data vdata;
+			
+			CHECK( 0, fd_dict_getval(vli->o ?: obj, &vdata) );
+			CHECK( 0, fd_dict_getlistof(AVP_BY_CODE, vli->o ?: obj, &sentinel) );
+			for (li = sentinel->next; li != sentinel; li = li->next) {
+				struct dict_avp_data data;
+				CHECK( 0, fd_dict_getval(li->o, &data) );
+				CHECK( 1, (avps = realloc(avps, (nb_avps + 1) * sizeof(struct avp_key))) ? 1 : 0 );
+				avps[nb_avps].req.avp_vendor = vdata.vendor_id;
+				avps[nb_avps].req.avp_code = data.avp_code;
+				avps[nb_avps].req.avp_name = NULL;
+				avps[nb_avps].sentinel = sentinel;
+				avps[nb_avps].obj = li->o;
+				nb_avps++;
+			}
+			vli = vli->next;
+		} while (vli != vsentinel);
+		
+		/* And all the commands */
+		CHECK( 0, fd_dict_getlistof(CMD_BY_CODE_R, fd_g_config->cnf_dict, &sentinel) );
+		for (li = sentinel->next; li != sentinel; li = li->next) {
+			struct dict_cmd_data data;
+			CHECK( 0, fd_dict_getval(li->o, &data) );
+			CHECK( 1, (cmds = realloc(cmds, (nb_cmds + 1) * sizeof(struct cmd_key))) ? 1 : 0 );
+			cmds[nb_cmds].code = data.cmd_code;
+			cmds[nb_cmds].rfl = data.cmd_flag_val & CMD_FLAG_REQUEST;
+			cmds[nb_cmds].obj = li->o;
+			nb_cmds++;
+		}
+		
+		printf("Dictionary contains %d AVPs and %d commands\n", nb_avps, nb_cmds);
+		
+		/* Check that both methods find the same objects */
+		for (i = 0; i < nb_avps; i++) {
+			CHECK( 0, fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_CODE_AND_VENDOR, &avps[i].req, &obj, ENOENT) );
+			CHECK( avps[i].obj, obj );
+			CHECK( avps[i].obj, list_search_avp(avps[i].sentinel, avps[i].req.avp_code) );
+		}
+		for (i = 0; i < nb_cmds; i++) {
+			CHECK( 0, fd_dict_search(fd_g_config->cnf_dict, DICT_COMMAND, cmds[i].rfl ? CMD_BY_CODE_R : CMD_BY_CODE_A, &cmds[i].code, &obj, ENOENT) );
+			CHECK( cmds[i].obj, obj );
+			CHECK( cmds[i].obj, list_search_cmd(sentinel, cmds[i].code, cmds[i].rfl) );
+		}
+		
+		/* Now measure */
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+		for (l = 0; l < test_parameter; l++)
+			for (i = 0; i < nb_avps; i++)
+				(void) list_search_avp(avps[i].sentinel, avps[i].req.avp_code);
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &end) );
+		display_result(test_parameter * nb_avps, &start, &end, "AVP_BY_CODE_AND_VENDOR list");
+		
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+		for (l = 0; l < test_parameter; l++)
+			for (i = 0; i < nb_avps; i++)
+				(void) fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_CODE_AND_VENDOR, &avps[i].req, &obj, ENOENT);
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &end) );
+		display_result(test_parameter * nb_avps, &start, &end, "AVP_BY_CODE_AND_VENDOR index");
+		
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+		for (l = 0; l < test_parameter; l++)
+			for (i = 0; i < nb_cmds; i++)
+				(void) list_search_cmd(sentinel, cmds[i].code, cmds[i].rfl);
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &end) );
+		display_result(test_parameter * nb_cmds, &start, &end, "CMD_BY_CODE list");
+		
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+		for (l = 0; l < test_parameter; l++)
+			for (i = 0; i < nb_cmds; i++)
+				(void) fd_dict_search(fd_g_config->cnf_dict, DICT_COMMAND, cmds[i].rfl ? CMD_BY_CODE_R : CMD_BY_CODE_A, &cmds[i].code, &obj, ENOENT);
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &end) );
+		display_result(test_parameter * nb_cmds, &start, &end, "CMD_BY_CODE index");
+		
+		free(avps);
+		free(cmds);
+	}
+	
 	LOG_D( "Dictionary at the end of %s: %s", __FILE__, fd_dict_dump(FD_DUMP_TEST_PARAMS, fd_g_config->cnf_dict) ?: "error");
 	
 	/* That's all for the tests yet */
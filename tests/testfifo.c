@@ -36,6 +36,7 @@
 #include "tests.h"
 #include <unistd.h>
 #include <limits.h>
+#include <stdint.h>
 
 /* Wrapper for pthread_barrier stuff on Mac OS X */
 #ifndef HAVE_PTHREAD_BAR
@@ -187,6 +188,85 @@ static void * test_fct2(void * data)
 }
 
 
+/* Number of items moved through each queue in the throughput comparison */
+#define NBR_ITEMS_THRPT	400000
+
+static void display_result(int nr, struct timespec * start, struct timespec * end, char * op)
+{
+	long double dur = (long double)end->tv_sec + (long double)end->tv_nsec/1000000000;
+	dur -= (long double)start->tv_sec + (long double)start->tv_nsec/1000000000;
+	long double thrp = (long double)nr / dur;
+	printf("%-22s %d items in %.6LFs (%.1LF/s)\n", op, nr, dur, thrp);
+}
+
+/* Structure passed to the producers and consumers threads of the throughput comparison */
+struct thrpt_data {
+	struct fifo     * queue;
+	int		  nbr;	 /* number of items to post / retrieve */
+	unsigned long long sum;	 /* consumers: sum of the values retrieved */
+};
+
+static void * thrpt_prod(void * data)
+{
+	struct thrpt_data * td = (struct thrpt_data *) data;
+	int i;
+	
+	for (i=1; i <= td->nbr; i++) {
+		void * item = (void *)(uintptr_t)i;
+		CHECK( 0, fd_fifo_post(td->queue, &item) );
+	}
+	
+	return NULL;
+}
+
+static void * thrpt_cons(void * data)
+{
+	struct thrpt_data * td = (struct thrpt_data *) data;
+	int i;
+	
+	for (i=0; i < td->nbr; i++) {
+		void * item;
+		CHECK( 0, fd_fifo_get(td->queue, &item) );
+		td->sum += (uintptr_t)item;
+	}
+	
+	return NULL;
+}
+
+/* Move NBR_ITEMS_THRPT items through the queue with nbr_prod producers and as many consumers */
+static void thrpt_run(struct fifo * queue, int nbr_prod, char * op)
+{
+	struct thrpt_data prods[4], conss[4];
+	pthread_t thr[8];
+	struct timespec start, end;
+	unsigned long long sum = 0;
+	int i, nbr = NBR_ITEMS_THRPT / nbr_prod;
+	
+	CHECK( 1, nbr_prod <= 4 ? 1 : 0 );
+	
+	CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+	for (i=0; i < nbr_prod; i++) {
+		conss[i].queue = prods[i].queue = queue;
+		conss[i].nbr = prods[i].nbr = nbr;
+		conss[i].sum = 0;
+		CHECK( 0, pthread_create( &thr[2 * i], NULL, thrpt_cons, &conss[i] ) );
+		CHECK( 0, pthread_create( &thr[2 * i + 1], NULL, thrpt_prod, &prods[i] ) );
+	}
+	for (i=0; i < nbr_prod * 2; i++) {
+		CHECK( 0, pthread_join( thr[i], NULL ) );
+	}
+	CHECK( 0, clock_gettime(CLOCK_REALTIME, &end) );
+	
+	/* Check that all items were received exactly once */
+	for (i=0; i < nbr_prod; i++)
+		sum += conss[i].sum;
+	CHECK( (unsigned long long)nbr_prod * nbr * (nbr + 1) / 2, sum );
+	CHECK( 0, fd_fifo_length(queue) );
+	
+	display_result(nbr * nbr_prod, &start, &end, op);
+}
+
+
 /* Main test routine */
 int main(int argc, char *argv[])
 {
@@ -569,6 +649,162 @@ int main(int argc, char *argv[])
 		
 	}
 	
+	/* Test the ring mode */
+	{
+		struct fifo      	*queue = NULL;
+		struct test_data	 td;
+		pthread_t		 th;
+		struct msg 		*msg  = NULL;
+		int 			*item, i, max;
+		long long 		 count;
+		
+		/* Invalid parameters */
+		CHECK( EINVAL, fd_fifo_new_ring(&queue, 0, 0) );
+		CHECK( EINVAL, fd_fifo_new_ring(&queue, 10, 0x80) );
+		
+		/* Basic operation, as above */
+		CHECK( 0, fd_fifo_new_ring(&queue, 10, FIFO_RING_STATS) );
+		CHECK( 0, fd_fifo_length(queue) );
+		msg = msg1;
+		CHECK( 0, fd_fifo_post(queue, &msg) );
+		CHECK( NULL, msg );
+		msg = msg2;
+		CHECK( 0, fd_fifo_post(queue, &msg) );
+		msg = msg3;
+		CHECK( 0, fd_fifo_post(queue, &msg) );
+		CHECK( 3, fd_fifo_length(queue) );
+		CHECK( 0, fd_fifo_get(queue, &msg) );
+		CHECK( msg1, msg);
+		CHECK(0, clock_gettime(CLOCK_REALTIME, &ts));
+		ts.tv_sec += 1;
+		CHECK( 0, fd_fifo_timedget(queue, &msg, &ts) );
+		CHECK( msg2, msg);
+		CHECK( 1, fd_fifo_select(queue, NULL) );
+		CHECK( 0, fd_fifo_tryget(queue, &msg) );
+		CHECK( msg3, msg);
+		CHECK( EWOULDBLOCK, fd_fifo_tryget(queue, &msg) );
+		CHECK( NULL, msg );
+		CHECK(0, clock_gettime(CLOCK_REALTIME, &ts));
+		ts.tv_nsec += 1000000; /* 1 millisecond */
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_nsec -= 1000000000L;
+			ts.tv_sec += 1;
+		}
+		CHECK( ETIMEDOUT, fd_fifo_timedget(queue, &msg, &ts) );
+		CHECK( 0, fd_fifo_select(queue, &ts) );
+		
+		/* The ring does not support fd_fifo_move */
+		{
+			struct fifo * other = NULL;
+			CHECK( 0, fd_fifo_new(&other, 0) );
+			CHECK( EINVAL, fd_fifo_move(queue, other, NULL) );
+			CHECK( EINVAL, fd_fifo_move(other, queue, NULL) );
+			CHECK( 0, fd_fifo_del(&other) );
+		}
+		
+		/* fd_fifo_post_noblock can exceed max up to the ring size (32 for max 10) */
+		for (i=0; i < 32; i++) {
+			msg = msg1;
+			CHECK( 0, fd_fifo_post_noblock(queue, (void *)&msg) );
+		}
+		msg = msg1;
+		CHECK( ENOSPC, fd_fifo_post_noblock(queue, (void *)&msg) );
+		CHECK( msg1, msg );
+		CHECK( 32, fd_fifo_length(queue) );
+		for (i=0; i < 32; i++) {
+			CHECK( 0, fd_fifo_get(queue, &msg) );
+		}
+		CHECK( 0, fd_fifo_getstats(queue, NULL, NULL, &max, &count, NULL, NULL, NULL) );
+		CHECK( 32, max );
+		CHECK( 35, count );
+		CHECK( 0, fd_fifo_del(&queue) );
+		
+		/* The thresholds, same sequence as above */
+		CHECK( 0, fd_fifo_new_ring(&queue, 20, 0) );
+		memset(&thrh_td, 0, sizeof(thrh_td));
+		thrh_td.queue = queue;
+		CHECK( 0, fd_fifo_setthrhd ( queue, NULL, 6, thrh_cb_h, 4, thrh_cb_l ) );
+		for (i=0; i<5; i++) {
+			msg = msg1;
+			CHECK( 0, fd_fifo_post(queue, &msg) );
+		}
+		for (i=0; i<5; i++) {
+			CHECK( 0, fd_fifo_get(queue, &msg) );
+		}
+		CHECK( 0, thrh_td.h_calls );
+		CHECK( 0, thrh_td.l_calls );
+		for (i=0; i<6; i++) {
+			msg = msg1;
+			CHECK( 0, fd_fifo_post(queue, &msg) );
+		} /* 6 msg in queue */
+		CHECK( 1, thrh_td.h_calls );
+		for (i=0; i<2; i++) {
+			CHECK( 0, fd_fifo_get(queue, &msg) );
+		} /* 4 msg in queue */
+		CHECK( 1, thrh_td.l_calls );
+		for (i=0; i<13; i++) {
+			msg = msg1;
+			CHECK( 0, fd_fifo_post(queue, &msg) );
+		} /* 17 msg in queue */
+		CHECK( 3, thrh_td.h_calls );
+		CHECK( 1, thrh_td.l_calls );
+		for (i=0; i<17; i++) {
+			CHECK( 0, fd_fifo_get(queue, &msg) );
+		} /* 0 msg in queue */
+		CHECK( 3, thrh_td.h_calls );
+		CHECK( 3, thrh_td.l_calls );
+		CHECK( 0, fd_fifo_del(&queue) );
+		
+		/* The max limit, and the wake up of a blocked producer */
+		CHECK( 0, fd_fifo_new_ring(&queue, 10, FIFO_RING_SPSC) );
+		td.queue = queue;
+		td.nbr = 15;
+		iter = 0;
+		CHECK( 0, pthread_create( &th, NULL, test_fct2, &td ) );
+		usleep(100000); /* 100 millisec */
+		CHECK( 10, iter );
+		for (i=0; i < td.nbr; i++) {
+			CHECK( 0, fd_fifo_get(queue, &item) );
+			CHECK( i, *item);
+			free(item);
+		}
+		CHECK( 0, pthread_join( th, NULL ) );
+		CHECK( 15, iter );
+		
+		/* Cancel a thread waiting for an item */
+		td.bar = NULL;
+		td.ts = NULL;
+		td.nbr = 1;
+		CHECK( 0, pthread_create( &th, NULL, test_fct, &td ) );
+		usleep(100000); /* 100 millisec */
+		CHECK( 0, pthread_cancel( th ) );
+		CHECK( 0, pthread_join( th, NULL ) );
+		CHECK( 0, fd_fifo_del(&queue) );
+	}
+	
+	/* Compare the throughput of the list and ring modes */
+	{
+		struct fifo * queue = NULL;
+		
+		CHECK( 0, fd_fifo_new(&queue, 1024) );
+		thrpt_run(queue, 1, "list 1P/1C");
+		thrpt_run(queue, 4, "list 4P/4C");
+		CHECK( 0, fd_fifo_del(&queue) );
+		
+		CHECK( 0, fd_fifo_new_ring(&queue, 1024, 0) );
+		thrpt_run(queue, 1, "ring MPMC 1P/1C");
+		thrpt_run(queue, 4, "ring MPMC 4P/4C");
+		CHECK( 0, fd_fifo_del(&queue) );
+		
+		CHECK( 0, fd_fifo_new_ring(&queue, 1024, FIFO_RING_SPSC) );
+		thrpt_run(queue, 1, "ring SPSC 1P/1C");
+		CHECK( 0, fd_fifo_del(&queue) );
+		
+		CHECK( 0, fd_fifo_new_ring(&queue, 1024, FIFO_RING_SPSC | FIFO_RING_STATS) );
+		thrpt_run(queue, 1, "ring SPSC+stats 1P/1C");
+		CHECK( 0, fd_fifo_del(&queue) );
+	}
+	
 	/* Delete the messages */
 	CHECK( 0, fd_msg_free( msg1 ) );
 	CHECK( 0, fd_msg_free( msg2 ) );
@@ -0,0 +1,126 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2011, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+#include "tests.h"
+
+#define NB_CALLERS	4
+#define NB_LOOPS	2000
+
+static struct fd_peer peer;
+static int stop = 0;
+static int calls = 0, errors = 0;
+
+/* The registrations of the test hook; alive is reset once fd_hook_unregister has returned */
+static struct reg {
+	int	alive;
+	int	called;
+} regs[NB_LOOPS];
+
+static void permanent_cb(enum fd_hook_type type, struct msg * msg, struct peer_hdr * peer, void * other, struct fd_hook_permsgdata *pmd, void * regdata)
+{
+	__atomic_add_fetch(&calls, 1, __ATOMIC_RELAXED);
+}
+
+static void test_cb(enum fd_hook_type type, struct msg * msg, struct peer_hdr * peer, void * other, struct fd_hook_permsgdata *pmd, void * regdata)
+{
+	struct reg * r = regdata;
+	int i;
+	
+	__atomic_add_fetch(&r->called, 1, __ATOMIC_RELAXED);
+	
+	/* Stay a little in the callback, and check that the registration is still valid all along */
+	for (i = 0; i < 100; i++) {
+		if (!__atomic_load_n(&r->alive, __ATOMIC_SEQ_CST)) {
+			__atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+}
+
+static void * caller_thr(void * arg)
+{
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+		fd_hook_call(HOOK_PEER_CONNECT_SUCCESS, NULL, &peer, NULL, NULL);
+	return NULL;
+}
+
+/* Main test routine */
+int main(int argc, char *argv[])
+{
+	struct fd_hook_hdl * perm = NULL;
+	pthread_t th[NB_CALLERS];
+	int i;
+	
+	/* First, initialize the daemon modules */
+	INIT_FD();
+	
+	/* A hook stays registered, so that the callers never use the default behavior */
+	CHECK( 0, fd_hook_register( HOOK_MASK( HOOK_PEER_CONNECT_SUCCESS ), permanent_cb, NULL, NULL, &perm) );
+	
+	for (i = 0; i < NB_CALLERS; i++) {
+		CHECK( 0, pthread_create(&th[i], NULL, caller_thr, NULL) );
+	}
+	
+	/* Wait for the callers to be running */
+	while (__atomic_load_n(&calls, __ATOMIC_RELAXED) < NB_CALLERS)
+		usleep(1000);
+	
+	/* Register and unregister a hook while the other threads call the hooks */
+	for (i = 0; i < NB_LOOPS; i++) {
+		struct fd_hook_hdl * hdl = NULL;
+		
+		regs[i].alive = 1;
+		CHECK( 0, fd_hook_register( HOOK_MASK( HOOK_PEER_CONNECT_SUCCESS ), test_cb, &regs[i], NULL, &hdl) );
+		
+		/* Unregister while the callers are using the hook */
+		while (__atomic_load_n(&regs[i].called, __ATOMIC_RELAXED) == 0)
+			sched_yield();
+		CHECK( 0, fd_hook_unregister( hdl ) );
+		
+		/* The callback must not be running or called anymore with this registration */
+		__atomic_store_n(&regs[i].alive, 0, __ATOMIC_SEQ_CST);
+	}
+	
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < NB_CALLERS; i++) {
+		CHECK( 0, pthread_join(th[i], NULL) );
+	}
+	
+	CHECK( 0, errors );
+	CHECK( 0, fd_hook_unregister( perm ) );
+	
+	/* That's all for the tests yet */
+	PASSTEST();
+} 
@@ -695,6 +695,54 @@ int main(int argc, char *argv[])
 			CHECK( 0, fd_msg_avp_hdr ( found, &avpdata ) );
 			CHECK( 3.1415F, avpdata->avp_value->f32 );
 			
+			/* Iterate over the instances of an AVP, with and without the index of the message */
+			{
+				struct dict_avp_request req = { 73565, 0, "AVP Test - enumi32" };
+				struct avp * added;
+				int i, cnt;
+				
+				CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME_AND_VENDOR, &req, &avp_model, ENOENT ) );
+				
+				for (i = 0; i < 3; i++) {
+					cnt = 0;
+					CHECK( 0, fd_msg_search_avp( msg, avp_model, &found ) );
+					while (found) {
+						CHECK( 0, fd_msg_avp_hdr ( found, &avpdata ) );
+						CHECK( 73565, avpdata->avp_vendor );
+						cnt++;
+						CHECK( 0, fd_msg_search_avp_next( found, &found ) );
+					}
+					CHECK( 3, cnt );
+				}
+				
+				/* The index is updated when the message is modified */
+				CHECK( 0, fd_msg_avp_new ( avp_model, 0, &added ) );
+				CHECK( 0, fd_msg_avp_add ( msg, MSG_BRW_LAST_CHILD, added ) );
+				for (i = 0; i < 3; i++) {
+					cnt = 0;
+					CHECK( 0, fd_msg_search_avp( msg, avp_model, &found ) );
+					while (found) {
+						cnt++;
+						CHECK( 0, fd_msg_search_avp_next( found, &found ) );
+					}
+					CHECK( 4, cnt );
+				}
+				CHECK( 0, fd_msg_search_avp_next( added, &found ) );
+				CHECK( NULL, found );
+				
+				CHECK( 0, fd_msg_search_avp( msg, avp_model, &found ) );
+				CHECK( 0, fd_msg_free( found ) );
+				for (i = 0; i < 3; i++) {
+					cnt = 0;
+					CHECK( 0, fd_msg_search_avp( msg, avp_model, &found ) );
+					while (found) {
+						cnt++;
+						CHECK( 0, fd_msg_search_avp_next( found, &found ) );
+					}
+					CHECK( 3, cnt );
+				}
+			}
+			
 			/* reinit the msg */
 			CHECK( 0, fd_msg_free ( msg ) );
 				
@@ -1445,7 +1493,137 @@ int main(int argc, char *argv[])
 			CHECK( 0, fd_msg_avp_hdr ( avp, &avpdata ) );
 			CHECK( -1099511627777LL, avpdata->avp_value->f64 );
 			
-			CHECK( 0, fd_msg_free( msg ) );
+			/* Parse the message again in zero-copy mode */
+			{
+				unsigned char * zbuf = NULL, * zref;
+				size_t zlen;
+				
+				CHECK( 0, fd_msg_bufferize( msg, &zbuf, &zlen ) );
+				CHECK( 0, fd_msg_free( msg ) );
+				CHECK( 148, zlen );
+				zref = zbuf;
+				
+				fd_msg_parse_zerocopy(1);
+				CHECK( 0, fd_msg_parse_buffer( &zbuf, zlen, &msg) );
+				CHECK( 0, fd_msg_parse_dict( msg, fd_g_config->cnf_dict, NULL ) );
+				
+				/* The value points inside the received buffer */
+				CHECK( 0, fd_msg_browse ( msg, MSG_BRW_FIRST_CHILD, &avp, NULL) );
+				CHECK( 0, fd_msg_avp_hdr ( avp, &avpdata ) );
+				CHECK( 6, avpdata->avp_value->os.len );
+				CHECK( zref + 28, avpdata->avp_value->os.data );
+				CHECK( 0, memcmp(avpdata->avp_value->os.data, "waaad", 6) );
+				
+				/* The unmodified message is copied as received */
+				{
+					unsigned char * sndbuf = NULL;
+					size_t sndbufsz = 0, sndlen = 0;
+					CHECK( 0, fd_msg_bufferize_to( msg, &sndbuf, &sndbufsz, &sndlen ) );
+					CHECK( 148, sndlen );
+					CHECK( 0, memcmp(sndbuf, zref, 148) );
+					free(sndbuf);
+				}
+				
+				/* Changing the value (even from itself) makes a private copy */
+				value.os.data = avpdata->avp_value->os.data + 1;
+				value.os.len = 3;
+				CHECK( 0, fd_msg_avp_setvalue ( avp, &value ) );
+				CHECK( 3, avpdata->avp_value->os.len );
+				CHECK( 1, (avpdata->avp_value->os.data != zref + 29) ? 1 : 0 );
+				CHECK( 0, memcmp(avpdata->avp_value->os.data, "aaa", 3) );
+				
+				/* The modified AVP is encoded again, the others are copied */
+				CHECK( 0, fd_msg_bufferize( msg, &zbuf, &zlen ) );
+				CHECK( 0, fd_msg_free( msg ) );
+				CHECK( 144, zlen );
+				CHECK( 0, fd_msg_parse_buffer( &zbuf, zlen, &msg) );
+				CHECK( 0, fd_msg_parse_dict( msg, fd_g_config->cnf_dict, NULL ) );
+				CHECK( 0, fd_msg_browse ( msg, MSG_BRW_FIRST_CHILD, &avp, NULL) );
+				CHECK( 0, fd_msg_avp_hdr ( avp, &avpdata ) );
+				CHECK( 3, avpdata->avp_value->os.len );
+				CHECK( 0, memcmp(avpdata->avp_value->os.data, "aaa", 3) );
+				CHECK( 0, fd_msg_browse ( avp, MSG_BRW_NEXT, &avp, NULL) );
+				CHECK( 0, fd_msg_avp_hdr ( avp, &avpdata ) );
+				CHECK( 0x123456, avpdata->avp_value->i32 );
+				CHECK( 0, fd_msg_bufferize( msg, &zbuf, &zlen ) );
+				CHECK( 0, fd_msg_free( msg ) );
+				
+				fd_msg_parse_zerocopy(0);
+				
+				/* Now parse it lazily: the AVPs are only created when accessed */
+				{
+					unsigned char * lref, * sndbuf = NULL, * sndcpy;
+					size_t sndbufsz = 0, sndlen = 0, off = 0;
+					struct avp_wirehdr wavp;
+					struct dict_object * rr_model = NULL;
+					int count = 0;
+					
+					CHECK( 144, zlen );
+					CHECK( 1, (lref = malloc(zlen)) ? 1 : 0 );
+					memcpy(lref, zbuf, zlen);
+					zref = zbuf;
+					
+					fd_msg_parse_lazy(1);
+					CHECK( 0, fd_msg_parse_buffer( &zbuf, zlen, &msg) );
+					
+					/* The AVPs are read in the buffer */
+					CHECK( 0, fd_msg_wire_browse( msg, &off, &wavp ) );
+					CHECK( 0, wavp.avp_flags & AVP_FLAG_VENDOR );
+					CHECK( zref + 28, wavp.avp_data );
+					CHECK( 3, wavp.avp_datalen );
+					do {
+						count++;
+					} while (fd_msg_wire_browse( msg, &off, &wavp ) == 0);
+					CHECK( 144 - 20, off ); /* relative to the first AVP */
+					CHECK( ENOENT, fd_msg_wire_browse( msg, &off, &wavp ) );
+					
+					/* Appending an AVP does not parse the message */
+					CHECK( 0, fd_dict_search( fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Route-Record", &rr_model, ENOENT ) );
+					CHECK( 0, fd_msg_avp_new ( rr_model, 0, &avp ) );
+					value.os.data = (unsigned char *)"relay.example";
+					value.os.len = 13;
+					CHECK( 0, fd_msg_avp_setvalue ( avp, &value ) );
+					CHECK( 0, fd_msg_avp_add ( msg, MSG_BRW_LAST_CHILD, avp ) );
+					off = 0;
+					CHECK( 0, fd_msg_wire_browse( msg, &off, &wavp ) );
+					
+					/* The received bytes are sent as is, followed by the new AVP */
+					CHECK( 0, fd_msg_bufferize_to( msg, &sndbuf, &sndbufsz, &sndlen ) );
+					CHECK( 144 + 24, sndlen );
+					CHECK( 144 + 24, sndbuf[3] );
+					CHECK( 0, memcmp(sndbuf + 4, lref + 4, 140) );
+					CHECK( 0, memcmp(sndbuf + 144 + 8, "relay.example", 13) );
+					CHECK( 1, (sndcpy = malloc(sndlen)) ? 1 : 0 );
+					memcpy(sndcpy, sndbuf, sndlen);
+					
+					/* Browsing the message creates the received AVPs before the added one */
+					CHECK( 0, fd_msg_browse ( msg, MSG_BRW_FIRST_CHILD, &avp, NULL) );
+					CHECK( ENOTSUP, fd_msg_wire_browse( msg, &off, &wavp ) );
+					CHECK( 0, fd_msg_parse_dict( msg, fd_g_config->cnf_dict, NULL ) );
+					CHECK( 0, fd_msg_avp_hdr ( avp, &avpdata ) );
+					CHECK( 3, avpdata->avp_value->os.len );
+					CHECK( 0, memcmp(avpdata->avp_value->os.data, "aaa", 3) );
+					while (count--) {
+						CHECK( 0, fd_msg_browse ( avp, MSG_BRW_NEXT, &avp, NULL) );
+					}
+					CHECK( 0, fd_msg_avp_hdr ( avp, &avpdata ) );
+					CHECK( AC_ROUTE_RECORD, avpdata->avp_code );
+					CHECK( 13, avpdata->avp_value->os.len );
+					CHECK( 0, fd_msg_browse ( avp, MSG_BRW_NEXT, &avp, NULL) );
+					CHECK( NULL, avp );
+					
+					/* And the message is still sent identically */
+					CHECK( 0, fd_msg_bufferize_to( msg, &sndbuf, &sndbufsz, &sndlen ) );
+					CHECK( 144 + 24, sndlen );
+					CHECK( 0, memcmp(sndbuf, sndcpy, sndlen) );
+					
+					CHECK( 0, fd_msg_free( msg ) );
+					fd_msg_parse_lazy(0);
+					free(sndbuf);
+					free(sndcpy);
+					free(lref);
+				}
+			}
 		}
 	}
 	
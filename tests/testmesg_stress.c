@@ -34,157 +34,30 @@
 *********************************************************************************************************/
 
 #include "tests.h"
-#include <dirent.h>
-#include <libgen.h>
-#include <dlfcn.h>
-
-#ifndef BUILD_DIR
-#error "Missing BUILD_DIR information"
-#endif /* BUILD_DIR */
 
 
 /* The number of times each operation is repeated to measure the average operation time */
 #define DEFAULT_NUMBER_OF_SAMPLES	100000
 
+/* Statistics of the messages caches when the measure started */
+static long long objects_start, sysallocs_start;
+
+static void start_measure(struct timespec * start)
+{
+	fd_msg_cache_getstats(&objects_start, &sysallocs_start);
+	CHECK( 0, clock_gettime(CLOCK_REALTIME, start) );
+}
+
+/* Display the throughput, and the number of objects allocated per message: without the caches, each one was a malloc. */
 static void display_result(int nr, struct timespec * start, struct timespec * end, char * fct, char * type, char *op)
 {
+	long long objects, sysallocs;
 	long double dur = (long double)end->tv_sec + (long double)end->tv_nsec/1000000000;
 	dur -= (long double)start->tv_sec + (long double)start->tv_nsec/1000000000;
 	long double thrp = (long double)nr / dur;
-	printf("%-19s: %d %-8s %-7s in %.6LFs (%.1LFmsg/s)\n", fct, nr, type, op, dur, thrp);
-}
-
-struct ext_info {
-	struct fd_list	chain;		/* link in the list */
-	void 		*handler;	/* object returned by dlopen() */
-	int 		(*init_cb)(int, int, char *);
-	char		*ext_name;	/* points to the extension name, either inside depends, or basename(filename) */
-	int		free_ext_name;	/* must be freed if it was malloc'd */
-	const char 	**depends;	/* names of the other extensions this one depends on (if provided) */
-};
-	
-static void load_all_extensions(char * prefix)
-{
-	DIR *dir;
-	struct dirent *dp;
-	char fullname[512];
-	int pathlen;
-	struct fd_list all_extensions = FD_LIST_INITIALIZER(all_extensions);
-	struct fd_list ext_with_depends = FD_LIST_INITIALIZER(ext_with_depends);
-
-	/* Find all extensions which have been compiled along the test */
-	LOG_D("Loading %s*.fdx from: '%s'", BUILD_DIR "/extensions", prefix ?: "");
-	CHECK( 0, (dir = opendir (BUILD_DIR "/extensions")) == NULL ? 1 : 0 );
-	pathlen = snprintf(fullname, sizeof(fullname), BUILD_DIR "/extensions/");
-	
-	while ((dp = readdir (dir)) != NULL) {
-		char * dot = strrchr(dp->d_name, '.');
-		if (dot && ((!prefix) || !(strncmp(dp->d_name, prefix, strlen(prefix)))) && (!(strcmp(dot, ".fdx")))) {
-			/* We found a file with name dict_*.fdx, attempt to load it */
-			struct ext_info * new = malloc(sizeof(struct ext_info));
-			CHECK( 1, new ? 1:0);
-			fd_list_init(&new->chain, new);
-			
-			snprintf(fullname + pathlen, sizeof(fullname) - pathlen, "%s", dp->d_name);
-			
-			LOG_D("Extension: '%s'", dp->d_name);
-			
-			/* load */
-			new->handler = dlopen(fullname, RTLD_NOW | RTLD_GLOBAL);
-			if (!new->handler) {
-				TRACE_DEBUG(INFO, "Unable to load '%s': %s.", fullname, dlerror());
-			}
-			CHECK( 0, new->handler == NULL ? 1 : 0 );
-			
-			/* resolve entry */
-			new->init_cb = dlsym( new->handler, "fd_ext_init" );
-			if (!new->init_cb) {
-				TRACE_DEBUG(INFO, "No 'fd_ext_init' entry point in '%s': %s.", fullname, dlerror());
-			}
-			CHECK( 0, new->init_cb == NULL ? 1 : 0 );
-			
-			new->depends = dlsym( new->handler, "fd_ext_depends" );
-			if (new->depends) {
-				new->ext_name = (char *)new->depends[0];
-				new->free_ext_name = 0;
-				if ( new->depends[1] ) {
-					fd_list_insert_before(&ext_with_depends, &new->chain);
-				} else {
-					fd_list_insert_before(&all_extensions, &new->chain);
-				}
-			} else {
-				new->ext_name = strdup(basename(dp->d_name));
-				new->free_ext_name = 1;
-				fd_list_insert_before(&all_extensions, &new->chain);
-			}
-			
-		}
-	}
-	
-	/* Now, reorder the list by dependencies */
-	{
-		int count, prevcount = 0;
-		struct fd_list * li;
-		do {
-			count = 0;
-			for (li=ext_with_depends.next; li != &ext_with_depends; li=li->next) {
-				struct ext_info * e = li->o;
-				int d;
-				int satisfied=0;
-				
-				/* Can we satisfy all dependencies? */
-				for (d=1;  ;d++) {
-					struct fd_list * eli;
-					if (!e->depends[d]) {
-						satisfied = 1;
-						break;
-					}
-					
-					/* can we find this dependency in the list? */
-					for (eli=all_extensions.next; eli != &all_extensions; eli = eli->next) {
-						struct ext_info * de = eli->o;
-						if (!strcasecmp(de->ext_name, e->depends[d]))
-							break; /* this dependency is satisfied */
-					}
-					
-					if (eli == &all_extensions) {
-						satisfied = 0;
-						break;
-					}
-				}
-				
-				if (satisfied) {
-					/* OK, we have all our dependencies in the list */
-					li=li->prev;
-					fd_list_unlink(&e->chain);
-					fd_list_insert_before(&all_extensions, &e->chain);
-				} else {
-					count++;
-				}
-			}
-			
-			if (prevcount && (prevcount == count)) {
-				LOG_E("Some extensions cannot have their dependencies satisfied, e.g.: %s", ((struct ext_info *)ext_with_depends.next->o)->ext_name);
-				CHECK(0, 1);
-			}
-			prevcount = count;
-			
-			if (FD_IS_LIST_EMPTY(&ext_with_depends))
-				break;
-		} while (1);
-	}
-	
-	/* Now, load all the extensions */
-	{
-		struct fd_list * li;
-		for (li=all_extensions.next; li != &all_extensions; li=li->next) {
-			struct ext_info * e = li->o;
-			int ret = (*e->init_cb)( FD_PROJECT_VERSION_MAJOR, FD_PROJECT_VERSION_MINOR, NULL );
-			LOG_N("Initializing extension '%s': %s", e->ext_name, ret ? strerror(ret) : "Success");
-		}
-	}
-	
-	/* We should probably clean the list here ? */
+	fd_msg_cache_getstats(&objects, &sysallocs);
+	printf("%-19s: %d %-8s %-7s in %.6LFs (%.1LFmsg/s) allocs/msg: %.2f objects, %.3f from the system\n", fct, nr, type, op, dur, thrp,
+		(double)(objects - objects_start) / nr, (double)(sysallocs - sysallocs_start) / nr);
 }
 
 /* Main test routine */
@@ -547,7 +420,7 @@ redo:
 		
 	/* fd_msg_parse_buffer */
 		
-		CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+		start_measure(&start);
 		
 		/* Test the msg_parse_buffer function */
 		for (i=0; i < test_parameter; i++) {
@@ -561,7 +434,7 @@ redo:
 		
 	/* fd_msg_parse_dict */
 		
-		CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+		start_measure(&start);
 		
 		/* Test the fd_msg_parse_dict function */
 		for (i=0; i < test_parameter; i++) {
@@ -576,7 +449,7 @@ redo:
 		
 	/* fd_msg_parse_rules */
 		
-		CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+		start_measure(&start);
 		
 		/* Test the fd_msg_parse_rules function */
 		for (i=0; i < test_parameter; i++) {
@@ -591,7 +464,7 @@ redo:
 		
 	/* fd_msg_new_answer_from_req (0) */
 		
-		CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+		start_measure(&start);
 		
 		/* Test the fd_msg_new_answer_from_req function */
 		for (i=0; i < test_parameter; i++) {
@@ -617,7 +490,7 @@ redo:
 		
 	/* fd_msg_new_answer_from_req (MSGFL_ANSW_ERROR) */
 		
-		CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+		start_measure(&start);
 		
 		/* Test the fd_msg_new_answer_from_req function */
 		for (i=0; i < test_parameter; i++) {
@@ -643,7 +516,7 @@ redo:
 	/* fd_msg_bufferize */
 		
 
-		CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+		start_measure(&start);
 		
 		/* Test the fd_msg_bufferize function */
 		for (i=0; i < test_parameter; i++) {
@@ -659,7 +532,7 @@ redo:
 		
 	/* fd_msg_free */
 		
-		CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+		start_measure(&start);
 		
 		/* Free those messages */
 		for (i=0; i < test_parameter; i++) {
@@ -676,6 +549,48 @@ redo:
 		free(stress_array);
 	}
 	
+	/* Relaying: parse the received buffer then bufferize the message again in the same output buffer, with and without zero-copy, and lazily */
+	{
+		int zc, i;
+		struct timespec start, end;
+		uint8_t * sndbuf = NULL;
+		size_t sndbufsz = 0;
+		
+		for (zc = 0; zc < 3; zc++) {
+			fd_msg_parse_zerocopy(zc == 1);
+			fd_msg_parse_lazy(zc == 2);
+			
+			start_measure(&start);
+			
+			for (i=0; i < test_parameter; i++) {
+				struct msg * m = NULL;
+				uint8_t * b;
+				size_t len = 0;
+				
+				if ((b = malloc(344)) == NULL)
+					break;
+				memcpy(b, buf, 344);
+				if (0 != fd_msg_parse_buffer( &b, 344, &m) )
+					break;
+				if ((zc < 2) && (0 != fd_msg_parse_dict( m, fd_g_config->cnf_dict, NULL ) ))
+					break;
+				if (0 != fd_msg_bufferize_to( m, &sndbuf, &sndbufsz, &len ) )
+					break;
+				if ((len != 344) || memcmp(sndbuf, buf, 344))
+					break;
+				fd_msg_free( m );
+			}
+			CHECK( test_parameter, i ); /* if false, a call failed or the message was not relayed as is */
+			
+			CHECK( 0, clock_gettime(CLOCK_REALTIME, &end) );
+			display_result(test_parameter, &start, &end, (zc == 2) ? "relay (lazy)" : (zc ? "relay (zero-copy)" : "relay (copy)"), "messages", "relayed");
+		}
+		
+		fd_msg_parse_zerocopy(0);
+		fd_msg_parse_lazy(0);
+		free(sndbuf);
+	}
+	
 	if (!dictionaries_loaded) {
 		load_all_extensions("dict_");
 		dictionaries_loaded = 1;
@@ -38,6 +38,34 @@
 const char * ids[] = { "b11", "b14", "b1", "b4" };
 #define DomainName "localdomain"
 
+/* Number of additional peers in the table */
+#define NUMBER_OF_PEERS		200
+
+/* Number of requests in flight through one peer */
+#define NUMBER_OF_REQUESTS	100000
+/* Number of these requests that have a timeout */
+#define NUMBER_OF_EXPIRING	1000
+
+static void display_result(int nr, struct timespec * start, struct timespec * end, char * op)
+{
+	long double dur = (long double)end->tv_sec + (long double)end->tv_nsec/1000000000;
+	dur -= (long double)start->tv_sec + (long double)start->tv_nsec/1000000000;
+	long double thrp = (long double)nr / dur;
+	printf("%-10s %d requests in %.6LFs (%.1LF/s)\n", op, nr, dur, thrp);
+}
+
+/* Callbacks for the requests with a timeout */
+static void anscb(void * data, struct msg ** msg)
+{
+	/* the answers are not processed by this test */
+}
+static void expirecb(void * data, DiamId_t sentto, size_t senttolen, struct msg ** req)
+{
+	(*(int *)data)++; /* all callbacks are called from the same expiry thread */
+	CHECK( 0, fd_msg_free(*req) );
+	*req = NULL;
+}
+
 /* Main test routine */
 int main(int argc, char *argv[])
 {
@@ -71,6 +99,146 @@ int main(int argc, char *argv[])
 		}
 	}
 	
+	/* Check the case-sensitive and insensitive searches */
+	{
+		struct peer_info inf;
+		char locid[255];
+		struct peer_hdr *p;
+		memset(&inf, 0, sizeof(inf));
+		inf.pi_diamid = (char *)locid;
+		snprintf(locid, sizeof(locid), "B14." DomainName);
+		CHECK( 0, fd_peer_getbyid((DiamId_t)locid, strlen((char *)locid), 0, &p));
+		CHECK( NULL, p );
+		CHECK( 0, fd_peer_getbyid((DiamId_t)locid, strlen((char *)locid), 1, &p));
+		CHECK( 1, p ? 1 : 0 );
+		CHECK( 0, strcmp("b14." DomainName, p->info.pi_diamid));
+		CHECK( EEXIST, fd_peer_add(&inf, __FILE__, NULL, NULL));
+		CHECK( 0, fd_peer_getbyid((DiamId_t)"b2." DomainName, strlen("b2." DomainName), 1, &p));
+		CHECK( NULL, p );
+	}
+	
+	/* Add many more peers, and search them */
+	{
+		int i;
+		struct peer_info inf;
+		char locid[255];
+		struct peer_hdr *p;
+		memset(&inf, 0, sizeof(inf));
+		inf.pi_diamid = (char *)locid;
+		for (i = 0; i < NUMBER_OF_PEERS; i++) {
+			snprintf(locid, sizeof(locid), "peer%d." DomainName, i);
+			CHECK( 0, fd_peer_add(&inf, __FILE__, NULL, NULL));
+		}
+		for (i = 0; i < NUMBER_OF_PEERS; i++) {
+			snprintf(locid, sizeof(locid), "PEER%d." DomainName, i);
+			CHECK( 0, fd_peer_getbyid((DiamId_t)locid, strlen((char *)locid), 0, &p));
+			CHECK( NULL, p );
+			CHECK( 0, fd_peer_getbyid((DiamId_t)locid, strlen((char *)locid), 1, &p));
+			CHECK( 1, p ? 1 : 0 );
+			snprintf(locid, sizeof(locid), "peer%d." DomainName, i);
+			CHECK( 0, strcmp((char *)locid, p->info.pi_diamid));
+			CHECK( 0, fd_peer_getbyid((DiamId_t)locid, strlen((char *)locid), 0, &p));
+			CHECK( 1, p ? 1 : 0 );
+			CHECK( 0, strcmp((char *)locid, p->info.pi_diamid));
+		}
+	}
+	
+	/* Store many requests in the sent requests list of a peer as when they are sent, and retrieve them as when the answers are received */
+	{
+		struct peer_hdr *p;
+		struct fd_peer * peer;
+		struct dict_object * cmd;
+		struct msg ** reqs;
+		struct msg * msg;
+		struct msg_hdr * hdr;
+		struct timespec start, end;
+		uint32_t hbh = 0xfffffff0; /* also check the hop-by-hop ids wrapping */
+		volatile int expired = 0;
+		int i, j;
+		
+		CHECK( 0, fd_peer_getbyid((DiamId_t)"b1." DomainName, strlen("b1." DomainName), 0, &p));
+		peer = (struct fd_peer *)p;
+		CHECK( 0, fd_dict_search( fd_g_config->cnf_dict, DICT_COMMAND, CMD_BY_NAME, "Device-Watchdog-Request", &cmd, ENOENT ) );
+		CHECK( 1, (reqs = calloc(NUMBER_OF_REQUESTS, sizeof(struct msg *))) ? 1 : 0 );
+		for (i = 0; i < NUMBER_OF_REQUESTS; i++) {
+			CHECK( 0, fd_msg_new( cmd, 0, &reqs[i] ) );
+		}
+		
+		/* Send them, the original hop-by-hop id is saved */
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+		for (i = 0; i < NUMBER_OF_REQUESTS; i++) {
+			msg = reqs[i];
+			CHECK( 0, fd_msg_hdr( msg, &hdr ) );
+			hdr->msg_hbhid = hbh + i;
+			CHECK( 0, fd_p_sr_store(&peer->p_sr, &msg, &hdr->msg_hbhid, i) );
+			CHECK( 1, msg ? 0 : 1 );
+		}
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &end) );
+		display_result(NUMBER_OF_REQUESTS, &start, &end, "stored");
+		CHECK( NUMBER_OF_REQUESTS, peer->p_sr.cnt );
+		
+		/* A duplicate hop-by-hop id is refused */
+		CHECK( 0, fd_msg_new( cmd, 0, &msg ) );
+		CHECK( 0, fd_msg_hdr( msg, &hdr ) );
+		hdr->msg_hbhid = hbh + 12345;
+		CHECK( EINVAL, fd_p_sr_store(&peer->p_sr, &msg, &hdr->msg_hbhid, 0) );
+		CHECK( 0, fd_msg_free( msg ) );
+		
+		/* Receive the answers in a different order */
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+		for (i = 0; i < NUMBER_OF_REQUESTS; i++) {
+			j = (int)(((uint64_t)i * 7919) % NUMBER_OF_REQUESTS);
+			CHECK( 0, fd_p_sr_fetch(&peer->p_sr, hbh + j, &msg) );
+			CHECK( reqs[j], msg );
+			CHECK( 0, fd_msg_hdr( msg, &hdr ) );
+			CHECK( j, hdr->msg_hbhid );
+		}
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &end) );
+		display_result(NUMBER_OF_REQUESTS, &start, &end, "fetched");
+		CHECK( 0, peer->p_sr.cnt );
+		CHECK( 0, fd_p_sr_fetch(&peer->p_sr, hbh, &msg) );
+		CHECK( NULL, msg );
+		
+		/* Now send requests with a timeout, and only receive the answers of half of them */
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+		for (i = 0; i < NUMBER_OF_EXPIRING; i++) {
+			struct timespec ts = start;
+			ts.tv_nsec += (100 + i % 100) * 1000000; /* between 100 and 200 ms */
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			msg = reqs[i];
+			CHECK( 0, fd_msg_anscb_associate( msg, anscb, (void *)&expired, expirecb, &ts ) );
+			CHECK( 0, fd_msg_hdr( msg, &hdr ) );
+			hdr->msg_hbhid = hbh + i;
+			CHECK( 0, fd_p_sr_store(&peer->p_sr, &msg, &hdr->msg_hbhid, i) );
+		}
+		for (i = 0; i < NUMBER_OF_EXPIRING; i += 2) {
+			CHECK( 0, fd_p_sr_fetch(&peer->p_sr, hbh + i, &msg) );
+			CHECK( reqs[i], msg );
+		}
+		for (i = 0; (i < 100) && (expired < NUMBER_OF_EXPIRING / 2); i++) {
+			struct timespec wait = { 0, 50000000 }; /* 50 ms */
+			CHECK( 0, nanosleep(&wait, NULL) );
+		}
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &end) );
+		CHECK( NUMBER_OF_EXPIRING / 2, expired );
+		CHECK( 0, peer->p_sr.cnt );
+		CHECK( NUMBER_OF_EXPIRING / 2, peer->p_sr.cnt_lost );
+		CHECK( 1, TS_IS_INFERIOR( &start, &end ) && (end.tv_sec - start.tv_sec < 2) ? 1 : 0 );
+		
+		/* The expired requests were freed by the callback */
+		for (i = 0; i < NUMBER_OF_REQUESTS; i++) {
+			if ((i < NUMBER_OF_EXPIRING) && (i % 2))
+				continue;
+			CHECK( 0, fd_msg_free( reqs[i] ) );
+		}
+		free(reqs);
+		
+		/* Terminate the expiry thread, as when the connection is closed */
+		fd_p_sr_failover(&peer->p_sr);
+	}
 	
 	/* That's all for the tests yet */
 	PASSTEST();
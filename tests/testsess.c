@@ -81,6 +81,19 @@ static __inline__ struct sess_state * new_state(os0_t sid, int *freed)
 
 void * g_opaque = (void *)"test";
 
+/* Maximum number of sessions created in the scaling benchmark (use -p to change) */
+#define DEFAULT_NUMBER_OF_SESSIONS	100000
+/* Number of searches done for each size */
+#define NUMBER_OF_SEARCHES		100000
+
+static void display_result(int nr, struct timespec * start, struct timespec * end, int nbsess, char * op)
+{
+	long double dur = (long double)end->tv_sec + (long double)end->tv_nsec/1000000000;
+	dur -= (long double)start->tv_sec + (long double)start->tv_nsec/1000000000;
+	long double thrp = (long double)nr / dur;
+	printf("%8d sessions: %-10s %d in %.6LFs (%.1LF/s)\n", nbsess, op, nr, dur, thrp);
+}
+
 /* Avoid a lot of casts */
 #undef strlen
 #define strlen(s) strlen((char *)s)
@@ -99,6 +112,8 @@ int main(int argc, char *argv[])
 	size_t str1len, str2len;
 	int new;
 	
+	test_parameter = DEFAULT_NUMBER_OF_SESSIONS;
+	
 	/* First, initialize the daemon modules */
 	INIT_FD();
 	
@@ -392,6 +407,83 @@ int main(int argc, char *argv[])
 		mycleanup(tms, str1, NULL);
 	}
 	
+	/* Measure the search time when the number of sessions grows */
+	{
+		struct session ** sessions;
+		char (*sids)[32];
+		struct timespec start, end;
+		uint32_t cnt, cnt2;
+		int nb, i;
+		
+		CHECK( 1, (sessions = calloc(test_parameter, sizeof(struct session *))) ? 1 : 0 );
+		CHECK( 1, (sids = calloc(test_parameter, sizeof(*sids))) ? 1 : 0 );
+		for (i = 0; i < test_parameter; i++)
+			snprintf(sids[i], sizeof(sids[i]), "testsess.bench;%d", i);
+		
+		for (nb = 1000; nb <= test_parameter; nb *= 10) {
+			/* Create the sessions */
+			CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+			for (i = 0; i < nb; i++) {
+				CHECK( 0, fd_sess_fromsid( (os0_t)sids[i], strlen(sids[i]), &sessions[i], &new ) );
+			}
+			CHECK( 0, clock_gettime(CLOCK_REALTIME, &end) );
+			display_result(nb, &start, &end, nb, "created");
+			
+			/* Search them, as done for each received message */
+			CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+			for (i = 0; i < NUMBER_OF_SEARCHES; i++) {
+				int j = random() % nb;
+				CHECK( 0, fd_sess_fromsid( (os0_t)sids[j], strlen(sids[j]), &sess1, &new ) );
+				if ((sess1 != sessions[j]) || new) {
+					CHECK( sessions[j], sess1 );
+					CHECK( 0, new );
+				}
+			}
+			CHECK( 0, clock_gettime(CLOCK_REALTIME, &end) );
+			display_result(NUMBER_OF_SEARCHES, &start, &end, nb, "searches");
+			
+			/* Change their timeouts, spread over the next hour */
+			CHECK( 0, fd_sess_getcount(&cnt) );
+			CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+			for (i = 0; i < nb; i++) {
+				struct timespec timeout = start;
+				timeout.tv_sec += 60 + random() % 3600;
+				CHECK( 0, fd_sess_settimeout( sessions[i], &timeout) );
+			}
+			CHECK( 0, clock_gettime(CLOCK_REALTIME, &end) );
+			display_result(nb, &start, &end, nb, "timeouts");
+			
+			/* Expire half of them now, they must all be destroyed quickly */
+			for (i = 0; i < nb; i += 2) {
+				CHECK( 0, fd_sess_settimeout( sessions[i], &end) );
+			}
+			for (i = 0; i < 100; i++) {
+				struct timespec wait = { 0, 50000000 }; /* 50 ms */
+				CHECK( 0, fd_sess_getcount(&cnt2) );
+				if (cnt2 == cnt - (nb + 1) / 2)
+					break;
+				CHECK( 0, nanosleep(&wait, NULL) );
+			}
+			CHECK( cnt - (nb + 1) / 2, cnt2 );
+			
+			/* And destroy the other ones */
+			CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
+			for (i = 1; i < nb; i += 2) {
+				CHECK( 0, fd_sess_destroy( &sessions[i] ) );
+			}
+			CHECK( 0, clock_gettime(CLOCK_REALTIME, &end) );
+			display_result(nb / 2, &start, &end, nb, "destroyed");
+			CHECK( 0, fd_sess_getcount(&cnt2) );
+			CHECK( cnt - nb, cnt2 );
+			
+			if ((nb < test_parameter) && (nb * 10 > test_parameter))
+				nb = test_parameter / 10;
+		}
+		
+		free(sessions);
+		free(sids);
+	}
+	
 	/* TODO: add tests on messages referencing sessions */
 	
 	/* That's all for the tests yet */
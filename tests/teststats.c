@@ -0,0 +1,193 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2011, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+#include "tests.h"
+
+static void * stat_thr(void * arg)
+{
+	int i;
+	for (i = 0; i < 10; i++)
+		fd_stat_inc(FD_STAT_MSG_IN);
+	return NULL;
+}
+
+static long long rc_in, rc_out, cmd_in, cmd_out;
+static void rc_cb(void * data, uint32_t rescode, long long in, long long out)
+{
+	if (rescode == 2001) {
+		rc_in = in;
+		rc_out = out;
+	}
+}
+static void cmd_cb(void * data, command_code_t code, int is_req, long long in, long long out)
+{
+	if ((code == 280) && !is_req) {
+		cmd_in = in;
+		cmd_out = out;
+	}
+}
+
+/* Main test routine */
+int main(int argc, char *argv[])
+{
+	/* First, initialize the daemon modules */
+	INIT_FD();
+	CHECK( 0, fd_queues_init()  );
+	CHECK( 0, fd_msg_init()  );
+	CHECK( 0, fd_stats_init()  );
+	
+	/* Check the buckets of the histograms */
+	{
+		int i;
+		unsigned long long v;
+		
+		for (i = 0; i < (1 << FD_STAT_SUB_BITS); i++) {
+			CHECK( i, fd_stat_bucket_max(i) );
+		}
+		for (i = 1; i < FD_STAT_BUCKETS; i++) {
+			CHECK( 1, fd_stat_bucket_max(i) > fd_stat_bucket_max(i - 1) ? 1 : 0 );
+		}
+		CHECK( 0xFFFFFFFFLL, fd_stat_bucket_max(FD_STAT_BUCKETS - 1) );
+		
+		/* The values are counted in the bucket just above them, with the expected precision */
+		for (v = 1; v < 0x100000000ULL; v = v * 3 + 1) {
+			struct fd_stat_histo_data data;
+			long long count = 0, width;
+			
+			CHECK( 0, fd_stat_histo_get(FD_STAT_H_WAIT_OUTGOING, &data) );
+			count = data.count;
+			fd_stat_histo_add(FD_STAT_H_WAIT_OUTGOING, v * 1000);
+			CHECK( 0, fd_stat_histo_get(FD_STAT_H_WAIT_OUTGOING, &data) );
+			CHECK( count + 1, data.count );
+			for (i = 0; i < FD_STAT_BUCKETS; i++) {
+				if (fd_stat_bucket_max(i) >= v)
+					break;
+			}
+			CHECK( 1, data.buckets[i] > 0 ? 1 : 0 );
+			/* the width of the bucket is 1, or 1 / 2^FD_STAT_SUB_BITS of the value at most */
+			width = (i == 0) ? 1 : fd_stat_bucket_max(i) - fd_stat_bucket_max(i - 1);
+			CHECK( 1, (width == 1) || ((width << FD_STAT_SUB_BITS) <= v) ? 1 : 0 );
+		}
+	}
+	
+	/* Check the quantiles */
+	{
+		struct fd_stat_histo_data data;
+		int i;
+		
+		for (i = 0; i < 900; i++)
+			fd_stat_histo_add(FD_STAT_H_ANSWER, 1000000); /* 1ms */
+		for (i = 0; i < 100; i++)
+			fd_stat_histo_add(FD_STAT_H_ANSWER, 50000000); /* 50ms */
+		CHECK( 0, fd_stat_histo_get(FD_STAT_H_ANSWER, &data) );
+		CHECK( 1000, data.count );
+		CHECK( 900 * 1000 + 100 * 50000, data.sum );
+		CHECK( 1, (fd_stat_quantile(&data, 0.5) >= 1000) && (fd_stat_quantile(&data, 0.5) < 1000 * 9 / 8) ? 1 : 0 );
+		CHECK( 1, (fd_stat_quantile(&data, 0.99) >= 50000) && (fd_stat_quantile(&data, 0.99) < 50000 * 9 / 8) ? 1 : 0 );
+	}
+	
+	/* The values of the terminated threads are kept */
+	{
+		pthread_t thr;
+		long long value;
+		
+		CHECK( 0, fd_stat_counter_get(FD_STAT_MSG_IN, &value) );
+		CHECK( 0, value );
+		fd_stat_inc(FD_STAT_MSG_IN);
+		CHECK( 0, pthread_create(&thr, NULL, stat_thr, NULL) );
+		CHECK( 0, pthread_join(thr, NULL) );
+		CHECK( 0, fd_stat_counter_get(FD_STAT_MSG_IN, &value) );
+		CHECK( 11, value );
+		
+		CHECK( EINVAL, fd_stat_counter_get(FD_STAT_COUNTERS, &value) );
+	}
+	
+	/* The time spent in the global queues is measured */
+	{
+		struct fd_stat_histo_data data;
+		void * item = &data;
+		
+		CHECK( 0, fd_stat_histo_get(FD_STAT_H_WAIT_LOCAL, &data) );
+		CHECK( 0, data.count );
+		CHECK( 0, fd_fifo_post(fd_g_local, &item) );
+		CHECK( 0, fd_fifo_get(fd_g_local, &item) );
+		CHECK( 0, fd_stat_histo_get(FD_STAT_H_WAIT_LOCAL, &data) );
+		CHECK( 1, data.count );
+	}
+	
+	/* Messages are counted per command and Result-Code */
+	{
+		struct msg * msg, * rcv;
+		struct msg_hdr * hdr;
+		struct dict_object * rc_model;
+		struct avp * avp;
+		union avp_value val;
+		uint8_t * buf;
+		size_t len;
+		long long value;
+		
+		CHECK( 0, fd_msg_new ( fd_dict_cmd_DWR, MSGFL_ALLOC_ETEID, &msg ) );
+		CHECK( 0, fd_msg_hdr ( msg, &hdr ) );
+		hdr->msg_flags &= ~CMD_FLAG_REQUEST;
+		CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Result-Code", &rc_model, ENOENT ) );
+		CHECK( 0, fd_msg_avp_new ( rc_model, 0, &avp ) );
+		val.u32 = 2001;
+		CHECK( 0, fd_msg_avp_setvalue ( avp, &val ) );
+		CHECK( 0, fd_msg_avp_add ( msg, MSG_BRW_LAST_CHILD, avp ) );
+		
+		fd_stat_msg(NULL, msg, 1);
+		
+		/* The received messages are not parsed yet */
+		CHECK( 0, fd_msg_bufferize( msg, &buf, &len ) );
+		CHECK( 0, fd_msg_parse_buffer( &buf, len, &rcv ) );
+		fd_stat_msg(NULL, rcv, 0);
+		fd_stat_msg(NULL, rcv, 0);
+		
+		CHECK( 0, fd_stat_iterate_rescode(NULL, rc_cb) );
+		CHECK( 2, rc_in );
+		CHECK( 1, rc_out );
+		CHECK( 0, fd_stat_iterate_cmd(NULL, cmd_cb) );
+		CHECK( 2, cmd_in );
+		CHECK( 1, cmd_out );
+		CHECK( 0, fd_stat_counter_get(FD_STAT_MSG_OUT, &value) );
+		CHECK( 1, value );
+		
+		CHECK( 0, fd_msg_free( msg ) );
+		CHECK( 0, fd_msg_free( rcv ) );
+	}
+	
+	/* That's all for the tests yet */
+	PASSTEST();
+} 